@@ -0,0 +1,384 @@
+/*
+bench.cpp - Throughput benchmarks for the compositor core
+author: Evan Shimizu
+
+Built as the compositor_bench target in binding.gyp. Only uses the public Compositor and Image
+interface, so the same file can be built against older revisions of src/ to compare them.
+
+usage: compositor_bench render [width] [height] [layers] [iterations] [threads]
+       compositor_bench blend [width] [height] [iterations]
+       compositor_bench getdata [width] [height] [iterations]
+       compositor_bench metrics [width] [height] [patchSize] [iterations]
+*/
+
+#include "../src/Compositor.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+
+using namespace Comp;
+
+typedef chrono::high_resolution_clock benchClock;
+
+static double elapsedMs(benchClock::time_point start)
+{
+  return chrono::duration<double, milli>(benchClock::now() - start).count();
+}
+
+static int intArg(int argc, char** argv, int i, int def)
+{
+  return (argc > i) ? atoi(argv[i]) : def;
+}
+
+// deterministic test layer. Gradients and a checkerboard, with alpha that varies across
+// the layer but is never zero, so nothing can be skipped as empty
+static Image makeLayer(int w, int h, int seed)
+{
+  Image img(w, h);
+  vector<unsigned char>& data = img.getData();
+
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      int i = (y * w + x) * 4;
+      int v = (x * 255 / w + y * 128 / h + ((x / 64 + y / 64 + seed) % 2) * 60 + seed * 37) % 256;
+
+      data[i] = (unsigned char)v;
+      data[i + 1] = (unsigned char)((v * 3 + seed * 11) % 256);
+      data[i + 2] = (unsigned char)(255 - v);
+      data[i + 3] = (unsigned char)(80 + (x * 7 + y * 3 + seed * 29) % 176);
+    }
+  }
+
+  return img;
+}
+
+// full size render of a layered document. Every iteration changes the opacity of the
+// bottom layer so no part of the stack can be reused from the previous render
+static int benchRender(int argc, char** argv)
+{
+  int w = intArg(argc, argv, 2, 1920);
+  int h = intArg(argc, argv, 3, 1080);
+  int layers = intArg(argc, argv, 4, 24);
+  int iterations = intArg(argc, argv, 5, 10);
+  int threads = intArg(argc, argv, 6, 0);
+
+  // 0 uses one thread per core
+  if (threads <= 0)
+    threads = max(1, (int)thread::hardware_concurrency());
+
+  Compositor comp;
+  int adjustments = 0;
+
+  for (int i = 0; i < layers; i++) {
+    // every eighth layer is an adjustment layer
+    if (i % 8 == 7) {
+      string name = "adjustment" + to_string(i);
+      comp.addAdjustmentLayer(name);
+
+      if (adjustments++ % 2 == 0)
+        comp.getLayer(name).addHSLAdjustment(15, 10, 5);
+      else
+        comp.getLayer(name).addExposureAdjustment(0.3f, 0, 1);
+
+      continue;
+    }
+
+    string name = "layer" + to_string(i);
+    Image img = makeLayer(w, h, i);
+    comp.addLayer(name, img);
+
+    // cycle through the blend modes, skipping pass through
+    comp.getLayer(name)._mode = (BlendMode)(i % 16);
+    comp.getLayer(name).setOpacity(0.4f + 0.6f * ((i * 5) % 7) / 6.0f);
+  }
+
+  Context c = comp.getNewContext();
+
+  // first render is a warm up, it also builds anything the compositor caches lazily
+  delete comp.render(c, "", threads);
+
+  auto start = benchClock::now();
+  for (int i = 0; i < iterations; i++) {
+    c["layer0"].setOpacity((i % 2 == 0) ? 0.9f : 1.0f);
+    delete comp.render(c, "", threads);
+  }
+  double ms = elapsedMs(start) / iterations;
+
+  printf("render %dx%d, %d layers (%d adjustment), %d threads\n", w, h, layers, adjustments, threads);
+  printf("  %.1f ms per render, %.1f layer Mpx/s\n", ms, (double)w * h * layers / (ms * 1000));
+
+  return 0;
+}
+
+// single threaded blend throughput for each blend mode. Each document is an opaque base layer
+// with layersPerMode layers in the measured mode on top. The base-only render time is subtracted
+// so the result is the cost of blending the mode layers.
+static int benchBlend(int argc, char** argv)
+{
+  int w = intArg(argc, argv, 2, 1920);
+  int h = intArg(argc, argv, 3, 1080);
+  int iterations = intArg(argc, argv, 4, 5);
+  const int layersPerMode = 4;
+
+  static const char* modeNames[] = { "normal", "multiply", "screen", "overlay", "hard light",
+    "soft light", "linear dodge", "color dodge", "linear burn", "linear light", "color", "lighten",
+    "darken", "pin light", "color burn", "vivid light" };
+
+  // opaque base layer
+  Image base = makeLayer(w, h, 0);
+  vector<unsigned char>& baseData = base.getData();
+  for (int i = 3; i < baseData.size(); i += 4)
+    baseData[i] = 255;
+
+  // renderFloat directly, render would reuse the cached composite from the previous iteration
+  auto timeRender = [&](Compositor& comp) {
+    Context c = comp.getNewContext();
+    vector<string> order = comp.getLayerOrder();
+    delete comp.renderFloat(c, nullptr, order, 1);
+
+    // fastest run, other processes on the machine only ever make a run slower
+    double best = 0;
+    for (int i = 0; i < iterations; i++) {
+      auto start = benchClock::now();
+      delete comp.renderFloat(c, nullptr, order, 1);
+      double ms = elapsedMs(start);
+      best = (i == 0) ? ms : min(best, ms);
+    }
+
+    return best;
+  };
+
+  Compositor baseComp;
+  baseComp.addLayer("base", base);
+  double baseMs = timeRender(baseComp);
+
+  printf("blend %dx%d, %d layers per mode, 1 thread\n", w, h, layersPerMode);
+
+  for (int m = 0; m < 16; m++) {
+    Compositor comp;
+    comp.addLayer("base", base);
+
+    for (int i = 0; i < layersPerMode; i++) {
+      string name = "layer" + to_string(i);
+      Image img = makeLayer(w, h, i + 1);
+      comp.addLayer(name, img);
+      comp.getLayer(name)._mode = (BlendMode)m;
+      comp.getLayer(name).setOpacity(0.8f);
+    }
+
+    double ms = timeRender(comp) - baseMs;
+    printf("  %-14s %8.1f Mpx/s\n", modeNames[m], (double)w * h * layersPerMode / (ms * 1000));
+  }
+
+  return 0;
+}
+
+// stands in for Nan::Set on a typed array. Called through a pointer so it can't be inlined
+static void setElement(unsigned char* dest, int i, unsigned char v)
+{
+  dest[i] = v;
+}
+
+static void (*volatile setElementFunc)(unsigned char*, int, unsigned char) = setElement;
+
+// the two ways ImageWrapper::getData has filled the array it returns: copying the pixel vector
+// and setting one element at a time, and a single memcpy into the backing store. The harness
+// doesn't embed v8, so the per element time leaves out the cost of Nan::Set itself (handle
+// creation, index lookup) and is a lower bound for the old path.
+static int benchGetData(int argc, char** argv)
+{
+  int w = intArg(argc, argv, 2, 1920);
+  int h = intArg(argc, argv, 3, 1080);
+  int iterations = intArg(argc, argv, 4, 10);
+
+  Image img = makeLayer(w, h, 0);
+  vector<unsigned char> dest(img.getData().size());
+
+  auto start = benchClock::now();
+  for (int i = 0; i < iterations; i++) {
+    vector<unsigned char> data = img.getData();
+    for (int j = 0; j < data.size(); j++)
+      setElementFunc(dest.data(), j, data[j]);
+  }
+  double perElementMs = elapsedMs(start) / iterations;
+
+  start = benchClock::now();
+  for (int i = 0; i < iterations; i++) {
+    vector<unsigned char>& data = img.getData();
+    memcpy(dest.data(), data.data(), data.size());
+  }
+  double memcpyMs = elapsedMs(start) / iterations;
+
+  printf("getData %dx%d (%.1f MB)\n", w, h, dest.size() / (1024.0 * 1024.0));
+  printf("  per element  %8.2f ms (without v8)\n", perElementMs);
+  printf("  memcpy       %8.2f ms\n", memcpyMs);
+
+  return 0;
+}
+
+// L channel of every pixel, one Lab conversion per pixel the way the structural comparisons
+// used to do it
+static vector<double> refLuma(Image& img)
+{
+  vector<unsigned char>& data = img.getData();
+  vector<double> luma(data.size() / 4);
+
+  for (int i = 0; i < luma.size(); i++) {
+    double a = data[i * 4 + 3] / 255.0;
+    luma[i] = Utils<double>::RGBToLab(data[i * 4] / 255.0 * a, data[i * 4 + 1] / 255.0 * a,
+      data[i * 4 + 2] / 255.0 * a)._L;
+  }
+
+  return luma;
+}
+
+// one vector per patch, same order as Image::patches
+static vector<Eigen::VectorXd> refPatches(Image& img, int patchSize)
+{
+  vector<double> luma = refLuma(img);
+  vector<Eigen::VectorXd> patches;
+  int w = img.getWidth();
+  int h = img.getHeight();
+
+  for (int y = 0; y < h; y += patchSize) {
+    for (int x = 0; x < w; x += patchSize) {
+      int pw = min(patchSize, w - x);
+      int ph = min(patchSize, h - y);
+
+      Eigen::VectorXd p;
+      p.resize(pw * ph);
+      for (int j = 0; j < ph; j++) {
+        for (int i = 0; i < pw; i++)
+          p[j * pw + i] = luma[(y + j) * w + x + i];
+      }
+
+      patches.push_back(p);
+    }
+  }
+
+  return patches;
+}
+
+// least squares fit of y on the centered x with a QR decomposition, returns the residual norm
+static double refFit(const Eigen::VectorXd& x, const Eigen::VectorXd& y)
+{
+  Eigen::MatrixX2d A;
+  A.resize(x.size(), Eigen::NoChange);
+  double avg = x.mean();
+
+  for (int i = 0; i < x.size(); i++) {
+    A(i, 0) = x[i] - avg;
+    A(i, 1) = 1;
+  }
+
+  Eigen::Vector2d p = A.colPivHouseholderQr().solve(y);
+  return (A * p - y).norm();
+}
+
+// the per pixel implementations of Image::structDiff, structIndBinDiff and MSSIM, before they
+// were computed from summed patch moments
+static double refStructDiff(Image& x, Image& y)
+{
+  vector<double> lx = refLuma(x);
+  vector<double> ly = refLuma(y);
+  Eigen::VectorXd vx = Eigen::Map<Eigen::VectorXd>(lx.data(), lx.size());
+  Eigen::VectorXd vy = Eigen::Map<Eigen::VectorXd>(ly.data(), ly.size());
+
+  return refFit(vx, vy) / vy.norm();
+}
+
+static vector<double> refStructIndBinDiff(Image& x, Image& y, int patchSize)
+{
+  vector<Eigen::VectorXd> xBins = refPatches(x, patchSize);
+  vector<Eigen::VectorXd> yBins = refPatches(y, patchSize);
+  vector<double> results;
+
+  for (int i = 0; i < xBins.size(); i++) {
+    double res = refFit(xBins[i], yBins[i]);
+    results.push_back(isnan(res) ? 0 : res);
+  }
+
+  return results;
+}
+
+static double refMSSIM(Image& x, Image& y, int patchSize)
+{
+  vector<Eigen::VectorXd> xBins = refPatches(x, patchSize);
+  vector<Eigen::VectorXd> yBins = refPatches(y, patchSize);
+  double mssim = 0;
+
+  for (int i = 0; i < xBins.size(); i++)
+    mssim += x.SSIMBinDiff(xBins[i], yBins[i], 1, 1, 1);
+
+  return mssim / xBins.size();
+}
+
+// structural comparison of two 4K renders, the summed moment implementations in Image against
+// the per pixel ones above. Also reports the largest relative difference between the two.
+static int benchMetrics(int argc, char** argv)
+{
+  int w = intArg(argc, argv, 2, 3840);
+  int h = intArg(argc, argv, 3, 2160);
+  int patchSize = intArg(argc, argv, 4, 16);
+  int iterations = intArg(argc, argv, 5, 3);
+
+  Image x = makeLayer(w, h, 1);
+  Image y = makeLayer(w, h, 2);
+
+  auto relative = [](double a, double b) {
+    return abs(a - b) / max(1e-12, max(abs(a), abs(b)));
+  };
+
+  auto time = [&](function<void()> f) {
+    f();
+    auto start = benchClock::now();
+    for (int i = 0; i < iterations; i++)
+      f();
+    return elapsedMs(start) / iterations;
+  };
+
+  double diff, refDiff, mssim, refMssim;
+  vector<double> bins, refBins;
+
+  double diffMs = time([&]() { diff = x.structDiff(&y); });
+  double refDiffMs = time([&]() { refDiff = refStructDiff(x, y); });
+  double binMs = time([&]() { bins = x.structIndBinDiff(&y, patchSize); });
+  double refBinMs = time([&]() { refBins = refStructIndBinDiff(x, y, patchSize); });
+  double mssimMs = time([&]() { mssim = x.MSSIM(&y, patchSize, 1, 1, 1); });
+  double refMssimMs = time([&]() { refMssim = refMSSIM(x, y, patchSize); });
+
+  double binError = 0;
+  for (int i = 0; i < bins.size() && i < refBins.size(); i++)
+    binError = max(binError, relative(bins[i], refBins[i]));
+
+  printf("metrics %dx%d, patch size %d, 1 thread\n", w, h, patchSize);
+  printf("                   moments   per pixel   max rel diff\n");
+  printf("  structDiff      %8.1f ms %8.1f ms   %.2g\n", diffMs, refDiffMs, relative(diff, refDiff));
+  printf("  structIndBin    %8.1f ms %8.1f ms   %.2g\n", binMs, refBinMs, binError);
+  printf("  MSSIM           %8.1f ms %8.1f ms   %.2g\n", mssimMs, refMssimMs, relative(mssim, refMssim));
+
+  return 0;
+}
+
+int main(int argc, char** argv)
+{
+  string mode = (argc > 1) ? argv[1] : "";
+
+  if (mode == "render")
+    return benchRender(argc, argv);
+  if (mode == "blend")
+    return benchBlend(argc, argv);
+  if (mode == "getdata")
+    return benchGetData(argc, argv);
+  if (mode == "metrics")
+    return benchMetrics(argc, argv);
+
+  printf("usage: compositor_bench render [width] [height] [layers] [iterations] [threads]\n");
+  printf("       compositor_bench blend [width] [height] [iterations]\n");
+  printf("       compositor_bench getdata [width] [height] [iterations]\n");
+  printf("       compositor_bench metrics [width] [height] [patchSize] [iterations]\n");
+  return 1;
+}
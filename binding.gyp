@@ -9,6 +9,15 @@
                 "src/Compositor.h",
                 "src/Image.h",
                 "src/Image.cpp",
+                "src/ImageCache.h",
+                "src/ImageCache.cpp",
+                "src/ImageMetrics.h",
+                "src/ImageMetrics.cpp",
+                "src/LayerCacheFile.h",
+                "src/LayerCacheFile.cpp",
+                "src/SampleQueue.h",
+                "src/ThreadPool.h",
+                "src/ThreadPool.cpp",
                 "src/Logger.h",
                 "src/Logger.cpp",
                 "src/third_party/lodepng/lodepng.cpp",
@@ -53,6 +62,61 @@
                 ['OS=="mac"', {"xcode_settings": {"GCC_ENABLE_CPP_EXCEPTIONS": "YES"}}]
             ],
             "defines": ["NOMINMAX"],
+        },
+        {
+            "target_name": "compositor_bench",
+            "type": "executable",
+            "sources": [
+                "bench/bench.cpp",
+                "src/Compositor.cpp",
+                "src/Compositor.h",
+                "src/Image.h",
+                "src/Image.cpp",
+                "src/ImageCache.h",
+                "src/ImageCache.cpp",
+                "src/ImageMetrics.h",
+                "src/ImageMetrics.cpp",
+                "src/LayerCacheFile.h",
+                "src/LayerCacheFile.cpp",
+                "src/SampleQueue.h",
+                "src/ThreadPool.h",
+                "src/ThreadPool.cpp",
+                "src/Logger.h",
+                "src/Logger.cpp",
+                "src/third_party/lodepng/lodepng.cpp",
+                "src/third_party/cpp-base64/base64.cpp",
+                "src/Layer.h",
+                "src/Layer.cpp",
+                "src/util.h",
+                "src/util.cpp",
+                "src/constraintData.h",
+                "src/constraintData.cpp",
+                "src/SearchData.cpp",
+                "src/searchData.h",
+                "src/Histogram.cpp",
+                "src/Histogram.h",
+                "src/Model.h",
+                "src/Model.cpp",
+                "src/third_party/libsvm/svm.h",
+                "src/third_party/libsvm/svm.cpp",
+                "src/gibbs_with_gaussian_mixture.cpp",
+                "src/gibbs_with_gaussian_mixture.h",
+                "src/DimRed.cpp",
+                "src/DimRed.h",
+                "src/ClickMap.h",
+                "src/ClickMap.cpp",
+                "src/Selection.h",
+                "src/Selection.cpp",
+            ],
+            "include_dirs": [
+                "src/third_party/flann/src/cpp",
+            ],
+            "cflags!": ["-fno-exceptions", "-fno-rtti"],
+            "cflags_cc!": ["-fno-exceptions", "-fno-rtti"],
+            "conditions": [
+                ['OS=="mac"', {"xcode_settings": {"GCC_ENABLE_CPP_EXCEPTIONS": "YES"}}]
+            ],
+            "defines": ["NOMINMAX"],
         }
     ]
 }
@@ -2,54 +2,156 @@
 #include "searchData.h"
 #include "third_party/json/src/json.hpp"
 
+// SSE2 is always available on x64 and doesn't need any extra compiler flags.
+// Define COMP_NO_SSE to build only the scalar kernels, e.g. to benchmark against them
+#if !defined(COMP_NO_SSE) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define COMP_USE_SSE
+#endif
+
 namespace Comp {
 
-  Compositor::Compositor() : _searchRunning(false)
+  Compositor::Compositor() : _searchRunning(false), _searchThreadsLeft(0), _expSearchThreads(1), _searchCascade(false),
+    _searchCandidates(0), _searchScreenRejected(0), _searchRendered(0), _searchRejected(0), _colorCubeSize(0), _renderPlanVersion(0), _renderGeneration(0)
+  {
+    _loadStats = LoadStats();
+  }
+
+  Compositor::Compositor(string filename, string imageDir) : Compositor()
   {
+    loadDarkroom(filename, imageDir);
   }
 
-  Compositor::Compositor(string filename, string imageDir)
+  bool Compositor::loadDarkroom(string filename, string imageDir, int threads, function<void(int, int, string)> progress)
   {
-    // two iterations, file load and then layer load
+    auto start = chrono::high_resolution_clock::now();
+    _loadStats = LoadStats();
+
+    if (_primary.size() > 0) {
+      getLogger()->log("Failed to load " + imageDir + filename + ". Compositor already has layers.", LogLevel::ERR);
+      return false;
+    }
+
+    // the file is parsed once, layers and the context both come from this
     nlohmann::json data;
     ifstream input(imageDir + filename);
 
     if (!input.is_open()) {
       // failing to load will return an empty context
       getLogger()->log("Failed to open file " + imageDir + filename, LogLevel::ERR);
-      return;
+      return false;
     }
 
-    input >> data;
+    // layers in file order. Image layers get decoded, the rest are adjustment layers
+    vector<string> names;
+    vector<string> files;
+    vector<string> order;
 
-    if (data.count("layers") == 0) {
-      // this is not a darkroom file, return
-      getLogger()->log(imageDir + filename + " is not a Darkroom file", LogLevel::ERR);
-      return;
+    // malformed files throw from the parser and from the typed reads. Everything that's read before
+    // the compositor is modified is read here
+    try {
+      input >> data;
+      input.close();
+
+      if (data.count("layers") == 0) {
+        // this is not a darkroom file, return
+        getLogger()->log(imageDir + filename + " is not a Darkroom file", LogLevel::ERR);
+        return false;
+      }
+
+      for (nlohmann::json::iterator it = data["layers"].begin(); it != data["layers"].end(); ++it) {
+        names.push_back(it.key());
+        files.push_back((it.value()["filename"] != "") ? imageDir + it.value()["filename"].get<string>() : "");
+      }
+
+      for (int i = 0; i < data["layerOrder"].size(); i++) {
+        order.push_back(data["layerOrder"][i].get<string>());
+      }
+    }
+    catch (nlohmann::json::exception& e) {
+      getLogger()->log("Failed to read " + imageDir + filename + ": " + e.what(), LogLevel::ERR);
+      return false;
     }
 
-    for (nlohmann::json::iterator it = data["layers"].begin(); it != data["layers"].end(); ++it) {
-      if (it.value()["filename"] != "") {
-        addLayer(it.key(), imageDir + it.value()["filename"].get<string>());
+    auto parseEnd = chrono::high_resolution_clock::now();
+
+    // decoding and analysis are independent per layer, so layers are handed out one at a time on the
+    // compositor's pool. The Image constructor does both, and analyze leaves the alpha bounds up to date
+    int total = (int)names.size();
+    vector<shared_ptr<Image>> images(total);
+
+    if (threads <= 0)
+      threads = max(1, (int)thread::hardware_concurrency());
+    threads = min(threads, max(1, total));
+
+    int done = 0;
+    mutex progressLock;
+
+    _pool.parallelFor(total, threads, 1, [&](int start, int end) {
+      for (int i = start; i < end; i++) {
+        if (files[i] != "")
+          images[i] = loadImage(files[i]);
+
+        if (progress) {
+          lock_guard<mutex> lock(progressLock);
+          done++;
+          progress(done, total, names[i]);
+        }
+      }
+    });
+
+    auto decodeEnd = chrono::high_resolution_clock::now();
+
+    for (int i = 0; i < total; i++) {
+      if (images[i] != nullptr) {
+        _imageData.set(names[i], images[i]);
+        _layerSources[names[i]] = files[i];
+        loadCachedSizes(_imageData, names[i], files[i]);
+        addLayer(names[i]);
       }
       else {
-        addAdjustmentLayer(it.key());
+        addAdjustmentLayer(names[i]);
       }
     }
 
-    // layer order
-    vector<string> order;
-    for (int i = 0; i < data["layerOrder"].size(); i++) {
-      order.push_back(data["layerOrder"][i]);
-    }
     setLayerOrder(order);
 
-    input.close();
+    try {
+      _primary = contextFromDarkroom(data, imageDir + filename);
+    }
+    catch (nlohmann::json::exception& e) {
+      getLogger()->log("Failed to read layer settings from " + imageDir + filename + ": " + e.what(), LogLevel::ERR);
+
+      // don't leave a half loaded document behind
+      for (auto& name : names)
+        deleteLayer(name);
+
+      return false;
+    }
+
+    // create layer vector key
+    contextToVector(_primary);
+    clearRenderCache();
 
-    _primary = contextFromDarkroom(imageDir + filename);
+    auto end = chrono::high_resolution_clock::now();
 
-	// create layer vector key
-	contextToVector(_primary);
+    _loadStats._layers = total;
+    _loadStats._threads = threads;
+    _loadStats._parseTime = chrono::duration<double, milli>(parseEnd - start).count();
+    _loadStats._decodeTime = chrono::duration<double, milli>(decodeEnd - parseEnd).count();
+    _loadStats._contextTime = chrono::duration<double, milli>(end - decodeEnd).count();
+    _loadStats._totalTime = chrono::duration<double, milli>(end - start).count();
+
+    stringstream ss;
+    ss << "Loaded " << total << " layers from " << imageDir + filename << " in " << _loadStats._totalTime << "ms on " << threads << " threads";
+    getLogger()->log(ss.str(), LogLevel::INFO);
+
+    return true;
+  }
+
+  LoadStats Compositor::getLoadStats()
+  {
+    return _loadStats;
   }
 
   Compositor::~Compositor()
@@ -58,15 +160,18 @@ namespace Comp {
 
   bool Compositor::addLayer(string name, string file)
   {
-    // load image data
-    _imageData[name]["full"] = shared_ptr<Image>(new Image(file));
-    cacheScaled(name);
+    // load image data. Decoding a png computes its alpha bounds and the layer cache stores them,
+    // so there's nothing to rescan
+    _imageData.set(name, loadImage(file));
+    _layerSources[name] = file;
+    loadCachedSizes(_imageData, name, file);
+    clearRenderCache();
 
     // check for existence in primary context
     if (_primary.count(name) > 0) {
       // when the layer exists, update the image and layer name
       _primary[name].setName(name);
-      _primary[name].setImage(_imageData[name]["full"]);
+      _primary[name].setImage(_imageData.get(name));
       getLogger()->log("Updated layer " + name);
       return false;
     }
@@ -86,9 +191,11 @@ namespace Comp {
     }
 
     // load image data
-    _imageData[name]["full"] = shared_ptr<Image>(new Image(img));
+    _imageData.set(name, shared_ptr<Image>(new Image(img)));
+    _layerSources.erase(name);
     addLayer(name);
     cacheScaled(name);
+    clearRenderCache();
     
     return true;
   }
@@ -102,8 +209,11 @@ namespace Comp {
     }
 
     // load image data
-    _layerMasks[name]["full"] = shared_ptr<Image>(new Image(file));
+    _layerMasks.set(name, loadImage(file));
+    _maskSources[name] = file;
     addLayerMask(name);
+    loadCachedSizes(_layerMasks, name, file);
+    clearRenderCache();
     return true;
   }
 
@@ -116,8 +226,10 @@ namespace Comp {
     }
 
     // load image data
-    _layerMasks[name]["full"] = shared_ptr<Image>(new Image(img));
+    _layerMasks.set(name, shared_ptr<Image>(new Image(img)));
+    _maskSources.erase(name);
     addLayerMask(name);
+    clearRenderCache();
     return true;
   }
 
@@ -146,8 +258,9 @@ namespace Comp {
     _primary[dest].setName(dest);
 
     // save a ref to the image data
-    _imageData[dest]["full"] = _primary[dest].getImage();
-    cacheScaled(dest);
+    _imageData.set(dest, _primary[dest].getImage());
+    if (_layerSources.count(src) > 0)
+      _layerSources[dest] = _layerSources[src];
 
     // place at end of order
     _layerOrder.push_back(dest);
@@ -179,6 +292,10 @@ namespace Comp {
 
     // erase from image data
     _imageData.erase(name);
+    _layerMasks.erase(name);
+    _layerSources.erase(name);
+    _maskSources.erase(name);
+    clearRenderCache();
 
     // update serialization key
     contextToVector(getNewContext(), _vectorKey);
@@ -261,6 +378,7 @@ namespace Comp {
 
     // and add to group order
     _groupOrder.insert(make_pair(priority, name));
+    clearRenderPlans();
 
     return true;
   }
@@ -290,6 +408,7 @@ namespace Comp {
 
     // and add to group order
     _groupOrder.insert(make_pair(priority, name));
+    clearRenderPlans();
 
     return true;
   }
@@ -314,6 +433,8 @@ namespace Comp {
         break;
       }
     }
+
+    clearRenderPlans();
   }
 
   void Compositor::addLayerToGroup(string layer, string group)
@@ -331,6 +452,7 @@ namespace Comp {
     // adds a layer to the affected layers of the group
     if (_groups.count(group) > 0 && _primary.count(layer) > 0) {
       _groups[group]._affectedLayers.insert(layer);
+      clearRenderPlans();
     }
     else {
       getLogger()->log("Unable to add " + layer + " to group " + group + ". One of them does not exist.", LogLevel::WARN);
@@ -341,6 +463,7 @@ namespace Comp {
   {
     if (_groups.count(group) > 0 && _primary.count(layer) > 0) {
       _groups[group]._affectedLayers.erase(layer);
+      clearRenderPlans();
     }
     else {
       getLogger()->log("Unable to remove " + layer + " from group " + group + ". One of them does not exist.", LogLevel::WARN);
@@ -357,6 +480,8 @@ namespace Comp {
           _groups[group]._affectedLayers.insert(l);
         }
       }
+
+      clearRenderPlans();
     }
   }
 
@@ -371,6 +496,8 @@ namespace Comp {
       else
         getLogger()->log("Unable to add " + o.second + " to group order. Group does not exist.", LogLevel::WARN);
     }
+
+    clearRenderPlans();
   }
 
   void Compositor::setGroupOrder(string group, float priority)
@@ -386,6 +513,7 @@ namespace Comp {
     }
 
     _groupOrder.insert(make_pair(priority, group));
+    clearRenderPlans();
   }
 
   bool Compositor::layerInGroup(string layer, string group)
@@ -414,6 +542,7 @@ namespace Comp {
   {
     if (_groups.count(name) > 0) {
       _groups[name]._effect = effect;
+      clearRenderPlans();
     }
   }
 
@@ -456,10 +585,7 @@ namespace Comp {
     if (size == "")
       size = "full";
 
-    if (_imageData.size() == 0)
-      return 0;
-    
-    return _imageData.begin()->second[size]->getWidth();
+    return _imageData.getWidth(size);
   }
 
   int Compositor::getHeight(string size)
@@ -467,28 +593,79 @@ namespace Comp {
     if (size == "")
       size = "full";
 
-    if (_imageData.size() == 0)
-      return 0;
-
-    return _imageData.begin()->second[size]->getHeight();
+    return _imageData.getHeight(size);
   }
 
-  Image* Compositor::render(string size)
+  Image* Compositor::render(string size, int threads)
   {
-    return render(getNewContext(), nullptr, vector<string>(), 1, size);
+    return render(getNewContext(), nullptr, vector<string>(), 1, size, threads);
   }
 
-  Image * Compositor::render(Context & c, string size)
+  Image * Compositor::render(Context & c, string size, int threads)
   {
-    return render(c, nullptr, vector<string>(), 1, size);
+    return render(c, nullptr, vector<string>(), 1, size, threads);
   }
 
-  Image* Compositor::render(Context& c, Image* comp, vector<string> order, float co, string size)
+  Image* Compositor::render(Context& c, Image* comp, vector<string> order, float co, string size, int threads)
   {
     if (c.size() == 0) {
       return new Image();
     }
 
+    // the layer stack is blended in floating point and converted to 8 bits once at the end
+    FloatImage* fcomp = (comp == nullptr) ? nullptr : new FloatImage(comp);
+    fcomp = renderFloat(c, fcomp, order, co, size, threads);
+
+    if (comp == nullptr) {
+      comp = fcomp->toImage();
+    }
+    else {
+      fcomp->toImage(comp);
+    }
+
+    delete fcomp;
+    return comp;
+  }
+
+  Image* Compositor::renderCached(string size, int threads)
+  {
+    return renderCached(getNewContext(), size, threads);
+  }
+
+  Image* Compositor::renderCached(Context& c, string size, int threads)
+  {
+    if (c.size() == 0 || _layerOrder.size() == 0) {
+      return new Image();
+    }
+
+    FloatImage* fcomp = renderFloatCached(c, size, threads, 0);
+    Image* comp = fcomp->toImage();
+
+    delete fcomp;
+    return comp;
+  }
+
+  // reads the conditional blend settings of the layer in the order used by LayerBlendState::_cb.
+  // Missing settings are 0
+  static void getConditionalBlendParams(Layer& l, float* cb)
+  {
+    static const char* keys[8] = { "srcBlackMin", "srcBlackMax", "srcWhiteMin", "srcWhiteMax",
+      "destBlackMin", "destBlackMax", "destWhiteMin", "destWhiteMax" };
+
+    const map<string, float>& cbData = l.getConditionalBlendSettings();
+    for (int i = 0; i < 8; i++) {
+      auto it = cbData.find(keys[i]);
+      cb[i] = (it == cbData.end()) ? 0 : it->second;
+    }
+  }
+
+  FloatImage* Compositor::renderFloat(Context& c, FloatImage* comp, vector<string> order, float co, string size, int threads,
+    unsigned int generation)
+  {
+    if (c.size() == 0) {
+      return new FloatImage();
+    }
+
     // if we have no layer order, this should be the first call and will be
     // set to the base layer order
     if (order.size() == 0) {
@@ -503,15 +680,15 @@ namespace Comp {
       size = "full";
     }
 
-    if (_imageData.begin()->second.count(size) > 0) {
-      width = _imageData.begin()->second[size]->getWidth();
-      height = _imageData.begin()->second[size]->getHeight();
+    if (_imageData.hasSize(size)) {
+      width = _imageData.getWidth(size);
+      height = _imageData.getHeight(size);
       useCache = true;
     }
     else {
       getLogger()->log("No render size named " + size + " found. Rendering at full size.", LogLevel::WARN);
-      width = _imageData.begin()->second["full"]->getWidth();
-      height = _imageData.begin()->second["full"]->getHeight();
+      width = _imageData.getWidth("full");
+      height = _imageData.getHeight("full");
     }
 
     // default mask (all white)
@@ -521,59 +698,69 @@ namespace Comp {
 
     // if a layer group is pass through, the recursive render call will pass
     // the current composition. If not, a blank image will be passed and
-    // the result will be composited in later
+    // the result will be composited in later.
+    // Photoshop appears to blend using an all white alpha 0 image. Premultiplied that's
+    // all zeros, and FloatImage reads transparent pixels back as white.
     if (comp == nullptr) {
-      comp = new Image(width, height);
+      comp = new FloatImage(width, height);
+    }
 
-      // Photoshop appears to blend using an all white alpha 0 image
-      vector<unsigned char>& compPxV_N = comp->getData();
-      unsigned char* compPx_N = compPxV_N.data();
-      for (int i = 0; i < compPxV_N.size(); i++) {
-        if (i % 4 == 3) {
+    vector<float>& compPxV = comp->getData();
+    float* compPx = compPxV.data();
+    RenderLayerMap& renderMap = comp->getRenderMap();
+
+    shared_ptr<RenderPlan> plan = getRenderPlan(order);
+
+    // scaled copies are built on first use. Build the ones this render needs up front, in parallel,
+    // instead of one at a time as the blend loop gets to them
+    if (useCache && size != "full") {
+      vector<string> layers;
+      vector<string> masks;
+      for (auto& step : plan->_steps) {
+        Layer& l = c[step._id];
+        if (l.isPrecomp() || l.isAdjustmentLayer())
           continue;
-        }
 
-        compPx_N[i] = 255;
+        layers.push_back(step._id);
+        if (l.hasMask())
+          masks.push_back(step._id);
       }
-    }
 
-    vector<unsigned char>& compPxV = comp->getData();
-    unsigned char* compPx = compPxV.data();
-    vector<string>& renderMap = comp->getRenderMap();
+      _imageData.prepare(layers, size, threads, _pool);
+      _layerMasks.prepare(masks, size, threads, _pool);
+    }
 
     // blend the layers
-    for (int lOrder = 0; lOrder < order.size(); lOrder++) {
-      string id = order[lOrder];
+    for (auto& step : plan->_steps) {
+      if (renderCancelled(generation))
+        break;
+
+      const string& id = step._id;
       Layer& l = c[id];
 
       // do a group visibility check here. A layer is visible if every
       // layer that affects it is also visible
       bool visible = l._visible;
       float opacityModifier = 1;
-      for (auto& o : _groupOrder) {
-        if (_groups[o.second]._affectedLayers.count(id) > 0) {
-          visible = visible & c[o.second]._visible;
-          opacityModifier *= c[o.second].getOpacity();
-        }
+      for (auto& g : step._groups) {
+        Layer& gl = c[g];
+        visible = visible & gl._visible;
+        opacityModifier *= gl.getOpacity();
       }
       opacityModifier *= co;
 
       if (!visible)
         continue;
 
-      vector<unsigned char>* layerPxV;
-      Image* tmpLayer = nullptr;
-      vector<unsigned char>* layerMaskPx;
-      bool shouldConditionalBlend = l.shouldConditionalBlend();
-      auto cbData = l.getConditionalBlendSettings();
-      float sbMin = cbData["srcBlackMin"];
-      float sbMax = cbData["srcBlackMax"];
-      float swMin = cbData["srcWhiteMin"];
-      float swMax = cbData["srcWhiteMax"];
-      float dbMin = cbData["destBlackMin"];
-      float dbMax = cbData["destBlackMax"];
-      float dwMin = cbData["destWhiteMin"];
-      float dwMax = cbData["destWhiteMax"];
+      // part of the composite this layer can change. layers that can't change anything are skipped
+      int x0 = 0, y0 = 0, x1 = width, y1 = height;
+      if (useCache && !getLayerExtent(c, step, size, x0, y0, x1, y1))
+        continue;
+
+      vector<float>* layerPxV;
+      FloatImage* tmpLayer = nullptr;
+      const unsigned char* layerMaskPx;
+      shared_ptr<Image> layerMask;
       bool hasMask = l.hasMask();
       bool isPrecompLayer = false;
 
@@ -583,15 +770,13 @@ namespace Comp {
         // pass through
         if (l._mode == PASS_THROUGH) {
           // this writes directly to comp
-          render(c, comp, l.getPrecompOrder(), l.getOpacity() * co, size);
+          renderFloat(c, comp, l.getPrecompOrder(), l.getOpacity() * co, size, threads, generation);
 
           // adjustments on a pass through precomp are normal adjustment layers
           // (except here you can't really modify the strength of them so ...?)
-          adjust(comp, l);
-          for (auto& o : _groupOrder) {
-            if (_groups[o.second]._affectedLayers.count(id) > 0) {
-              adjust(comp, c[o.second]);
-            }
+          adjust(comp, l, step._strokes, threads);
+          for (auto& g : step._groups) {
+            adjust(comp, c[g], plan->_groups[g]._strokes, threads);
           }
 
           continue;
@@ -599,14 +784,9 @@ namespace Comp {
         else {
           // pretend like we have a blank render context
           // the blending takes the precomp layer opacity into account later
-          tmpLayer = render(c, nullptr, l.getPrecompOrder(), co, size);
-          // apply adjustments, continue as normal
-          adjust(tmpLayer, l);
-          for (auto& o : _groupOrder) {
-            if (_groups[o.second]._affectedLayers.count(id) > 0) {
-              adjust(tmpLayer, c[o.second]);
-            }
-          }
+          tmpLayer = renderFloat(c, nullptr, l.getPrecompOrder(), co, size, threads, generation);
+          // apply adjustments, continue as normal. Group adjustments run below like any other layer
+          adjust(tmpLayer, l, step._strokes, threads);
           layerPxV = &tmpLayer->getData();
           isPrecompLayer = true;
         }
@@ -615,221 +795,1191 @@ namespace Comp {
         // handle adjustment layers
         // ok so here we adjust the current composition, then blend it as normal below
         // create duplicate of current composite
-        tmpLayer = new Image(*comp);
-        adjust(tmpLayer, l);
+        tmpLayer = new FloatImage(*comp);
+        adjust(tmpLayer, l, step._strokes, threads);
         layerPxV = &tmpLayer->getData();
       }
       else {
         // a layer may be part of a group, so we will have to run adjustments on it
         // even if not we'll duplicate it anyway to make the process easier
-        tmpLayer = new Image(*_imageData[l.getName()][size].get());
-        // copy render map state for this layer
-        tmpLayer->getRenderMap() = comp->getRenderMap();
-        adjust(tmpLayer, l);
+        tmpLayer = new FloatImage(_imageData.get(l.getName(), size).get());
+        adjust(tmpLayer, l, step._strokes, threads);
         layerPxV = &tmpLayer->getData();
       }
 
       // ok at this point the base adjustments have been handled.
       // we now check the group settings and apply those to the layer
-      for (auto& o : _groupOrder) {
-        if (_groups[o.second]._affectedLayers.count(id) > 0) {
-          adjust(tmpLayer, c[o.second]);
-        }
+      for (auto& g : step._groups) {
+        adjust(tmpLayer, c[g], plan->_groups[g]._strokes, threads);
       }
 
       // check for layer mask
       if (hasMask) {
-        layerMaskPx = &_layerMasks[l.getName()][size]->getData();
+        layerMask = _layerMasks.get(l.getName(), size);
+        layerMaskPx = layerMask->getPixels();
       }
       else {
-        layerMaskPx = &defaultMaskPx;
+        layerMaskPx = defaultMaskPx.data();
       }
 
-      unsigned char* layerPx = layerPxV->data();
-
       auto translation = l.getOffset();
 
+      LayerBlendState state;
+      state._compPx = compPx;
+      state._layerPx = layerPxV->data();
+      state._maskPx = layerMaskPx;
+      state._width = width;
+      state._height = height;
+      state._xStart = x0;
+      state._xEnd = x1;
+      state._offsetX = pixelOffset(translation.first, width);
+      state._offsetY = pixelOffset(translation.second, height);
+      state._opacity = l.getOpacity() * opacityModifier;
+      state._conditionalBlend = l.shouldConditionalBlend();
+      state._cbChannel = l.getConditionalBlendChannel();
+      getConditionalBlendParams(l, state._cb);
+      state._renderMap = &renderMap;
+      state._srcRenderMap = nullptr;
+
+      // resolve render map ids up front, the kernels only write ids
+      renderMap.allocate();
+      if (isPrecompLayer) {
+        state._srcRenderMap = &tmpLayer->getRenderMap();
+        for (int k = 0; k < state._srcRenderMap->numIds(); k++) {
+          state._srcIds.push_back(renderMap.getId(state._srcRenderMap->getName(k)));
+        }
+      }
+      else {
+        state._layerId = renderMap.getId(l.getName());
+      }
+
       // blend the layer
-      for (int y = 0; y < height; y++) {
-        // offset
-        int yt = y + translation.second * height;
+      // the blend mode is resolved once here, and since rows are independent of each other
+      // the layer is split into bands of rows that are blended separately
+      BlendRowsFunc blendFunc = getBlendRowsFunc(l._mode);
+      parallelFor(y1 - y0, threads, 16, [&](int yStart, int yEnd) {
+        (this->*blendFunc)(state, y0 + yStart, y0 + yEnd);
+      });
 
-        if (yt < 0 || yt >= height)
-          continue;
+      // adjustment layer clean up, if applicable
+      if (tmpLayer != nullptr) {
+        delete tmpLayer;
+      }
+    }
 
-        for (int x = 0; x < width; x++) {
-          // offset
-          int xt = x + translation.first * width;
+    // delete the mask
+    delete defaultMask;
 
-          if (xt < 0 || xt >= width)
-            continue;
+    return comp;
+  }
 
-          int i = xt + yt * width;
-          int o = x + y * width;
 
-          if (i < 0 || (unsigned int)i >= comp->numPx())
-            continue;
+  Image* Compositor::renderRegion(Context& c, int x, int y, int w, int h, string size, int threads)
+  {
+    if (w <= 0 || h <= 0) {
+      getLogger()->log("Unable to render region. Width and height must be positive.", LogLevel::WARN);
+      return new Image();
+    }
 
-          // pixel data is a flat array, rgba interlaced format
-          // a = background, b = new layer
-          // alphas
-          float ab = (layerPx[i * 4 + 3] / 255.0f) * (l.getOpacity() * opacityModifier);
-          float aa = compPx[o * 4 + 3] / 255.0f;
+    if (size == "") {
+      size = "full";
+    }
 
-          // alpha ab is modulated by layer mask
-          // layer mask is assumed greyscale, pull red channel as representative and premult with mask alpha
-          float maskAlpha = ((*layerMaskPx)[i * 4] / 255.0f) * ((*layerMaskPx)[i * 4 + 3] / 255.0f);
-          ab *= maskAlpha;
+    if (_imageData.empty() || !_imageData.hasSize(size)) {
+      if (!_imageData.empty())
+        getLogger()->log("No render size named " + size + " found. Rendering at full size.", LogLevel::WARN);
+      size = "full";
+    }
 
-          // short circuit here if ab == 0
-          if (ab == 0)
-            continue;
+    FloatImage* comp = renderRegionFloat(c, nullptr, _layerOrder, 1, size, x, y, w, h, threads);
+    Image* img = comp->toImage();
+    delete comp;
 
-          // mark the pixel as affected by the current layer
-          if (!isPrecompLayer) {
-            renderMap[o] = l.getName();
-          }
-          else {
-            renderMap[o] = tmpLayer->getRenderMap()[o];
-          }
+    return img;
+  }
 
-          if (shouldConditionalBlend) {
-            // i'm unsure if it works literally just on the layer below it or the composition up to this point
-            float abScale = conditionalBlend(l.getConditionalBlendChannel(), sbMin,
-              sbMax, swMin, swMax, dbMin, dbMax, dwMin, dwMax,
-              layerPx[i * 4] / 255.0f, layerPx[i * 4 + 1] / 255.0f, layerPx[i * 4 + 2] / 255.0f,
-              compPx[o * 4] / 255.0f, compPx[o * 4 + 1] / 255.0f, compPx[o * 4 + 2] / 255.0f);
+  FloatImage* Compositor::renderRegionFloat(Context& c, FloatImage* comp, const vector<string>& order, float co, string size,
+    int x, int y, int w, int h, int threads)
+  {
+    if (comp == nullptr) {
+      comp = new FloatImage(w, h);
+    }
 
-            ab = ab * abScale;
-          }
+    if (c.size() == 0 || _imageData.empty()) {
+      return comp;
+    }
 
-          float ad = aa + ab - aa * ab;
+    int width = getWidth(size);
+    int height = getHeight(size);
 
-          compPx[o * 4 + 3] = (unsigned char)(ad * 255);
+    // default mask (all white)
+    Image defaultMask(w, h);
+    vector<unsigned char>& defaultMaskPx = defaultMask.getData();
+    fill(defaultMaskPx.begin(), defaultMaskPx.end(), 255);
 
-          // premult colors
-          float rb = premult(layerPx[i * 4], ab);
-          float gb = premult(layerPx[i * 4 + 1], ab);
-          float bb = premult(layerPx[i * 4 + 2], ab);
+    vector<float>& compPxV = comp->getData();
+    float* compPx = compPxV.data();
+    RenderLayerMap& renderMap = comp->getRenderMap();
 
-          float ra = premult(compPx[o * 4], aa);
-          float ga = premult(compPx[o * 4 + 1], aa);
-          float ba = premult(compPx[o * 4 + 2], aa);
+    shared_ptr<RenderPlan> plan = getRenderPlan(order);
 
-          // blend modes
-          if (l._mode == BlendMode::NORMAL) {
-            // b over a, standard alpha blend
-            compPx[o * 4] = cvt(normal(ra, rb, aa, ab), ad);
-            compPx[o * 4 + 1] = cvt(normal(ga, gb, aa, ab), ad);
-            compPx[o * 4 + 2] = cvt(normal(ba, bb, aa, ab), ad);
-          }
-          else if (l._mode == BlendMode::MULTIPLY) {
-            compPx[o * 4] = cvt(multiply(ra, rb, aa, ab), ad);
-            compPx[o * 4 + 1] = cvt(multiply(ga, gb, aa, ab), ad);
-            compPx[o * 4 + 2] = cvt(multiply(ba, bb, aa, ab), ad);
-          }
-          else if (l._mode == BlendMode::SCREEN) {
-            compPx[o * 4] = cvt(screen(ra, rb, aa, ab), ad);
-            compPx[o * 4 + 1] = cvt(screen(ga, gb, aa, ab), ad);
-            compPx[o * 4 + 2] = cvt(screen(ba, bb, aa, ab), ad);
-          }
-          else if (l._mode == BlendMode::OVERLAY) {
-            compPx[o * 4] = cvt(overlay(ra, rb, aa, ab), ad);
-            compPx[o * 4 + 1] = cvt(overlay(ga, gb, aa, ab), ad);
-            compPx[o * 4 + 2] = cvt(overlay(ba, bb, aa, ab), ad);
-          }
-          else if (l._mode == BlendMode::HARD_LIGHT) {
-            compPx[o * 4] = cvt(hardLight(ra, rb, aa, ab), ad);
-            compPx[o * 4 + 1] = cvt(hardLight(ga, gb, aa, ab), ad);
-            compPx[o * 4 + 2] = cvt(hardLight(ba, bb, aa, ab), ad);
-          }
-          else if (l._mode == BlendMode::SOFT_LIGHT) {
-            compPx[o * 4] = cvt(softLight(ra, rb, aa, ab), ad);
-            compPx[o * 4 + 1] = cvt(softLight(ga, gb, aa, ab), ad);
-            compPx[o * 4 + 2] = cvt(softLight(ba, bb, aa, ab), ad);
-          }
-          else if (l._mode == BlendMode::LINEAR_DODGE) {
-            // special override for alpha here
-            ad = (aa + ab > 1) ? 1 : (aa + ab);
-            compPx[o * 4 + 3] = (unsigned char)(ad * 255);
-
-            compPx[o * 4] = cvt(linearDodge(ra, rb, aa, ab), ad);
-            compPx[o * 4 + 1] = cvt(linearDodge(ga, gb, aa, ab), ad);
-            compPx[o * 4 + 2] = cvt(linearDodge(ba, bb, aa, ab), ad);
-          }
-          else if (l._mode == BlendMode::COLOR_DODGE) {
-            compPx[o * 4] = cvt(colorDodge(ra, rb, aa, ab), ad);
-            compPx[o * 4 + 1] = cvt(colorDodge(ga, gb, aa, ab), ad);
-            compPx[o * 4 + 2] = cvt(colorDodge(ba, bb, aa, ab), ad);
-          }
-          else if (l._mode == BlendMode::LINEAR_BURN) {
-            // need unmultiplied colors for this one
-            compPx[o * 4] = cvt(linearBurn(compPx[o * 4] / 255.0f, layerPx[i * 4] / 255.0f, aa, ab), ad);
-            compPx[o * 4 + 1] = cvt(linearBurn(compPx[o * 4 + 1] / 255.0f, layerPx[i * 4 + 1] / 255.0f, aa, ab), ad);
-            compPx[o * 4 + 2] = cvt(linearBurn(compPx[o * 4 + 2] / 255.0f, layerPx[i * 4 + 2] / 255.0f, aa, ab), ad);
-          }
-          else if (l._mode == BlendMode::LINEAR_LIGHT) {
-            compPx[o * 4] = cvt(linearLight(compPx[o * 4] / 255.0f, layerPx[i * 4] / 255.0f, aa, ab), ad);
-            compPx[o * 4 + 1] = cvt(linearLight(compPx[o * 4 + 1] / 255.0f, layerPx[i * 4 + 1] / 255.0f, aa, ab), ad);
-            compPx[o * 4 + 2] = cvt(linearLight(compPx[o * 4 + 2] / 255.0f, layerPx[i * 4 + 2] / 255.0f, aa, ab), ad);
-          }
-          else if (l._mode == BlendMode::COLOR) {
-            // also no premult colors
-            RGBColor dest;
-            dest._r = compPx[o * 4] / 255.0f;
-            dest._g = compPx[o * 4 + 1] / 255.0f;
-            dest._b = compPx[o * 4 + 2] / 255.0f;
-
-            RGBColor src;
-            src._r = layerPx[i * 4] / 255.0f;
-            src._g = layerPx[i * 4 + 1] / 255.0f;
-            src._b = layerPx[i * 4 + 2] / 255.0f;
-
-            RGBColor res = color(dest, src, aa, ab);
-            compPx[o * 4] = cvt(res._r, ad);
-            compPx[o * 4 + 1] = cvt(res._g, ad);
-            compPx[o * 4 + 2] = cvt(res._b, ad);
-          }
-          else if (l._mode == BlendMode::LIGHTEN) {
-            compPx[o * 4] = cvt(lighten(ra, rb, aa, ab), ad);
-            compPx[o * 4 + 1] = cvt(lighten(ga, gb, aa, ab), ad);
-            compPx[o * 4 + 2] = cvt(lighten(ba, bb, aa, ab), ad);
-          }
-          else if (l._mode == BlendMode::DARKEN) {
-            compPx[o * 4] = cvt(darken(ra, rb, aa, ab), ad);
-            compPx[o * 4 + 1] = cvt(darken(ga, gb, aa, ab), ad);
-            compPx[o * 4 + 2] = cvt(darken(ba, bb, aa, ab), ad);
-          }
-          else if (l._mode == BlendMode::PIN_LIGHT) {
-            compPx[o * 4] = cvt(pinLight(ra, rb, aa, ab), ad);
-            compPx[o * 4 + 1] = cvt(pinLight(ga, gb, aa, ab), ad);
-            compPx[o * 4 + 2] = cvt(pinLight(ba, bb, aa, ab), ad);
-          }
-          else if (l._mode == BlendMode::COLOR_BURN) {
-            // also unmultiplied colors here
-            compPx[o * 4] = cvt(colorBurn(compPx[o * 4] / 255.0f, layerPx[i * 4] / 255.0f, aa, ab), ad);
-            compPx[o * 4 + 1] = cvt(colorBurn(compPx[o * 4 + 1] / 255.0f, layerPx[i * 4 + 1] / 255.0f, aa, ab), ad);
-            compPx[o * 4 + 2] = cvt(colorBurn(compPx[o * 4 + 2] / 255.0f, layerPx[i * 4 + 2] / 255.0f, aa, ab), ad);
+    for (auto& step : plan->_steps) {
+      const string& id = step._id;
+      Layer& l = c[id];
+
+      bool visible = l._visible;
+      float opacityModifier = 1;
+      for (auto& g : step._groups) {
+        Layer& gl = c[g];
+        visible = visible & gl._visible;
+        opacityModifier *= gl.getOpacity();
+      }
+      opacityModifier *= co;
+
+      if (!visible)
+        continue;
+
+      // canvas pixels the layer can change, clipped to the region and moved into region coordinates
+      int x0, y0, x1, y1;
+      if (!getLayerExtent(c, step, size, x0, y0, x1, y1))
+        continue;
+
+      x0 = clamp(x0 - x, 0, w);
+      y0 = clamp(y0 - y, 0, h);
+      x1 = clamp(x1 - x, 0, w);
+      y1 = clamp(y1 - y, 0, h);
+
+      if (x1 <= x0 || y1 <= y0)
+        continue;
+
+      // layer pixels are read at the offset position (see blendRows). Cropping the layer at the
+      // offset region lines it up with the composite, so the blend itself runs without an offset.
+      // Adjustment layers work on the composite, which only exists for the region, so they're not offset.
+      auto translation = l.getOffset();
+      int dx = pixelOffset(translation.first, width);
+      int dy = pixelOffset(translation.second, height);
+
+      FloatImage* tmpLayer = nullptr;
+      bool isPrecompLayer = false;
+
+      if (l.isPrecomp()) {
+        if (l._mode == PASS_THROUGH) {
+          renderRegionFloat(c, comp, l.getPrecompOrder(), l.getOpacity() * co, size, x, y, w, h, threads);
+
+          adjust(comp, l, step._strokes, threads);
+          for (auto& g : step._groups) {
+            adjust(comp, c[g], plan->_groups[g]._strokes, threads);
           }
-          else if (l._mode == BlendMode::VIVID_LIGHT) {
-            compPx[o * 4] = cvt(vividLight(compPx[o * 4] / 255.0f, layerPx[i * 4] / 255.0f, aa, ab), ad);
-            compPx[o * 4 + 1] = cvt(vividLight(compPx[o * 4 + 1] / 255.0f, layerPx[i * 4 + 1] / 255.0f, aa, ab), ad);
-            compPx[o * 4 + 2] = cvt(vividLight(compPx[o * 4 + 2] / 255.0f, layerPx[i * 4 + 2] / 255.0f, aa, ab), ad);
+
+          continue;
+        }
+        else {
+          tmpLayer = renderRegionFloat(c, nullptr, l.getPrecompOrder(), co, size, x + dx, y + dy, w, h, threads);
+          adjust(tmpLayer, l, step._strokes, threads);
+          isPrecompLayer = true;
+        }
+      }
+      else if (l.isAdjustmentLayer()) {
+        tmpLayer = new FloatImage(*comp);
+        adjust(tmpLayer, l, step._strokes, threads);
+      }
+      else if (step._strokes.size() > 0) {
+        // strokes need the area around the layer's pixels, so they run on the whole layer
+        FloatImage full(_imageData.get(l.getName(), size).get());
+        adjust(&full, l, step._strokes, threads);
+        tmpLayer = full.crop(x + dx, y + dy, w, h);
+      }
+      else {
+        Image* part = _imageData.get(l.getName(), size)->crop(x + dx, y + dy, w, h);
+        tmpLayer = new FloatImage(part);
+        delete part;
+        adjust(tmpLayer, l, step._strokes, threads);
+      }
+
+      for (auto& g : step._groups) {
+        adjust(tmpLayer, c[g], plan->_groups[g]._strokes, threads);
+      }
+
+      Image* maskPart = nullptr;
+      if (l.hasMask()) {
+        maskPart = _layerMasks.get(l.getName(), size)->crop(x + dx, y + dy, w, h);
+      }
+
+      LayerBlendState state;
+      state._compPx = compPx;
+      state._layerPx = tmpLayer->getData().data();
+      state._maskPx = (maskPart != nullptr) ? maskPart->getData().data() : defaultMaskPx.data();
+      state._width = w;
+      state._height = h;
+      state._xStart = x0;
+      state._xEnd = x1;
+      state._offsetX = 0;
+      state._offsetY = 0;
+      state._opacity = l.getOpacity() * opacityModifier;
+      state._conditionalBlend = l.shouldConditionalBlend();
+      state._cbChannel = l.getConditionalBlendChannel();
+      getConditionalBlendParams(l, state._cb);
+      state._renderMap = &renderMap;
+      state._srcRenderMap = nullptr;
+
+      renderMap.allocate();
+      if (isPrecompLayer) {
+        state._srcRenderMap = &tmpLayer->getRenderMap();
+        for (int k = 0; k < state._srcRenderMap->numIds(); k++) {
+          state._srcIds.push_back(renderMap.getId(state._srcRenderMap->getName(k)));
+        }
+      }
+      else {
+        state._layerId = renderMap.getId(l.getName());
+      }
+
+      BlendRowsFunc blendFunc = getBlendRowsFunc(l._mode);
+      parallelFor(y1 - y0, threads, 16, [&](int yStart, int yEnd) {
+        (this->*blendFunc)(state, y0 + yStart, y0 + yEnd);
+      });
+
+      delete tmpLayer;
+
+      if (maskPart != nullptr)
+        delete maskPart;
+    }
+
+    return comp;
+  }
+
+  unsigned int Compositor::newRenderGeneration()
+  {
+    unsigned int generation = ++_renderGeneration;
+
+    // 0 means never cancel, skip it when the counter wraps
+    if (generation == 0)
+      generation = ++_renderGeneration;
+
+    return generation;
+  }
+
+  bool Compositor::renderCancelled(unsigned int generation)
+  {
+    return generation != 0 && generation != _renderGeneration;
+  }
+
+  bool Compositor::renderProgressive(Context& c, string size, unsigned int generation, function<void(Image*, string)> callback, int threads)
+  {
+    if (size == "") {
+      size = "full";
+    }
+
+    if (c.size() == 0 || _imageData.empty()) {
+      callback(new Image(), size);
+      return true;
+    }
+
+    if (!_imageData.hasSize(size)) {
+      getLogger()->log("No render size named " + size + " found. Rendering at full size.", LogLevel::WARN);
+      size = "full";
+    }
+
+    // preview levels, smallest first
+    int targetWidth = getWidth(size);
+    multimap<int, string> levels;
+    for (auto& cached : _imageData.getSizes()) {
+      int w = getWidth(cached);
+      if (w < targetWidth)
+        levels.insert(make_pair(w, cached));
+    }
+    levels.insert(make_pair(targetWidth, size));
+
+    for (auto& level : levels) {
+      // only the final level goes through the prefix cache, previews are cheap and would evict it
+      FloatImage* comp = (level.second == size) ? renderFloatCached(c, size, threads, generation) :
+        renderFloat(c, nullptr, vector<string>(), 1, level.second, threads, generation);
+
+      if (renderCancelled(generation)) {
+        delete comp;
+        return false;
+      }
+
+      Image* img = comp->toImage();
+      delete comp;
+      callback(img, level.second);
+    }
+
+    return true;
+  }
+
+  void Compositor::clearRenderCache()
+  {
+    lock_guard<mutex> lock(_prefixCacheLock);
+    _prefixCache.clear();
+  }
+
+  shared_ptr<RenderPlan> Compositor::getRenderPlan(const vector<string>& order)
+  {
+    unsigned int version;
+
+    {
+      lock_guard<mutex> lock(_renderPlanLock);
+      auto it = _renderPlans.find(order);
+      if (it != _renderPlans.end())
+        return it->second;
+
+      version = _renderPlanVersion;
+    }
+
+    shared_ptr<RenderPlan> plan = compileRenderPlan(order);
+
+    lock_guard<mutex> lock(_renderPlanLock);
+
+    // groups changed while compiling, the plan is still good for this render but isn't kept
+    if (version != _renderPlanVersion)
+      return plan;
+
+    // the prefix cache renders arbitrary slices of the layer order, don't let those pile up
+    if (_renderPlans.size() >= 256)
+      _renderPlans.clear();
+
+    _renderPlans[order] = plan;
+    return plan;
+  }
+
+  shared_ptr<RenderPlan> Compositor::compileRenderPlan(const vector<string>& order)
+  {
+    shared_ptr<RenderPlan> plan = shared_ptr<RenderPlan>(new RenderPlan());
+    plan->_order = order;
+
+    for (auto& id : order) {
+      plan->_steps.push_back(compilePlanStep(id));
+
+      for (auto& g : plan->_steps.back()._groups) {
+        if (plan->_groups.count(g) == 0)
+          plan->_groups[g] = compilePlanStep(g);
+      }
+    }
+
+    return plan;
+  }
+
+  PlanStep Compositor::compilePlanStep(const string& id)
+  {
+    PlanStep step;
+    step._id = id;
+    step._groupEffects = false;
+
+    for (auto& o : _groupOrder) {
+      Group& g = _groups[o.second];
+
+      if (g._affectedLayers.count(id) > 0) {
+        step._groups.push_back(o.second);
+
+        if (g._effect._mode != EffectMode::NONE)
+          step._groupEffects = true;
+
+        if (g._effect._mode == EffectMode::STROKE)
+          step._strokes.push_back(o.second);
+      }
+    }
+
+    return step;
+  }
+
+  void Compositor::clearRenderPlans()
+  {
+    lock_guard<mutex> lock(_renderPlanLock);
+    _renderPlans.clear();
+    _renderPlanVersion++;
+  }
+
+  FloatImage* Compositor::renderFloatCached(Context& c, string size, int threads, unsigned int generation)
+  {
+    if (size == "") {
+      size = "full";
+    }
+
+    vector<string> order = _layerOrder;
+    int n = (int)order.size();
+
+    // sizes that aren't in the cache fall back to full size in renderFloat, skip caching those
+    if (!_imageData.hasSize(size)) {
+      return renderFloat(c, nullptr, order, 1, size, threads, generation);
+    }
+
+    // each prefix hash covers the state of every layer up to and including that position,
+    // so a matching hash at position i means the composite after layer i is unchanged
+    vector<size_t> prefix(n);
+    size_t h = 0;
+    for (int i = 0; i < n; i++) {
+      hashCombine(h, layerStateHash(c, order[i], size));
+      prefix[i] = h;
+    }
+
+    shared_ptr<FloatImage> snapshot;
+    int snapIndex = -1;
+    int firstChanged = 0;
+
+    {
+      lock_guard<mutex> lock(_prefixCacheLock);
+      if (_prefixCache.count(size) > 0) {
+        PrefixCacheEntry& e = _prefixCache[size];
+        while (firstChanged < n && firstChanged < e._prefix.size() && e._prefix[firstChanged] == prefix[firstChanged])
+          firstChanged++;
+
+        if (e._snapshot != nullptr && e._index < firstChanged) {
+          snapshot = e._snapshot;
+          snapIndex = e._index;
+        }
+      }
+    }
+
+    // Move the snapshot up to just before the first layer that changed since the last render.
+    // Interactive edits tend to hit the same layer over and over, so the next render can
+    // usually resume right below it. If nothing changed, keep a valid snapshot where it is.
+    int newSnap = firstChanged - 1;
+    if (firstChanged == n && snapshot != nullptr)
+      newSnap = snapIndex;
+
+    // snapshots are never modified once cached, the render works on a copy
+    FloatImage* comp = (snapshot != nullptr) ? new FloatImage(*snapshot) : nullptr;
+
+    if (newSnap > snapIndex) {
+      vector<string> head(order.begin() + snapIndex + 1, order.begin() + newSnap + 1);
+      comp = renderFloat(c, comp, head, 1, size, threads, generation);
+
+      // a cancelled render is incomplete and can't be cached
+      if (renderCancelled(generation))
+        return comp;
+
+      snapshot = shared_ptr<FloatImage>(new FloatImage(*comp));
+      snapIndex = newSnap;
+    }
+
+    if (snapIndex + 1 < n) {
+      vector<string> tail(order.begin() + snapIndex + 1, order.end());
+      comp = renderFloat(c, comp, tail, 1, size, threads, generation);
+    }
+
+    if (renderCancelled(generation))
+      return comp;
+
+    {
+      lock_guard<mutex> lock(_prefixCacheLock);
+
+      // snapshots are 16 bytes per pixel, only keep the one for the size rendered last
+      if (_prefixCache.count(size) == 0)
+        _prefixCache.clear();
+
+      PrefixCacheEntry& e = _prefixCache[size];
+      e._prefix = prefix;
+      e._index = snapIndex;
+      e._snapshot = snapshot;
+    }
+
+    return comp;
+  }
+
+  size_t Compositor::layerStateHash(Context& c, string id, string size)
+  {
+    size_t h = 0;
+    hashCombine(h, id);
+
+    if (c.count(id) == 0)
+      return h;
+
+    Layer& l = c[id];
+    hashCombine(h, l.stateHash());
+
+    // groups modify visibility, opacity and adjustments of their layers
+    for (auto& o : _groupOrder) {
+      if (_groups[o.second]._affectedLayers.count(id) > 0) {
+        hashCombine(h, o.second);
+        hashCombine(h, c[o.second].stateHash());
+
+        ImageEffect& effect = _groups[o.second]._effect;
+        hashCombine(h, (int)effect._mode);
+        hashCombine(h, effect._width);
+        hashCombine(h, effect._color._r);
+        hashCombine(h, effect._color._g);
+        hashCombine(h, effect._color._b);
+      }
+    }
+
+    // scaled copies come and go with the cache budget, so identify the pixels by the
+    // full size image they're made from
+    if (_imageData.has(id, size)) {
+      hashCombine(h, (void*)_imageData.get(id).get());
+      hashCombine(h, size);
+    }
+
+    if (_layerMasks.has(id, size)) {
+      hashCombine(h, (void*)_layerMasks.get(id).get());
+      hashCombine(h, size);
+    }
+
+    // precomps render their own layer list
+    for (auto& p : l.getPrecompOrder())
+      hashCombine(h, layerStateHash(c, p, size));
+
+    return h;
+  }
+
+  // modes that blend unpremultiplied colors
+  static inline bool blendsStraight(BlendMode mode)
+  {
+    return mode == BlendMode::LINEAR_BURN || mode == BlendMode::LINEAR_LIGHT ||
+      mode == BlendMode::COLOR || mode == BlendMode::COLOR_BURN || mode == BlendMode::VIVID_LIGHT;
+  }
+
+#ifdef COMP_USE_SSE
+  // SSE versions of the blend functions, four pixels of one channel per register.
+  // Each one evaluates every branch of the scalar function and picks per lane.
+
+  // mask ? a : b
+  static inline __m128 sseSelect(__m128 mask, __m128 a, __m128 b)
+  {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+  }
+
+  static inline __m128 sseLighten(__m128 Dca, __m128 Sca, __m128 Da, __m128 Sa)
+  {
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128 srcOver = _mm_add_ps(Sca, _mm_mul_ps(Dca, _mm_sub_ps(one, Sa)));
+    __m128 destOver = _mm_add_ps(Dca, _mm_mul_ps(Sca, _mm_sub_ps(one, Da)));
+    return sseSelect(_mm_cmpgt_ps(Sca, Dca), srcOver, destOver);
+  }
+
+  static inline __m128 sseDarken(__m128 Dca, __m128 Sca, __m128 Da, __m128 Sa)
+  {
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128 srcOver = _mm_add_ps(Sca, _mm_mul_ps(Dca, _mm_sub_ps(one, Sa)));
+    __m128 destOver = _mm_add_ps(Dca, _mm_mul_ps(Sca, _mm_sub_ps(one, Da)));
+    return sseSelect(_mm_cmpgt_ps(Sca, Dca), destOver, srcOver);
+  }
+
+  static inline __m128 sseColorDodge(__m128 Dca, __m128 Sca, __m128 Da, __m128 Sa)
+  {
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128 rest = _mm_add_ps(_mm_mul_ps(Sca, _mm_sub_ps(one, Da)), _mm_mul_ps(Dca, _mm_sub_ps(one, Sa)));
+    __m128 SaDa = _mm_mul_ps(Sa, Da);
+
+    // min(1, Dca / Da * Sa / (Sa - Sca)) with one divide. Like the scalar min, a NaN ratio
+    // (Da = 0) gives 1, and that gets multiplied by Da = 0 anyway
+    __m128 ratio = _mm_div_ps(_mm_mul_ps(Dca, Sa), _mm_mul_ps(Da, _mm_sub_ps(Sa, Sca)));
+    __m128 partial = _mm_add_ps(_mm_mul_ps(SaDa, _mm_min_ps(ratio, one)), rest);
+
+    __m128 full = _mm_add_ps(SaDa, rest);
+    __m128 clear = _mm_mul_ps(Sca, _mm_sub_ps(one, Da));
+
+    __m128 srcFull = _mm_cmpeq_ps(Sca, Sa);
+    __m128 res = sseSelect(_mm_cmplt_ps(Sca, Sa), partial, _mm_setzero_ps());
+    res = sseSelect(srcFull, full, res);
+    return sseSelect(_mm_and_ps(srcFull, _mm_cmpeq_ps(Dca, _mm_setzero_ps())), clear, res);
+  }
+
+  static inline __m128 sseColorBurn(__m128 Dc, __m128 Sc, __m128 Da, __m128 Sa)
+  {
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128 zero = _mm_setzero_ps();
+    __m128 burn = _mm_max_ps(_mm_sub_ps(one, _mm_div_ps(_mm_sub_ps(one, Dc), Sc)), zero);
+    burn = sseSelect(_mm_cmpeq_ps(Sc, zero), zero, burn);
+
+    return _mm_add_ps(_mm_mul_ps(burn, Sa), _mm_mul_ps(Dc, _mm_sub_ps(one, Sa)));
+  }
+
+  // blends one channel. Dca and Sca are premultiplied, Dc and Sc are the unpremultiplied colors
+  // (only set for straight modes). invDa is 1 / Da, 0 where Da is 0. Returns the blended
+  // premultiplied color before clamping. Color and pass through are handled by the caller.
+  template <BlendMode mode>
+  static inline __m128 sseBlendChannel(__m128 Dca, __m128 Sca, __m128 Dc, __m128 Sc, __m128 Da, __m128 Sa,
+    __m128 invDa)
+  {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 two = _mm_set1_ps(2.0f);
+    const __m128 half = _mm_set1_ps(0.5f);
+
+    if (mode == BlendMode::NORMAL) {
+      return _mm_add_ps(Sca, _mm_mul_ps(Dca, _mm_sub_ps(one, Sa)));
+    }
+    else if (mode == BlendMode::MULTIPLY) {
+      return _mm_add_ps(_mm_add_ps(_mm_mul_ps(Sca, Dca), _mm_mul_ps(Sca, _mm_sub_ps(one, Da))),
+        _mm_mul_ps(Dca, _mm_sub_ps(one, Sa)));
+    }
+    else if (mode == BlendMode::SCREEN) {
+      return _mm_sub_ps(_mm_add_ps(Sca, Dca), _mm_mul_ps(Sca, Dca));
+    }
+    else if (mode == BlendMode::OVERLAY || mode == BlendMode::HARD_LIGHT) {
+      // the two are the same blend with the roles of the layers swapped in the test
+      __m128 SD2 = _mm_mul_ps(two, _mm_mul_ps(Sca, Dca));
+      __m128 low = _mm_add_ps(_mm_add_ps(SD2, _mm_mul_ps(Sca, _mm_sub_ps(one, Da))), _mm_mul_ps(Dca, _mm_sub_ps(one, Sa)));
+      __m128 high = _mm_sub_ps(_mm_sub_ps(_mm_add_ps(_mm_mul_ps(Sca, _mm_add_ps(one, Da)), _mm_mul_ps(Dca, _mm_add_ps(one, Sa))),
+        _mm_mul_ps(Da, Sa)), SD2);
+
+      __m128 isLow = (mode == BlendMode::OVERLAY) ? _mm_cmple_ps(_mm_mul_ps(two, Dca), Da) :
+        _mm_cmple_ps(_mm_mul_ps(two, Sca), Sa);
+      return sseSelect(isLow, low, high);
+    }
+    else if (mode == BlendMode::SOFT_LIGHT) {
+      __m128 m = _mm_mul_ps(Dca, invDa);
+      __m128 S2 = _mm_sub_ps(_mm_mul_ps(two, Sca), Sa);
+      __m128 rest = _mm_add_ps(_mm_sub_ps(Sca, _mm_mul_ps(Sca, Da)), Dca);
+
+      __m128 dark = _mm_add_ps(_mm_add_ps(_mm_mul_ps(Dca, _mm_add_ps(Sa, _mm_mul_ps(S2, _mm_sub_ps(one, m)))),
+        _mm_mul_ps(Sca, _mm_sub_ps(one, Da))), _mm_mul_ps(Dca, _mm_sub_ps(one, Sa)));
+
+      // 16m^3 - 12m^2 - 3m
+      __m128 poly = _mm_mul_ps(m, _mm_sub_ps(_mm_mul_ps(m, _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(16.0f), m), _mm_set1_ps(12.0f))),
+        _mm_set1_ps(3.0f)));
+      __m128 lightDark = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(Da, S2), poly), rest);
+      __m128 light = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(Da, S2), _mm_sub_ps(_mm_sqrt_ps(m), m)), rest);
+
+      __m128 res = sseSelect(_mm_cmple_ps(_mm_mul_ps(_mm_set1_ps(4.0f), Dca), Da), lightDark, light);
+      return sseSelect(_mm_cmple_ps(_mm_mul_ps(two, Sca), Sa), dark, res);
+    }
+    else if (mode == BlendMode::LINEAR_DODGE) {
+      return _mm_add_ps(Sca, Dca);
+    }
+    else if (mode == BlendMode::COLOR_DODGE) {
+      return sseColorDodge(Dca, Sca, Da, Sa);
+    }
+    else if (mode == BlendMode::LINEAR_BURN || mode == BlendMode::LINEAR_LIGHT) {
+      // burn is Dc + Sc - 1, light is Dc + 2Sc - 1
+      __m128 S = (mode == BlendMode::LINEAR_BURN) ? Sc : _mm_mul_ps(two, Sc);
+      __m128 v = _mm_sub_ps(_mm_add_ps(Dc, S), one);
+      __m128 res = _mm_add_ps(_mm_mul_ps(v, Sa), _mm_mul_ps(Dc, _mm_sub_ps(one, Sa)));
+
+      // transparent background takes the layer color
+      return sseSelect(_mm_cmpeq_ps(Da, zero), Sc, res);
+    }
+    else if (mode == BlendMode::LIGHTEN) {
+      return sseLighten(Dca, Sca, Da, Sa);
+    }
+    else if (mode == BlendMode::DARKEN) {
+      return sseDarken(Dca, Sca, Da, Sa);
+    }
+    else if (mode == BlendMode::PIN_LIGHT) {
+      __m128 dark = sseDarken(Dca, _mm_mul_ps(Sca, two), Da, Sa);
+      __m128 light = sseLighten(Dca, _mm_mul_ps(two, _mm_sub_ps(Sca, half)), Da, Sa);
+      __m128 res = sseSelect(_mm_cmplt_ps(Sca, half), dark, light);
+
+      return sseSelect(_mm_cmpeq_ps(Da, zero), Sca, res);
+    }
+    else if (mode == BlendMode::COLOR_BURN) {
+      return sseColorBurn(Dc, Sc, Da, Sa);
+    }
+    else if (mode == BlendMode::VIVID_LIGHT) {
+      __m128 burn = sseColorBurn(Dc, _mm_mul_ps(Sc, two), Da, Sa);
+      __m128 dodge = sseColorDodge(_mm_mul_ps(Dc, Da), _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(two, Sc), half), Sa), Da, Sa);
+
+      return sseSelect(_mm_cmplt_ps(Sc, half), burn, dodge);
+    }
+
+    return Dca;
+  }
+#endif
+
+  Compositor::BlendRowsFunc Compositor::getBlendRowsFunc(BlendMode mode)
+  {
+    switch (mode) {
+    case BlendMode::NORMAL:
+      return &Compositor::blendRows<BlendMode::NORMAL>;
+    case BlendMode::MULTIPLY:
+      return &Compositor::blendRows<BlendMode::MULTIPLY>;
+    case BlendMode::SCREEN:
+      return &Compositor::blendRows<BlendMode::SCREEN>;
+    case BlendMode::OVERLAY:
+      return &Compositor::blendRows<BlendMode::OVERLAY>;
+    case BlendMode::HARD_LIGHT:
+      return &Compositor::blendRows<BlendMode::HARD_LIGHT>;
+    case BlendMode::SOFT_LIGHT:
+      return &Compositor::blendRows<BlendMode::SOFT_LIGHT>;
+    case BlendMode::LINEAR_DODGE:
+      return &Compositor::blendRows<BlendMode::LINEAR_DODGE>;
+    case BlendMode::COLOR_DODGE:
+      return &Compositor::blendRows<BlendMode::COLOR_DODGE>;
+    case BlendMode::LINEAR_BURN:
+      return &Compositor::blendRows<BlendMode::LINEAR_BURN>;
+    case BlendMode::LINEAR_LIGHT:
+      return &Compositor::blendRows<BlendMode::LINEAR_LIGHT>;
+    case BlendMode::COLOR:
+      return &Compositor::blendRows<BlendMode::COLOR>;
+    case BlendMode::LIGHTEN:
+      return &Compositor::blendRows<BlendMode::LIGHTEN>;
+    case BlendMode::DARKEN:
+      return &Compositor::blendRows<BlendMode::DARKEN>;
+    case BlendMode::PIN_LIGHT:
+      return &Compositor::blendRows<BlendMode::PIN_LIGHT>;
+    case BlendMode::COLOR_BURN:
+      return &Compositor::blendRows<BlendMode::COLOR_BURN>;
+    case BlendMode::VIVID_LIGHT:
+      return &Compositor::blendRows<BlendMode::VIVID_LIGHT>;
+    default:
+      // anything else (pass through on a non-group layer) only accumulates alpha
+      return &Compositor::blendRows<BlendMode::PASS_THROUGH>;
+    }
+  }
+
+  template<BlendMode mode>
+  void Compositor::blendRows(LayerBlendState& s, int yStart, int yEnd)
+  {
+    const bool straight = blendsStraight(mode);
+
+    float* compPx = s._compPx;
+    float* layerPx = s._layerPx;
+    const unsigned char* maskPx = s._maskPx;
+    int width = s._width;
+    int height = s._height;
+    RenderLayerMap& renderMap = *s._renderMap;
+
+    // columns whose offset position is inside the layer
+    int xStart = max(s._xStart, -s._offsetX);
+    int xEnd = min(s._xEnd, width - s._offsetX);
+
+    for (int y = yStart; y < yEnd; y++) {
+      // offset
+      int yt = y + s._offsetY;
+
+      if (yt < 0 || yt >= height)
+        continue;
+
+      int x = xStart;
+
+#ifdef COMP_USE_SSE
+      // four pixels at a time. Conditional blend tests each pixel against its settings, it stays scalar
+      if (!s._conditionalBlend) {
+        for (; x + 4 <= xEnd; x += 4) {
+          blendQuad<mode>(s, x + y * width, x + s._offsetX + yt * width);
+        }
+      }
+#endif
+
+      // remaining pixels
+      for (; x < xEnd; x++) {
+        int i = x + s._offsetX + yt * width;
+        int o = x + y * width;
+
+        // pixel data is a flat array, rgba interlaced format, premultiplied
+        // a = background, b = new layer
+        // alphas
+        float la = layerPx[i * 4 + 3];
+        float ab = la * s._opacity;
+        float aa = compPx[o * 4 + 3];
+
+        // alpha ab is modulated by layer mask
+        // layer mask is assumed greyscale, pull red channel as representative and premult with mask alpha
+        float maskAlpha = (maskPx[i * 4] / 255.0f) * (maskPx[i * 4 + 3] / 255.0f);
+        ab *= maskAlpha;
+
+        // short circuit here if ab == 0
+        if (ab == 0)
+          continue;
+
+        // mark the pixel as affected by the current layer
+        if (s._srcRenderMap == nullptr) {
+          renderMap.set(o, s._layerId);
+        }
+        else {
+          renderMap.set(o, s._srcIds[s._srcRenderMap->get(o)]);
+        }
+
+        // unpremultiplied colors, transparent background reads as white
+        float rbs = 0, gbs = 0, bbs = 0;
+        float ras = 1, gas = 1, bas = 1;
+        if (straight || s._conditionalBlend) {
+          rbs = layerPx[i * 4] / la;
+          gbs = layerPx[i * 4 + 1] / la;
+          bbs = layerPx[i * 4 + 2] / la;
+
+          if (aa > 0) {
+            ras = compPx[o * 4] / aa;
+            gas = compPx[o * 4 + 1] / aa;
+            bas = compPx[o * 4 + 2] / aa;
           }
         }
+
+        if (s._conditionalBlend) {
+          // i'm unsure if it works literally just on the layer below it or the composition up to this point
+          float abScale = conditionalBlend(s._cbChannel, s._cb[0], s._cb[1], s._cb[2], s._cb[3],
+            s._cb[4], s._cb[5], s._cb[6], s._cb[7], rbs, gbs, bbs, ras, gas, bas);
+
+          ab = ab * abScale;
+        }
+
+        float ad = aa + ab - aa * ab;
+
+        if (mode == BlendMode::LINEAR_DODGE) {
+          // special override for alpha here
+          ad = (aa + ab > 1) ? 1 : (aa + ab);
+        }
+
+        // premult colors
+        float rb = (layerPx[i * 4] / la) * ab;
+        float gb = (layerPx[i * 4 + 1] / la) * ab;
+        float bb = (layerPx[i * 4 + 2] / la) * ab;
+
+        float ra = compPx[o * 4];
+        float ga = compPx[o * 4 + 1];
+        float ba = compPx[o * 4 + 2];
+
+        // blend modes
+        if (mode == BlendMode::NORMAL) {
+          // b over a, standard alpha blend
+          compPx[o * 4] = cvtPremult(normal(ra, rb, aa, ab), ad);
+          compPx[o * 4 + 1] = cvtPremult(normal(ga, gb, aa, ab), ad);
+          compPx[o * 4 + 2] = cvtPremult(normal(ba, bb, aa, ab), ad);
+        }
+        else if (mode == BlendMode::MULTIPLY) {
+          compPx[o * 4] = cvtPremult(multiply(ra, rb, aa, ab), ad);
+          compPx[o * 4 + 1] = cvtPremult(multiply(ga, gb, aa, ab), ad);
+          compPx[o * 4 + 2] = cvtPremult(multiply(ba, bb, aa, ab), ad);
+        }
+        else if (mode == BlendMode::SCREEN) {
+          compPx[o * 4] = cvtPremult(screen(ra, rb, aa, ab), ad);
+          compPx[o * 4 + 1] = cvtPremult(screen(ga, gb, aa, ab), ad);
+          compPx[o * 4 + 2] = cvtPremult(screen(ba, bb, aa, ab), ad);
+        }
+        else if (mode == BlendMode::OVERLAY) {
+          compPx[o * 4] = cvtPremult(overlay(ra, rb, aa, ab), ad);
+          compPx[o * 4 + 1] = cvtPremult(overlay(ga, gb, aa, ab), ad);
+          compPx[o * 4 + 2] = cvtPremult(overlay(ba, bb, aa, ab), ad);
+        }
+        else if (mode == BlendMode::HARD_LIGHT) {
+          compPx[o * 4] = cvtPremult(hardLight(ra, rb, aa, ab), ad);
+          compPx[o * 4 + 1] = cvtPremult(hardLight(ga, gb, aa, ab), ad);
+          compPx[o * 4 + 2] = cvtPremult(hardLight(ba, bb, aa, ab), ad);
+        }
+        else if (mode == BlendMode::SOFT_LIGHT) {
+          compPx[o * 4] = cvtPremult(softLight(ra, rb, aa, ab), ad);
+          compPx[o * 4 + 1] = cvtPremult(softLight(ga, gb, aa, ab), ad);
+          compPx[o * 4 + 2] = cvtPremult(softLight(ba, bb, aa, ab), ad);
+        }
+        else if (mode == BlendMode::LINEAR_DODGE) {
+          compPx[o * 4] = cvtPremult(linearDodge(ra, rb, aa, ab), ad);
+          compPx[o * 4 + 1] = cvtPremult(linearDodge(ga, gb, aa, ab), ad);
+          compPx[o * 4 + 2] = cvtPremult(linearDodge(ba, bb, aa, ab), ad);
+        }
+        else if (mode == BlendMode::COLOR_DODGE) {
+          compPx[o * 4] = cvtPremult(colorDodge(ra, rb, aa, ab), ad);
+          compPx[o * 4 + 1] = cvtPremult(colorDodge(ga, gb, aa, ab), ad);
+          compPx[o * 4 + 2] = cvtPremult(colorDodge(ba, bb, aa, ab), ad);
+        }
+        else if (mode == BlendMode::LINEAR_BURN) {
+          // need unmultiplied colors for this one
+          compPx[o * 4] = cvtPremult(linearBurn(ras, rbs, aa, ab), ad);
+          compPx[o * 4 + 1] = cvtPremult(linearBurn(gas, gbs, aa, ab), ad);
+          compPx[o * 4 + 2] = cvtPremult(linearBurn(bas, bbs, aa, ab), ad);
+        }
+        else if (mode == BlendMode::LINEAR_LIGHT) {
+          compPx[o * 4] = cvtPremult(linearLight(ras, rbs, aa, ab), ad);
+          compPx[o * 4 + 1] = cvtPremult(linearLight(gas, gbs, aa, ab), ad);
+          compPx[o * 4 + 2] = cvtPremult(linearLight(bas, bbs, aa, ab), ad);
+        }
+        else if (mode == BlendMode::COLOR) {
+          // also no premult colors
+          RGBColor dest;
+          dest._r = ras;
+          dest._g = gas;
+          dest._b = bas;
+
+          RGBColor src;
+          src._r = rbs;
+          src._g = gbs;
+          src._b = bbs;
+
+          RGBColor res = color(dest, src, aa, ab);
+          compPx[o * 4] = cvtPremult(res._r, ad);
+          compPx[o * 4 + 1] = cvtPremult(res._g, ad);
+          compPx[o * 4 + 2] = cvtPremult(res._b, ad);
+        }
+        else if (mode == BlendMode::LIGHTEN) {
+          compPx[o * 4] = cvtPremult(lighten(ra, rb, aa, ab), ad);
+          compPx[o * 4 + 1] = cvtPremult(lighten(ga, gb, aa, ab), ad);
+          compPx[o * 4 + 2] = cvtPremult(lighten(ba, bb, aa, ab), ad);
+        }
+        else if (mode == BlendMode::DARKEN) {
+          compPx[o * 4] = cvtPremult(darken(ra, rb, aa, ab), ad);
+          compPx[o * 4 + 1] = cvtPremult(darken(ga, gb, aa, ab), ad);
+          compPx[o * 4 + 2] = cvtPremult(darken(ba, bb, aa, ab), ad);
+        }
+        else if (mode == BlendMode::PIN_LIGHT) {
+          compPx[o * 4] = cvtPremult(pinLight(ra, rb, aa, ab), ad);
+          compPx[o * 4 + 1] = cvtPremult(pinLight(ga, gb, aa, ab), ad);
+          compPx[o * 4 + 2] = cvtPremult(pinLight(ba, bb, aa, ab), ad);
+        }
+        else if (mode == BlendMode::COLOR_BURN) {
+          // also unmultiplied colors here
+          compPx[o * 4] = cvtPremult(colorBurn(ras, rbs, aa, ab), ad);
+          compPx[o * 4 + 1] = cvtPremult(colorBurn(gas, gbs, aa, ab), ad);
+          compPx[o * 4 + 2] = cvtPremult(colorBurn(bas, bbs, aa, ab), ad);
+        }
+        else if (mode == BlendMode::VIVID_LIGHT) {
+          compPx[o * 4] = cvtPremult(vividLight(ras, rbs, aa, ab), ad);
+          compPx[o * 4 + 1] = cvtPremult(vividLight(gas, gbs, aa, ab), ad);
+          compPx[o * 4 + 2] = cvtPremult(vividLight(bas, bbs, aa, ab), ad);
+        }
+
+        compPx[o * 4 + 3] = ad;
       }
-      // adjustment layer clean up, if applicable
-      if (tmpLayer != nullptr) {
-        delete tmpLayer;
+    }
+  }
+
+#ifdef COMP_USE_SSE
+  template<BlendMode mode>
+  inline void Compositor::blendQuad(LayerBlendState& s, int o, int i)
+  {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 inv255 = _mm_set1_ps(1.0f / 255.0f);
+
+    float* compPx = s._compPx + o * 4;
+    float* layerPx = s._layerPx + i * 4;
+
+    // mask alpha is red * alpha of the mask, same as the scalar path
+    __m128i mask = _mm_loadu_si128((const __m128i*)(s._maskPx + i * 4));
+    __m128 maskR = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(mask, _mm_set1_epi32(0xff))), inv255);
+    __m128 maskA = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(mask, 24)), inv255);
+
+    // layer alpha goes in la, layer color (premultiplied) in lr, lg, lb
+    __m128 lr = _mm_loadu_ps(layerPx);
+    __m128 lg = _mm_loadu_ps(layerPx + 4);
+    __m128 lb = _mm_loadu_ps(layerPx + 8);
+    __m128 la = _mm_loadu_ps(layerPx + 12);
+    _MM_TRANSPOSE4_PS(lr, lg, lb, la);
+
+    // ab = la * opacity * mask. The layer color premultiplied by ab is the stored color
+    // times ab / la, which is just the opacity and mask, so no divide is needed here
+    __m128 scale = _mm_mul_ps(_mm_set1_ps(s._opacity), _mm_mul_ps(maskR, maskA));
+    __m128 ab = _mm_mul_ps(la, scale);
+
+    __m128 active = _mm_cmpneq_ps(ab, zero);
+    int activeBits = _mm_movemask_ps(active);
+    if (activeBits == 0)
+      return;
+
+    // mark the pixels as affected by the current layer
+    for (int j = 0; j < 4; j++) {
+      if (activeBits & (1 << j)) {
+        if (s._srcRenderMap == nullptr) {
+          s._renderMap->set(o + j, s._layerId);
+        }
+        else {
+          s._renderMap->set(o + j, s._srcIds[s._srcRenderMap->get(o + j)]);
+        }
       }
     }
 
-    // delete the mask
-    delete defaultMask;
+    __m128 cr = _mm_loadu_ps(compPx);
+    __m128 cg = _mm_loadu_ps(compPx + 4);
+    __m128 cb = _mm_loadu_ps(compPx + 8);
+    __m128 aa = _mm_loadu_ps(compPx + 12);
+    _MM_TRANSPOSE4_PS(cr, cg, cb, aa);
+
+    __m128 ad = _mm_sub_ps(_mm_add_ps(aa, ab), _mm_mul_ps(aa, ab));
+    if (mode == BlendMode::LINEAR_DODGE) {
+      // special override for alpha here
+      ad = _mm_min_ps(_mm_add_ps(aa, ab), one);
+    }
+
+    __m128 rr = cr, rg = cg, rb = cb;
+
+    if (mode != BlendMode::PASS_THROUGH) {
+      // one divide each for the composite and layer alpha, shared by all three channels
+      __m128 aaPositive = _mm_cmpgt_ps(aa, zero);
+      __m128 invAa = _mm_and_ps(aaPositive, _mm_div_ps(one, aa));
+
+      // unpremultiplied colors, transparent background reads as white
+      __m128 dr = one, dg = one, db = one;
+      __m128 sr = zero, sg = zero, sb = zero;
+      if (blendsStraight(mode)) {
+        __m128 invLa = _mm_div_ps(one, la);
+        sr = _mm_mul_ps(lr, invLa);
+        sg = _mm_mul_ps(lg, invLa);
+        sb = _mm_mul_ps(lb, invLa);
+
+        dr = sseSelect(aaPositive, _mm_mul_ps(cr, invAa), one);
+        dg = sseSelect(aaPositive, _mm_mul_ps(cg, invAa), one);
+        db = sseSelect(aaPositive, _mm_mul_ps(cb, invAa), one);
+      }
+
+      if (mode == BlendMode::COLOR) {
+        // the HSY round trip behind color is branchy per pixel (hue sector, fmod), it runs one
+        // lane at a time on the values loaded above
+        float destLanes[3][4], srcLanes[3][4], resLanes[3][4], daLanes[4], saLanes[4];
+        _mm_storeu_ps(destLanes[0], dr);
+        _mm_storeu_ps(destLanes[1], dg);
+        _mm_storeu_ps(destLanes[2], db);
+        _mm_storeu_ps(srcLanes[0], sr);
+        _mm_storeu_ps(srcLanes[1], sg);
+        _mm_storeu_ps(srcLanes[2], sb);
+        _mm_storeu_ps(daLanes, aa);
+        _mm_storeu_ps(saLanes, ab);
+
+        for (int j = 0; j < 4; j++) {
+          resLanes[0][j] = resLanes[1][j] = resLanes[2][j] = 0;
+          if (!(activeBits & (1 << j)))
+            continue;
+
+          RGBColor dest;
+          dest._r = destLanes[0][j];
+          dest._g = destLanes[1][j];
+          dest._b = destLanes[2][j];
+
+          RGBColor source;
+          source._r = srcLanes[0][j];
+          source._g = srcLanes[1][j];
+          source._b = srcLanes[2][j];
+
+          RGBColor c = color(dest, source, daLanes[j], saLanes[j]);
+          resLanes[0][j] = c._r;
+          resLanes[1][j] = c._g;
+          resLanes[2][j] = c._b;
+        }
+
+        rr = _mm_loadu_ps(resLanes[0]);
+        rg = _mm_loadu_ps(resLanes[1]);
+        rb = _mm_loadu_ps(resLanes[2]);
+      }
+      else {
+        rr = sseBlendChannel<mode>(cr, _mm_mul_ps(lr, scale), dr, sr, aa, ab, invAa);
+        rg = sseBlendChannel<mode>(cg, _mm_mul_ps(lg, scale), dg, sg, aa, ab, invAa);
+        rb = sseBlendChannel<mode>(cb, _mm_mul_ps(lb, scale), db, sb, aa, ab, invAa);
+      }
+
+      // cvtPremult: clamping the unpremultiplied color to [0, 1] is clamping this one to [0, ad]
+      rr = _mm_min_ps(_mm_max_ps(rr, zero), ad);
+      rg = _mm_min_ps(_mm_max_ps(rg, zero), ad);
+      rb = _mm_min_ps(_mm_max_ps(rb, zero), ad);
+    }
+
+    // pixels the layer doesn't reach keep the composite
+    rr = sseSelect(active, rr, cr);
+    rg = sseSelect(active, rg, cg);
+    rb = sseSelect(active, rb, cb);
+    __m128 ra = sseSelect(active, ad, aa);
 
-    return comp;
+    _MM_TRANSPOSE4_PS(rr, rg, rb, ra);
+    _mm_storeu_ps(compPx, rr);
+    _mm_storeu_ps(compPx + 4, rg);
+    _mm_storeu_ps(compPx + 8, rb);
+    _mm_storeu_ps(compPx + 12, ra);
   }
+#endif
 
+  inline void Compositor::blendPixel(BlendMode mode, RGBAColor& comp, RGBAColor& layer, float ab)
+  {
+    float aa = comp._a;
+    float ad = aa + ab - aa * ab;
+
+    comp._a = ad;
+
+    // premult colors
+    float rb = layer._r * ab;
+    float gb = layer._g * ab;
+    float bb = layer._b * ab;
+
+    float ra = comp._r * aa;
+    float ga = comp._g * aa;
+    float ba = comp._b * aa;
+
+    // blend modes
+    if (mode == BlendMode::NORMAL) {
+      // b over a, standard alpha blend
+      comp._r = cvtT(normal(ra, rb, aa, ab), ad);
+      comp._g = cvtT(normal(ga, gb, aa, ab), ad);
+      comp._b = cvtT(normal(ba, bb, aa, ab), ad);
+    }
+    else if (mode == BlendMode::MULTIPLY) {
+      comp._r = cvtT(multiply(ra, rb, aa, ab), ad);
+      comp._g = cvtT(multiply(ga, gb, aa, ab), ad);
+      comp._b = cvtT(multiply(ba, bb, aa, ab), ad);
+    }
+    else if (mode == BlendMode::SCREEN) {
+      comp._r = cvtT(screen(ra, rb, aa, ab), ad);
+      comp._g = cvtT(screen(ga, gb, aa, ab), ad);
+      comp._b = cvtT(screen(ba, bb, aa, ab), ad);
+    }
+    else if (mode == BlendMode::OVERLAY) {
+      comp._r = cvtT(overlay(ra, rb, aa, ab), ad);
+      comp._g = cvtT(overlay(ga, gb, aa, ab), ad);
+      comp._b = cvtT(overlay(ba, bb, aa, ab), ad);
+    }
+    else if (mode == BlendMode::HARD_LIGHT) {
+      comp._r = cvtT(hardLight(ra, rb, aa, ab), ad);
+      comp._g = cvtT(hardLight(ga, gb, aa, ab), ad);
+      comp._b = cvtT(hardLight(ba, bb, aa, ab), ad);
+    }
+    else if (mode == BlendMode::SOFT_LIGHT) {
+      comp._r = cvtT(softLight(ra, rb, aa, ab), ad);
+      comp._g = cvtT(softLight(ga, gb, aa, ab), ad);
+      comp._b = cvtT(softLight(ba, bb, aa, ab), ad);
+    }
+    else if (mode == BlendMode::LINEAR_DODGE) {
+      // special override for alpha here
+      ad = (aa + ab > 1) ? 1 : (aa + ab);
+      comp._a = ad;
+
+      comp._r = cvtT(linearDodge(ra, rb, aa, ab), ad);
+      comp._g = cvtT(linearDodge(ga, gb, aa, ab), ad);
+      comp._b = cvtT(linearDodge(ba, bb, aa, ab), ad);
+    }
+    else if (mode == BlendMode::COLOR_DODGE) {
+      comp._r = cvtT(colorDodge(ra, rb, aa, ab), ad);
+      comp._g = cvtT(colorDodge(ga, gb, aa, ab), ad);
+      comp._b = cvtT(colorDodge(ba, bb, aa, ab), ad);
+    }
+    else if (mode == BlendMode::LINEAR_BURN) {
+      // need unmultiplied colors for this one
+      comp._r = cvtT(linearBurn(comp._r, layer._r, aa, ab), ad);
+      comp._g = cvtT(linearBurn(comp._g, layer._g, aa, ab), ad);
+      comp._b = cvtT(linearBurn(comp._b, layer._b, aa, ab), ad);
+    }
+    else if (mode == BlendMode::LINEAR_LIGHT) {
+      comp._r = cvtT(linearLight(comp._r, layer._r, aa, ab), ad);
+      comp._g = cvtT(linearLight(comp._g, layer._g, aa, ab), ad);
+      comp._b = cvtT(linearLight(comp._b, layer._b, aa, ab), ad);
+    }
+    else if (mode == BlendMode::COLOR) {
+      // also no premult colors
+      RGBColor dest;
+      dest._r = comp._r;
+      dest._g = comp._g;
+      dest._b = comp._b;
+
+      RGBColor src;
+      src._r = layer._r;
+      src._g = layer._g;
+      src._b = layer._b;
+
+      RGBColor res = color(dest, src, aa, ab);
+      comp._r = cvtT(res._r, ad);
+      comp._g = cvtT(res._g, ad);
+      comp._b = cvtT(res._b, ad);
+    }
+    else if (mode == BlendMode::LIGHTEN) {
+      comp._r = cvtT(lighten(ra, rb, aa, ab), ad);
+      comp._g = cvtT(lighten(ga, gb, aa, ab), ad);
+      comp._b = cvtT(lighten(ba, bb, aa, ab), ad);
+    }
+    else if (mode == BlendMode::DARKEN) {
+      comp._r = cvtT(darken(ra, rb, aa, ab), ad);
+      comp._g = cvtT(darken(ga, gb, aa, ab), ad);
+      comp._b = cvtT(darken(ba, bb, aa, ab), ad);
+    }
+    else if (mode == BlendMode::PIN_LIGHT) {
+      comp._r = cvtT(pinLight(ra, rb, aa, ab), ad);
+      comp._g = cvtT(pinLight(ga, gb, aa, ab), ad);
+      comp._b = cvtT(pinLight(ba, bb, aa, ab), ad);
+    }
+    else if (mode == BlendMode::COLOR_BURN) {
+      // also unmultiplied colors here
+      comp._r = cvtT(colorBurn(comp._r, layer._r, aa, ab), ad);
+      comp._g = cvtT(colorBurn(comp._g, layer._g, aa, ab), ad);
+      comp._b = cvtT(colorBurn(comp._b, layer._b, aa, ab), ad);
+    }
+    else if (mode == BlendMode::VIVID_LIGHT) {
+      comp._r = cvtT(vividLight(comp._r, layer._r, aa, ab), ad);
+      comp._g = cvtT(vividLight(comp._g, layer._g, aa, ab), ad);
+      comp._b = cvtT(vividLight(comp._b, layer._b, aa, ab), ad);
+    }
+  }
 
   Utils<float>::RGBAColorT Compositor::renderPixel(Context& c, typename Utils<float>::RGBAColorT* compPx, vector<string> order,
     int i, float co, string size) {
@@ -852,28 +2002,20 @@ namespace Comp {
       order = _layerOrder;
     }
 
+    shared_ptr<RenderPlan> plan = getRenderPlan(order);
+
     // blend the layers
-    for (int lOrder = 0; lOrder < order.size(); lOrder++) {
-      string id = order[lOrder];
+    for (auto& step : plan->_steps) {
+      const string& id = step._id;
       Layer& l = c[id];
       bool shouldConditionalBlend = l.shouldConditionalBlend();
-      auto cbData = l.getConditionalBlendSettings();
-      float sbMin = cbData["srcBlackMin"];
-      float sbMax = cbData["srcBlackMax"];
-      float swMin = cbData["srcWhiteMin"];
-      float swMax = cbData["srcWhiteMax"];
-      float dbMin = cbData["destBlackMin"];
-      float dbMax = cbData["destBlackMax"];
-      float dwMin = cbData["destWhiteMin"];
-      float dwMax = cbData["destWhiteMax"];
 
       bool visible = l._visible;
       float opacityModifier = 1;
-      for (auto& o : _groupOrder) {
-        if (_groups[o.second]._affectedLayers.count(id) > 0) {
-          visible = visible & c[o.second]._visible;
-          opacityModifier *= c[o.second].getOpacity();
-        }
+      for (auto& g : step._groups) {
+        Layer& gl = c[g];
+        visible = visible & gl._visible;
+        opacityModifier *= gl.getOpacity();
       }
 
       if (!visible)
@@ -905,7 +2047,7 @@ namespace Comp {
       else {
         // so a layer may have other things clipped to it, in which case we apply the
         // specified adjustment only to the source layer and the composite as normal
-        layerPx = adjustPixel<float>(_imageData[l.getName()][size]->getPixel(i), l);
+        layerPx = adjustPixel<float>(_imageData.get(l.getName(), size)->getPixel(i), l);
       }
 
       auto translation = l.getOffset();
@@ -917,14 +2059,12 @@ namespace Comp {
 
       // ok at this point the base adjustments have been handled.
       // we now check the group settings and apply those to the layer
-      for (auto& o : _groupOrder) {
-        if (_groups[o.second]._affectedLayers.count(id) > 0) {
-          layerPx = adjustPixel<float>(layerPx, c[o.second]);
-        }
+      for (auto& g : step._groups) {
+        layerPx = adjustPixel<float>(layerPx, c[g]);
       }
 
       if (l.hasMask()) {
-        maskPx = _layerMasks[l.getName()][size]->getPixel(i);
+        maskPx = _layerMasks.get(l.getName(), size)->getPixel(i);
       }
       else {
         maskPx._r = 1;
@@ -937,133 +2077,22 @@ namespace Comp {
       // a = background, b = new layer
       // alphas
       float ab = layerPx._a * (l.getOpacity() * opacityModifier);
-      float aa = compPx->_a;
-
       ab *= (maskPx._r * maskPx._a);
 
       if (shouldConditionalBlend) {
+        float cb[8];
+        getConditionalBlendParams(l, cb);
+
         // i'm unsure if it works literally just on the layer below it or the composition up to this point
-        float abScale = conditionalBlend(l.getConditionalBlendChannel(), sbMin,
-          sbMax, swMin, swMax, dbMin, dbMax, dwMin, dwMax,
+        float abScale = conditionalBlend(l.getConditionalBlendChannel(), cb[0],
+          cb[1], cb[2], cb[3], cb[4], cb[5], cb[6], cb[7],
           layerPx._r, layerPx._g, layerPx._b,
           compPx->_r, compPx->_g, compPx->_b);
 
         ab = ab * abScale;
       }
 
-      float ad = aa + ab - aa * ab;
-
-      compPx->_a = ad;
-
-      // premult colors
-      float rb = layerPx._r * ab;
-      float gb = layerPx._g * ab;
-      float bb = layerPx._b * ab;
-
-      float ra = compPx->_r * aa;
-      float ga = compPx->_g * aa;
-      float ba = compPx->_b * aa;
-
-      // blend modes
-      if (l._mode == BlendMode::NORMAL) {
-        // b over a, standard alpha blend
-        compPx->_r = cvtT(normal(ra, rb, aa, ab), ad);
-        compPx->_g = cvtT(normal(ga, gb, aa, ab), ad);
-        compPx->_b = cvtT(normal(ba, bb, aa, ab), ad);
-      }
-      else if (l._mode == BlendMode::MULTIPLY) {
-        compPx->_r = cvtT(multiply(ra, rb, aa, ab), ad);
-        compPx->_g = cvtT(multiply(ga, gb, aa, ab), ad);
-        compPx->_b = cvtT(multiply(ba, bb, aa, ab), ad);
-      }
-      else if (l._mode == BlendMode::SCREEN) {
-        compPx->_r = cvtT(screen(ra, rb, aa, ab), ad);
-        compPx->_g = cvtT(screen(ga, gb, aa, ab), ad);
-        compPx->_b = cvtT(screen(ba, bb, aa, ab), ad);
-      }
-      else if (l._mode == BlendMode::OVERLAY) {
-        compPx->_r = cvtT(overlay(ra, rb, aa, ab), ad);
-        compPx->_g = cvtT(overlay(ga, gb, aa, ab), ad);
-        compPx->_b = cvtT(overlay(ba, bb, aa, ab), ad);
-      }
-      else if (l._mode == BlendMode::HARD_LIGHT) {
-        compPx->_r = cvtT(hardLight(ra, rb, aa, ab), ad);
-        compPx->_g = cvtT(hardLight(ga, gb, aa, ab), ad);
-        compPx->_b = cvtT(hardLight(ba, bb, aa, ab), ad);
-      }
-      else if (l._mode == BlendMode::SOFT_LIGHT) {
-        compPx->_r = cvtT(softLight(ra, rb, aa, ab), ad);
-        compPx->_g = cvtT(softLight(ga, gb, aa, ab), ad);
-        compPx->_b = cvtT(softLight(ba, bb, aa, ab), ad);
-      }
-      else if (l._mode == BlendMode::LINEAR_DODGE) {
-        // special override for alpha here
-        ad = (aa + ab > 1) ? 1 : (aa + ab);
-        compPx->_a = ad;
-
-        compPx->_r = cvtT(linearDodge(ra, rb, aa, ab), ad);
-        compPx->_g = cvtT(linearDodge(ga, gb, aa, ab), ad);
-        compPx->_b = cvtT(linearDodge(ba, bb, aa, ab), ad);
-      }
-      else if (l._mode == BlendMode::COLOR_DODGE) {
-        compPx->_r = cvtT(colorDodge(ra, rb, aa, ab), ad);
-        compPx->_g = cvtT(colorDodge(ga, gb, aa, ab), ad);
-        compPx->_b = cvtT(colorDodge(ba, bb, aa, ab), ad);
-      }
-      else if (l._mode == BlendMode::LINEAR_BURN) {
-        // need unmultiplied colors for this one
-        compPx->_r = cvtT(linearBurn(compPx->_r, layerPx._r, aa, ab), ad);
-        compPx->_g = cvtT(linearBurn(compPx->_g, layerPx._g, aa, ab), ad);
-        compPx->_b = cvtT(linearBurn(compPx->_b, layerPx._b, aa, ab), ad);
-      }
-      else if (l._mode == BlendMode::LINEAR_LIGHT) {
-        compPx->_r = cvtT(linearLight(compPx->_r, layerPx._r, aa, ab), ad);
-        compPx->_g = cvtT(linearLight(compPx->_g, layerPx._g, aa, ab), ad);
-        compPx->_b = cvtT(linearLight(compPx->_b, layerPx._b, aa, ab), ad);
-      }
-      else if (l._mode == BlendMode::COLOR) {
-        // also no premult colors
-        RGBColor dest;
-        dest._r = compPx->_r;
-        dest._g = compPx->_g;
-        dest._b = compPx->_b;
-
-        RGBColor src;
-        src._r = layerPx._r;
-        src._g = layerPx._g;
-        src._b = layerPx._b;
-
-        RGBColor res = color(dest, src, aa, ab);
-        compPx->_r = cvtT(res._r, ad);
-        compPx->_g = cvtT(res._g, ad);
-        compPx->_b = cvtT(res._b, ad);
-      }
-      else if (l._mode == BlendMode::LIGHTEN) {
-        compPx->_r = cvtT(lighten(ra, rb, aa, ab), ad);
-        compPx->_g = cvtT(lighten(ga, gb, aa, ab), ad);
-        compPx->_b = cvtT(lighten(ba, bb, aa, ab), ad);
-      }
-      else if (l._mode == BlendMode::DARKEN) {
-        compPx->_r = cvtT(darken(ra, rb, aa, ab), ad);
-        compPx->_g = cvtT(darken(ga, gb, aa, ab), ad);
-        compPx->_b = cvtT(darken(ba, bb, aa, ab), ad);
-      }
-      else if (l._mode == BlendMode::PIN_LIGHT) {
-        compPx->_r = cvtT(pinLight(ra, rb, aa, ab), ad);
-        compPx->_g = cvtT(pinLight(ga, gb, aa, ab), ad);
-        compPx->_b = cvtT(pinLight(ba, bb, aa, ab), ad);
-      }
-      else if (l._mode == BlendMode::COLOR_BURN) {
-        // also unmultiplied colors here
-        compPx->_r = cvtT(colorBurn(compPx->_r, layerPx._r, aa, ab), ad);
-        compPx->_g = cvtT(colorBurn(compPx->_g, layerPx._g, aa, ab), ad);
-        compPx->_b = cvtT(colorBurn(compPx->_b, layerPx._b, aa, ab), ad);
-      }
-      else if (l._mode == BlendMode::VIVID_LIGHT) {
-        compPx->_r = cvtT(vividLight(compPx->_r, layerPx._r, aa, ab), ad);
-        compPx->_g = cvtT(vividLight(compPx->_g, layerPx._g, aa, ab), ad);
-        compPx->_b = cvtT(vividLight(compPx->_b, layerPx._b, aa, ab), ad);
-      }
+      blendPixel(l._mode, *compPx, layerPx, ab);
     }
 
     Utils<float>::RGBAColorT retVal;
@@ -1081,14 +2110,14 @@ namespace Comp {
   Utils<float>::RGBAColorT Compositor::renderPixel(Context & c, int x, int y, string size) {
     int width, height;
 
-    if (_imageData.begin()->second.count(size) > 0) {
-      width = _imageData.begin()->second[size]->getWidth();
-      height = _imageData.begin()->second[size]->getHeight();
+    if (_imageData.hasSize(size)) {
+      width = _imageData.getWidth(size);
+      height = _imageData.getHeight(size);
     }
     else {
       getLogger()->log("No render size named " + size + " found. Rendering at full size.", LogLevel::WARN);
-      width = _imageData.begin()->second["full"]->getWidth();
-      height = _imageData.begin()->second["full"]->getHeight();
+      width = _imageData.getWidth("full");
+      height = _imageData.getHeight("full");
     }
 
     int index = x + y * width;
@@ -1099,14 +2128,14 @@ namespace Comp {
   Utils<float>::RGBAColorT Compositor::renderPixel(Context & c, float x, float y, string size) {
     int width, height;
 
-    if (_imageData.begin()->second.count(size) > 0) {
-      width = _imageData.begin()->second[size]->getWidth();
-      height = _imageData.begin()->second[size]->getHeight();
+    if (_imageData.hasSize(size)) {
+      width = _imageData.getWidth(size);
+      height = _imageData.getHeight(size);
     }
     else {
       getLogger()->log("No render size named " + size + " found. Rendering at full size.", LogLevel::WARN);
-      width = _imageData.begin()->second["full"]->getWidth();
-      height = _imageData.begin()->second["full"]->getHeight();
+      width = _imageData.getWidth("full");
+      height = _imageData.getHeight("full");
     }
 
     int index = (int)(x * width) + (int)(y * height) * width;
@@ -1114,6 +2143,333 @@ namespace Comp {
     return renderPixel(c, index, size);
   }
 
+  vector<vector<RGBAColor> > Compositor::renderPixels(vector<Context*>& contexts, const vector<int>& x, const vector<int>& y, string size)
+  {
+    if (size == "" || !_imageData.hasSize(size)) {
+      size = "full";
+    }
+
+    int n = (int)contexts.size();
+    int m = (int)min(x.size(), y.size());
+
+    PixelBatch comp(n, m);
+    vector<float> co(n, 1);
+    renderPixels(contexts, comp, x, y, _layerOrder, co, size);
+
+    vector<vector<RGBAColor> > ret(n, vector<RGBAColor>(m));
+    for (int k = 0; k < n; k++) {
+      for (int i = 0; i < m; i++) {
+        ret[k][i] = comp.get(k * m + i);
+      }
+    }
+
+    return ret;
+  }
+
+  void Compositor::renderPixels(vector<Context*>& contexts, PixelBatch& comp, const vector<int>& x, const vector<int>& y,
+    const vector<string>& order, const vector<float>& co, const string& size, const PixelBase& base)
+  {
+    int width = getWidth(size);
+    int height = getHeight(size);
+    int m = comp._pixels;
+
+    shared_ptr<RenderPlan> plan = getRenderPlan(order);
+    vector<RGBAColor> layerPx(m);
+
+    for (int s = 0; s < plan->_steps.size(); s++) {
+      PlanStep& step = plan->_steps[s];
+
+      for (int k = 0; k < comp._contexts; k++) {
+        Context& c = *contexts[k];
+        Layer& l = c[step._id];
+        int start = k * m;
+
+        bool visible = l._visible;
+        float opacityModifier = co[k];
+        for (auto& g : step._groups) {
+          Layer& gl = c[g];
+          visible = visible & gl._visible;
+          opacityModifier *= gl.getOpacity();
+        }
+
+        if (!visible)
+          continue;
+
+        // everything that doesn't depend on the pixel is resolved once here. Tables and cubes are
+        // cached per layer, so this takes the same path as a full render
+        vector<AdjustmentStep> adjSteps = compileAdjustments(l);
+        vector<vector<AdjustmentStep> > groupSteps;
+        for (auto& g : step._groups) {
+          groupSteps.push_back(compileAdjustments(c[g]));
+        }
+
+        auto translation = l.getOffset();
+        int dx = pixelOffset(translation.first, width);
+        int dy = pixelOffset(translation.second, height);
+
+        // precomps and adjustment layers are read at the offset position like image layers,
+        // which is what blendRows does with the precomp render and the adjusted composite
+        vector<int> xs(m), ys(m);
+        for (int i = 0; i < m; i++) {
+          xs[i] = x[i] + dx;
+          ys[i] = y[i] + dy;
+        }
+
+        // the composite below this layer at any pixel: the starting composite with every earlier step on top
+        vector<Context*> single(1, contexts[k]);
+        vector<float> singleCo(1, co[k]);
+        PixelBase baseK = [&](int, PixelBatch& out, const vector<int>& px, const vector<int>& py) {
+          if (base)
+            base(k, out, px, py);
+        };
+        PixelBase belowK = [&](int, PixelBatch& out, const vector<int>& px, const vector<int>& py) {
+          vector<string> below(plan->_order.begin(), plan->_order.begin() + s);
+          baseK(0, out, px, py);
+          renderPixels(single, out, px, py, below, singleCo, size, baseK);
+        };
+
+        if (l.isPrecomp()) {
+          // precomps can differ between contexts, so each context renders its own
+          PixelBatch sub(1, m);
+
+          if (l._mode == PASS_THROUGH) {
+            copy(comp._r.begin() + start, comp._r.begin() + start + m, sub._r.begin());
+            copy(comp._g.begin() + start, comp._g.begin() + start + m, sub._g.begin());
+            copy(comp._b.begin() + start, comp._b.begin() + start + m, sub._b.begin());
+            copy(comp._a.begin() + start, comp._a.begin() + start + m, sub._a.begin());
+
+            // this renders into the composite, so layers inside start from what's below the precomp
+            renderPixels(single, sub, x, y, l.getPrecompOrder(), vector<float>(1, l.getOpacity() * co[k]), size, belowK);
+
+            // adjustments on a pass through precomp apply to the composite
+            for (int i = 0; i < m; i++) {
+              RGBAColor px = sub.get(i);
+              adjustPixel(px, adjSteps, l);
+              for (int g = 0; g < groupSteps.size(); g++) {
+                adjustPixel(px, groupSteps[g], c[step._groups[g]]);
+              }
+              comp.set(start + i, px);
+            }
+
+            continue;
+          }
+
+          // same as a full render, the precomp starts from a blank composite
+          renderPixels(single, sub, xs, ys, l.getPrecompOrder(), singleCo, size);
+          for (int i = 0; i < m; i++) {
+            layerPx[i] = sub.get(i);
+          }
+        }
+        else if (l.isAdjustmentLayer()) {
+          if (dx == 0 && dy == 0) {
+            for (int i = 0; i < m; i++) {
+              layerPx[i] = comp.get(start + i);
+            }
+          }
+          else {
+            PixelBatch shifted(1, m);
+            belowK(0, shifted, xs, ys);
+            for (int i = 0; i < m; i++) {
+              layerPx[i] = shifted.get(i);
+            }
+          }
+        }
+
+        shared_ptr<Image> img;
+        if (!l.isPrecomp() && !l.isAdjustmentLayer())
+          img = _imageData.get(l.getName(), size);
+
+        shared_ptr<Image> mask;
+        if (l.hasMask())
+          mask = _layerMasks.get(l.getName(), size);
+
+        bool useConditionalBlend = l.shouldConditionalBlend();
+        float cb[8];
+        if (useConditionalBlend)
+          getConditionalBlendParams(l, cb);
+
+        float opacity = l.getOpacity() * opacityModifier;
+        BlendMode mode = l._mode;
+
+        for (int i = 0; i < m; i++) {
+          // image layers and masks are read at the offset position, same as render
+          int xt = xs[i];
+          int yt = ys[i];
+
+          if (xt < 0 || xt >= width || yt < 0 || yt >= height)
+            continue;
+
+          int index = xt + yt * width;
+
+          if (img != nullptr)
+            layerPx[i] = img->getPixel(index);
+
+          RGBAColor& px = layerPx[i];
+          adjustPixel(px, adjSteps, l);
+          for (int g = 0; g < groupSteps.size(); g++) {
+            adjustPixel(px, groupSteps[g], c[step._groups[g]]);
+          }
+          px._r = clamp(px._r, 0.0f, 1.0f);
+          px._g = clamp(px._g, 0.0f, 1.0f);
+          px._b = clamp(px._b, 0.0f, 1.0f);
+
+          float ab = px._a * opacity;
+
+          if (mask != nullptr) {
+            RGBAColor maskPx = mask->getPixel(index);
+            ab *= (maskPx._r * maskPx._a);
+          }
+
+          RGBAColor compPx = comp.get(start + i);
+
+          if (useConditionalBlend) {
+            ab *= conditionalBlend(l.getConditionalBlendChannel(), cb[0], cb[1], cb[2], cb[3], cb[4], cb[5], cb[6], cb[7],
+              px._r, px._g, px._b, compPx._r, compPx._g, compPx._b);
+          }
+
+          if (ab == 0)
+            continue;
+
+          blendPixel(mode, compPx, px, ab);
+          comp.set(start + i, compPx);
+        }
+      }
+    }
+  }
+
+  vector<vector<RGBAColor> > Compositor::opacityResponse(Context& c, string layer, const vector<float>& values,
+    const vector<int>& x, const vector<int>& y, string size)
+  {
+    if (size == "" || !_imageData.hasSize(size)) {
+      size = "full";
+    }
+
+    int m = (int)min(x.size(), y.size());
+    int nv = (int)values.size();
+
+    auto pos = find(_layerOrder.begin(), _layerOrder.end(), layer);
+    bool analytic = pos != _layerOrder.end() && isOpacityAffine(c, layer);
+
+    // interpolating outside of [0, 1] would extrapolate past what the blend was checked for
+    for (auto& v : values) {
+      if (v < 0 || v > 1)
+        analytic = false;
+    }
+
+    if (!analytic) {
+      vector<Context> temps(nv, c);
+      vector<Context*> tempPtrs;
+      for (int i = 0; i < nv; i++) {
+        temps[i][layer].setOpacity(values[i]);
+        tempPtrs.push_back(&temps[i]);
+      }
+
+      return renderPixels(tempPtrs, x, y, size);
+    }
+
+    vector<string> below(_layerOrder.begin(), pos);
+    vector<string> target(1, layer);
+    vector<string> above(pos + 1, _layerOrder.end());
+    vector<float> co(1, 1);
+
+    vector<Context*> base(1, &c);
+    Context full(c);
+    full[layer].setOpacity(1);
+    vector<Context*> fullPtr(1, &full);
+
+    // composite below the layer, which is also the result at opacity 0, and the result at opacity 1.
+    // Offset adjustment layers need these at other pixels too, see PixelBase
+    PixelBase belowBase = [&](int, PixelBatch& out, const vector<int>& px, const vector<int>& py) {
+      renderPixels(base, out, px, py, below, co, size);
+    };
+    auto renderEnds = [&](PixelBatch& zero, PixelBatch& one, const vector<int>& px, const vector<int>& py) {
+      renderPixels(base, zero, px, py, below, co, size);
+      one = zero;
+      renderPixels(fullPtr, one, px, py, target, co, size, belowBase);
+    };
+
+    // interpolate premultiplied, the blend is affine there
+    auto interpolate = [](const RGBAColor& c0, const RGBAColor& c1, float t) {
+      RGBAColor px;
+      px._a = c0._a + t * (c1._a - c0._a);
+
+      if (px._a > 0) {
+        px._r = (c0._r * c0._a + t * (c1._r * c1._a - c0._r * c0._a)) / px._a;
+        px._g = (c0._g * c0._a + t * (c1._g * c1._a - c0._g * c0._a)) / px._a;
+        px._b = (c0._b * c0._a + t * (c1._b * c1._a - c0._b * c0._a)) / px._a;
+      }
+      else {
+        px._r = c0._r;
+        px._g = c0._g;
+        px._b = c0._b;
+      }
+
+      return px;
+    };
+
+    PixelBatch zero(1, m);
+    PixelBatch one(1, m);
+    renderEnds(zero, one, x, y);
+
+    // every value gets a copy of the pixels so the layers above run over all of them in one batch
+    vector<int> sx, sy;
+    PixelBatch swept(1, nv * m);
+
+    for (int v = 0; v < nv; v++) {
+      for (int i = 0; i < m; i++) {
+        sx.push_back(x[i]);
+        sy.push_back(y[i]);
+
+        RGBAColor px = interpolate(zero.get(i), one.get(i), values[v]);
+        swept.set(v * m + i, px);
+      }
+    }
+
+    // sample j of the swept batch belongs to value j / m
+    PixelBase sweptBase = [&](int, PixelBatch& out, const vector<int>& px, const vector<int>& py) {
+      int n = (int)px.size();
+      PixelBatch z(1, n);
+      PixelBatch o(1, n);
+      renderEnds(z, o, px, py);
+
+      for (int j = 0; j < n; j++) {
+        RGBAColor s = interpolate(z.get(j), o.get(j), values[j / m]);
+        out.set(j, s);
+      }
+    };
+
+    renderPixels(base, swept, sx, sy, above, co, size, sweptBase);
+
+    vector<vector<RGBAColor> > ret(nv, vector<RGBAColor>(m));
+    for (int v = 0; v < nv; v++) {
+      for (int i = 0; i < m; i++) {
+        ret[v][i] = swept.get(v * m + i);
+      }
+    }
+
+    return ret;
+  }
+
+  bool Compositor::isOpacityAffine(Context& c, string layer)
+  {
+    // group and pass through precomp opacity scales other layers, precomps are rendered recursively
+    if (isGroup(layer) || c[layer].isPrecomp())
+      return false;
+
+    // modes where the premultiplied result is affine in the layer alpha. The others
+    // either branch on the layer alpha or clamp
+    switch (c[layer]._mode) {
+    case NORMAL:
+    case MULTIPLY:
+    case SCREEN:
+    case OVERLAY:
+    case HARD_LIGHT:
+      return true;
+    default:
+      return false;
+    }
+  }
+
   Image * Compositor::renderUpToLayer(Context & c, string layer, string orderLayer, float dim, string size)
   {
     // set up the context
@@ -1147,12 +2503,12 @@ namespace Comp {
     // masking
     if (mod[layer].isAdjustmentLayer()) {
       // for adjustment layers, use the mask if it exists
-      if (_layerMasks.count(layer) > 0) {
-        shared_ptr<Image> mask = _layerMasks[layer][size];
-        vector<unsigned char>& maskPx = mask->getData();
+      if (_layerMasks.has(layer)) {
+        shared_ptr<Image> mask = _layerMasks.get(layer, size);
+        const unsigned char* maskPx = mask->getPixels();
         vector<unsigned char>& imgPx = i->getData();
 
-        for (int i = 0; i < maskPx.size() / 4; i++) {
+        for (int i = 0; i < mask->dataSize() / 4; i++) {
           int idx = i * 4;
           float maskAlpha = max((maskPx[idx] / 255.0f) * (maskPx[idx + 3] / 255.0f), dim);
 
@@ -1165,10 +2521,10 @@ namespace Comp {
     else if (!isGroup(layer)) {
       // for regular layers, if any of the pixels in the layer is non-zero alpha don't mask
       shared_ptr<Image> layerImg = getCachedImage(layer, size);
-      vector<unsigned char>& layerPx = layerImg->getData();
+      const unsigned char* layerPx = layerImg->getPixels();
       vector<unsigned char>& imgPx = i->getData();
 
-      for (int i = 0; i < layerPx.size() / 4; i++) {
+      for (int i = 0; i < layerImg->dataSize() / 4; i++) {
         int idx = i * 4;
         float maskAlpha = max(dim, layerPx[idx + 3] / 255.0f);
 
@@ -1276,13 +2632,7 @@ namespace Comp {
 
   vector<string> Compositor::getCacheSizes()
   {
-    vector<string> sizes;
-
-    for (auto kvp : _imageData.begin()->second) {
-      sizes.push_back(kvp.first);
-    }
-
-    return sizes;
+    return _imageData.getSizes();
   }
 
   bool Compositor::addCacheSize(string name, float scaleFactor)
@@ -1293,15 +2643,11 @@ namespace Comp {
       return false;
     }
 
-    // delete existing
-    for (auto kvp : _imageData) {
-      kvp.second.erase(name);
-    }
+    // scaled copies are built the next time this size is rendered
+    _imageData.setScale(name, scaleFactor);
+    _layerMasks.setScale(name, scaleFactor);
 
-    // recompute
-    for (auto i : _imageData) {
-      _imageData[i.first][name] = i.second["full"]->resize(scaleFactor);
-    }
+    clearRenderCache();
 
     return true;
   }
@@ -1314,19 +2660,71 @@ namespace Comp {
       return false;
     }
 
-    // delete existing
-    for (auto kvp : _imageData) {
-      kvp.second.erase(name);
-    }
+    _imageData.deleteScale(name);
+    _layerMasks.deleteScale(name);
 
+    clearRenderCache();
     return true;
   }
 
+  void Compositor::setCacheMemoryBudget(size_t bytes)
+  {
+    _imageData.setMemoryBudget(bytes);
+    _layerMasks.setMemoryBudget(bytes);
+  }
+
+  size_t Compositor::getCacheMemoryBudget()
+  {
+    return _imageData.getMemoryBudget();
+  }
+
+  size_t Compositor::getCacheMemoryUsage()
+  {
+    return _imageData.getMemoryUsage() + _layerMasks.getMemoryUsage();
+  }
+
+  bool Compositor::openLayerCache(string file)
+  {
+    return _layerCache.open(file);
+  }
+
+  void Compositor::closeLayerCache()
+  {
+    _layerCache.close();
+  }
+
+  bool Compositor::saveLayerCache(string file)
+  {
+    vector<LayerCacheItem> items;
+
+    auto addItems = [&](ImageCache& cache, map<string, string>& sources) {
+      for (auto& s : sources) {
+        if (!cache.has(s.first))
+          continue;
+
+        // builds any sizes that haven't been rendered yet
+        for (auto& size : cache.getSizes()) {
+          LayerCacheItem item;
+          item._source = s.second;
+          item._size = size;
+          item._scale = cache.getScale(size);
+          item._img = cache.get(s.first, size);
+          items.push_back(item);
+        }
+      }
+    };
+
+    addItems(_imageData, _layerSources);
+    addItems(_layerMasks, _maskSources);
+
+    return LayerCacheFile::write(file, items);
+  }
+
   shared_ptr<Image> Compositor::getCachedImage(string id, string size)
   {
-    if (_imageData.count(id) > 0) {
-      if (_imageData[id].count(size) > 0) {
-        return _imageData[id][size];
+    if (_imageData.has(id)) {
+      if (_imageData.has(id, size)) {
+        return _imageData.get(id, size);
       }
     }
     else if (_primary[id].isAdjustmentLayer()) {
@@ -1362,7 +2760,7 @@ namespace Comp {
   }
 
   void Compositor::startSearch(searchCallback cb, SearchMode mode, map<string, float> settings,
-    int threads, string searchRenderSize)
+    int threads, string searchRenderSize, searchDoneCallback done)
   {
     if (_searchRunning) {
       stopSearch();
@@ -1373,12 +2771,24 @@ namespace Comp {
     _searchThreads.resize(threads);
 
     _activeCallback = cb;
+    _searchDoneCallback = done;
     _searchMode = mode;
     _searchSettings = settings;
     _searchRunning = true;
     _searchRenderSize = searchRenderSize;
     _initSearchContext = getNewContext();
 
+    _searchCandidates = 0;
+    _searchScreenRejected = 0;
+    _searchRendered = 0;
+    _searchRejected = 0;
+    _searchStart = chrono::high_resolution_clock::now();
+
+    // the coarse stage is pointless if the search already renders at micro size
+    _searchCascade = settings["cascade"] > 0 && searchRenderSize != "micro" && _imageData.hasSize("micro");
+    if (settings["cascade"] > 0 && !_searchCascade)
+      getLogger()->log("Search cascade disabled. Requires a micro size different from the search render size", LogLevel::WARN);
+
     stringstream ss;
     ss << "Starting search with " << threads << " threads";
     getLogger()->log(ss.str(), LogLevel::INFO);
@@ -1404,17 +2814,35 @@ namespace Comp {
       if (_searchSettings.count("modifyLayerBlendModes") == 0) {
         _searchSettings["modifyLayerBlendModes"] = 0;
       }
+
+      // candidates are screened against the starting image
+      _cascadeScreen = nullptr;
+      if (_searchCascade) {
+        _cascadeScreen = shared_ptr<ExpSearchSet>(new ExpSearchSet());
+        shared_ptr<Image> initRender = shared_ptr<Image>(render(_initSearchContext, _searchRenderSize));
+        _cascadeScreen->setInitial(shared_ptr<ExpSearchSample>(new ExpSearchSample(initRender, _initSearchContext, vector<double>())));
+      }
     }
 
     if (mode == EXPLORATORY) {
-      // TODO: Maybe temporary? Exploratory starts in its own single thread
+      // exploratory search has one thread accepting samples in order, which renders candidates
+      // on all the search threads. see expSearchRounds
+      _expSearchThreads = threads;
       _searchThreads.resize(1);
-      _searchThreads[0] = thread(&Compositor::exploratorySearch, this);
+      _searchThreadsLeft = 1;
+      _searchThreads[0] = thread([this]() {
+        exploratorySearch();
+        searchThreadDone();
+      });
     }
     else {
       // start threads
+      _searchThreadsLeft = threads;
       for (int i = 0; i < threads; i++) {
-        _searchThreads[i] = thread(&Compositor::runSearch, this);
+        _searchThreads[i] = thread([this]() {
+          runSearch();
+          searchThreadDone();
+        });
       }
     }
 
@@ -1450,6 +2878,12 @@ namespace Comp {
     return;
   }
 
+  void Compositor::searchThreadDone()
+  {
+    if (--_searchThreadsLeft == 0 && _searchDoneCallback)
+      _searchDoneCallback();
+  }
+
   void Compositor::runSearch()
   {
     while (_searchRunning) {
@@ -1470,11 +2904,17 @@ namespace Comp {
 
   void Compositor::resetImages(string name)
   {
-    if (_imageData.count(name) == 0)
+    if (!_imageData.has(name))
       return;
 
-    for (auto img : _imageData[name])
-      img.second->reset(1, 1, 1);
+    // scaled copies of a solid color are the same color, so just rebuild them when needed
+    _imageData.get(name)->reset(1, 1, 1);
+    _imageData.invalidate(name);
+
+    // no longer matches the png
+    _layerSources.erase(name);
+
+    clearRenderCache();
   }
 
   ConstraintData& Compositor::getConstraintData()
@@ -1523,7 +2963,7 @@ namespace Comp {
       nlohmann::json layers = nlohmann::json::array();
       for (auto& l : _layerOrder) {
         // adjustment layers have no pixel data
-        if (_imageData.count(l) == 0)
+        if (!_imageData.has(l))
           continue;
 
         // skip invisible
@@ -1652,11 +3092,32 @@ namespace Comp {
   {
     scores.clear();
 
-    // store the current pixel color
-    RGBAColor srcPixel = renderPixel(c, x, y);
+    bool delta = (mode == "visibilityDelta" || mode == "specVisibilityDelta");
+    ImportanceMapMode toggleMode = (mode == "visibilityDelta") ? ImportanceMapMode::VISIBILITY_DELTA : ImportanceMapMode::SPEC_VISIBILITY_DELTA;
+
+    // the current pixel color and the color with each layer toggled are rendered in one batch.
+    // contexts[0] is the current context, contexts[k + 1] has layer k of the primary context toggled
+    vector<Context> toggles;
+    vector<Context*> contexts(1, &c);
+
+    if (delta) {
+      toggles.assign(_primary.size(), c);
 
+      int k = 0;
+      for (auto& kvp : _primary) {
+        toggleForImportance(toggles[k], kvp.first, toggleMode);
+        contexts.push_back(&toggles[k]);
+        k++;
+      }
+    }
+
+    vector<vector<RGBAColor> > px = renderPixels(contexts, vector<int>(1, x), vector<int>(1, y), "full");
+    RGBAColor srcPixel = px[0][0];
+
+    int k = 0;
     for (auto& kvp : _primary) {
       string id = kvp.first;
+      k++;
 
       if (mode == "alpha") {
         if (!_primary[id].isAdjustmentLayer() && !_primary[id].isPrecomp()) {
@@ -1668,46 +3129,8 @@ namespace Comp {
           scores[id] = 0;
         }
       }
-      else if (mode == "visibilityDelta") {
-        // the visibility delta is the magnitude of the pixel color difference
-        // with the layer's visibility toggled
-        Context toggle(c);
-        toggle[id]._visible = !toggle[id]._visible;
-        RGBAColor modPixel = renderPixel(toggle, x, y, "full");
-
-        // calculate difference
-        // premultiplied alpha
-        float rd = (srcPixel._r * srcPixel._a) - (modPixel._r * modPixel._a);
-        float gd = (srcPixel._g * srcPixel._a) - (modPixel._g * modPixel._a);
-        float bd = (srcPixel._b * srcPixel._a) - (modPixel._b * modPixel._a);
-        float diff = sqrt(rd * rd + gd * gd + bd * bd);
-
-        scores[id] = diff;
-
-        // log it 
-        getLogger()->log("visibilityDelta for " + id + ": " + to_string(diff));
-      }
-      else if (mode == "specVisibilityDelta") {
-        // the speculative visibility delta is basically the same as the visibility
-        // delta, but with some corner case handling
-        // there are two visibility conditions: opacity > 0, visility on
-        // - if layer is visible but opacity is 0, the delta is compared to opacity 1
-        // - if layer is invisible but opacity is 0, the delta is comapred to visible + opacity 1
-        // - if layer is visible, the delta is compared to invisible
-        Context toggle(c);
-
-        if (toggle[id].getOpacity() == 0) {
-          toggle[id].setOpacity(1);
-
-          if (!toggle[id]._visible) {
-            toggle[id]._visible = true;
-          }
-        }
-        else {
-          toggle[id]._visible = !toggle[id]._visible;
-        }
-
-        RGBAColor modPixel = renderPixel(toggle, x, y, "full");
+      else if (delta) {
+        RGBAColor modPixel = px[k][0];
 
         // calculate difference
         // premultiplied alpha
@@ -1719,7 +3142,7 @@ namespace Comp {
         scores[id] = diff;
 
         // log it 
-        getLogger()->log("specVisibilityDelta for " + id + ": " + to_string(diff));
+        getLogger()->log(mode + " for " + id + ": " + to_string(diff));
       }
     }
 
@@ -1734,9 +3157,6 @@ namespace Comp {
 
   double Compositor::pointImportance(ImportanceMapMode mode, string layer, int x, int y, Context & c)
   {
-    // store the current pixel color
-    RGBAColor srcPixel = renderPixel(c, x, y, "full");
-
     if (mode == ImportanceMapMode::ALPHA) {
       if (!_primary[layer].isAdjustmentLayer()) {
         shared_ptr<Image> img = getCachedImage(layer, "full");
@@ -1747,12 +3167,18 @@ namespace Comp {
         return 0;
       }
     }
-    else if (mode == ImportanceMapMode::VISIBILITY_DELTA) {
-      // the visibility delta is the magnitude of the pixel color difference
-      // with the layer's visibility toggled
+    else if (mode == ImportanceMapMode::VISIBILITY_DELTA || mode == ImportanceMapMode::SPEC_VISIBILITY_DELTA) {
+      // render the current pixel color and the toggled one together
       Context toggle(c);
-      toggle[layer]._visible = !toggle[layer]._visible;
-      RGBAColor modPixel = renderPixel(toggle, x, y);
+      toggleForImportance(toggle, layer, mode);
+
+      vector<Context*> contexts;
+      contexts.push_back(&c);
+      contexts.push_back(&toggle);
+
+      vector<vector<RGBAColor> > px = renderPixels(contexts, vector<int>(1, x), vector<int>(1, y), "full");
+      RGBAColor srcPixel = px[0][0];
+      RGBAColor modPixel = px[1][0];
 
       // calculate difference
       // premultiplied alpha
@@ -1765,37 +3191,8 @@ namespace Comp {
       //getLogger()->log("visibilityDelta for " + id + ": " + to_string(diff));
       return diff;
     }
-    else if (mode == ImportanceMapMode::SPEC_VISIBILITY_DELTA) {
-      // the speculative visibility delta is basically the same as the visibility
-      // delta, but with some corner case handling
-      // there are two visibility conditions: opacity > 0, visility on
-      // - if layer is visible but opacity is 0, the delta is compared to opacity 1
-      // - if layer is invisible but opacity is 0, the delta is comapred to visible + opacity 1
-      // - if layer is visible, the delta is compared to invisible
-      Context toggle(c);
-
-      if (toggle[layer].getOpacity() == 0) {
-        toggle[layer].setOpacity(1);
-
-        if (!toggle[layer]._visible) {
-          toggle[layer]._visible = true;
-        }
-      }
-      else {
-        toggle[layer]._visible = !toggle[layer]._visible;
-      }
-
-      RGBAColor modPixel = renderPixel(toggle, x, y, "full");
-
-      // calculate difference
-      // premultiplied alpha
-      float rd = (srcPixel._r * srcPixel._a) - (modPixel._r * modPixel._a);
-      float gd = (srcPixel._g * srcPixel._a) - (modPixel._g * modPixel._a);
-      float bd = (srcPixel._b * srcPixel._a) - (modPixel._b * modPixel._a);
-      float diff = sqrt(rd * rd + gd * gd + bd * bd);
 
-      return diff;
-    }
+    return 0;
   }
 
   shared_ptr<ImportanceMap> Compositor::computeImportanceMap(string layer, ImportanceMapMode mode, Context& current)
@@ -1820,37 +3217,9 @@ namespace Comp {
       }
     }
     else if (mode == ImportanceMapMode::VISIBILITY_DELTA || mode == ImportanceMapMode::SPEC_VISIBILITY_DELTA) {
-      shared_ptr<Image> img;
-
-      if (mode == ImportanceMapMode::VISIBILITY_DELTA) {
-        // the visibility delta is the magnitude of the pixel color difference
-        // with the layer's visibility toggled
-        Context toggle(current);
-        toggle[layer]._visible = !toggle[layer]._visible;
-        img = shared_ptr<Image>(render(toggle));
-      }
-      else if (mode == ImportanceMapMode::SPEC_VISIBILITY_DELTA) {
-        // the speculative visibility delta is basically the same as the visibility
-        // delta, but with some corner case handling
-        // there are two visibility conditions: opacity > 0, visility on
-        // - if layer is visible but opacity is 0, the delta is compared to opacity 1
-        // - if layer is invisible but opacity is 0, the delta is comapred to visible + opacity 1
-        // - if layer is visible, the delta is compared to invisible
-        Context toggle(current);
-
-        if (toggle[layer].getOpacity() == 0) {
-          toggle[layer].setOpacity(1);
-
-          if (!toggle[layer]._visible) {
-            toggle[layer]._visible = true;
-          }
-        }
-        else {
-          toggle[layer]._visible = !toggle[layer]._visible;
-        }
-
-        img = shared_ptr<Image>(render(toggle));
-      }
+      Context toggle(current);
+      toggleForImportance(toggle, layer, mode);
+      shared_ptr<Image> img = shared_ptr<Image>(render(toggle));
 
       for (int y = 0; y < maxH; y++) {
         for (int x = 0; x < maxW; x++) {
@@ -1862,20 +3231,178 @@ namespace Comp {
           float bd = (srcPixel._b * srcPixel._a) - (modPixel._b * modPixel._a);
           float diff = sqrt(rd * rd + gd * gd + bd * bd);
 
-          newMap->setVal(diff, x, y);
+          newMap->setVal(diff, x, y);
+        }
+      }
+    }
+
+    _importanceMapCache[layer][mode] = newMap;
+    return newMap;
+  }
+
+  void Compositor::computeAllImportanceMaps(ImportanceMapMode mode, Context & current, int threads)
+  {
+    if (mode == ImportanceMapMode::VISIBILITY_DELTA || mode == ImportanceMapMode::SPEC_VISIBILITY_DELTA) {
+      computeDeltaImportanceMaps(mode, current, threads);
+      return;
+    }
+
+    for (auto& l : _layerOrder) {
+      computeImportanceMap(l, mode, current);
+    }
+  }
+
+  void Compositor::computeDeltaImportanceMaps(ImportanceMapMode mode, Context& current, int threads)
+  {
+    getLogger()->log("Computing importance maps for all layers type " + to_string(mode));
+
+    vector<string> order = _layerOrder;
+    int n = (int)order.size();
+    if (n == 0)
+      return;
+
+    int width = getWidth();
+    int height = getHeight();
+    vector<shared_ptr<ImportanceMap>> maps(n);
+
+    int workers = max(1, min(threads, n));
+    int renderThreads = (workers == 1) ? threads : 1;
+    shared_ptr<FloatImage> full = shared_ptr<FloatImage>(renderFloat(current, nullptr, order, 1, "full", threads));
+    vector<float>& fullPx = full->getData();
+
+    // each worker gets a contiguous run of layers and only pays for rendering the layers below
+    // its run once. After that the below composite just gets the current layer blended on.
+    parallelFor(n, workers, (n + workers - 1) / workers, [&](int start, int end) {
+      // contexts get modified by lookups, so every worker needs its own
+      Context c(current);
+      FloatImage* below = nullptr;
+
+      if (start > 0) {
+        below = renderFloat(c, nullptr, vector<string>(order.begin(), order.begin() + start), 1, "full", renderThreads);
+      }
+
+      for (int i = start; i < end; i++) {
+        string id = order[i];
+        shared_ptr<ImportanceMap> m = shared_ptr<ImportanceMap>(new ImportanceMap(width, height));
+
+        // pixels outside of the layer's extent are the same with or without it
+        int x0, y0, x1, y1;
+        if (getLayerExtent(c, id, "full", x0, y0, x1, y1)) {
+          Context toggle(c);
+          toggleForImportance(toggle, id, mode);
+
+          FloatImage* mod = (below == nullptr) ? nullptr : new FloatImage(*below);
+          mod = renderFloat(toggle, mod, vector<string>(order.begin() + i, order.end()), 1, "full", renderThreads);
+          vector<float>& modPx = mod->getData();
+
+          // both buffers are premultiplied already
+          for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+              int p = (x + y * width) * 4;
+              float rd = fullPx[p] - modPx[p];
+              float gd = fullPx[p + 1] - modPx[p + 1];
+              float bd = fullPx[p + 2] - modPx[p + 2];
+              m->setVal(sqrt(rd * rd + gd * gd + bd * bd), x, y);
+            }
+          }
+
+          delete mod;
+        }
+
+        maps[i] = m;
+
+        // move the below composite up past this layer
+        below = renderFloat(c, below, vector<string>(1, id), 1, "full", renderThreads);
+      }
+
+      delete below;
+    });
+
+    for (int i = 0; i < n; i++) {
+      _importanceMapCache[order[i]][mode] = maps[i];
+    }
+  }
+
+  void Compositor::toggleForImportance(Context& c, string layer, ImportanceMapMode mode)
+  {
+    if (mode == ImportanceMapMode::VISIBILITY_DELTA) {
+      // the visibility delta is the magnitude of the pixel color difference
+      // with the layer's visibility toggled
+      c[layer]._visible = !c[layer]._visible;
+    }
+    else if (mode == ImportanceMapMode::SPEC_VISIBILITY_DELTA) {
+      // the speculative visibility delta is basically the same as the visibility
+      // delta, but with some corner case handling
+      // there are two visibility conditions: opacity > 0, visility on
+      // - if layer is visible but opacity is 0, the delta is compared to opacity 1
+      // - if layer is invisible but opacity is 0, the delta is comapred to visible + opacity 1
+      // - if layer is visible, the delta is compared to invisible
+      if (c[layer].getOpacity() == 0) {
+        c[layer].setOpacity(1);
+
+        if (!c[layer]._visible) {
+          c[layer]._visible = true;
         }
       }
+      else {
+        c[layer]._visible = !c[layer]._visible;
+      }
     }
+  }
 
-    _importanceMapCache[layer][mode] = newMap;
-    return newMap;
+  bool Compositor::getLayerExtent(Context& c, string id, string size, int& x0, int& y0, int& x1, int& y1)
+  {
+    return getLayerExtent(c, compilePlanStep(id), size, x0, y0, x1, y1);
   }
 
-  void Compositor::computeAllImportanceMaps(ImportanceMapMode mode, Context & current)
+  bool Compositor::getLayerExtent(Context& c, const PlanStep& step, string size, int& x0, int& y0, int& x1, int& y1)
   {
-    for (auto& l : _layerOrder) {
-      computeImportanceMap(l, mode, current);
-    }
+    int width = getWidth(size);
+    int height = getHeight(size);
+
+    x0 = 0;
+    y0 = 0;
+    x1 = width;
+    y1 = height;
+
+    // adjustment layers and precomps can change anything
+    Layer& l = c[step._id];
+    string name = l.getName();
+    if (l.isAdjustmentLayer() || l.isPrecomp() || !_imageData.has(name, size))
+      return true;
+
+    // group effects (strokes) draw outside of the layer's own alpha
+    if (step._groupEffects)
+      return true;
+
+    // adjustments don't change alpha, so the layer can only affect pixels where it has some.
+    // a mask can only take more away
+    int bx0, by0, bx1, by1;
+    _imageData.get(name, size)->getAlphaBounds(bx0, by0, bx1, by1);
+
+    if (l.hasMask() && _layerMasks.has(name, size)) {
+      int mx0, my0, mx1, my1;
+      _layerMasks.get(name, size)->getAlphaBounds(mx0, my0, mx1, my1);
+      bx0 = max(bx0, mx0);
+      by0 = max(by0, my0);
+      bx1 = min(bx1, mx1);
+      by1 = min(by1, my1);
+    }
+
+    if (bx1 <= bx0 || by1 <= by0)
+      return false;
+
+    // the blend reads layer pixel (x + dx, y + dy) for output pixel (x, y), see pixelOffset
+    auto offset = l.getOffset();
+    int dx = pixelOffset(offset.first, width);
+    int dy = pixelOffset(offset.second, height);
+
+    x0 = clamp(bx0 - dx, 0, width);
+    y0 = clamp(by0 - dy, 0, height);
+    x1 = clamp(bx1 - dx, 0, width);
+    y1 = clamp(by1 - dy, 0, height);
+
+    return x1 > x0 && y1 > y0;
   }
 
   shared_ptr<ImportanceMap> Compositor::getImportanceMap(string layer, ImportanceMapMode mode)
@@ -2179,18 +3706,16 @@ namespace Comp {
         }
 
         // coarse scan of the opacity to see if it can satisfy the goal
-        // temporary rendering context
-        Context temp(c);
+        vector<float> opacities;
+        for (int i = 0; i <= 100; i++) {
+          opacities.push_back(0.01f * i);
+        }
+
+        vector<vector<RGBAColor> > sweep = opacityResponse(c, layer, opacities, x, y, "full");
 
         for (int i = 0; i <= 100; i++) {
           float val = 0.01f * i;
-          temp[layer].setOpacity(val);
-
-          // render all of the pixels
-          vector<RGBAColor> testPixels;
-          for (int i = 0; i < x.size(); i++) {
-            testPixels.push_back(renderPixel(temp, x[i], y[i], "full"));
-          }
+          vector<RGBAColor>& testPixels = sweep[i];
 
           if (g.meetsGoal(testPixels)) {
             // add param to ret, continue
@@ -2321,33 +3846,44 @@ namespace Comp {
 
       sortedPts.clear();
 
-      // evaluate all points
-      for (auto& p : pts) {
-        // apply points
-        int i = 0;
-        map<string, float> currentParamVals;
-        for (auto& param : params) {
-          renderContext[layer].addAdjustment(adj, param.first, p[i]);
-          currentParamVals[param.first] = p[i];
-          i++;
+      // evaluate all points. Points are rendered in batches, each with its own copy of the context
+      const int batchSize = 256;
+      for (int start = 0; start < pts.size(); start += batchSize) {
+        int end = min((int)pts.size(), start + batchSize);
+
+        vector<Context> batch(end - start, renderContext);
+        vector<Context*> batchPtrs;
+        vector<map<string, float> > batchParamVals;
+
+        for (int b = start; b < end; b++) {
+          // apply points
+          int i = 0;
+          map<string, float> currentParamVals;
+          for (auto& param : params) {
+            batch[b - start][layer].addAdjustment(adj, param.first, pts[b][i]);
+            currentParamVals[param.first] = pts[b][i];
+            i++;
+          }
+
+          batchPtrs.push_back(&batch[b - start]);
+          batchParamVals.push_back(currentParamVals);
         }
 
         // render the pixels
-        vector<RGBAColor> testPixels;
-        for (int j = 0; j < x.size(); j++) {
-          testPixels.push_back(renderPixel(renderContext, x[j], y[j], "full"));
-        }
+        vector<vector<RGBAColor> > testPixels = renderPixels(batchPtrs, x, y, "full");
 
-        // get the objective
-        float fx = g.goalObjective(testPixels);
+        for (int b = start; b < end; b++) {
+          // get the objective
+          float fx = g.goalObjective(testPixels[b - start]);
 
-        if (fx < minimum) {
-          minimum = fx;
-          paramVals = currentParamVals;
-        }
+          if (fx < minimum) {
+            minimum = fx;
+            paramVals = batchParamVals[b - start];
+          }
 
-        // put in the sorted points
-        sortedPts.insert(make_pair(fx, p));
+          // put in the sorted points
+          sortedPts.insert(make_pair(fx, pts[b]));
+        }
       }
 
       getLogger()->log("Layer " + layer + " adjustment " + to_string(adj) + " current minimum is " + to_string(minimum) + " at level " + to_string(level));
@@ -2551,36 +4087,38 @@ namespace Comp {
       return new Image();
 
     Image* mimg = new Image(*img);
-    vector<string>& renderMap = img->getRenderMap();
+    RenderLayerMap& renderMap = img->getRenderMap();
 
     vector<unsigned char>& imgPxv = mimg->getData();
     unsigned char* imgPx = imgPxv.data();
     set<string> groupLayers = getGroup(group)._affectedLayers;
 
-    for (int i = 0; i < renderMap.size(); i++) {
-      // check group membership
+    // check group membership once per layer in the render map instead of once per pixel
+    vector<bool> acceptLayer(renderMap.numIds(), false);
+    for (int id = 0; id < renderMap.numIds(); id++) {
       // if a render group is in a layer list, we check to see if the given layer
       // is part of that render group
-      string name = renderMap[i];
+      const string& name = renderMap.getName(id);
 
       // easy direct check
-      bool acceptPx = false;
       if (groupLayers.count(name) > 0) {
-        acceptPx = true;
+        acceptLayer[id] = true;
       }
       else {
         vector<string> affects = getModifierOrder(name);
-        
+
         // if any of the modifier order layers are in the group, accept
         for (auto& n : affects) {
           if (groupLayers.count(n) > 0) {
-            acceptPx = true;
+            acceptLayer[id] = true;
           }
         }
       }
+    }
 
+    for (unsigned int i = 0; i < renderMap.size(); i++) {
       // green alpha max px
-      if (acceptPx == true) {
+      if (acceptLayer[renderMap.get(i)]) {
         imgPx[i * 4] = 0;
         imgPx[i * 4 + 1] = 255;
         imgPx[i * 4 + 2] = 0;
@@ -2599,7 +4137,7 @@ namespace Comp {
 
   void Compositor::addLayer(string name)
   {
-    _primary[name] = Layer(name, _imageData[name]["full"]);
+    _primary[name] = Layer(name, _imageData.get(name));
 
     // place at end of order
     _layerOrder.push_back(name);
@@ -2612,15 +4150,11 @@ namespace Comp {
 
   void Compositor::addLayerMask(string name)
   {
-    _primary[name].setMask(_layerMasks[name]["full"]);
-
-    // rescale
-    _layerMasks[name]["micro"] = _layerMasks[name]["full"]->resize(0.05f);
-    _layerMasks[name]["thumb"] = _layerMasks[name]["full"]->resize(0.15f);
-    _layerMasks[name]["small"] = _layerMasks[name]["full"]->resize(0.25f);
-    _layerMasks[name]["medium"] = _layerMasks[name]["full"]->resize(0.5f);
+    shared_ptr<Image> mask = _layerMasks.get(name);
+    _primary[name].setMask(mask);
+    mask->updateAlphaBounds();
 
-    getLogger()->log("Added mask " + _layerMasks[name]["full"]->getFilename() + " to layer " + name);
+    getLogger()->log("Added mask " + mask->getFilename() + " to layer " + name);
   }
 
   int Compositor::indexedOffset(float x, float y, string size)
@@ -2629,7 +4163,7 @@ namespace Comp {
     int w = getWidth(size);
     int h = getHeight(size);
 
-    return (int)(x * w) + (int)((y * h) * w);
+    return pixelOffset(x, w) + pixelOffset(y, h) * w;
   }
 
   int Compositor::applyIndexedOffset(int i, float dx, float dy, string size)
@@ -2637,12 +4171,33 @@ namespace Comp {
     return 0;
   }
 
+  shared_ptr<Image> Compositor::loadImage(const string & file)
+  {
+    if (_layerCache.isOpen()) {
+      shared_ptr<Image> img = _layerCache.get(file);
+      if (img != nullptr)
+        return img;
+    }
+
+    return shared_ptr<Image>(new Image(file));
+  }
+
+  void Compositor::loadCachedSizes(ImageCache & cache, const string & name, const string & file)
+  {
+    if (!_layerCache.isOpen())
+      return;
+
+    for (auto& s : _layerCache.getSizes(file)) {
+      // sizes that were changed since the file was written get rebuilt when needed
+      if (s.first != "full" && cache.getScale(s.first) == s.second)
+        cache.setLevel(name, s.first, _layerCache.get(file, s.first));
+    }
+  }
+
   void Compositor::cacheScaled(string name)
   {
-    _imageData[name]["micro"] = _imageData[name]["full"]->resize(0.05f);
-    _imageData[name]["thumb"] = _imageData[name]["full"]->resize(0.15f);
-    _imageData[name]["small"] = _imageData[name]["full"]->resize(0.25f);
-    _imageData[name]["medium"] = _imageData[name]["full"]->resize(0.5f);
+    // scaled copies are built by _imageData when a render first needs them
+    _imageData.get(name)->updateAlphaBounds();
   }
 
   float Compositor::finiteDifference(Image * a, Image * b, float delta)
@@ -2681,8 +4236,15 @@ namespace Comp {
     float delta = 0.01f;
 
     // r is the current render context
+    // every parameter gets its own context, the pixels for all of them are rendered together
+    vector<Context> temps(currentVals.size(), r);
+    vector<Context*> tempPtrs;
+    int index = 0;
+
     for (auto& p : currentVals) {
-      Context temp(r);
+      Context& temp = temps[index];
+      tempPtrs.push_back(&temp);
+      index++;
 
       float dp;
       if (p.second >= 1) {
@@ -2694,15 +4256,16 @@ namespace Comp {
       }
 
       temp[layer].addAdjustment(t, p.first, dp);
+    }
 
-      // compute
-      vector<RGBAColor> testPixels;
-      for (int i = 0; i < x.size(); i++) {
-        testPixels.push_back(renderPixel(temp, x[i], y[i], "full"));
-      }
+    // compute
+    vector<vector<RGBAColor> > testPixels = renderPixels(tempPtrs, x, y, "full");
 
-      float fxp = g.goalObjective(testPixels);
+    index = 0;
+    for (auto& p : currentVals) {
+      float fxp = g.goalObjective(testPixels[index]);
       results[p.first] = (fxp - fx) / 0.01;
+      index++;
     }
 
     return results;
@@ -2787,11 +4350,16 @@ namespace Comp {
       }
     }
 
+    _searchCandidates++;
+    if (_searchCascade && !cascadeScreen(*_cascadeScreen, start, vector<double>()))
+      return;
+
     // render
     Image* r = render(start, _searchRenderSize);
+    _searchRendered++;
 
     // callback
-    _activeCallback(r, start, map<string, float>(), map<string, string>());
+    _activeCallback(r, start, searchStatsMetadata(), map<string, string>());
   }
 
   void Compositor::initPoissonDisk(int n, int level, int k) {
@@ -2859,134 +4427,82 @@ namespace Comp {
     // set the initial configuration
     activeSet.setInitial(shared_ptr<ExpSearchSample>(new ExpSearchSample(currentRender, _initSearchContext, cv)));
 
+    // one random stream per candidate slot. With a seed set, a search with the same seed and
+    // thread count produces the same results
+    int slots = max(1, _expSearchThreads);
+    unsigned int seed = (_searchSettings.count("seed") > 0) ? (unsigned int)_searchSettings["seed"] : random_device()();
+    vector<mt19937> gens;
+    for (int i = 0; i < slots; i++) {
+      seed_seq seq = { seed, (unsigned int)i };
+      gens.push_back(mt19937(seq));
+    }
+
     // run structural search, then everything else
-    expStructSearch(activeSet);
+    expStructSearch(activeSet, gens);
+
+    // settings are read here, workers don't touch _searchSettings
+    double crossoverRate = _searchSettings["crossoverRate"];
+    double crossoverChance = _searchSettings["crossoverChance"];
+    double mutationRate = _searchSettings["mutationRate"];
+    bool useStructOnly = _searchSettings["useStructOnly"] > 0;
 
-    random_device rd;
-    mt19937 gen(rd());
-    uniform_real_distribution<double> zeroOne(0, 1);
-    
     // keep a single sample and repeatedly mutate it, similar to genetic op but without
     // a population since we don't have an objective here. Crossover samples are
     // pulled from the active set
-    // termination condition: consecutive failures (up for debate)
-    int failures = 0;
-    int sample = 0;
-    while (failures < _searchSettings["maxFailures"]) {
-      // skip to the end and return results if search is no longer running
-      if (!_searchRunning)
-        break;
-      
-      stringstream log;
-      log << "[" << sample << "]\t";
+    expSearchRounds(activeSet, key, cv, gens, false, [&](vector<double>& x, mt19937& gen, const vector<vector<double>>& pool, stringstream& log) {
+      uniform_real_distribution<double> zeroOne(0, 1);
 
       // crossover
-      if (zeroOne(gen) < _searchSettings["crossoverRate"]) {
-        shared_ptr<ExpSearchSample> xover;
+      if (zeroOne(gen) < crossoverRate) {
         int xsample;
 
         // 50% chance to crossover with the start config, 100% if activeSet is size 0
-        if (activeSet.size() == 0 || zeroOne(gen) < 0.5) {
+        // pool[0] is the start config, the rest is the active set
+        if (pool.size() == 1 || zeroOne(gen) < 0.5) {
           xsample = -1;
-          xover = activeSet.getInitial();
         }
         else {
-          xsample = (int)(zeroOne(gen) * activeSet.size());
-          xover = activeSet.get(xsample);
+          xsample = (int)(zeroOne(gen) * (pool.size() - 1));
         }
 
-        vector<double> xvec = xover->getContextVector();
+        const vector<double>& xvec = pool[xsample + 1];
 
         log << "Crossover (" << xsample << ")";
 
-        for (int i = 0; i < cv.size(); i++) {
-          if (zeroOne(gen) < _searchSettings["crossoverChance"]) {
-            cv[i] = xvec[i];
+        for (int i = 0; i < x.size(); i++) {
+          if (zeroOne(gen) < crossoverChance) {
+            x[i] = xvec[i];
             log << " [" << i << "]";
           }
         }
       }
 
-      for (int i = 0; i < cv.size(); i++) {
+      for (int i = 0; i < x.size(); i++) {
         // mutate the current context, which has been translated to a vector
         // mutate here just means randomize between 0 and 1
         // note: some parameters are toggles (like relative for selective color) may have to deal with them later
-        if (zeroOne(gen) < _searchSettings["mutationRate"]) {
-          cv[i] = zeroOne(gen);
+        if (zeroOne(gen) < mutationRate) {
+          x[i] = zeroOne(gen);
           log << " Mutation [" << i << "]";
         }
       }
 
-      getLogger()->log(log.str());
-
       // option to only use struct results as a base
-      if (_searchSettings["useStructOnly"] > 0) {
+      if (useStructOnly && _structResults.size() > 0) {
         // randomly select a base
         int ind = (int)(zeroOne(gen) * _structResults.size());
-        vector<double> base = _structResults[ind];
+        const vector<double>& base = _structResults[ind];
 
         for (int id : _structParams) {
-          cv[id] = base[id];
-        }
-      }
-
-      // attempt to add the thing
-      Context newCtx = vectorToContext(cv, key);
-
-      // sanity check for levels, restore to default if invalid
-      for (auto& l : newCtx) {
-        auto adj = l.second.getAdjustment(AdjustmentType::LEVELS);
-        if (adj.size() > 0) {
-          if (adj["inMin"] > adj["inMax"] || adj["outMin"] > adj["outMax"]) {
-            // restore to initial conditions
-            l.second.addAdjustment(AdjustmentType::LEVELS, _initSearchContext[l.first].getAdjustment(AdjustmentType::LEVELS));
-
-            // update vector
-            cv = contextToVector(newCtx, key);
-          }
-        }
-      }
-
-      shared_ptr<Image> img = shared_ptr<Image>(render(newCtx, _searchRenderSize));
-      shared_ptr<ExpSearchSample> newSample = shared_ptr<ExpSearchSample>(new ExpSearchSample(img, newCtx, cv));
-
-      // check that the result is "reasonable"
-      bool good = activeSet.isGood(newSample);
-      // failing to be a reasonable sample isn't necsesarily a failure to find diversity, so it won't be counted as such
-
-      if (good) {
-        bool success = activeSet.add(newSample);
-
-        if (!success) {
-          failures++;
-        }
-        else {
-          map<string, string> m2;
-          m2["reason"] = activeSet.getReason(activeSet.size() - 1);
-
-          _activeCallback(new Image(*img.get()), newCtx, map<string, float>(), m2);
-          failures = 0;
+          x[id] = base[id];
         }
       }
-
-      getLogger()->log("Failures: " + to_string(failures) + "/" + to_string(_searchSettings["maxFailures"]));
-      sample++;
-    }
+    });
 
     // right now things that are added to the set can't be removed, so we return as we find at the moment.
-    // return everything to the calling function with the callback
-    //for (int i = 0; i < activeSet.size(); i++) {
-    //  auto x = activeSet.get(i);
-
-      // string metadata things
-    //  map<string, string> m2;
-    //  m2["reason"] = activeSet.getReason(i);
-
-    //  _activeCallback(new Image(*x->getImg().get()), x->getContext(), map<string, float>(), m2);
-    //}
   }
 
-  void Compositor::expStructSearch(ExpSearchSet & activeSet)
+  void Compositor::expStructSearch(ExpSearchSet & activeSet, vector<mt19937>& gens)
   {
     getLogger()->log("Starting structural search");
 
@@ -3019,19 +4535,12 @@ namespace Comp {
       }
     }
 
-    random_device rd;
-    mt19937 gen(rd());
-    uniform_real_distribution<double> zeroOne(0, 1);
+    double mutationRate = _searchSettings["mutationRate"];
+    double toggleRate = _searchSettings["toggleRate"];
 
     // for now structure is assumed to imply opacity only
-    int failures = 0;
-    int sample = 0;
-    while (failures < _searchSettings["maxFailures"]) {
-      if (!_searchRunning)
-        break;
-      
-      stringstream log;
-      log << "[" << sample << "]\t";
+    expSearchRounds(activeSet, key, cv, gens, true, [&](vector<double>& x, mt19937& gen, const vector<vector<double>>& pool, stringstream& log) {
+      uniform_real_distribution<double> zeroOne(0, 1);
 
       // crossover is eliminated here in favor of toggling
       // but maybe we do want crossover back to the original config
@@ -3040,8 +4549,8 @@ namespace Comp {
       for (auto& id : _structParams) {
         // mutate the current context, which has been translated to a vector
         // mutate here just means randomize between 0 and 1
-        if (zeroOne(gen) < _searchSettings["mutationRate"]) {
-          cv[id] = zeroOne(gen);
+        if (zeroOne(gen) < mutationRate) {
+          x[id] = zeroOne(gen);
           log << " Mutation [" << id << "]";
         }
       }
@@ -3050,44 +4559,154 @@ namespace Comp {
       // this randomly sets an opacity layer to either on (100%) or off (0%)
       // with a 50% chance
       for (auto& id : _structParams) {
-        if (zeroOne(gen) < _searchSettings["toggleRate"]) {
+        if (zeroOne(gen) < toggleRate) {
           log << " Toggle [" << id << "]";
-          cv[id] = (zeroOne(gen) < 0.5) ? 1 : 0;
+          x[id] = (zeroOne(gen) < 0.5) ? 1 : 0;
         }
       }
+    });
+  }
+
+  void Compositor::expSearchRounds(ExpSearchSet & activeSet, nlohmann::json & key, vector<double>& cv, vector<mt19937>& gens,
+    bool structural, function<void(vector<double>&, mt19937&, const vector<vector<double>>&, stringstream&)> mutate)
+  {
+    int slots = (int)gens.size();
+    int maxFailures = (int)_searchSettings["maxFailures"];
 
-      getLogger()->log(log.str());
+    // vectorToContext and contextToVector aren't const on the key, each slot gets its own
+    vector<nlohmann::json> keys(slots, key);
 
-      // attempt to add the thing
-      Context newCtx = vectorToContext(cv, key);
-      shared_ptr<Image> img = shared_ptr<Image>(render(newCtx, _searchRenderSize));
-      shared_ptr<ExpSearchSample> newSample = shared_ptr<ExpSearchSample>(new ExpSearchSample(img, newCtx, cv));
+    int failures = 0;
+    int sample = 0;
+    while (failures < maxFailures) {
+      // skip to the end and return results if search is no longer running
+      if (!_searchRunning)
+        break;
 
-      // check that the result is "reasonable"
-      bool good = activeSet.isGood(newSample);
-      // failing to be a reasonable sample isn't necsesarily a failure to find diversity, so it won't be counted as such
+      // crossover sources as of the start of the round. The set only changes between rounds
+      vector<vector<double>> pool;
+      pool.push_back(activeSet.getInitial()->getContextVector());
+      for (int i = 0; i < activeSet.size(); i++)
+        pool.push_back(activeSet.get(i)->getContextVector());
+
+      // speculatively build and render one candidate per slot from the current vector
+      vector<vector<double>> candidates(slots, cv);
+      vector<Context> contexts(slots);
+      vector<shared_ptr<ExpSearchSample>> samples(slots);
+      vector<string> logs(slots);
+
+      // workers only read the initial context. operator[] could insert, so they go through find
+      const Context& initContext = _initSearchContext;
+
+      parallelFor(slots, slots, 1, [&](int start, int end) {
+        for (int i = start; i < end; i++) {
+          stringstream log;
+          log << "[" << sample + i << "]\t";
+
+          mutate(candidates[i], gens[i], pool, log);
+          logs[i] = log.str();
+
+          Context newCtx = vectorToContext(candidates[i], keys[i]);
+
+          // sanity check for levels, restore to default if invalid
+          for (auto& l : newCtx) {
+            auto adj = l.second.getAdjustment(AdjustmentType::LEVELS);
+            if (adj.size() > 0) {
+              auto init = initContext.find(l.first);
+              if (init != initContext.end() && (adj["inMin"] > adj["inMax"] || adj["outMin"] > adj["outMax"])) {
+                // restore to initial conditions. Layer copies share settings, this doesn't copy any pixels
+                Layer initLayer = init->second;
+                l.second.addAdjustment(AdjustmentType::LEVELS, initLayer.getAdjustment(AdjustmentType::LEVELS));
+
+                // update vector
+                candidates[i] = contextToVector(newCtx, keys[i]);
+              }
+            }
+          }
 
-      if (good) {
-        bool success = activeSet.add(newSample, true);
+          // isGood only compares against the initial config, so screening doesn't depend on slot order
+          _searchCandidates++;
+          if (!cascadeScreen(activeSet, newCtx, candidates[i])) {
+            logs[i] += " Screened out";
+            continue;
+          }
 
-        if (!success) {
-          failures++;
+          shared_ptr<Image> img = shared_ptr<Image>(render(newCtx, _searchRenderSize));
+          samples[i] = shared_ptr<ExpSearchSample>(new ExpSearchSample(img, newCtx, candidates[i]));
+          contexts[i] = newCtx;
+          _searchRendered++;
         }
-        else {
-          map<string, string> m2;
-          m2["reason"] = activeSet.getReason(activeSet.size() - 1);
+      });
+
+      // accept in slot order, exactly as if the candidates had been generated one after another
+      for (int i = 0; i < slots && failures < maxFailures && _searchRunning; i++) {
+        getLogger()->log(logs[i]);
+
+        // the next round mutates from the last candidate looked at, like the single threaded walk
+        cv = candidates[i];
 
-          _activeCallback(new Image(*img.get()), newCtx, map<string, float>(), m2);
-          _structResults.push_back(cv);
-          failures = 0;
+        // check that the result is "reasonable". Screened out candidates have no sample
+        bool good = samples[i] != nullptr && activeSet.isGood(samples[i]);
+        // failing to be a reasonable sample isn't necsesarily a failure to find diversity, so it won't be counted as such
+
+        if (samples[i] != nullptr && !good)
+          _searchRejected++;
+
+        if (good) {
+          bool success = activeSet.add(samples[i], structural);
+
+          if (!success) {
+            failures++;
+          }
+          else {
+            map<string, string> m2;
+            m2["reason"] = activeSet.getReason(activeSet.size() - 1);
+
+            _activeCallback(new Image(*samples[i]->getImg().get()), contexts[i], searchStatsMetadata(), m2);
+
+            if (structural)
+              _structResults.push_back(candidates[i]);
+
+            failures = 0;
+          }
         }
-      }
 
-      getLogger()->log("Failures: " + to_string(failures) + "/" + to_string(_searchSettings["maxFailures"]));
-      sample++;
+        getLogger()->log("Failures: " + to_string(failures) + "/" + to_string(maxFailures));
+        sample++;
+      }
     }
   }
 
+  bool Compositor::cascadeScreen(ExpSearchSet & screen, Context & ctx, const vector<double>& ctxVec)
+  {
+    if (!_searchCascade)
+      return true;
+
+    // histogram checks work on fractions of the image, so a tiny render gives close to the same answer
+    shared_ptr<Image> coarse = shared_ptr<Image>(render(ctx, "micro"));
+    if (screen.isGood(shared_ptr<ExpSearchSample>(new ExpSearchSample(coarse, ctx, ctxVec))))
+      return true;
+
+    _searchScreenRejected++;
+    return false;
+  }
+
+  map<string, float> Compositor::searchStatsMetadata()
+  {
+    float candidates = (float)_searchCandidates;
+    float rendered = (float)_searchRendered;
+    double elapsed = chrono::duration<double>(chrono::high_resolution_clock::now() - _searchStart).count();
+
+    map<string, float> meta;
+    meta["candidates"] = candidates;
+    meta["candidatesPerSecond"] = (elapsed > 0) ? (float)(candidates / elapsed) : 0;
+    meta["screenRejectRate"] = (candidates > 0) ? _searchScreenRejected / candidates : 0;
+    meta["rendered"] = rendered;
+    meta["renderRejectRate"] = (rendered > 0) ? _searchRejected / rendered : 0;
+
+    return meta;
+  }
+
   inline float Compositor::premult(unsigned char px, float a)
   {
     return (float)((px / 255.0f) * a);
@@ -3099,304 +4718,590 @@ namespace Comp {
     return (unsigned char)((v > 255) ? 255 : (v < 0) ? 0 : v);
   }
 
-  void Compositor::adjust(Image * adjLayer, Layer& l)
+  inline float Compositor::cvtPremult(float px, float a)
+  {
+    float v = px / a;
+    return ((v > 1) ? 1 : (v < 0) ? 0 : v) * a;
+  }
+
+  void Compositor::adjust(Image * adjLayer, Layer& l, int threads)
+  {
+    // adjustments run on the floating point buffer, convert there and back
+    FloatImage working(adjLayer);
+    adjust(&working, l, threads);
+    working.toImage(adjLayer);
+  }
+
+  void Compositor::adjust(FloatImage * adjLayer, Layer& l, int threads)
+  {
+    adjust(adjLayer, l, compilePlanStep(l.getName())._strokes, threads);
+  }
+
+  void Compositor::adjust(FloatImage * adjLayer, Layer& l, const vector<string>& strokes, int threads)
   {
     // apply stroke effects if needed
-    for (auto& o : _groupOrder) {
-      if (_groups[o.second]._affectedLayers.count(l.getName()) > 0) {
-        // check for effects
-        if (_groups[o.second]._effect._mode == EffectMode::STROKE) {
-          // adjust is called on duplicated layers so this should be ok and not permanent
-          // stroke the image
-          Image* inclusionMap = getGroupInclusionMap(adjLayer, o.second);
-          adjLayer->stroke(inclusionMap, _groups[o.second]._effect._width, _groups[o.second]._effect._color);
-          delete inclusionMap;
-        }
+    // strokes operate on 8-bit images, so the layer is only converted if a stroke is present
+    Image* strokeLayer = nullptr;
+    for (auto& g : strokes) {
+      if (strokeLayer == nullptr) {
+        strokeLayer = adjLayer->toImage();
       }
+
+      // adjust is called on duplicated layers so this should be ok and not permanent
+      // stroke the image
+      ImageEffect& effect = _groups[g]._effect;
+      Image* inclusionMap = getGroupInclusionMap(strokeLayer, g);
+      strokeLayer->stroke(inclusionMap, effect._width, effect._color);
+      delete inclusionMap;
     }
 
-    // only certain modes are recognized
+    if (strokeLayer != nullptr) {
+      // strokes grow the layer past its old alpha
+      strokeLayer->updateAlphaBounds();
+      adjLayer->fromImage(strokeLayer);
+      delete strokeLayer;
+    }
+
+    vector<AdjustmentStep> steps = compileAdjustments(l);
+
+    if (steps.size() == 0)
+      return;
+
+    // pixels outside the alpha bounds are transparent and stay that way, so only the bounds are adjusted
+    int x0, y0, x1, y1;
+    adjLayer->getAlphaBounds(x0, y0, x1, y1);
+    if (x1 <= x0 || y1 <= y0)
+      return;
+
+    int width = adjLayer->getWidth();
+    int rowGrain = max(1, 16384 / (x1 - x0));
+
+    // each pixel is loaded once, run through the entire adjustment list, then stored
+    parallelFor(y1 - y0, threads, rowGrain, [&](int start, int end) {
+      for (int y = y0 + start; y < y0 + end; y++) {
+        for (int x = x0; x < x1; x++) {
+          int i = x + y * width;
+          RGBAColor px = adjLayer->getPixel(i);
+          adjustPixel(px, steps, l);
+          adjLayer->setPixel(i, px);
+        }
+      }
+    });
+  }
+
+  vector<AdjustmentStep> Compositor::compileAdjustments(Layer & l, int cubeSize)
+  {
+    vector<AdjustmentStep> steps;
+
     for (auto type : l.getAdjustments()) {
+      AdjustmentStep step;
+      step._type = type;
+      step._baked = false;
+      step._adj = l.getAdjustment(type);
+      map<string, float>& adj = step._adj;
+
       if (type == AdjustmentType::HSL) {
-        hslAdjust(adjLayer, l.getAdjustment(type));
+        step._params[0] = adj["hue"];
+        step._params[1] = adj["sat"];
+        step._params[2] = adj["light"];
       }
       else if (type == AdjustmentType::LEVELS) {
-        levelsAdjust(adjLayer, l.getAdjustment(type));
-      }
-      else if (type == AdjustmentType::CURVES) {
-        curvesAdjust(adjLayer, l.getAdjustment(type), l);
+        step._params[0] = adj["inMin"];
+        step._params[1] = adj["inMax"];
+        step._params[2] = adj["gamma"] * 10;
+        step._params[3] = adj["outMin"];
+        step._params[4] = adj["outMax"];
       }
       else if (type == AdjustmentType::EXPOSURE) {
-        exposureAdjust(adjLayer, l.getAdjustment(type));
-      }
-      else if (type == AdjustmentType::GRADIENT) {
-        gradientMap(adjLayer, l.getAdjustment(type), l);
+        step._params[0] = adj["exposure"];
+        step._params[1] = adj["offset"];
+        step._params[2] = adj["gamma"];
       }
       else if (type == AdjustmentType::SELECTIVE_COLOR) {
-        selectiveColor(adjLayer, l.getAdjustment(type), l);
+        step._selectiveColor = l.getSelectiveColor();
+
+        for (auto& c : step._selectiveColor) {
+          for (auto& p : c.second) {
+            p.second = (p.second - 0.5) * 2;
+          }
+        }
+
+        step._params[0] = (adj["relative"] > 0) ? 1.0f : 0.0f;
       }
       else if (type == AdjustmentType::COLOR_BALANCE) {
-        colorBalanceAdjust(adjLayer, l.getAdjustment(type));
+        step._params[0] = adj["shadowR"];
+        step._params[1] = adj["shadowG"];
+        step._params[2] = adj["shadowB"];
+        step._params[3] = adj["midR"];
+        step._params[4] = adj["midG"];
+        step._params[5] = adj["midB"];
+        step._params[6] = adj["highR"];
+        step._params[7] = adj["highG"];
+        step._params[8] = adj["highB"];
+        step._params[9] = adj["preserveLuma"];
       }
       else if (type == AdjustmentType::PHOTO_FILTER) {
-        photoFilterAdjust(adjLayer, l.getAdjustment(type));
-      }
-      else if (type == AdjustmentType::COLORIZE) {
-        colorizeAdjust(adjLayer, l.getAdjustment(type));
-      }
-      else if (type == AdjustmentType::LIGHTER_COLORIZE) {
-        lighterColorizeAdjust(adjLayer, l.getAdjustment(type));
-      }
-      else if (type == AdjustmentType::OVERWRITE_COLOR) {
-        overwriteColorAdjust(adjLayer, l.getAdjustment(type));
-      }
-      else if (type == AdjustmentType::INVERT) {
-        invertAdjust(adjLayer);
+        step._params[0] = adj["density"];
+        step._params[1] = adj["r"];
+        step._params[2] = adj["g"];
+        step._params[3] = adj["b"];
+        step._params[4] = adj["preserveLuma"];
+      }
+      else if (type == AdjustmentType::COLORIZE || type == AdjustmentType::LIGHTER_COLORIZE ||
+        type == AdjustmentType::OVERWRITE_COLOR) {
+        step._params[0] = adj["r"];
+        step._params[1] = adj["g"];
+        step._params[2] = adj["b"];
+        step._params[3] = adj["a"];
       }
       else if (type == AdjustmentType::BRIGHTNESS) {
-        brightnessAdjust(adjLayer, l.getAdjustment(type));
+        // make sure both keys exist so the per-pixel lookups don't insert
+        adj["contrast"];
+        adj["brightness"];
       }
+      else if (type != AdjustmentType::CURVES && type != AdjustmentType::GRADIENT &&
+        type != AdjustmentType::INVERT) {
+        // only certain modes are recognized
+        continue;
+      }
+
+      steps.push_back(step);
     }
-  }
 
-  inline void Compositor::hslAdjust(Image * adjLayer, map<string, float> adj)
-  {
-    // Right now the bare-bones hsl adjustment is here. PS has a lot of options for carefully
-    // crafting remappings, but we don't do that for now.
-    // basically we convert to hsl, add the proper adjustment, convert back to rgb8
-    vector<unsigned char>& img = adjLayer->getData();
-    float h = adj["hue"];
-    float s = adj["sat"];
-    float l = adj["light"];
+    steps = bakeChannelTables(steps, l);
+
+    if (cubeSize < 0)
+      cubeSize = _colorCubeSize;
+
+    // lists that are entirely per channel are already as cheap as a cube lookup
+    bool mixesChannels = false;
+    for (auto& step : steps) {
+      if (!step._baked && !isPerChannel(step))
+        mixesChannels = true;
+    }
 
-    for (int i = 0; i < img.size() / 4; i++) {
-      RGBAColor layerPx = adjLayer->getPixel(i);
-      hslAdjust(layerPx, h, s, l);
+    if (cubeSize > 1 && mixesChannels) {
+      AdjustmentStep cube;
+      cube._type = steps[0]._type;
+      cube._baked = false;
+      cube._cube = getColorCube(steps, l, cubeSize);
+      cube._cubeSize = cubeSize;
 
-      // convert to char
-      img[i * 4] = (unsigned char) (layerPx._r * 255);
-      img[i * 4 + 1] = (unsigned char) (layerPx._g * 255);
-      img[i * 4 + 2] = (unsigned char) (layerPx._b * 255);
+      steps.clear();
+      steps.push_back(cube);
     }
+
+    return steps;
   }
 
-  inline void Compositor::curvesAdjust(Image * adjLayer, map<string, float> adj, Layer & l)
+  void Compositor::setColorCubeSize(int size)
   {
-    // fairly simple adjustment
-    // take each channel, modify the pixel values by the specified curve
-    // after per-channel adjustments are done, then apply the RGB (brightness) curve which really
-    // should be labeled value because that's what that curve seems to affect
-    vector<unsigned char>& img = adjLayer->getData();
-
-    for (int i = 0; i < img.size() / 4; i++) {
-      RGBAColor adjPx = adjLayer->getPixel(i);
-      curvesAdjust(adjPx, adj, l);
+    _colorCubeSize = (size > 1) ? size : 0;
+  }
 
-      img[i * 4] = (unsigned char)(clamp(adjPx._r, 0.0f, 1.0f) * 255);
-      img[i * 4 + 1] = (unsigned char)(clamp(adjPx._g, 0.0f, 1.0f) * 255);
-      img[i * 4 + 2] = (unsigned char)(clamp(adjPx._b, 0.0f, 1.0f) * 255);
-    }
+  int Compositor::getColorCubeSize()
+  {
+    return _colorCubeSize;
   }
 
-  inline void Compositor::exposureAdjust(Image * adjLayer, map<string, float> adj)
+  shared_ptr<vector<float>> Compositor::getColorCube(vector<AdjustmentStep>& steps, Layer & l, int size)
   {
-    vector<unsigned char>& img = adjLayer->getData();
+    size_t key = l.adjustmentHash();
+    hashCombine(key, size);
+
+    {
+      lock_guard<mutex> lock(_colorCubeLock);
+      auto it = _colorCubeCache.find(key);
+      if (it != _colorCubeCache.end() && l.sameAdjustments(it->second.first))
+        return it->second.second;
+    }
+
+    // red varies fastest, then green, then blue
+    shared_ptr<vector<float>> cube = shared_ptr<vector<float>>(new vector<float>(size * size * size * 3));
+    vector<float>& data = *cube;
+    float scale = 1.0f / (size - 1);
+
+    for (int b = 0; b < size; b++) {
+      for (int g = 0; g < size; g++) {
+        for (int r = 0; r < size; r++) {
+          RGBAColor px;
+          px._r = r * scale;
+          px._g = g * scale;
+          px._b = b * scale;
+          px._a = 1;
+          adjustPixel(px, steps, l);
+
+          int i = ((b * size + g) * size + r) * 3;
+          data[i] = px._r;
+          data[i + 1] = px._g;
+          data[i + 2] = px._b;
+        }
+      }
+    }
 
-    float exposure = adj["exposure"];
-    float offset = adj["offset"];
-    float gamma = adj["gamma"];
+    lock_guard<mutex> lock(_colorCubeLock);
 
-    for (int i = 0; i < img.size() / 4; i++) {
-      RGBAColor adjPx = adjLayer->getPixel(i);
-      exposureAdjust(adjPx, exposure, offset, gamma);
+    // slider drags produce a new cube every frame, don't let them pile up
+    if (_colorCubeCache.size() >= 64)
+      _colorCubeCache.clear();
 
-      img[i * 4] = (unsigned char)(adjPx._r * 255);
-      img[i * 4 + 1] = (unsigned char)(adjPx._g * 255);
-      img[i * 4 + 2] = (unsigned char)(adjPx._b * 255);
-    }
+    _colorCubeCache[key] = make_pair(l.getSettings(), cube);
+    return cube;
   }
 
-  inline void Compositor::gradientMap(Image * adjLayer, map<string, float> adj, Layer& l)
+  inline void Compositor::cubeLookup(RGBAColor & px, const float * cube, int size)
   {
-    vector<unsigned char>& img = adjLayer->getData();
-
-    for (int i = 0; i < img.size() / 4; i++) {
-      RGBAColor adjPx = adjLayer->getPixel(i);
-      gradientMap(adjPx, adj, l);
-
-      img[i * 4] = (unsigned char)(adjPx._r * 255);
-      img[i * 4 + 1] = (unsigned char)(adjPx._g * 255);
-      img[i * 4 + 2] = (unsigned char)(adjPx._b * 255);
+    int n = size - 1;
+    float fr = clamp(px._r, 0.0f, 1.0f) * n;
+    float fg = clamp(px._g, 0.0f, 1.0f) * n;
+    float fb = clamp(px._b, 0.0f, 1.0f) * n;
+
+    int r0 = min((int)fr, n - 1);
+    int g0 = min((int)fg, n - 1);
+    int b0 = min((int)fb, n - 1);
+    float dr = fr - r0;
+    float dg = fg - g0;
+    float db = fb - b0;
+
+    // corners of the cell
+    int sr = 3;
+    int sg = size * 3;
+    int sb = size * size * 3;
+    const float* c000 = cube + r0 * sr + g0 * sg + b0 * sb;
+    const float* c111 = c000 + sr + sg + sb;
+    const float* c1;
+    const float* c2;
+    float w0, w1, w2, w3;
+
+    // pick the tetrahedron containing the point, then weight its four corners
+    if (dr >= dg) {
+      if (dg >= db) {
+        c1 = c000 + sr;
+        c2 = c000 + sr + sg;
+        w0 = 1 - dr; w1 = dr - dg; w2 = dg - db; w3 = db;
+      }
+      else if (dr >= db) {
+        c1 = c000 + sr;
+        c2 = c000 + sr + sb;
+        w0 = 1 - dr; w1 = dr - db; w2 = db - dg; w3 = dg;
+      }
+      else {
+        c1 = c000 + sb;
+        c2 = c000 + sr + sb;
+        w0 = 1 - db; w1 = db - dr; w2 = dr - dg; w3 = dg;
+      }
+    }
+    else {
+      if (db >= dg) {
+        c1 = c000 + sb;
+        c2 = c000 + sg + sb;
+        w0 = 1 - db; w1 = db - dg; w2 = dg - dr; w3 = dr;
+      }
+      else if (db >= dr) {
+        c1 = c000 + sg;
+        c2 = c000 + sg + sb;
+        w0 = 1 - dg; w1 = dg - db; w2 = db - dr; w3 = dr;
+      }
+      else {
+        c1 = c000 + sg;
+        c2 = c000 + sr + sg;
+        w0 = 1 - dg; w1 = dg - dr; w2 = dr - db; w3 = db;
+      }
     }
+
+    px._r = w0 * c000[0] + w1 * c1[0] + w2 * c2[0] + w3 * c111[0];
+    px._g = w0 * c000[1] + w1 * c1[1] + w2 * c2[1] + w3 * c111[1];
+    px._b = w0 * c000[2] + w1 * c1[2] + w2 * c2[2] + w3 * c111[2];
   }
 
-  inline void Compositor::selectiveColor(Image * adjLayer, map<string, float> adj, Layer & l)
+  map<string, double> Compositor::colorCubeReport(Layer & l, int size, int samples)
   {
-    // so according to the PS docs this will apply per-channel adjustments relative to
-    // "how close the color is to an option in the menu" which implies a barycentric weighting
-    // of the colors. Photoshop's internal color space is probably Lab so that seems like the right
-    // approach, however the conversion to Lab and computation of barycentric coords is really expensive.
-    // For now we'll approximate by using the HCL cone and some hacky interpolation because barycentric
-    // coordinates get rather odd in a cone
-    vector<unsigned char>& img = adjLayer->getData();
+    map<string, double> report;
+
+    if (size < 2 || samples < 1) {
+      getLogger()->log("colorCubeReport needs a cube size of at least 2 and at least one sample", LogLevel::WARN);
+      return report;
+    }
 
-    map<string, map<string, float>> data = l.getSelectiveColor();
+    vector<AdjustmentStep> exact = compileAdjustments(l, 0);
 
-    for (auto& c : data) {
-      for (auto& p : c.second) {
-        p.second = (p.second - 0.5) * 2;
-      }
+    // always rebuild so the build time is measured
+    auto buildStart = chrono::high_resolution_clock::now();
+    AdjustmentStep cube;
+    cube._type = AdjustmentType::HSL;
+    cube._baked = false;
+    cube._cubeSize = size;
+    {
+      lock_guard<mutex> lock(_colorCubeLock);
+      size_t key = l.adjustmentHash();
+      hashCombine(key, size);
+      _colorCubeCache.erase(key);
     }
+    cube._cube = getColorCube(exact, l, size);
+    vector<AdjustmentStep> cubed(1, cube);
+    auto buildEnd = chrono::high_resolution_clock::now();
 
-    bool rel = adj["relative"] > 0;
+    mt19937 gen(1234);
+    uniform_real_distribution<float> dist(0, 1);
+    vector<RGBAColor> input(samples);
+    for (auto& px : input) {
+      px._r = dist(gen);
+      px._g = dist(gen);
+      px._b = dist(gen);
+      px._a = 1;
+    }
+
+    vector<RGBAColor> a = input;
+    auto exactStart = chrono::high_resolution_clock::now();
+    for (auto& px : a)
+      adjustPixel(px, exact, l);
+    auto exactEnd = chrono::high_resolution_clock::now();
+
+    vector<RGBAColor> b = input;
+    auto cubeStart = chrono::high_resolution_clock::now();
+    for (auto& px : b)
+      adjustPixel(px, cubed, l);
+    auto cubeEnd = chrono::high_resolution_clock::now();
+
+    double maxError = 0;
+    double totalError = 0;
+    for (int i = 0; i < samples; i++) {
+      double e[3] = { fabs(a[i]._r - b[i]._r), fabs(a[i]._g - b[i]._g), fabs(a[i]._b - b[i]._b) };
+      for (int c = 0; c < 3; c++) {
+        maxError = max(maxError, e[c]);
+        totalError += e[c];
+      }
+    }
+
+    report["maxError"] = maxError;
+    report["meanError"] = totalError / (samples * 3.0);
+    report["buildMs"] = chrono::duration<double, milli>(buildEnd - buildStart).count();
+    report["exactNsPerPx"] = chrono::duration<double, nano>(exactEnd - exactStart).count() / samples;
+    report["cubeNsPerPx"] = chrono::duration<double, nano>(cubeEnd - cubeStart).count() / samples;
 
-    for (int i = 0; i < img.size() / 4; i++) {
-      RGBAColor adjPx = adjLayer->getPixel(i);
-      selectiveColor<float>(adjPx, data, rel);
+    stringstream ss;
+    ss << "Color cube " << size << " for " << l.getName() << ": max error " << report["maxError"] << ", mean error "
+      << report["meanError"] << ", exact " << report["exactNsPerPx"] << " ns/px, cube " << report["cubeNsPerPx"]
+      << " ns/px, build " << report["buildMs"] << " ms";
+    getLogger()->log(ss.str());
 
-      img[i * 4] = (unsigned char)(adjPx._r * 255);
-      img[i * 4 + 1] = (unsigned char)(adjPx._g * 255);
-      img[i * 4 + 2] = (unsigned char)(adjPx._b * 255);
-    }
+    return report;
   }
 
-  inline void Compositor::colorBalanceAdjust(Image * adjLayer, map<string, float> adj)
+  vector<AdjustmentStep> Compositor::bakeChannelTables(vector<AdjustmentStep>& steps, Layer & l)
   {
-    // the color balance adjustment is based on the GIMP implementation due to the
-    // complexities involved with reverse-engineering the photoshop balance adjustment
-    // from scratch (it appears non-linear? dunno)
-    // source: https://github.com/liovch/GPUImage/commit/fcc85db4fdafae1d4e41313c96bb1cac54dc93b4#diff-5acce76055236dedac2284353170c24aR117
-    vector<unsigned char>& img = adjLayer->getData();
+    size_t key = l.adjustmentHash();
 
-    float shadowR = adj["shadowR"];
-    float shadowG = adj["shadowG"];
-    float shadowB = adj["shadowB"];
-    float midR = adj["midR"];
-    float midG = adj["midG"];
-    float midB = adj["midB"];
-    float highR = adj["highR"];
-    float highG = adj["highG"];
-    float highB = adj["highB"];
-    float pl = adj["preserveLuma"];
+    {
+      lock_guard<mutex> lock(_channelTableLock);
+      auto it = _channelTableCache.find(key);
+      if (it != _channelTableCache.end() && l.sameAdjustments(it->second.first))
+        return it->second.second;
+    }
 
-    for (int i = 0; i < img.size() / 4; i++) {
-      RGBAColor adjPx = adjLayer->getPixel(i);
-      colorBalanceAdjust(adjPx, shadowR, shadowG, shadowB, midR, midG, midB, highR, highG, highB, pl);
+    // a bin that interpolates worse than a quarter of an 8-bit level falls back to the exact path
+    const float tolerance = 0.25f / 255;
+    const float probes[] = { 0.25f, 0.5f, 0.75f };
 
-      img[i * 4] = (unsigned char)(adjPx._r * 255);
-      img[i * 4 + 1] = (unsigned char)(adjPx._g * 255);
-      img[i * 4 + 2] = (unsigned char)(adjPx._b * 255);
-    }
-  }
+    vector<AdjustmentStep> baked;
 
-  inline void Compositor::photoFilterAdjust(Image * adjLayer, map<string, float> adj)
-  {
-    // so photoshop does some weird stuff here and I don't actually have any idea how
-    // it manages to add color by "simulating a color filter" for certain colors
-    // someone should explain to me how/why it actually adds things to specific colors but for now
-    // we'll do the simple version
-    vector<unsigned char>& img = adjLayer->getData();
+    for (int i = 0; i < steps.size();) {
+      int end = i;
+      while (end < steps.size() && isPerChannel(steps[end]))
+        end++;
 
-    float d = adj["density"];
-    float r = adj["r"];
-    float g = adj["g"];
-    float b = adj["b"];
-    float pl = adj["preserveLuma"];
+      // a lone invert is cheaper to compute than to look up
+      if (end == i || (end - i == 1 && steps[i]._type == AdjustmentType::INVERT)) {
+        baked.push_back(steps[i]);
+        i = (end == i) ? i + 1 : end;
+        continue;
+      }
+
+      // sample the exact path over [0, 1]. Every channel sees the same input so one pass fills all three
+      shared_ptr<ChannelTable> t = shared_ptr<ChannelTable>(new ChannelTable());
+      t->_run.assign(steps.begin() + i, steps.begin() + end);
+      t->_values.resize(ChannelTableSize * 3);
+      t->_exact.assign(ChannelTableSize * 3, 0);
+
+      for (int k = 0; k < ChannelTableSize; k++) {
+        float v = k / (float)(ChannelTableSize - 1);
+        RGBAColor px;
+        px._r = v;
+        px._g = v;
+        px._b = v;
+        px._a = 1;
+        adjustPixel(px, t->_run, l);
+
+        t->_values[k] = px._r;
+        t->_values[ChannelTableSize + k] = px._g;
+        t->_values[ChannelTableSize * 2 + k] = px._b;
+      }
+
+      // probe inside each bin and flag the ones where the straight line misses the curve
+      for (int k = 0; k < ChannelTableSize - 1; k++) {
+        for (float f : probes) {
+          float v = (k + f) / (ChannelTableSize - 1);
+          RGBAColor px;
+          px._r = v;
+          px._g = v;
+          px._b = v;
+          px._a = 1;
+          adjustPixel(px, t->_run, l);
+
+          float exact[3] = { px._r, px._g, px._b };
+          for (int c = 0; c < 3; c++) {
+            const float* values = t->_values.data() + ChannelTableSize * c;
+            float lerp = values[k] + (values[k + 1] - values[k]) * f;
+            if (abs(lerp - exact[c]) > tolerance)
+              t->_exact[ChannelTableSize * c + k] = 1;
+          }
+        }
+      }
 
-    for (int i = 0; i < img.size() / 4; i++) {
-      RGBAColor adjPx = adjLayer->getPixel(i);
-      photoFilterAdjust(adjPx, d, r, g, b, pl);
+      AdjustmentStep table;
+      table._type = steps[i]._type;
+      table._baked = true;
+      table._table = t;
 
-      img[i * 4] = (unsigned char)(adjPx._r * 255);
-      img[i * 4 + 1] = (unsigned char)(adjPx._g * 255);
-      img[i * 4 + 2] = (unsigned char)(adjPx._b * 255);
+      baked.push_back(table);
+      i = end;
     }
-  }
 
-  inline void Compositor::colorizeAdjust(Image * adjLayer, map<string, float> adj)
-  {
-    // identical to color layer blend mode, assuming a solid color input layer
-    vector<unsigned char>& img = adjLayer->getData();
-    float sr = adj["r"];
-    float sg = adj["g"];
-    float sb = adj["b"];
-    float a = adj["a"];
+    lock_guard<mutex> lock(_channelTableLock);
 
-    for (int i = 0; i < img.size() / 4; i++) {
-      RGBAColor adjPx = adjLayer->getPixel(i);
-      colorizeAdjust(adjPx, sr, sg, sb, a);
+    // same reasoning as the color cube cache, slider drags shouldn't pile up tables
+    if (_channelTableCache.size() >= 64)
+      _channelTableCache.clear();
 
-      img[i * 4] = (unsigned char)(adjPx._r * 255);
-      img[i * 4 + 1] = (unsigned char)(adjPx._g * 255);
-      img[i * 4 + 2] = (unsigned char)(adjPx._b * 255);
+    // a colliding layer replaces the entry
+    _channelTableCache[key] = make_pair(l.getSettings(), baked);
+    return baked;
+  }
+
+  bool Compositor::isPerChannel(AdjustmentStep & step)
+  {
+    switch (step._type) {
+    case AdjustmentType::LEVELS:
+    case AdjustmentType::CURVES:
+    case AdjustmentType::EXPOSURE:
+    case AdjustmentType::INVERT:
+    case AdjustmentType::BRIGHTNESS:
+      return true;
+    case AdjustmentType::COLOR_BALANCE:
+      // preserve luma mixes the channels through HSL
+      return step._params[9] <= 0;
+    default:
+      return false;
     }
   }
 
-  inline void Compositor::lighterColorizeAdjust(Image * adjLayer, map<string, float> adj)
+  // linearly interpolated lookup into one channel of a baked table. Returns false if v lands in a
+  // bin that has to be evaluated exactly
+  static inline bool channelLookup(const float* values, const unsigned char* exact, float v, float& out)
   {
-    // identical to lighter color layer blend mode, assuming a solid color input layer
-    // I'm fairly sure this is literally just max(dest.L, src.L)
-    vector<unsigned char>& img = adjLayer->getData();
+    float f = v * (ChannelTableSize - 1);
 
-    float sr = adj["r"];
-    float sg = adj["g"];
-    float sb = adj["b"];
-    float a = adj["a"];
+    if (f <= 0) {
+      out = values[0];
+      return true;
+    }
+    if (f >= ChannelTableSize - 1) {
+      out = values[ChannelTableSize - 1];
+      return true;
+    }
 
-    for (int i = 0; i < img.size() / 4; i++) {
-      RGBAColor adjPx = adjLayer->getPixel(i);
-      lighterColorizeAdjust(adjPx, sr, sg, sb, a);
+    int k = (int)f;
+    if (exact[k])
+      return false;
 
-      img[i * 4] = (unsigned char)(adjPx._r * 255);
-      img[i * 4 + 1] = (unsigned char)(adjPx._g * 255);
-      img[i * 4 + 2] = (unsigned char)(adjPx._b * 255);
-    }
+    float t = f - k;
+    out = values[k] + (values[k + 1] - values[k]) * t;
+    return true;
   }
 
-  inline void Compositor::overwriteColorAdjust(Image * adjLayer, map<string, float> adj)
+  inline void Compositor::adjustPixel(RGBAColor & px, vector<AdjustmentStep>& steps, Layer & l)
   {
-    vector<unsigned char>& img = adjLayer->getData();
-    float sr = adj["r"];
-    float sg = adj["g"];
-    float sb = adj["b"];
-    float a = adj["a"];
+    for (auto& step : steps) {
+      float* p = step._params;
 
-    for (int i = 0; i < img.size() / 4; i++) {
-      RGBAColor adjPx = adjLayer->getPixel(i);
-      overwriteColorAdjust(adjPx, sr, sg, sb, a);
+      if (step._cube != nullptr) {
+        cubeLookup(px, step._cube->data(), step._cubeSize);
+        continue;
+      }
 
-      img[i * 4] = (unsigned char)(adjPx._r * 255);
-      img[i * 4 + 1] = (unsigned char)(adjPx._g * 255);
-      img[i * 4 + 2] = (unsigned char)(adjPx._b * 255);
-    }
-  }
+      if (step._baked) {
+        ChannelTable& t = *step._table;
+        const float* values = t._values.data();
+        const unsigned char* exact = t._exact.data();
+        float r, g, b;
 
-  inline void Compositor::invertAdjust(Image * adjLayer)
-  {
-    vector<unsigned char>& img = adjLayer->getData();
+        if (channelLookup(values, exact, px._r, r) &&
+          channelLookup(values + ChannelTableSize, exact + ChannelTableSize, px._g, g) &&
+          channelLookup(values + ChannelTableSize * 2, exact + ChannelTableSize * 2, px._b, b)) {
+          px._r = r;
+          px._g = g;
+          px._b = b;
+        }
+        else {
+          adjustPixel(px, t._run, l);
+        }
+        continue;
+      }
 
-    for (int i = 0; i < img.size() / 4; i++) {
-      RGBAColor adjPx = adjLayer->getPixel(i);
-      invertAdjustT<float>(adjPx);
+      switch (step._type) {
+      case AdjustmentType::HSL:
+        hslAdjust(px, p[0], p[1], p[2]);
+        break;
+      case AdjustmentType::LEVELS:
+        levelsAdjust(px, p[0], p[1], p[2], p[3], p[4]);
+        break;
+      case AdjustmentType::CURVES:
+        curvesAdjust(px, step._adj, l);
+        break;
+      case AdjustmentType::EXPOSURE:
+        exposureAdjust(px, p[0], p[1], p[2]);
+        break;
+      case AdjustmentType::GRADIENT:
+        gradientMap(px, step._adj, l);
+        break;
+      case AdjustmentType::SELECTIVE_COLOR:
+        selectiveColor<float>(px, step._selectiveColor, p[0] > 0);
+        break;
+      case AdjustmentType::COLOR_BALANCE:
+        colorBalanceAdjust(px, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], p[9]);
+        break;
+      case AdjustmentType::PHOTO_FILTER:
+        photoFilterAdjust(px, p[0], p[1], p[2], p[3], p[4]);
+        break;
+      case AdjustmentType::COLORIZE:
+        colorizeAdjust(px, p[0], p[1], p[2], p[3]);
+        break;
+      case AdjustmentType::LIGHTER_COLORIZE:
+        lighterColorizeAdjust(px, p[0], p[1], p[2], p[3]);
+        break;
+      case AdjustmentType::OVERWRITE_COLOR:
+        overwriteColorAdjust(px, p[0], p[1], p[2], p[3]);
+        break;
+      case AdjustmentType::INVERT:
+        invertAdjustT<float>(px);
+        break;
+      case AdjustmentType::BRIGHTNESS:
+        brightnessAdjust(px, step._adj);
+        break;
+      default:
+        break;
+      }
 
-      img[i * 4] = (unsigned char)(adjPx._r * 255);
-      img[i * 4 + 1] = (unsigned char)(adjPx._g * 255);
-      img[i * 4 + 2] = (unsigned char)(adjPx._b * 255);
+      // clamp between steps so the result matches running each adjustment as its own pass
+      px._r = clamp(px._r, 0.0f, 1.0f);
+      px._g = clamp(px._g, 0.0f, 1.0f);
+      px._b = clamp(px._b, 0.0f, 1.0f);
     }
   }
 
-  inline void Compositor::brightnessAdjust(Image * adjLayer, map<string, float> adj)
+  void Compositor::parallelFor(int count, int threads, int grain, function<void(int, int)> f)
   {
-    vector<unsigned char>& img = adjLayer->getData();
-
-    for (int i = 0; i < img.size() / 4; i++) {
-      RGBAColor adjPx = adjLayer->getPixel(i);
-      brightnessAdjust(adjPx, adj);
-
-      img[i * 4] = (unsigned char)(adjPx._r * 255);
-      img[i * 4 + 1] = (unsigned char)(adjPx._g * 255);
-      img[i * 4 + 2] = (unsigned char)(adjPx._b * 255);
-    }
+    _pool.parallelFor(count, threads, grain, f);
   }
 
   vector<double> Compositor::contextToVector(Context c, nlohmann::json& key)
@@ -3447,6 +5352,11 @@ namespace Comp {
 
     input >> data;
 
+    return contextFromDarkroom(data, file);
+  }
+
+  Context Compositor::contextFromDarkroom(nlohmann::json& data, string file)
+  {
     if (data.count("layers") == 0) {
       // this is not a darkroom file, return
       getLogger()->log(file + " is not a Darkroom file", LogLevel::ERR);
@@ -10,10 +10,16 @@ author: Evan Shimizu
 #include <functional>
 #include <algorithm>
 #include <thread>
+#include <atomic>
+#include <mutex>
 #include <set>
 #include <random>
+#include <chrono>
 
 #include "Image.h"
+#include "ImageCache.h"
+#include "LayerCacheFile.h"
+#include "ThreadPool.h"
 #include "Layer.h"
 #include "util.h"
 #include "ConstraintData.h"
@@ -26,6 +32,10 @@ using namespace std;
 namespace Comp {
   typedef function<void(Image*, Context, map<string, float>, map<string, string>)> searchCallback;
 
+  // called from a search thread once every search thread has returned, whether the search was
+  // stopped or ended on its own
+  typedef function<void()> searchDoneCallback;
+
   enum SearchMode {
     SEARCH_DEBUG,          // returns the same image at intervals for testing app functionality
     RANDOM,         // randomly adjusts the available parameters to do things
@@ -71,6 +81,151 @@ namespace Comp {
     int _width;
   };
 
+  // number of entries per channel in a baked per-channel adjustment table
+  const int ChannelTableSize = 4096;
+
+  struct ChannelTable;
+
+  // One step of a layer's adjustment list with its settings pulled out of the layer ahead of time.
+  // The values in _params depend on the type, see Compositor::compileAdjustments.
+  struct AdjustmentStep {
+    AdjustmentType _type;
+    float _params[10];
+
+    // if true, this step replaces a run of per-channel adjustments and looks values up in _table.
+    // _type is unused
+    bool _baked;
+    shared_ptr<ChannelTable> _table;
+
+    // if set, this step replaces the entire adjustment list with a _cubeSize^3 color cube,
+    // see Compositor::setColorCubeSize. _type is unused
+    shared_ptr<vector<float> > _cube;
+    int _cubeSize;
+
+    // raw settings, for the adjustments that still look values up by name (curves, brightness)
+    map<string, float> _adj;
+
+    // selective color table, already rescaled to [-1, 1]
+    map<string, map<string, float> > _selectiveColor;
+  };
+
+  // A run of per-channel adjustments sampled at ChannelTableSize evenly spaced points, see
+  // Compositor::bakeChannelTables. Where the run is too steep for linear interpolation (levels
+  // gamma near 0, right above levels inMin, steep curve points) the bin is flagged and pixels
+  // that land in it run the original steps instead.
+  struct ChannelTable {
+    // red, green, then blue, ChannelTableSize entries each
+    vector<float> _values;
+
+    // non-zero if values in [k, k + 1) / (ChannelTableSize - 1) need the exact path. Same layout as _values
+    vector<unsigned char> _exact;
+
+    // the steps the table was sampled from
+    vector<AdjustmentStep> _run;
+  };
+
+  // Everything the blend kernels need to composite one layer, resolved once per layer
+  struct LayerBlendState {
+    float* _compPx;
+    float* _layerPx;
+    const unsigned char* _maskPx;
+    int _width;
+    int _height;
+
+    // columns of the composite the layer can reach, see Compositor::getLayerExtent
+    int _xStart;
+    int _xEnd;
+
+    // layer pixel offset, see Compositor::pixelOffset
+    int _offsetX;
+    int _offsetY;
+
+    // layer opacity including group and precomp modifiers
+    float _opacity;
+
+    // conditional blend settings, in the order
+    // srcBlackMin, srcBlackMax, srcWhiteMin, srcWhiteMax, destBlackMin, destBlackMax, destWhiteMin, destWhiteMax
+    bool _conditionalBlend;
+    string _cbChannel;
+    float _cb[8];
+
+    RenderLayerMap* _renderMap;
+
+    // render map id of the layer being blended
+    uint16_t _layerId;
+
+    // precomp layers copy their own render map into the composite instead.
+    // _srcIds translates ids in the precomp's map to ids in _renderMap
+    RenderLayerMap* _srcRenderMap;
+    vector<uint16_t> _srcIds;
+  };
+
+  // Samples of a sparse pixel render (see Compositor::renderPixels). Channels are stored in separate
+  // arrays, sample (context k, pixel i) is at k * _pixels + i. Colors are unpremultiplied.
+  struct PixelBatch {
+    PixelBatch(int contexts, int pixels) : _contexts(contexts), _pixels(pixels),
+      _r(contexts * pixels, 1), _g(contexts * pixels, 1), _b(contexts * pixels, 1), _a(contexts * pixels, 0) { }
+
+    int _contexts;
+    int _pixels;
+    vector<float> _r;
+    vector<float> _g;
+    vector<float> _b;
+    vector<float> _a;
+
+    inline RGBAColor get(int s) {
+      RGBAColor c;
+      c._r = _r[s];
+      c._g = _g[s];
+      c._b = _b[s];
+      c._a = _a[s];
+      return c;
+    }
+
+    inline void set(int s, RGBAColor& c) {
+      _r[s] = c._r;
+      _g[s] = c._g;
+      _b[s] = c._b;
+      _a[s] = c._a;
+    }
+  };
+
+  // Result of the last top level render at one cache size. _prefix[i] is the hash of the
+  // state of layers 0 through i of the layer order. _snapshot holds the composite after
+  // layer _index, which is valid as long as _prefix[_index] still matches.
+  struct PrefixCacheEntry {
+    vector<size_t> _prefix;
+    int _index;
+    shared_ptr<FloatImage> _snapshot;
+  };
+
+  // Structural part of rendering one layer: which groups apply to it and which of those
+  // have effects. This only changes when groups are edited, so it's resolved once when a
+  // RenderPlan is compiled instead of scanning every group on every render.
+  struct PlanStep {
+    string _id;
+
+    // groups that affect the layer, in group order
+    vector<string> _groups;
+
+    // groups in _groups with a stroke effect
+    vector<string> _strokes;
+
+    // true if any group in _groups has an effect
+    bool _groupEffects;
+  };
+
+  // A layer order compiled against the compositor's groups. Per layer settings (visibility,
+  // opacity, mode, offsets, adjustments) still come from the Context at render time, so
+  // parameter edits don't need a new plan. Precomp layers use the plan for their own order.
+  struct RenderPlan {
+    vector<string> _order;
+    vector<PlanStep> _steps;
+
+    // steps for the group layers referenced by _steps. Only used for their strokes
+    map<string, PlanStep> _groups;
+  };
+
   struct Group {
     string _name;
     bool _readOnly;   // read only groups are in the inherent photoshop strucutre and cannot be removed right now
@@ -79,6 +234,16 @@ namespace Comp {
     ImageEffect _effect;
   };
 
+  // Timing of a Darkroom file load, see Compositor::loadDarkroom. Times are in milliseconds.
+  struct LoadStats {
+    int _layers;
+    int _threads;
+    double _parseTime;    // reading and parsing the json
+    double _decodeTime;   // decoding and analyzing every layer image
+    double _contextTime;  // building the layers and the primary context from the parsed file
+    double _totalTime;
+  };
+
   // the compositor for now assumes that every layer it contains have the same dimensions.
   // having unequal layer sizes will likely lead to crashes or other undefined behavior
   class Compositor {
@@ -87,6 +252,15 @@ namespace Comp {
     Compositor(string filename, string imageDir);
     ~Compositor();
 
+    // loads a Darkroom file into an empty compositor. Layer images are decoded and analyzed in parallel
+    // on the given number of threads (0 uses one per core). If given, progress is called as
+    // (layers decoded, total layers, layer name) after each image, one call at a time, from the loading threads.
+    // Returns false if the file can't be loaded.
+    bool loadDarkroom(string filename, string imageDir, int threads = 0, function<void(int, int, string)> progress = nullptr);
+
+    // timing of the last loadDarkroom call
+    LoadStats getLoadStats();
+
     // adds a layer, true on success, false if layer already exists
     bool addLayer(string name, string file);
     bool addLayer(string name, Image& img);
@@ -149,13 +323,63 @@ namespace Comp {
     // since the render functions do hit the js interface, images are allocated and 
     // memory is explicity handled to prevent scope issues
     // The render functions should be used for GUI render calls.
-    Image* render(string size = "");
+    // threads controls how many workers the blend and adjustment passes are split across.
+    // Output is identical for any thread count.
+    Image* render(string size = "", int threads = 1);
 
     // wrapper for old render calls
-    Image* render(Context& c, string size = "");
+    Image* render(Context& c, string size = "", int threads = 1);
 
     // render with a given context
-    Image* render(Context& c, Image* comp, vector<string> order, float co, string size = "");
+    Image* render(Context& c, Image* comp, vector<string> order, float co, string size = "", int threads = 1);
+
+    // full renders for interactive use (the node render and asyncRender calls). These resume from
+    // the cached composite below the first layer that changed since the last cached render, see
+    // renderFloatCached. Search, importance map and goal renders use render and skip the cache,
+    // so they don't evict the interactive snapshot.
+    Image* renderCached(string size = "", int threads = 1);
+    Image* renderCached(Context& c, string size = "", int threads = 1);
+
+    // render into the floating point working buffer. render() calls this and converts the result.
+    // Use this when the result feeds into more compositing to avoid the 8-bit round trip.
+    // A non-zero generation (see newRenderGeneration) stops the render between layers once it's
+    // superseded. The partial result is returned, check renderCancelled before using it.
+    FloatImage* renderFloat(Context& c, FloatImage* comp, vector<string> order, float co, string size = "", int threads = 1,
+      unsigned int generation = 0);
+
+    // Render generations let newer renders supersede older ones. Each call to newRenderGeneration
+    // returns a new token, and renders started with an older token stop at the next layer.
+    // Generation 0 is never cancelled.
+    unsigned int newRenderGeneration();
+    bool renderCancelled(unsigned int generation);
+
+    // Renders the context at increasing sizes, ending with the given one. The cache sizes smaller
+    // than the target go first, smallest first, so a preview is available quickly.
+    // callback(img, size) is called after each level and owns img.
+    // Returns false if the generation was superseded before the last level finished.
+    bool renderProgressive(Context& c, string size, unsigned int generation, function<void(Image*, string)> callback, int threads = 1);
+
+    // renders the rectangle [x, x + w) x [y, y + h) of the canvas at the given size into a w x h image.
+    // Layers are cropped to the rectangle before they're adjusted and blended, so the cost follows
+    // the area of the rectangle instead of the canvas. Parts outside the canvas are transparent.
+    Image* renderRegion(Context& c, int x, int y, int w, int h, string size = "", int threads = 1);
+
+    // Adjustment lists that mix channels (hsl, selective color, gradient map, color balance with
+    // preserve luma, ...) can be baked into a size^3 color cube that is sampled with tetrahedral
+    // interpolation instead of running each adjustment per pixel. 0 (the default) turns this off.
+    // 33 is usually close enough to be invisible in 8-bit output, see colorCubeReport.
+    void setColorCubeSize(int size);
+    int getColorCubeSize();
+
+    // compares the color cube for the layer's adjustments against the per-pixel path on random colors.
+    // Returns maxError and meanError (per channel, [0, 1] scale), buildMs for the cube, and
+    // exactNsPerPx / cubeNsPerPx timings
+    map<string, double> colorCubeReport(Layer& l, int size = 33, int samples = 100000);
+
+    // drops the cached partial composite used by renderCached. The cache checks layer settings on its
+    // own, call this when image data changes outside of the compositor or to free the snapshot
+    // (16 bytes per pixel of the last size rendered).
+    void clearRenderCache();
 
     // renders the composition up to and including the specified layer.
     // additionally, the pixels unaffected by the given layer are dimmed by a maximum specified amount
@@ -181,6 +405,20 @@ namespace Comp {
 
     inline Utils<float>::RGBAColorT renderPixel(Context& c, typename Utils<float>::RGBAColorT* compPx, vector<string> order, int i, float co, string size = "");
 
+    // Renders the pixels (x[i], y[i]) for every context in one pass. Meant for the optimizers,
+    // which render the same few pixels for many variations of one context. Groups are resolved
+    // and adjustments compiled once per layer and context instead of once per pixel.
+    // Returns renderPixel style colors indexed as [context][pixel].
+    vector<vector<RGBAColor> > renderPixels(vector<Context*>& contexts, const vector<int>& x, const vector<int>& y, string size = "");
+
+    // Renders the pixels (x[i], y[i]) with the opacity of the given layer set to each of the values,
+    // everything else as in the context. Returns renderPixels style colors indexed as [value][pixel].
+    // For blend modes where the blended result is affine in the layer's alpha, the layers below and
+    // the layer itself are rendered once and the curve is interpolated from the opacity 0 and 1
+    // results, so only the layers above get rendered per value. Other layers fall back to renderPixels.
+    vector<vector<RGBAColor> > opacityResponse(Context& c, string layer, const vector<float>& values,
+      const vector<int>& x, const vector<int>& y, string size = "");
+
     // render directly to a string with the primary context
     string renderToBase64();
 
@@ -197,9 +435,23 @@ namespace Comp {
     bool deleteCacheSize(string name);
     shared_ptr<Image> getCachedImage(string id, string size);
 
+    // memory limit in bytes for the scaled copies of layer images, 0 for no limit. Masks get a limit
+    // of the same size. Least recently used copies are dropped when over the limit and rebuilt when needed again.
+    void setCacheMemoryBudget(size_t bytes);
+    size_t getCacheMemoryBudget();
+    size_t getCacheMemoryUsage();
+
+    // Layer cache files hold already decoded layer and mask images at every cache size (see LayerCacheFile).
+    // While one is open, layers and masks loaded from png use its copy instead when the png hasn't changed.
+    bool openLayerCache(string file);
+    void closeLayerCache();
+
+    // writes every layer and mask that was loaded from a png to a layer cache file, at every cache size
+    bool saveLayerCache(string file);
+
     // main entry point for starting the search process.
     void startSearch(searchCallback cb, SearchMode mode, map<string, float> settings,
-      int threads = 1, string searchRenderSize = "");
+      int threads = 1, string searchRenderSize = "", searchDoneCallback done = nullptr);
     void stopSearch();
     void runSearch();
 
@@ -251,6 +503,7 @@ namespace Comp {
 
     // takes a darkroom file and loads it, returning a context
     Context contextFromDarkroom(string file);
+    Context contextFromDarkroom(nlohmann::json& data, string file);
 
     // computes the regional importance for the rectangle specified by x, y, w, h
     // and returns the results in names and scores
@@ -265,8 +518,9 @@ namespace Comp {
     // Compositor's cache. It also returns the resulting image.
     shared_ptr<ImportanceMap> computeImportanceMap(string layer, ImportanceMapMode mode, Context& current);
 
-    // given a mode, compute all the importance maps for a particular mode
-    void computeAllImportanceMaps(ImportanceMapMode mode, Context& current);
+    // given a mode, compute all the importance maps for a particular mode.
+    // The visibility delta modes share one pass over the layer order, split across threads by layer.
+    void computeAllImportanceMaps(ImportanceMapMode mode, Context& current, int threads = 1);
 
     // importance map cache manipulation
     shared_ptr<ImportanceMap> getImportanceMap(string layer, ImportanceMapMode mode);
@@ -360,12 +614,24 @@ namespace Comp {
     void addLayerMask(string name);
 
     int indexedOffset(float x, float y, string size);
+
+    // whole pixel offset for a layer translation (a fraction of the canvas size). Every render path
+    // reads layer pixel (x + dx, y + dy) for output pixel (x, y) with dx, dy from here, so full, region
+    // and sparse pixel renders agree on which pixel a translated layer lands on.
+    static inline int pixelOffset(float offset, int size) { return (int)floor(offset * size); }
     int applyIndexedOffset(int i, float dx, float dy, string size);
 
-    // stores standard scales of the image in the cache
-    // standard sizes are: thumb - 15%, small - 25%, medium - 50%
+    // prepares an image added from memory for the cache by finding its alpha bounds. Images loaded from
+    // png or the layer cache already have them. Scaled copies are made by _imageData on first use
+    // standard sizes are: micro - 5%, thumb - 15%, small - 25%, medium - 50%
     void cacheScaled(string name);
 
+    // loads a png, using the open layer cache's copy if it has one. Safe to call from multiple threads
+    shared_ptr<Image> loadImage(const string& file);
+
+    // copies the scaled versions of file from the open layer cache into cache, for sizes with matching scales
+    void loadCachedSizes(ImageCache& cache, const string& name, const string& file);
+
     float finiteDifference(Image* a, Image* b, float delta);
 
     // this returns the numerical derivative for each of the parameters in currentVals
@@ -377,16 +643,38 @@ namespace Comp {
     // search modes
     void randomSearch(Context start);
 
-    // parent thread for the exploratory search. Right now it's single threaded with
-    // no option to change, may adjust in the future.
+    // parent thread for the exploratory search. Candidates are rendered on _expSearchThreads threads
+    // and accepted on this one.
     void exploratorySearch();
 
+    // called by each search thread as it returns
+    void searchThreadDone();
+
     // subroutine for the exploratory search
-    void expStructSearch(ExpSearchSet& activeSet);
+    void expStructSearch(ExpSearchSet& activeSet, vector<mt19937>& gens);
+
+    // Runs exploratory search rounds until maxFailures samples in a row fail to make it into the set.
+    // Each round, every slot (one per entry in gens) mutates a copy of cv with its own random stream,
+    // then renders it, all in parallel. The candidates are then checked with isGood and add in slot order
+    // on the calling thread, so acceptance works the same as one candidate at a time.
+    // mutate(vector, rng, crossover pool, log) changes the vector. The pool is the initial config
+    // followed by the active set as of the start of the round.
+    void expSearchRounds(ExpSearchSet& activeSet, nlohmann::json& key, vector<double>& cv, vector<mt19937>& gens,
+      bool structural, function<void(vector<double>&, mt19937&, const vector<vector<double>>&, stringstream&)> mutate);
+
+    // first stage of the search cascade. Renders ctx at micro size and runs screen's quality checks on it.
+    // Returns true if the candidate should be rendered at the search size (always true if the cascade is off)
+    bool cascadeScreen(ExpSearchSet& screen, Context& ctx, const vector<double>& ctxVec);
+
+    // candidates per second and per stage rejection rates for the running search
+    map<string, float> searchStatsMetadata();
 
     inline float premult(unsigned char px, float a);
     inline unsigned char cvt(float px, float a);
 
+    // FloatImage version of cvt. Clamps the unpremultiplied value and returns it premultiplied by a
+    inline float cvtPremult(float px, float a);
+
     template <typename T>
     inline T cvtT(T px, T a);
     
@@ -438,21 +726,118 @@ namespace Comp {
     template <typename T>
     inline T vividLight(T Dc, T Sc, T Da, T Sa);
 
-    void adjust(Image* adjLayer, Layer& l);
+    typedef void (Compositor::*BlendRowsFunc)(LayerBlendState&, int, int);
+
+    // returns the blend kernel for the given mode
+    BlendRowsFunc getBlendRowsFunc(BlendMode mode);
+
+    // blends rows [yStart, yEnd) of a layer into the composite. The mode is a template
+    // parameter so it gets picked once per layer instead of tested for every pixel.
+    template <BlendMode mode>
+    void blendRows(LayerBlendState& s, int yStart, int yEnd);
+
+    // blendRows for four pixels, composite pixel o onward and layer pixel i onward, with SSE.
+    // Only defined when SSE is available
+    template <BlendMode mode>
+    inline void blendQuad(LayerBlendState& s, int o, int i);
+
+    void adjust(Image* adjLayer, Layer& l, int threads = 1);
+    void adjust(FloatImage* adjLayer, Layer& l, int threads = 1);
+
+    // adjust with the list of stroke groups already resolved (see PlanStep::_strokes)
+    void adjust(FloatImage* adjLayer, Layer& l, const vector<string>& strokes, int threads = 1);
+
+    // returns the compiled plan for the given order, compiling it if needed.
+    // Plans are dropped whenever layers or groups change structurally (see clearRenderPlans).
+    shared_ptr<RenderPlan> getRenderPlan(const vector<string>& order);
+    shared_ptr<RenderPlan> compileRenderPlan(const vector<string>& order);
+    PlanStep compilePlanStep(const string& id);
+
+    // drops compiled render plans. Called by everything that changes the layer order or groups
+    void clearRenderPlans();
+
+    // splits [0, count) into chunks of at most grain items and runs f(start, end) on each
+    // across the given number of threads, using the compositor's worker pool. Chunks are pulled
+    // from a shared counter so threads that finish early pick up remaining work.
+    // threads <= 1 runs f inline.
+    void parallelFor(int count, int threads, int grain, function<void(int, int)> f);
+
+    // renderFloat for a region of the canvas. comp (if given) is the w x h composite of the region
+    // starting at canvas pixel (x, y). see renderRegion
+    FloatImage* renderRegionFloat(Context& c, FloatImage* comp, const vector<string>& order, float co, string size,
+      int x, int y, int w, int h, int threads);
+
+    // full layer stack render that resumes from the cached composite of the longest
+    // unchanged prefix of the layer order. Only the last size rendered is kept
+    FloatImage* renderFloatCached(Context& c, string size, int threads, unsigned int generation);
+
+    // computes VISIBILITY_DELTA or SPEC_VISIBILITY_DELTA maps for every layer in the layer order.
+    // Each worker keeps a running composite of the layers below the one it's on, so a layer's
+    // toggled render only has to blend the layers from it upwards.
+    void computeDeltaImportanceMaps(ImportanceMapMode mode, Context& current, int threads);
+
+    // changes the layer in the context to the state the visibility delta importance maps compare against
+    void toggleForImportance(Context& c, string layer, ImportanceMapMode mode);
+
+    // pixel rectangle [x0, x1) x [y0, y1) of a render at the given size that the layer can change,
+    // based on the cached alpha bounds of the layer image and mask.
+    // Returns false if the layer can't change any pixel (fully transparent).
+    bool getLayerExtent(Context& c, string id, string size, int& x0, int& y0, int& x1, int& y1);
+    bool getLayerExtent(Context& c, const PlanStep& step, string size, int& x0, int& y0, int& x1, int& y1);
+
+    // hash of everything that affects how the layer renders: its own settings, the groups
+    // applied to it, precomp contents and the image data used at the given size
+    size_t layerStateHash(Context& c, string id, string size);
+
+    // fills a single context batch with the composite that context k of a pixel render starts from,
+    // at the given pixels. Offset adjustment layers read the composite below them at the shifted position,
+    // which usually isn't one of the rendered pixels
+    typedef function<void(int k, PixelBatch& out, const vector<int>& x, const vector<int>& y)> PixelBase;
+
+    // renders order into the batch, see renderPixels. co is the opacity modifier for each context,
+    // base gives the starting composite at arbitrary pixels (transparent if empty)
+    void renderPixels(vector<Context*>& contexts, PixelBatch& comp, const vector<int>& x, const vector<int>& y,
+      const vector<string>& order, const vector<float>& co, const string& size, const PixelBase& base = PixelBase());
+
+    // true if opacityResponse can interpolate the given layer's opacity
+    bool isOpacityAffine(Context& c, string layer);
+
+    // blends one unpremultiplied layer pixel with alpha ab into comp
+    inline void blendPixel(BlendMode mode, RGBAColor& comp, RGBAColor& layer, float ab);
 
     // adjusts a single pixel according to the given adjustment layer
     template <typename T>
     inline typename Utils<T>::RGBAColorT adjustPixel(typename Utils<T>::RGBAColorT comp, Layer& l);
 
-    // HSL
-    inline void hslAdjust(Image* adjLayer, map<string, float> adj);
+    // flattens the layer's adjustment list into steps that can be run per pixel without
+    // touching the layer's settings maps
+    // cubeSize -1 uses the compositor's color cube setting, 0 never bakes a cube.
+    vector<AdjustmentStep> compileAdjustments(Layer& l, int cubeSize = -1);
+
+    // replaces runs of adjustments that work on each channel independently (levels, curves,
+    // exposure, invert, brightness, color balance without preserve luma) with one table lookup.
+    // Results are cached by the layer's adjustment hash, so every render size and the sparse
+    // pixel renderer use the same tables
+    vector<AdjustmentStep> bakeChannelTables(vector<AdjustmentStep>& steps, Layer& l);
+
+    // true if the step's output channel only depends on the same input channel
+    bool isPerChannel(AdjustmentStep& step);
 
+    // returns the color cube for the given compiled steps, from the cache if the layer's
+    // adjustments have been baked at this size before
+    shared_ptr<vector<float> > getColorCube(vector<AdjustmentStep>& steps, Layer& l, int size);
+
+    // tetrahedral interpolation into a color cube
+    inline void cubeLookup(RGBAColor& px, const float* cube, int size);
+
+    // runs every compiled step on a single pixel. Channels are clamped to [0, 1] after each step.
+    inline void adjustPixel(RGBAColor& px, vector<AdjustmentStep>& steps, Layer& l);
+
+    // HSL
     template <typename T>
     inline void hslAdjust(typename Utils<T>::RGBAColorT& adjPx, T h, T s, T l);
 
     // Levels
-    inline void levelsAdjust(Image* adjLayer, map<string, float> adj);
-
     template <typename T>
     inline void levelsAdjust(typename Utils<T>::RGBAColorT& adjPx, T inMin, T inMax, T gamma, T outMin, T outMax);
 
@@ -460,26 +845,18 @@ namespace Comp {
     inline T levels(T px, T inMin, T inMax, T gamma, T outMin, T outMax);
 
     // Curves
-    inline void curvesAdjust(Image* adjLayer, map<string, float> adj, Layer& l);
-
     template <typename T>
     inline void curvesAdjust(typename Utils<T>::RGBAColorT& adjPx, map<string, T>& adj, Layer& l);
 
     // Exposure
-    inline void exposureAdjust(Image* adjLayer, map<string, float> adj);
-
     template <typename T>
     inline void exposureAdjust(typename Utils<T>::RGBAColorT& adjPx, T exposure, T offset, T gamma);
 
     // Gradient Map
-    inline void gradientMap(Image* adjLayer, map<string, float> adj, Layer& l);
-
     template <typename T>
     inline void gradientMap(typename Utils<T>::RGBAColorT& adjPx, map<string, T>& adj, Layer& l);
 
     // selective color
-    inline void selectiveColor(Image* adjLayer, map<string, float> adj, Layer& l);
-
     template <typename T>
     inline void selectiveColor(typename Utils<T>::RGBAColorT& adjPx, map<string, T>& adj, Layer& l);
 
@@ -488,8 +865,6 @@ namespace Comp {
     inline void selectiveColor(typename Utils<T>::RGBAColorT& adjPx, map<string, map<string, float>>& data, bool rel);
 
     // Color Balance
-    inline void colorBalanceAdjust(Image* adjLayer, map<string, float> adj);
-
     template <typename T>
     inline void colorBalanceAdjust(typename Utils<T>::RGBAColorT& adjPx, T shadowR, T shadowG, T shadowB,
       T midR, T midG, T midB, T highR, T highG, T highB, T pl);
@@ -498,38 +873,26 @@ namespace Comp {
     inline T colorBalance(T px, T shadow, T mid, T high);
 
     // Photo filter
-    inline void photoFilterAdjust(Image* adjLayer, map<string, float> adj);
-    
     template<typename T>
     inline void photoFilterAdjust(typename Utils<T>::RGBAColorT& adjPx, T d, T r, T g, T b, T pl);
 
     // Colorize
-    inline void colorizeAdjust(Image* adjLayer, map<string, float> adj);
-
     template <typename T>
     inline void colorizeAdjust(typename Utils<T>::RGBAColorT& adjPx, T sr, T sg, T sb, T a);
 
     // Lighter Colorize
-    inline void lighterColorizeAdjust(Image* adjLayer, map<string, float> adj);
-
     template <typename T>
     inline void lighterColorizeAdjust(typename Utils<T>::RGBAColorT& adjPx, T sr, T sg, T sb, T a);
 
     // Overwrite Color
-    inline void overwriteColorAdjust(Image* adjLayer, map<string, float> adj);
-
     template <typename T>
     inline void overwriteColorAdjust(typename Utils<T>::RGBAColorT& adjPx, T sr, T sg, T sb, T a);
 
     // invert
-    inline void invertAdjust(Image* adjLayer);
-
     template<typename T>
     inline void invertAdjustT(typename Utils<T>::RGBAColorT& adjPx);
 
     // brightness/contrast
-    inline void brightnessAdjust(Image* adjLayer, map<string, float> adj);
-
     template <typename T>
     inline void brightnessAdjust(typename Utils<T>::RGBAColorT& adjPx, map<string, T>& adj);
 
@@ -560,13 +923,66 @@ namespace Comp {
     map<string, set<string>> _layerTags;
 
     // cached of scaled images for rendering at different sizes
-    map<string, map<string, shared_ptr<Image>>> _imageData;
-    map<string, map<string, shared_ptr<Image>>> _layerMasks;
+    ImageCache _imageData;
+    ImageCache _layerMasks;
+
+    // png each layer and mask was loaded from. Layers set from memory or changed in place aren't listed
+    map<string, string> _layerSources;
+    map<string, string> _maskSources;
+    LayerCacheFile _layerCache;
     map<string, map<string, shared_ptr<Image>>> _precompRenderCache;
 
+    // see setColorCubeSize
+    int _colorCubeSize;
+
+    // baked color cubes keyed by layer adjustment hash and cube size, along with the settings they
+    // were baked from. Same as _channelTableCache, a hit needs the settings to match
+    map<size_t, pair<LayerSettings, shared_ptr<vector<float> > > > _colorCubeCache;
+    mutex _colorCubeLock;
+
+    // output of bakeChannelTables keyed by layer adjustment hash, along with the settings it was
+    // baked from. A hash match only counts if the settings match too (see Layer::sameAdjustments)
+    map<size_t, pair<LayerSettings, vector<AdjustmentStep> > > _channelTableCache;
+    mutex _channelTableLock;
+
+    // prefix composite cache for renderCached, keyed by size (one entry at most). see renderFloatCached
+    map<string, PrefixCacheEntry> _prefixCache;
+    mutex _prefixCacheLock;
+
+    // compiled render plans keyed by layer order. see getRenderPlan
+    map<vector<string>, shared_ptr<RenderPlan> > _renderPlans;
+    unsigned int _renderPlanVersion;
+    mutex _renderPlanLock;
+
+    // latest render generation handed out. see newRenderGeneration
+    atomic<unsigned int> _renderGeneration;
+
+    // workers for parallelFor. Kept for the life of the compositor so renders don't start threads
+    ThreadPool _pool;
+
     bool _searchRunning;
     searchCallback _activeCallback;
     vector<thread> _searchThreads;
+
+    // search threads that haven't returned yet, the last one calls _searchDoneCallback
+    atomic<int> _searchThreadsLeft;
+    searchDoneCallback _searchDoneCallback;
+
+    // number of threads exploratory search renders candidates on
+    int _expSearchThreads;
+
+    // screen candidates with a micro render before rendering them at the search size. See the cascade setting
+    bool _searchCascade;
+
+    // quality checks for screening RANDOM candidates. Exploratory search screens with its active set
+    shared_ptr<ExpSearchSet> _cascadeScreen;
+
+    // candidate counts for the running search, reported in the metadata of each result
+    atomic<int> _searchCandidates;
+    atomic<int> _searchScreenRejected;
+    atomic<int> _searchRendered;
+    atomic<int> _searchRejected;
+    chrono::high_resolution_clock::time_point _searchStart;
     string _searchRenderSize;
     SearchMode _searchMode;
 
@@ -605,6 +1021,8 @@ namespace Comp {
     // a context.
     nlohmann::json _vectorKey;
 
+    LoadStats _loadStats;
+
     // precomputed sampling patterns for various levels of detail (0 is full res)
     map<int, map<int, shared_ptr<PoissonDisk>>> _pdiskCache;
   };
@@ -1469,28 +1887,6 @@ namespace Comp {
     return alpha;
   }
 
-  inline void Compositor::levelsAdjust(Image* adjLayer, map<string, float> adj) {
-    vector<unsigned char>& img = adjLayer->getData();
-
-    // gamma is between 0 and 10 usually
-    // so sometimes these values are missing and we should use defaults.
-    float inMin = adj["inMin"];
-    float inMax = adj["inMax"];
-    float gamma = (adj["gamma"] * 10);
-    float outMin = adj["outMin"];
-    float outMax = adj["outMax"];
-
-    for (int i = 0; i < img.size() / 4; i++) {
-      RGBAColor layerPx = adjLayer->getPixel(i);
-      levelsAdjust(layerPx, inMin, inMax, gamma, outMin, outMax);
-
-      // convert to char
-      img[i * 4] = (unsigned char)(layerPx._r * 255);
-      img[i * 4 + 1] = (unsigned char)(layerPx._g * 255);
-      img[i * 4 + 2] = (unsigned char)(layerPx._b * 255);
-    }
-  }
-
   template<>
   inline typename Utils<ExpStep>::RGBAColorT Compositor::adjustPixel<ExpStep>(typename Utils<ExpStep>::RGBAColorT comp, Layer & l)
   {
@@ -1593,4 +1989,20 @@ modifyLayerBlendModes
   - Used by: RANDOM (default: 0)
   - Set to 1 to allow the random sampler to change blend modes
   - Set to 0 to disallow
+
+seed
+  - Used by: EXPLORATORY (default: random)
+  - Seed for the candidate random streams. The same seed and thread count gives the same results
+
+diversityNeighbors
+  - Used by: EXPLORATORY (default: 8)
+  - Number of accepted samples, closest by image descriptor, that a candidate is checked against
+  - Set to 0 to check every accepted sample
+
+cascade
+  - Used by: RANDOM, EXPLORATORY (default: 0)
+  - Set to 1 to render each candidate at micro size first and drop it there if it fails the
+    brightness, hue and clipping checks. Only the remaining candidates are rendered at the search size.
+    RANDOM uses the default tolerances of ExpSearchSet for the checks
+  - Results carry candidates, candidatesPerSecond, screenRejectRate, rendered and renderRejectRate metadata
 */
\ No newline at end of file
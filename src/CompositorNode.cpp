@@ -74,48 +74,6 @@ void hardware_concurrency(const Nan::FunctionCallbackInfo<v8::Value>& info)
   info.GetReturnValue().Set(Nan::New(thread::hardware_concurrency()));
 }
 
-void asyncSampleEvent(uv_work_t * req)
-{
-  // construct the proper objects and do the callback
-  Nan::HandleScope scope;
-
-  // this is in the node thread
-  asyncSampleEventData* data = static_cast<asyncSampleEventData*>(req->data);
-
-  // create objects
-  // image object
-  const int argc = 2;
-  v8::Local<v8::Value> argv[argc] = { Nan::New<v8::External>(data->img), Nan::New(true) };
-  v8::Local<v8::Function> cons = Nan::New<v8::Function>(ImageWrapper::imageConstructor);
-  v8::Local<v8::Object> imgInst = Nan::NewInstance(cons, argc, argv).ToLocalChecked();
-
-  // context object
-  const int argc2 = 1;
-  v8::Local<v8::Value> argv2[argc2] = { Nan::New<v8::External>(&(data->ctx)) };
-  v8::Local<v8::Function> cons2 = Nan::New<v8::Function>(ContextWrapper::contextConstructor);
-  v8::Local<v8::Object> ctxInst = Nan::NewInstance(cons2, argc2, argv2).ToLocalChecked();
-
-  // metadata object
-  v8::Local<v8::Object> metadata = Nan::New<v8::Object>();
-  for (auto k : data->meta) {
-    Nan::Set(metadata, Nan::New(k.first).ToLocalChecked(), Nan::New(k.second));
-  }
-
-  // string metadata
-  for (auto k : data->meta2) {
-    Nan::Set(metadata, Nan::New(k.first).ToLocalChecked(), Nan::New(k.second).ToLocalChecked());
-  }
-
-  // construct emitter objects
-  v8::Local<v8::Value> emitArgv[] = { Nan::New("sample").ToLocalChecked(), imgInst, ctxInst, metadata };
-  Nan::MakeCallback(data->c->handle(), "emit", 4, emitArgv);
-}
-
-void asyncNop(uv_work_t * req)
-{
-  // yup it does a nop
-}
-
 v8::Local<v8::Value> excGet(v8::Local<v8::Object>& obj, string key)
 {
   if (Nan::HasOwnProperty(obj, Nan::New(key).ToLocalChecked()).ToChecked()) {
@@ -126,6 +84,19 @@ v8::Local<v8::Value> excGet(v8::Local<v8::Object>& obj, string key)
   return Nan::New(NULL);
 }
 
+v8::Local<v8::Object> loadStatsToObject(const Comp::LoadStats& stats)
+{
+  v8::Local<v8::Object> ret = Nan::New<v8::Object>();
+  Nan::Set(ret, Nan::New("layers").ToLocalChecked(), Nan::New(stats._layers));
+  Nan::Set(ret, Nan::New("threads").ToLocalChecked(), Nan::New(stats._threads));
+  Nan::Set(ret, Nan::New("parseTime").ToLocalChecked(), Nan::New(stats._parseTime));
+  Nan::Set(ret, Nan::New("decodeTime").ToLocalChecked(), Nan::New(stats._decodeTime));
+  Nan::Set(ret, Nan::New("contextTime").ToLocalChecked(), Nan::New(stats._contextTime));
+  Nan::Set(ret, Nan::New("totalTime").ToLocalChecked(), Nan::New(stats._totalTime));
+
+  return ret;
+}
+
 // object bindings
 Nan::Persistent<v8::Function> ImageWrapper::imageConstructor;
 Nan::Persistent<v8::Function> ImportanceMapWrapper::importanceMapConstructor;
@@ -225,10 +196,15 @@ void ImageWrapper::getData(const Nan::FunctionCallbackInfo<v8::Value>& info) {
   ImageWrapper* image = ObjectWrap::Unwrap<ImageWrapper>(info.Holder());
   nullcheck(image->_image, "image.data");
 
-  auto data = image->_image->getData();
-  v8::Local<v8::Uint8ClampedArray> ret = v8::Uint8ClampedArray::New(v8::ArrayBuffer::New(v8::Isolate::GetCurrent(), data.size()), 0, data.size());
-  for (int i = 0; i < data.size(); i++) {
-    Nan::Set(ret, i, Nan::New(data[i]));
+  // read only, images borrowed from a layer cache file don't need their own copy for this
+  const unsigned char* data = image->_image->getPixels();
+  size_t size = image->_image->dataSize();
+  v8::Local<v8::Uint8ClampedArray> ret = v8::Uint8ClampedArray::New(v8::ArrayBuffer::New(v8::Isolate::GetCurrent(), size), 0, size);
+
+  // fill the backing store directly, setting elements one at a time through v8 is very slow
+  if (size > 0) {
+    unsigned char* dest = (unsigned char*)ret->Buffer()->GetContents().Data();
+    memcpy(dest, data, size);
   }
 
   info.GetReturnValue().Set(ret);
@@ -481,8 +457,7 @@ void ImageWrapper::writeToImageData(const Nan::FunctionCallbackInfo<v8::Value>&
   v8::Local<v8::Uint8ClampedArray> arr = Nan::Get(info[0].As<v8::Object>(), Nan::New("data").ToLocalChecked()).ToLocalChecked().As<v8::Uint8ClampedArray>();
   unsigned char *data = (unsigned char*)arr->Buffer()->GetContents().Data();
 
-  vector<unsigned char>& imData = image->_image->getData();
-  memcpy(data, &imData[0], imData.size());
+  memcpy(data, image->_image->getPixels(), image->_image->dataSize());
 
   // i don't think this needs to return anything?
 }
@@ -1103,7 +1078,7 @@ void LayerRef::getGradient(const Nan::FunctionCallbackInfo<v8::Value>& info)
 
   // construct object. 
   v8::Local<v8::Array> grad = Nan::New<v8::Array>();
-  Comp::Gradient& g = layer->_layer->getGradient();
+  const Comp::Gradient& g = layer->_layer->getGradient();
   for (int i = 0; i < g._x.size(); i++) {
     // construct object
     v8::Local<v8::Object> pt = Nan::New<v8::Object>();
@@ -1724,17 +1699,29 @@ void CompositorWrapper::Init(v8::Local<v8::Object> exports)
   Nan::SetPrototypeMethod(tpl, "setLayerOrder", setLayerOrder);
   Nan::SetPrototypeMethod(tpl, "getTopLayerOrder", getLayerNames);
   Nan::SetPrototypeMethod(tpl, "size", size);
+  Nan::SetPrototypeMethod(tpl, "asyncLoadDarkroom", asyncLoadDarkroom);
+  Nan::SetPrototypeMethod(tpl, "getLoadStats", getLoadStats);
   Nan::SetPrototypeMethod(tpl, "render", render);
   Nan::SetPrototypeMethod(tpl, "asyncRender", asyncRender);
   Nan::SetPrototypeMethod(tpl, "getCacheSizes", getCacheSizes);
   Nan::SetPrototypeMethod(tpl, "addCacheSize", addCacheSize);
   Nan::SetPrototypeMethod(tpl, "deleteCacheSize", deleteCacheSize);
+  Nan::SetPrototypeMethod(tpl, "setCacheMemoryBudget", setCacheMemoryBudget);
+  Nan::SetPrototypeMethod(tpl, "getCacheMemoryUsage", getCacheMemoryUsage);
+  Nan::SetPrototypeMethod(tpl, "openLayerCache", openLayerCache);
+  Nan::SetPrototypeMethod(tpl, "closeLayerCache", closeLayerCache);
+  Nan::SetPrototypeMethod(tpl, "saveLayerCache", saveLayerCache);
   Nan::SetPrototypeMethod(tpl, "getCachedImage", getCachedImage);
   Nan::SetPrototypeMethod(tpl, "reorderLayer", reorderLayer);
   Nan::SetPrototypeMethod(tpl, "startSearch", startSearch);
   Nan::SetPrototypeMethod(tpl, "stopSearch", stopSearch);
+  Nan::SetPrototypeMethod(tpl, "setSampleQueueOptions", setSampleQueueOptions);
+  Nan::SetPrototypeMethod(tpl, "getSampleQueueStats", getSampleQueueStats);
   Nan::SetPrototypeMethod(tpl, "renderContext", renderContext);
   Nan::SetPrototypeMethod(tpl, "asyncRenderContext", asyncRenderContext);
+  Nan::SetPrototypeMethod(tpl, "renderRegion", renderRegion);
+  Nan::SetPrototypeMethod(tpl, "asyncRenderRegion", asyncRenderRegion);
+  Nan::SetPrototypeMethod(tpl, "asyncRenderProgressive", asyncRenderProgressive);
   Nan::SetPrototypeMethod(tpl, "getContext", getContext);
   Nan::SetPrototypeMethod(tpl, "setContext", setContext);
   Nan::SetPrototypeMethod(tpl, "resetImages", resetImages);
@@ -1798,18 +1785,29 @@ void CompositorWrapper::Init(v8::Local<v8::Object> exports)
   Nan::SetPrototypeMethod(tpl, "getGroupInclusionMap", getGroupInclusionMap);
   Nan::SetPrototypeMethod(tpl, "addGroupEffect", addGroupEffect);
   Nan::SetPrototypeMethod(tpl, "renderOnlyLayer", renderOnlyLayer);
+  Nan::SetPrototypeMethod(tpl, "setColorCubeSize", setColorCubeSize);
+  Nan::SetPrototypeMethod(tpl, "getColorCubeSize", getColorCubeSize);
+  Nan::SetPrototypeMethod(tpl, "colorCubeReport", colorCubeReport);
+  Nan::SetPrototypeMethod(tpl, "clearRenderCache", clearRenderCache);
   Nan::SetPrototypeMethod(tpl, "isLayer", isLayer);
 
   compositorConstructor.Reset(Nan::GetFunction(tpl).ToLocalChecked());
   Nan::Set(exports, Nan::New("Compositor").ToLocalChecked(), Nan::GetFunction(tpl).ToLocalChecked());
 }
 
-CompositorWrapper::CompositorWrapper()
+CompositorWrapper::CompositorWrapper() : _samples(nullptr), _sampleCapacity(256), _sampleDrop(false), _sampleBatch(16)
 {
 }
 
 CompositorWrapper::~CompositorWrapper()
 {
+  if (_samples != nullptr) {
+    // search threads can't wait on the queue while this thread waits on them
+    _samples->setAccepting(false);
+    _compositor->stopSearch();
+    _samples->close();
+  }
+
   delete _compositor;
 }
 
@@ -2030,6 +2028,56 @@ void CompositorWrapper::size(const Nan::FunctionCallbackInfo<v8::Value>& info)
   info.GetReturnValue().Set(Nan::New(c->_compositor->size()));
 }
 
+void CompositorWrapper::asyncLoadDarkroom(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+  CompositorWrapper* c = ObjectWrap::Unwrap<CompositorWrapper>(info.Holder());
+  nullcheck(c->_compositor, "compositor.asyncLoadDarkroom");
+
+  // asyncLoadDarkroom(file, dir, [threads], [progress], callback)
+  if (!info[0]->IsString() || !info[1]->IsString()) {
+    Nan::ThrowError("asyncLoadDarkroom should be called as asyncLoadDarkroom(file, dir, [threads], [progress], callback).");
+    return;
+  }
+
+  Nan::Utf8String i0(info[0]);
+  Nan::Utf8String i1(info[1]);
+  string file(*i0);
+  string dir(*i1);
+
+  int threads = 0;
+  int argIndex = 2;
+
+  if (info[argIndex]->IsNumber()) {
+    threads = Nan::To<int>(info[argIndex]).ToChecked();
+    argIndex++;
+  }
+
+  Nan::Callback* progress = nullptr;
+  if (info[argIndex]->IsFunction() && info[argIndex + 1]->IsFunction()) {
+    progress = new Nan::Callback(info[argIndex].As<v8::Function>());
+    argIndex++;
+  }
+
+  if (!info[argIndex]->IsFunction()) {
+    delete progress;
+    Nan::ThrowError("asyncLoadDarkroom should be called as asyncLoadDarkroom(file, dir, [threads], [progress], callback).");
+    return;
+  }
+
+  Nan::Callback* callback = new Nan::Callback(info[argIndex].As<v8::Function>());
+  Nan::AsyncQueueWorker(new LoadDarkroomWorker(callback, progress, c->_compositor, file, dir, threads));
+
+  info.GetReturnValue().SetUndefined();
+}
+
+void CompositorWrapper::getLoadStats(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+  CompositorWrapper* c = ObjectWrap::Unwrap<CompositorWrapper>(info.Holder());
+  nullcheck(c->_compositor, "compositor.getLoadStats");
+
+  info.GetReturnValue().Set(loadStatsToObject(c->_compositor->getLoadStats()));
+}
+
 void CompositorWrapper::imageDimensions(const Nan::FunctionCallbackInfo<v8::Value>& info)
 {
   CompositorWrapper* c = ObjectWrap::Unwrap<CompositorWrapper>(info.Holder());
@@ -2057,17 +2105,24 @@ void CompositorWrapper::render(const Nan::FunctionCallbackInfo<v8::Value>& info)
   CompositorWrapper* c = ObjectWrap::Unwrap<CompositorWrapper>(info.Holder());
   nullcheck(c->_compositor, "compositor.render");
 
-  Comp::Image* img;
+  // render([size], [threads])
+  string size = "";
+  int threads = 1;
 
   if (info[0]->IsString()) {
     Nan::Utf8String val0(info[0]);
-    string size(*val0);
-    img = c->_compositor->render(size);
+    size = string(*val0);
+
+    if (info[1]->IsNumber()) {
+      threads = Nan::To<int>(info[1]).ToChecked();
+    }
   }
-  else {
-    img = c->_compositor->render();
+  else if (info[0]->IsNumber()) {
+    threads = Nan::To<int>(info[0]).ToChecked();
   }
 
+  Comp::Image* img = c->_compositor->renderCached(size, threads);
+
   // construct the image
   v8::Local<v8::Function> cons = Nan::New<v8::Function>(ImageWrapper::imageConstructor);
   const int argc = 2;
@@ -2082,23 +2137,29 @@ void CompositorWrapper::asyncRender(const Nan::FunctionCallbackInfo<v8::Value>&
   CompositorWrapper* c = ObjectWrap::Unwrap<CompositorWrapper>(info.Holder());
   nullcheck(c->_compositor, "compositor.render");
 
+  // asyncRender([size], [threads], callback)
   string size = "";
-  Nan::Callback* callback;
+  int threads = 1;
+  int argIndex = 0;
 
-  if (info[0]->IsString()) {
-    Nan::Utf8String val0(info[0]);
+  if (info[argIndex]->IsString()) {
+    Nan::Utf8String val0(info[argIndex]);
     size = string(*val0);
-
-    callback = new Nan::Callback(info[1].As<v8::Function>());
+    argIndex++;
   }
-  else if (info[0]->IsFunction()) {
-    callback = new Nan::Callback(info[0].As<v8::Function>());
+
+  if (info[argIndex]->IsNumber()) {
+    threads = Nan::To<int>(info[argIndex]).ToChecked();
+    argIndex++;
   }
-  else {
-    Nan::ThrowError("asyncRender should either have a callback or a size string and a callback.");
+
+  if (!info[argIndex]->IsFunction()) {
+    Nan::ThrowError("asyncRender should be called as asyncRender([size], [threads], callback).");
+    return;
   }
 
-  Nan::AsyncQueueWorker(new RenderWorker(callback, size, c->_compositor));
+  Nan::Callback* callback = new Nan::Callback(info[argIndex].As<v8::Function>());
+  Nan::AsyncQueueWorker(new RenderWorker(callback, size, c->_compositor, threads));
 
   info.GetReturnValue().SetUndefined();
 }
@@ -2124,7 +2185,12 @@ void CompositorWrapper::renderContext(const Nan::FunctionCallbackInfo<v8::Value>
     size = string(*val0);
   }
 
-  Comp::Image* img = c->_compositor->render(ctx->_context, size);
+  int threads = 1;
+  if (info[2]->IsNumber()) {
+    threads = Nan::To<int>(info[2]).ToChecked();
+  }
+
+  Comp::Image* img = c->_compositor->renderCached(ctx->_context, size, threads);
 
   v8::Local<v8::Function> cons = Nan::New<v8::Function>(ImageWrapper::imageConstructor);
   const int argc = 2;
@@ -2149,23 +2215,168 @@ void CompositorWrapper::asyncRenderContext(const Nan::FunctionCallbackInfo<v8::V
   }
   ContextWrapper* ctx = Nan::ObjectWrap::Unwrap<ContextWrapper>(maybe1.ToLocalChecked());
 
+  // asyncRenderContext(context, [size], [threads], callback)
   string size = "";
-  Nan::Callback* callback;
+  int threads = 1;
+  int argIndex = 1;
 
-  if (info[1]->IsString()) {
-    Nan::Utf8String val0(info[1]);
+  if (info[argIndex]->IsString()) {
+    Nan::Utf8String val0(info[argIndex]);
     size = string(*val0);
+    argIndex++;
+  }
 
-    callback = new Nan::Callback(info[2].As<v8::Function>());
+  if (info[argIndex]->IsNumber()) {
+    threads = Nan::To<int>(info[argIndex]).ToChecked();
+    argIndex++;
   }
-  else if (info[1]->IsFunction()) {
-    callback = new Nan::Callback(info[1].As<v8::Function>());
+
+  if (!info[argIndex]->IsFunction()) {
+    Nan::ThrowError("asyncRenderContext should be called as asyncRenderContext(context, [size], [threads], callback).");
+    return;
   }
-  else {
-    Nan::ThrowError("asyncRenderContext should either have a callback or a size string and a callback.");
+
+  Nan::Callback* callback = new Nan::Callback(info[argIndex].As<v8::Function>());
+  Nan::AsyncQueueWorker(new RenderWorker(callback, size, c->_compositor, ctx->_context, threads));
+
+  info.GetReturnValue().SetUndefined();
+}
+
+void CompositorWrapper::renderRegion(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+  CompositorWrapper* c = ObjectWrap::Unwrap<CompositorWrapper>(info.Holder());
+  nullcheck(c->_compositor, "compositor.renderRegion");
+
+  // renderRegion(context, x, y, w, h, [size], [threads])
+  if (!info[0]->IsObject() || !info[1]->IsNumber() || !info[2]->IsNumber() || !info[3]->IsNumber() || !info[4]->IsNumber()) {
+    Nan::ThrowError("renderRegion(context:object, x:int, y:int, w:int, h:int, [size:string], [threads:int]) argument error");
+    return;
+  }
+
+  Nan::MaybeLocal<v8::Object> maybe1 = Nan::To<v8::Object>(info[0]);
+  if (maybe1.IsEmpty()) {
+    Nan::ThrowError("Object found is empty!");
+    return;
+  }
+  ContextWrapper* ctx = Nan::ObjectWrap::Unwrap<ContextWrapper>(maybe1.ToLocalChecked());
+
+  int x = Nan::To<int>(info[1]).ToChecked();
+  int y = Nan::To<int>(info[2]).ToChecked();
+  int w = Nan::To<int>(info[3]).ToChecked();
+  int h = Nan::To<int>(info[4]).ToChecked();
+
+  string size = "";
+  if (info[5]->IsString()) {
+    Nan::Utf8String val5(info[5]);
+    size = string(*val5);
+  }
+
+  int threads = 1;
+  if (info[6]->IsNumber()) {
+    threads = Nan::To<int>(info[6]).ToChecked();
+  }
+
+  Comp::Image* img = c->_compositor->renderRegion(ctx->_context, x, y, w, h, size, threads);
+
+  v8::Local<v8::Function> cons = Nan::New<v8::Function>(ImageWrapper::imageConstructor);
+  const int argc = 2;
+  v8::Local<v8::Value> argv[argc] = { Nan::New<v8::External>(img), Nan::New(true) };
+
+  info.GetReturnValue().Set(Nan::NewInstance(cons, argc, argv).ToLocalChecked());
+}
+
+void CompositorWrapper::asyncRenderRegion(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+  CompositorWrapper* c = ObjectWrap::Unwrap<CompositorWrapper>(info.Holder());
+  nullcheck(c->_compositor, "compositor.asyncRenderRegion");
+
+  // asyncRenderRegion(context, x, y, w, h, [size], [threads], callback)
+  if (!info[0]->IsObject() || !info[1]->IsNumber() || !info[2]->IsNumber() || !info[3]->IsNumber() || !info[4]->IsNumber()) {
+    Nan::ThrowError("asyncRenderRegion should be called as asyncRenderRegion(context, x, y, w, h, [size], [threads], callback).");
+    return;
   }
 
-  Nan::AsyncQueueWorker(new RenderWorker(callback, size, c->_compositor, ctx->_context));
+  Nan::MaybeLocal<v8::Object> maybe1 = Nan::To<v8::Object>(info[0]);
+  if (maybe1.IsEmpty()) {
+    Nan::ThrowError("Object found is empty!");
+    return;
+  }
+  ContextWrapper* ctx = Nan::ObjectWrap::Unwrap<ContextWrapper>(maybe1.ToLocalChecked());
+
+  int x = Nan::To<int>(info[1]).ToChecked();
+  int y = Nan::To<int>(info[2]).ToChecked();
+  int w = Nan::To<int>(info[3]).ToChecked();
+  int h = Nan::To<int>(info[4]).ToChecked();
+
+  string size = "";
+  int threads = 1;
+  int argIndex = 5;
+
+  if (info[argIndex]->IsString()) {
+    Nan::Utf8String val(info[argIndex]);
+    size = string(*val);
+    argIndex++;
+  }
+
+  if (info[argIndex]->IsNumber()) {
+    threads = Nan::To<int>(info[argIndex]).ToChecked();
+    argIndex++;
+  }
+
+  if (!info[argIndex]->IsFunction()) {
+    Nan::ThrowError("asyncRenderRegion should be called as asyncRenderRegion(context, x, y, w, h, [size], [threads], callback).");
+    return;
+  }
+
+  Nan::Callback* callback = new Nan::Callback(info[argIndex].As<v8::Function>());
+  Nan::AsyncQueueWorker(new RenderWorker(callback, size, c->_compositor, ctx->_context, x, y, w, h, threads));
+
+  info.GetReturnValue().SetUndefined();
+}
+
+void CompositorWrapper::asyncRenderProgressive(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+  CompositorWrapper* c = ObjectWrap::Unwrap<CompositorWrapper>(info.Holder());
+  nullcheck(c->_compositor, "compositor.asyncRenderProgressive");
+
+  // asyncRenderProgressive(context, [size], [threads], callback)
+  if (!info[0]->IsObject()) {
+    Nan::ThrowError("asyncRenderProgressive should be called as asyncRenderProgressive(context, [size], [threads], callback).");
+    return;
+  }
+
+  Nan::MaybeLocal<v8::Object> maybe1 = Nan::To<v8::Object>(info[0]);
+  if (maybe1.IsEmpty()) {
+    Nan::ThrowError("Object found is empty!");
+    return;
+  }
+  ContextWrapper* ctx = Nan::ObjectWrap::Unwrap<ContextWrapper>(maybe1.ToLocalChecked());
+
+  string size = "";
+  int threads = 1;
+  int argIndex = 1;
+
+  if (info[argIndex]->IsString()) {
+    Nan::Utf8String val(info[argIndex]);
+    size = string(*val);
+    argIndex++;
+  }
+
+  if (info[argIndex]->IsNumber()) {
+    threads = Nan::To<int>(info[argIndex]).ToChecked();
+    argIndex++;
+  }
+
+  if (!info[argIndex]->IsFunction()) {
+    Nan::ThrowError("asyncRenderProgressive should be called as asyncRenderProgressive(context, [size], [threads], callback).");
+    return;
+  }
+
+  // the new generation supersedes any progressive render still running
+  unsigned int generation = c->_compositor->newRenderGeneration();
+
+  Nan::Callback* callback = new Nan::Callback(info[argIndex].As<v8::Function>());
+  Nan::AsyncQueueWorker(new ProgressiveRenderWorker(callback, size, c->_compositor, ctx->_context, generation, threads));
 
   info.GetReturnValue().SetUndefined();
 }
@@ -2233,6 +2444,66 @@ void CompositorWrapper::deleteCacheSize(const Nan::FunctionCallbackInfo<v8::Valu
   info.GetReturnValue().Set(Nan::New(c->_compositor->deleteCacheSize(size)));
 }
 
+void CompositorWrapper::setCacheMemoryBudget(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+  CompositorWrapper* c = ObjectWrap::Unwrap<CompositorWrapper>(info.Holder());
+  nullcheck(c->_compositor, "compositor.setCacheMemoryBudget");
+
+  if (!info[0]->IsNumber()) {
+    Nan::ThrowError("setCacheMemoryBudget expects (number)");
+    return;
+  }
+
+  // budget is given in megabytes
+  double mb = Nan::To<double>(info[0]).ToChecked();
+  c->_compositor->setCacheMemoryBudget((mb <= 0) ? 0 : (size_t)(mb * 1024 * 1024));
+}
+
+void CompositorWrapper::getCacheMemoryUsage(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+  CompositorWrapper* c = ObjectWrap::Unwrap<CompositorWrapper>(info.Holder());
+  nullcheck(c->_compositor, "compositor.getCacheMemoryUsage");
+
+  // in megabytes, same as setCacheMemoryBudget
+  info.GetReturnValue().Set(Nan::New(c->_compositor->getCacheMemoryUsage() / (1024.0 * 1024.0)));
+}
+
+void CompositorWrapper::openLayerCache(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+  CompositorWrapper* c = ObjectWrap::Unwrap<CompositorWrapper>(info.Holder());
+  nullcheck(c->_compositor, "compositor.openLayerCache");
+
+  if (!info[0]->IsString()) {
+    Nan::ThrowError("openLayerCache expects (string)");
+    return;
+  }
+
+  Nan::Utf8String val0(info[0]);
+  info.GetReturnValue().Set(Nan::New(c->_compositor->openLayerCache(string(*val0))));
+}
+
+void CompositorWrapper::closeLayerCache(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+  CompositorWrapper* c = ObjectWrap::Unwrap<CompositorWrapper>(info.Holder());
+  nullcheck(c->_compositor, "compositor.closeLayerCache");
+
+  c->_compositor->closeLayerCache();
+}
+
+void CompositorWrapper::saveLayerCache(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+  CompositorWrapper* c = ObjectWrap::Unwrap<CompositorWrapper>(info.Holder());
+  nullcheck(c->_compositor, "compositor.saveLayerCache");
+
+  if (!info[0]->IsString()) {
+    Nan::ThrowError("saveLayerCache expects (string)");
+    return;
+  }
+
+  Nan::Utf8String val0(info[0]);
+  info.GetReturnValue().Set(Nan::New(c->_compositor->saveLayerCache(string(*val0))));
+}
+
 void CompositorWrapper::getCachedImage(const Nan::FunctionCallbackInfo<v8::Value>& info)
 {
   CompositorWrapper* c = ObjectWrap::Unwrap<CompositorWrapper>(info.Holder());
@@ -2320,24 +2591,39 @@ void CompositorWrapper::startSearch(const Nan::FunctionCallbackInfo<v8::Value>&
     threads = thread::hardware_concurrency();
   }
 
-  // ok so this part gets complicated. 
-  // hopefully what happens here is that we create a callback function for the c++ code to call
-  // in order to get the image data out of c++ into js. The compositor object itself will
-  // run the search loop and the node code is called through the anonymous function created here.
-  Comp::searchCallback cb = [c](Comp::Image* img, Comp::Context ctx, map<string, float> meta, map<string, string> meta2) {
-    // create necessary data structures
-    asyncSampleEventData* asyncData = new asyncSampleEventData();
-    asyncData->request.data = (void*)asyncData;
-    asyncData->img = img;
-    asyncData->ctx = ctx;
-    asyncData->c = c;
-    asyncData->meta = meta;
-    asyncData->meta2 = meta2;
-
-    uv_queue_work(uv_default_loop(), &asyncData->request, asyncNop, reinterpret_cast<uv_after_work_cb>(asyncSampleEvent));
+  // the compositor stops any running search before starting a new one. Stop it here first so
+  // the sample queue can be reset with nothing writing to it
+  if (c->_samples == nullptr) {
+    c->_samples = new SearchSampleChannel(c, c->_sampleCapacity, c->_sampleDrop, c->_sampleBatch);
+  }
+  else {
+    c->_samples->setAccepting(false);
+    c->_compositor->stopSearch();
+    c->_samples->drain();
+    c->_samples->configure(c->_sampleCapacity, c->_sampleDrop, c->_sampleBatch);
+    c->_samples->setAccepting(true);
+  }
+  uint64_t generation = c->_samples->beginSearch();
+
+  // The compositor calls this from its search threads. Samples go through the channel's queue
+  // and are emitted as "sample" events on the node thread.
+  SearchSampleChannel* samples = c->_samples;
+  Comp::searchCallback cb = [samples](Comp::Image* img, Comp::Context ctx, map<string, float> meta, map<string, string> meta2) {
+    SearchSample* s = new SearchSample();
+    s->_img = img;
+    s->_ctx = ctx;
+    s->_meta = meta;
+    s->_meta2 = meta2;
+
+    samples->push(s);
+  };
+
+  // searches can end on their own (exploratory search stops after maxFailures), which has to let node exit
+  Comp::searchDoneCallback done = [samples, generation]() {
+    samples->finishSearch(generation);
   };
 
-  c->_compositor->startSearch(cb, mode, opt, threads, renderSize);
+  c->_compositor->startSearch(cb, mode, opt, threads, renderSize, done);
 
   info.GetReturnValue().SetUndefined();
 }
@@ -2350,11 +2636,50 @@ void CompositorWrapper::stopSearch(const Nan::FunctionCallbackInfo<v8::Value>& i
   Nan::Callback* callback = new Nan::Callback(info[0].As<v8::Function>());
 
   // async this, it blocks
-  Nan::AsyncQueueWorker(new StopSearchWorker(callback, c->_compositor));
+  Nan::AsyncQueueWorker(new StopSearchWorker(callback, c->_compositor, c->_samples));
 
   info.GetReturnValue().SetUndefined();
 }
 
+void CompositorWrapper::setSampleQueueOptions(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+  CompositorWrapper* c = ObjectWrap::Unwrap<CompositorWrapper>(info.Holder());
+  nullcheck(c->_compositor, "compositor.setSampleQueueOptions");
+
+  // setSampleQueueOptions(capacity, [dropWhenFull], [batchSize]). Applies from the next startSearch
+  if (!info[0]->IsNumber()) {
+    Nan::ThrowError("setSampleQueueOptions(int, [bool], [int]) argument error");
+    return;
+  }
+
+  c->_sampleCapacity = (size_t)max(1, Nan::To<int>(info[0]).ToChecked());
+
+  if (info[1]->IsBoolean()) {
+    c->_sampleDrop = Nan::To<bool>(info[1]).ToChecked();
+  }
+
+  if (info[2]->IsNumber()) {
+    c->_sampleBatch = max(1, Nan::To<int>(info[2]).ToChecked());
+  }
+}
+
+void CompositorWrapper::getSampleQueueStats(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+  CompositorWrapper* c = ObjectWrap::Unwrap<CompositorWrapper>(info.Holder());
+  nullcheck(c->_compositor, "compositor.getSampleQueueStats");
+
+  // counts are totals over every search run by this compositor
+  v8::Local<v8::Object> ret = Nan::New<v8::Object>();
+  SearchSampleChannel* s = c->_samples;
+  Nan::Set(ret, Nan::New("produced").ToLocalChecked(), Nan::New((double)((s == nullptr) ? 0 : s->produced())));
+  Nan::Set(ret, Nan::New("delivered").ToLocalChecked(), Nan::New((double)((s == nullptr) ? 0 : s->delivered())));
+  Nan::Set(ret, Nan::New("dropped").ToLocalChecked(), Nan::New((double)((s == nullptr) ? 0 : s->dropped())));
+  Nan::Set(ret, Nan::New("queued").ToLocalChecked(), Nan::New((double)((s == nullptr) ? 0 : s->queued())));
+  Nan::Set(ret, Nan::New("capacity").ToLocalChecked(), Nan::New((double)((s == nullptr) ? c->_sampleCapacity : s->capacity())));
+
+  info.GetReturnValue().Set(ret);
+}
+
 void CompositorWrapper::setContext(const Nan::FunctionCallbackInfo<v8::Value>& info)
 {
   CompositorWrapper* c = ObjectWrap::Unwrap<CompositorWrapper>(info.Holder());
@@ -2913,10 +3238,15 @@ void CompositorWrapper::computeAllImportanceMaps(const Nan::FunctionCallbackInfo
     }
     ContextWrapper* ctx = Nan::ObjectWrap::Unwrap<ContextWrapper>(maybe1.ToLocalChecked());
 
-    c->_compositor->computeAllImportanceMaps(mode, ctx->_context);
+    int threads = 1;
+    if (info[2]->IsNumber()) {
+      threads = Nan::To<int>(info[2]).ToChecked();
+    }
+
+    c->_compositor->computeAllImportanceMaps(mode, ctx->_context, threads);
   }
   else {
-    Nan::ThrowError("compositor.computeAllImportanceMaps(int, Context) argument error");
+    Nan::ThrowError("compositor.computeAllImportanceMaps(int, Context, [int]) argument error");
   }
 }
 
@@ -3886,38 +4216,127 @@ void CompositorWrapper::renderOnlyLayer(const Nan::FunctionCallbackInfo<v8::Valu
   }
 }
 
-RenderWorker::RenderWorker(Nan::Callback * callback, string size, Comp::Compositor * c) :
-  Nan::AsyncWorker(callback), _size(size), _c(c)
+void CompositorWrapper::setColorCubeSize(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+  CompositorWrapper* c = ObjectWrap::Unwrap<CompositorWrapper>(info.Holder());
+  nullcheck(c->_compositor, "compositor.setColorCubeSize");
+
+  if (info[0]->IsNumber()) {
+    c->_compositor->setColorCubeSize(Nan::To<int>(info[0]).ToChecked());
+  }
+  else {
+    Nan::ThrowError("setColorCubeSize(int) argument error");
+  }
+}
+
+void CompositorWrapper::getColorCubeSize(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+  CompositorWrapper* c = ObjectWrap::Unwrap<CompositorWrapper>(info.Holder());
+  nullcheck(c->_compositor, "compositor.getColorCubeSize");
+
+  info.GetReturnValue().Set(Nan::New(c->_compositor->getColorCubeSize()));
+}
+
+void CompositorWrapper::colorCubeReport(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+  CompositorWrapper* c = ObjectWrap::Unwrap<CompositorWrapper>(info.Holder());
+  nullcheck(c->_compositor, "compositor.colorCubeReport");
+
+  if (info[0]->IsObject() && info[1]->IsString()) {
+    Nan::MaybeLocal<v8::Object> maybe1 = Nan::To<v8::Object>(info[0]);
+    if (maybe1.IsEmpty()) {
+      Nan::ThrowError("Object found is empty!");
+    }
+    ContextWrapper* ctx = Nan::ObjectWrap::Unwrap<ContextWrapper>(maybe1.ToLocalChecked());
+
+    Nan::Utf8String i1(info[1]);
+    string layer(*i1);
+
+    int size = 33;
+    if (info[2]->IsNumber()) {
+      size = Nan::To<int>(info[2]).ToChecked();
+    }
+
+    int samples = 100000;
+    if (info[3]->IsNumber()) {
+      samples = Nan::To<int>(info[3]).ToChecked();
+    }
+
+    // the context belongs to js, looking the layer up with [] would add a blank one
+    auto l = ctx->_context.find(layer);
+    if (l == ctx->_context.end()) {
+      Nan::ThrowError(string("colorCubeReport: layer " + layer + " does not exist in the context").c_str());
+      return;
+    }
+
+    map<string, double> report = c->_compositor->colorCubeReport(l->second, size, samples);
+
+    v8::Local<v8::Object> ret = Nan::New<v8::Object>();
+    for (auto& kvp : report) {
+      Nan::Set(ret, Nan::New(kvp.first).ToLocalChecked(), Nan::New(kvp.second));
+    }
+
+    info.GetReturnValue().Set(ret);
+  }
+  else {
+    Nan::ThrowError("colorCubeReport(Context, string, [int], [int]) argument error");
+  }
+}
+
+void CompositorWrapper::clearRenderCache(const Nan::FunctionCallbackInfo<v8::Value>& info)
+{
+  CompositorWrapper* c = ObjectWrap::Unwrap<CompositorWrapper>(info.Holder());
+  nullcheck(c->_compositor, "compositor.clearRenderCache");
+
+  c->_compositor->clearRenderCache();
+}
+
+RenderWorker::RenderWorker(Nan::Callback * callback, string size, Comp::Compositor * c, int threads) :
+  Nan::AsyncWorker(callback), _size(size), _c(c), _threads(threads)
 {
   _customContext = false;
   _dim = -1;
+  _region = false;
 }
 
-RenderWorker::RenderWorker(Nan::Callback * callback, string size, Comp::Compositor * c, Comp::Context ctx):
-  Nan::AsyncWorker(callback), _size(size), _c(c), _ctx(ctx)
+RenderWorker::RenderWorker(Nan::Callback * callback, string size, Comp::Compositor * c, Comp::Context ctx, int threads):
+  Nan::AsyncWorker(callback), _size(size), _c(c), _ctx(ctx), _threads(threads)
 {
   _customContext = true;
   _dim = -1;
+  _region = false;
 }
 
 RenderWorker::RenderWorker(Nan::Callback * callback, string size, Comp::Compositor * c, Comp::Context ctx, string layer, string pc, float dim) :
-  Nan::AsyncWorker(callback), _size(size), _c(c), _ctx(ctx), _dim(dim), _layer(layer), _pc(pc)
+  Nan::AsyncWorker(callback), _size(size), _c(c), _ctx(ctx), _dim(dim), _layer(layer), _pc(pc), _threads(1)
 {
   _customContext = true;
+  _region = false;
+}
+
+RenderWorker::RenderWorker(Nan::Callback * callback, string size, Comp::Compositor * c, Comp::Context ctx, int x, int y, int w, int h, int threads) :
+  Nan::AsyncWorker(callback), _size(size), _c(c), _ctx(ctx), _x(x), _y(y), _w(w), _h(h), _threads(threads)
+{
+  _customContext = true;
+  _dim = -1;
+  _region = true;
 }
 
 void RenderWorker::Execute()
 {
-  if (_customContext) {
+  if (_region) {
+    _img = _c->renderRegion(_ctx, _x, _y, _w, _h, _size, _threads);
+  }
+  else if (_customContext) {
     if (_dim < 0) {
-      _img = _c->render(_ctx, _size);
+      _img = _c->renderCached(_ctx, _size, _threads);
     }
     else {
       _img = _c->renderUpToLayer(_ctx, _layer, _pc, _dim, _size);
     }
   }
   else
-    _img = _c->render(_size);
+    _img = _c->renderCached(_size, _threads);
 }
 
 void RenderWorker::HandleOKCallback()
@@ -3933,13 +4352,111 @@ void RenderWorker::HandleOKCallback()
   callback->Call(2, cb);
 }
 
-StopSearchWorker::StopSearchWorker(Nan::Callback * callback, Comp::Compositor * c):
-  Nan::AsyncWorker(callback), _c(c)
+ProgressiveRenderWorker::ProgressiveRenderWorker(Nan::Callback * callback, string size, Comp::Compositor * c, Comp::Context ctx,
+  unsigned int generation, int threads) :
+  Nan::AsyncProgressQueueWorker<ProgressiveRenderLevel>(callback), _c(c), _size(size), _ctx(ctx), _generation(generation), _threads(threads)
 {
 }
 
+void ProgressiveRenderWorker::Execute(const ExecutionProgress & progress)
+{
+  string target = (_size == "") ? "full" : _size;
+
+  _c->renderProgressive(_ctx, _size, _generation, [&](Comp::Image* img, string size) {
+    ProgressiveRenderLevel level;
+    level._img = img;
+    level._size = size;
+    level._final = (size == target);
+    progress.Send(&level, 1);
+  }, _threads);
+}
+
+void ProgressiveRenderWorker::HandleProgressCallback(const ProgressiveRenderLevel * data, size_t count)
+{
+  Nan::HandleScope scope;
+
+  for (size_t i = 0; i < count; i++) {
+    const int argc = 2;
+    v8::Local<v8::Value> argv[argc] = { Nan::New<v8::External>(data[i]._img), Nan::New(true) };
+    v8::Local<v8::Function> cons = Nan::New<v8::Function>(ImageWrapper::imageConstructor);
+    v8::Local<v8::Object> imgInst = Nan::NewInstance(cons, argc, argv).ToLocalChecked();
+
+    v8::Local<v8::Value> cb[] = { Nan::Null(), imgInst, Nan::New(data[i]._size).ToLocalChecked(), Nan::New(data[i]._final) };
+    callback->Call(4, cb);
+  }
+}
+
+void ProgressiveRenderWorker::HandleOKCallback()
+{
+  // every level was already delivered through HandleProgressCallback
+}
+
+LoadDarkroomWorker::LoadDarkroomWorker(Nan::Callback * callback, Nan::Callback * progress, Comp::Compositor * c, string file, string dir, int threads) :
+  Nan::AsyncProgressQueueWorker<LoadDarkroomProgress>(callback), _progress(progress), _c(c), _file(file), _dir(dir), _threads(threads), _loaded(false)
+{
+}
+
+LoadDarkroomWorker::~LoadDarkroomWorker()
+{
+  delete _progress;
+}
+
+void LoadDarkroomWorker::Execute(const ExecutionProgress & progress)
+{
+  if (_progress == nullptr) {
+    _loaded = _c->loadDarkroom(_file, _dir, _threads);
+    return;
+  }
+
+  _loaded = _c->loadDarkroom(_file, _dir, _threads, [&](int done, int total, string layer) {
+    LoadDarkroomProgress p;
+    p._done = done;
+    p._total = total;
+    p._layer = layer;
+    progress.Send(&p, 1);
+  });
+}
+
+void LoadDarkroomWorker::HandleProgressCallback(const LoadDarkroomProgress * data, size_t count)
+{
+  Nan::HandleScope scope;
+
+  if (_progress == nullptr)
+    return;
+
+  for (size_t i = 0; i < count; i++) {
+    v8::Local<v8::Value> cb[] = { Nan::New(data[i]._done), Nan::New(data[i]._total), Nan::New(data[i]._layer).ToLocalChecked() };
+    _progress->Call(3, cb);
+  }
+}
+
+void LoadDarkroomWorker::HandleOKCallback()
+{
+  Nan::HandleScope scope;
+
+  if (!_loaded) {
+    v8::Local<v8::Value> cb[] = { Nan::Error(string("Failed to load " + _dir + _file + ". See the log for details.").c_str()) };
+    callback->Call(1, cb);
+    return;
+  }
+
+  v8::Local<v8::Value> cb[] = { Nan::Null(), loadStatsToObject(_c->getLoadStats()) };
+  callback->Call(2, cb);
+}
+
+StopSearchWorker::StopSearchWorker(Nan::Callback * callback, Comp::Compositor * c, SearchSampleChannel* samples):
+  Nan::AsyncWorker(callback), _c(c), _samples(samples)
+{
+  _generation = (samples != nullptr) ? samples->generation() : 0;
+}
+
 void StopSearchWorker::Execute()
 {
+  // startSearch stops the previous search itself, so if another one started since this stop
+  // was requested there's nothing left to stop here
+  if (_samples != nullptr && _samples->generation() != _generation)
+    return;
+
   // this could take a while
   _c->stopSearch();
 }
@@ -3948,10 +4465,178 @@ void StopSearchWorker::HandleOKCallback()
 {
   Nan::HandleScope scope;
 
+  // everything the search produced goes out before the callback
+  if (_samples != nullptr) {
+    _samples->drain();
+    _samples->endSearch(_generation);
+  }
+
   v8::Local<v8::Value> cb[] = { Nan::Null() };
   callback->Call(1, cb);
 }
 
+SearchSampleChannel::SearchSampleChannel(CompositorWrapper * c, size_t capacity, bool drop, int batchSize) :
+  _c(c), _drop(drop), _batchSize(batchSize), _accepting(true), _active(true), _generation(0), _finished(0), _produced(0), _delivered(0), _dropped(0)
+{
+  _queue = unique_ptr<Comp::SampleQueue<SearchSample*>>(new Comp::SampleQueue<SearchSample*>(capacity));
+
+  uv_async_init(uv_default_loop(), &_async, onAsync);
+  _async.data = this;
+}
+
+SearchSampleChannel::~SearchSampleChannel()
+{
+  SearchSample* s;
+  while (_queue->pop(s)) {
+    delete s->_img;
+    delete s;
+  }
+}
+
+void SearchSampleChannel::push(SearchSample * s)
+{
+  _produced++;
+
+  while (!_queue->push(s)) {
+    if (_drop || !_accepting) {
+      _dropped++;
+      delete s->_img;
+      delete s;
+      return;
+    }
+
+    // full, wait for the node thread to catch up
+    uv_async_send(&_async);
+    this_thread::sleep_for(chrono::milliseconds(1));
+  }
+
+  // wakeups are merged by libuv, so this is cheap when node is already behind
+  uv_async_send(&_async);
+}
+
+void SearchSampleChannel::drain()
+{
+  Nan::HandleScope scope;
+  while (emit(_batchSize) > 0) {}
+}
+
+void SearchSampleChannel::configure(size_t capacity, bool drop, int batchSize)
+{
+  // anything still waiting belongs to the last search
+  drain();
+
+  if (capacity != _queue->capacity())
+    _queue = unique_ptr<Comp::SampleQueue<SearchSample*>>(new Comp::SampleQueue<SearchSample*>(capacity));
+
+  _drop = drop;
+  _batchSize = batchSize;
+}
+
+void SearchSampleChannel::setAccepting(bool accepting)
+{
+  _accepting = accepting;
+}
+
+uint64_t SearchSampleChannel::beginSearch()
+{
+  setActive(true);
+  return ++_generation;
+}
+
+void SearchSampleChannel::endSearch(uint64_t generation)
+{
+  if (generation == _generation)
+    setActive(false);
+}
+
+void SearchSampleChannel::finishSearch(uint64_t generation)
+{
+  _finished = generation;
+
+  // onAsync ends the search on the node thread after the last samples go out
+  uv_async_send(&_async);
+}
+
+void SearchSampleChannel::setActive(bool active)
+{
+  if (active == _active)
+    return;
+
+  _active = active;
+  if (active)
+    uv_ref((uv_handle_t*)&_async);
+  else
+    uv_unref((uv_handle_t*)&_async);
+}
+
+void SearchSampleChannel::close()
+{
+  _accepting = false;
+  uv_close((uv_handle_t*)&_async, onClose);
+}
+
+void SearchSampleChannel::onAsync(uv_async_t * handle)
+{
+  SearchSampleChannel* ch = static_cast<SearchSampleChannel*>(handle->data);
+
+  Nan::HandleScope scope;
+
+  // read before emitting, every sample of a finished search is queued by the time it's set
+  uint64_t finished = ch->_finished;
+
+  // one batch per wakeup, then give the rest of the event loop a turn
+  if (ch->emit(ch->_batchSize) == ch->_batchSize)
+    uv_async_send(&ch->_async);
+  else
+    ch->endSearch(finished);
+}
+
+void SearchSampleChannel::onClose(uv_handle_t * handle)
+{
+  delete static_cast<SearchSampleChannel*>(handle->data);
+}
+
+int SearchSampleChannel::emit(int count)
+{
+  int emitted = 0;
+  SearchSample* s;
+
+  while (emitted < count && _queue->pop(s)) {
+    // image object, takes ownership of the image
+    const int argc = 2;
+    v8::Local<v8::Value> argv[argc] = { Nan::New<v8::External>(s->_img), Nan::New(true) };
+    v8::Local<v8::Function> cons = Nan::New<v8::Function>(ImageWrapper::imageConstructor);
+    v8::Local<v8::Object> imgInst = Nan::NewInstance(cons, argc, argv).ToLocalChecked();
+
+    // context object, copies the context
+    const int argc2 = 1;
+    v8::Local<v8::Value> argv2[argc2] = { Nan::New<v8::External>(&(s->_ctx)) };
+    v8::Local<v8::Function> cons2 = Nan::New<v8::Function>(ContextWrapper::contextConstructor);
+    v8::Local<v8::Object> ctxInst = Nan::NewInstance(cons2, argc2, argv2).ToLocalChecked();
+
+    // metadata object
+    v8::Local<v8::Object> metadata = Nan::New<v8::Object>();
+    for (auto k : s->_meta) {
+      Nan::Set(metadata, Nan::New(k.first).ToLocalChecked(), Nan::New(k.second));
+    }
+
+    // string metadata
+    for (auto k : s->_meta2) {
+      Nan::Set(metadata, Nan::New(k.first).ToLocalChecked(), Nan::New(k.second).ToLocalChecked());
+    }
+
+    delete s;
+
+    v8::Local<v8::Value> emitArgv[] = { Nan::New("sample").ToLocalChecked(), imgInst, ctxInst, metadata };
+    Nan::MakeCallback(_c->handle(), "emit", 4, emitArgv);
+
+    _delivered++;
+    emitted++;
+  }
+
+  return emitted;
+}
+
 void ClickMapWrapper::Init(v8::Local<v8::Object> exports)
 {
   Nan::HandleScope scope;
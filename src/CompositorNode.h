@@ -10,6 +10,7 @@ author: Evan Shimizu
 #include "Compositor.h"
 #include "util.h"
 #include "Model.h"
+#include "SampleQueue.h"
 
 #include <nan.h>
 
@@ -173,14 +174,22 @@ private:
 };
 */
 
-void asyncSampleEvent(uv_work_t* req);
-void asyncNop(uv_work_t* req);
+class SearchSampleChannel;
 
 class CompositorWrapper : public Nan::ObjectWrap {
 public:
   static void Init(v8::Local<v8::Object> exports);
 
   Comp::Compositor* _compositor;
+
+  // delivers search results to js. Created by the first startSearch call
+  SearchSampleChannel* _samples;
+
+  // queue settings for the next search, see setSampleQueueOptions
+  size_t _sampleCapacity;
+  bool _sampleDrop;
+  int _sampleBatch;
+
 private:
   explicit CompositorWrapper();
   ~CompositorWrapper();
@@ -196,19 +205,31 @@ private:
   static void setLayerOrder(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void getLayerNames(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void size(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void asyncLoadDarkroom(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void getLoadStats(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void imageDimensions(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void render(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void asyncRender(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void renderContext(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void asyncRenderContext(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void renderRegion(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void asyncRenderRegion(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void asyncRenderProgressive(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void getContext(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void getCacheSizes(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void addCacheSize(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void deleteCacheSize(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void setCacheMemoryBudget(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void getCacheMemoryUsage(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void openLayerCache(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void closeLayerCache(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void saveLayerCache(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void getCachedImage(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void reorderLayer(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void startSearch(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void stopSearch(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void setSampleQueueOptions(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void getSampleQueueStats(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void setContext(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void resetImages(const Nan::FunctionCallbackInfo<v8::Value>& info);
   //static void computeExpContext(const Nan::FunctionCallbackInfo<v8::Value>& info);
@@ -271,6 +292,10 @@ private:
   static void propLayerHistogramIntersect(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void getGroupInclusionMap(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void renderOnlyLayer(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void setColorCubeSize(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void getColorCubeSize(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void colorCubeReport(const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void clearRenderCache(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static Nan::Persistent<v8::Function> compositorConstructor;
 };
 
@@ -386,14 +411,17 @@ private:
 
 class RenderWorker : public Nan::AsyncWorker {
 public:
-  RenderWorker(Nan::Callback *callback, string size, Comp::Compositor* c);
+  RenderWorker(Nan::Callback *callback, string size, Comp::Compositor* c, int threads = 1);
 
   // render a specific context async
-  RenderWorker(Nan::Callback *callback, string size, Comp::Compositor* c, Comp::Context ctx);
+  RenderWorker(Nan::Callback *callback, string size, Comp::Compositor* c, Comp::Context ctx, int threads = 1);
  
   // render with the renderUpToLayer function instead
   RenderWorker(Nan::Callback *callback, string size, Comp::Compositor* c, Comp::Context ctx, string layer, string pc, float dim);
 
+  // render a region of a context with renderRegion
+  RenderWorker(Nan::Callback *callback, string size, Comp::Compositor* c, Comp::Context ctx, int x, int y, int w, int h, int threads = 1);
+
   ~RenderWorker() {}
 
   void Execute() override;
@@ -411,11 +439,79 @@ private:
   float _dim;
   string _layer;
   string _pc;
+
+  // region to render, only used if _region is set
+  bool _region;
+  int _x;
+  int _y;
+  int _w;
+  int _h;
+
+  // number of threads used by the render call
+  int _threads;
+};
+
+// one finished level of a progressive render
+struct ProgressiveRenderLevel {
+  Comp::Image* _img;
+  string _size;
+  bool _final;
+};
+
+// Renders a context at increasing sizes with Compositor::renderProgressive. The callback is called
+// once per level as callback(err, image, size, final). Starting a new progressive render
+// supersedes this one, in which case it stops without calling back again.
+class ProgressiveRenderWorker : public Nan::AsyncProgressQueueWorker<ProgressiveRenderLevel> {
+public:
+  ProgressiveRenderWorker(Nan::Callback* callback, string size, Comp::Compositor* c, Comp::Context ctx, unsigned int generation, int threads = 1);
+  ~ProgressiveRenderWorker() {}
+
+  void Execute(const ExecutionProgress& progress) override;
+  void HandleProgressCallback(const ProgressiveRenderLevel* data, size_t count) override;
+
+protected:
+  void HandleOKCallback() override;
+
+private:
+  Comp::Compositor* _c;
+  string _size;
+  Comp::Context _ctx;
+  unsigned int _generation;
+  int _threads;
+};
+
+// progress of a Darkroom file load
+struct LoadDarkroomProgress {
+  int _done;
+  int _total;
+  string _layer;
+};
+
+// Loads a Darkroom file into an empty compositor with Compositor::loadDarkroom. progress is called
+// as progress(layers decoded, total layers, layer name) and callback as callback(err, stats) when done.
+class LoadDarkroomWorker : public Nan::AsyncProgressQueueWorker<LoadDarkroomProgress> {
+public:
+  LoadDarkroomWorker(Nan::Callback* callback, Nan::Callback* progress, Comp::Compositor* c, string file, string dir, int threads);
+  ~LoadDarkroomWorker();
+
+  void Execute(const ExecutionProgress& progress) override;
+  void HandleProgressCallback(const LoadDarkroomProgress* data, size_t count) override;
+
+protected:
+  void HandleOKCallback() override;
+
+private:
+  Nan::Callback* _progress;
+  Comp::Compositor* _c;
+  string _file;
+  string _dir;
+  int _threads;
+  bool _loaded;
 };
 
 class StopSearchWorker : public Nan::AsyncWorker {
 public:
-  StopSearchWorker(Nan::Callback* callback, Comp::Compositor* c);
+  StopSearchWorker(Nan::Callback* callback, Comp::Compositor* c, SearchSampleChannel* samples = nullptr);
   void Execute() override;
 
 protected:
@@ -423,16 +519,94 @@ protected:
 
 private:
   Comp::Compositor* _c;
+  SearchSampleChannel* _samples;
+
+  // search this worker stops, see SearchSampleChannel::beginSearch
+  uint64_t _generation;
 };
 
-struct asyncSampleEventData {
-  uv_work_t request;
+// one search result on its way to js
+struct SearchSample {
+  Comp::Image* _img;
+  Comp::Context _ctx;
+  map<string, float> _meta;
+  map<string, string> _meta2;
+};
+
+// Carries search results from the search threads to the node thread. Search threads push into a
+// bounded lock-free queue and wake node through a single uv_async_t, which then emits up to
+// batchSize "sample" events per wakeup. When the queue is full a search thread either drops the
+// sample or waits for room, depending on drop.
+class SearchSampleChannel {
+public:
+  // node thread only
+  SearchSampleChannel(CompositorWrapper* c, size_t capacity, bool drop, int batchSize);
+
+  // takes ownership of the sample. Safe to call from any thread
+  void push(SearchSample* s);
+
+  // emits every waiting sample. node thread only
+  void drain();
+
+  // replaces the queue. Only call while no search is running. node thread only
+  void configure(size_t capacity, bool drop, int batchSize);
+
+  // while not accepting, pushed samples are dropped instead of queued or waited on.
+  // Turned off while the node thread waits for search threads to stop, so they can't wait on it
+  void setAccepting(bool accepting);
+
+  // marks the channel active for a new search, which keeps node running so the search can deliver
+  // its samples. Returns the new search generation. node thread only
+  uint64_t beginSearch();
+
+  // lets node exit again, unless a search has started since the given generation. A stop that
+  // finishes after the next startSearch must not deactivate the new search. node thread only
+  void endSearch(uint64_t generation);
+
+  // number of the current (or last) search. Safe to call from any thread
+  uint64_t generation() { return _generation; }
+
+  // the search threads of the given search have all returned. Once its samples are delivered the
+  // channel lets node exit, same as endSearch. Safe to call from any thread
+  void finishSearch(uint64_t generation);
+
+  // stops accepting samples and frees the channel once libuv is done with it. node thread only
+  void close();
+
+  uint64_t produced() { return _produced; }
+  uint64_t delivered() { return _delivered; }
+  uint64_t dropped() { return _dropped; }
+  size_t queued() { return _queue->size(); }
+  size_t capacity() { return _queue->capacity(); }
+
+private:
+  ~SearchSampleChannel();
+
+  static void onAsync(uv_async_t* handle);
+  static void onClose(uv_handle_t* handle);
+
+  // pops and emits up to count samples, returns the number emitted
+  int emit(int count);
+
+  void setActive(bool active);
+
+  CompositorWrapper* _c;
+  unique_ptr<Comp::SampleQueue<SearchSample*>> _queue;
+  atomic<bool> _drop;
+  int _batchSize;
+  atomic<bool> _accepting;
+  bool _active;
+  atomic<uint64_t> _generation;
+
+  // last search whose threads returned on their own, see finishSearch
+  atomic<uint64_t> _finished;
+
+  atomic<uint64_t> _produced;
+  atomic<uint64_t> _delivered;
+  atomic<uint64_t> _dropped;
 
-  Comp::Image* img;
-  Comp::Context ctx;
-  map<string, float> meta;
-  map<string, string> meta2;
-  CompositorWrapper* c;
+  uv_async_t _async;
 };
 
-v8::Local<v8::Value> excGet(v8::Local<v8::Object>& obj, string key);
\ No newline at end of file
+v8::Local<v8::Value> excGet(v8::Local<v8::Object>& obj, string key);
+v8::Local<v8::Object> loadStatsToObject(const Comp::LoadStats& stats);
\ No newline at end of file
@@ -1,20 +1,53 @@
 #include "Image.h"
 #include "Histogram.h"
+#include "ImageMetrics.h"
 
 #define STB_IMAGE_RESIZE_IMPLEMENTATION
 #include "third_party/stb_image_resize.h"
 
 namespace Comp {
+  RenderLayerMap::RenderLayerMap(unsigned int size) : _size(size)
+  {
+    _names.push_back("");
+    _lookup[""] = 0;
+  }
+
+  uint16_t RenderLayerMap::getId(const string & name)
+  {
+    auto it = _lookup.find(name);
+    if (it != _lookup.end())
+      return it->second;
+
+    if (_names.size() > UINT16_MAX) {
+      getLogger()->log("Render layer map is out of ids, " + name + " will not be tracked", Comp::WARN);
+      return 0;
+    }
+
+    uint16_t id = (uint16_t)_names.size();
+    _names.push_back(name);
+    _lookup[name] = id;
+
+    return id;
+  }
+
+  void RenderLayerMap::allocate()
+  {
+    if (_ids.size() == 0 && _size > 0) {
+      _ids = vector<uint16_t>(_size, 0);
+    }
+  }
+
   Image::Image(unsigned int w, unsigned int h) : _w(w), _h(h), _filename("")
   {
     _data = vector<unsigned char>(w * h * 4, 0);
-    _renderLayerMap = vector<string>(w * h);
+    _renderLayerMap = RenderLayerMap(w * h);
+    setAlphaBounds(0, 0, w, h);
   }
 
   Image::Image(string filename)
   {
     loadFromFile(filename);
-    _renderLayerMap = vector<string>(_w * _h);
+    _renderLayerMap = RenderLayerMap(_w * _h);
     analyze();
   }
 
@@ -32,22 +65,39 @@ namespace Comp {
       getLogger()->log("Error interpreting base64 data. Potentitally fatal.", Comp::ERR);
     }
 
-    _renderLayerMap = vector<string>(_w * _h);
+    _renderLayerMap = RenderLayerMap(_w * _h);
 
     analyze();
   }
 
+  Image::Image(unsigned int w, unsigned int h, const unsigned char * data, string filename) :
+    _w(w), _h(h), _totalAlpha(0), _avgAlpha(0), _totalLuma(0), _avgLuma(0), _filename(filename)
+  {
+    _data = vector<unsigned char>(data, data + (size_t)w * h * 4);
+    _renderLayerMap = RenderLayerMap(w * h);
+    setAlphaBounds(0, 0, w, h);
+  }
+
+  Image::Image(unsigned int w, unsigned int h, shared_ptr<const unsigned char> data, string filename) :
+    _w(w), _h(h), _totalAlpha(0), _avgAlpha(0), _totalLuma(0), _avgLuma(0), _filename(filename), _borrowed(data)
+  {
+    _renderLayerMap = RenderLayerMap(w * h);
+    setAlphaBounds(0, 0, w, h);
+  }
+
   Image::Image(const Image & other)
   {
     _w = other._w;
     _h = other._h;
     _data = other._data;
+    _borrowed = other._borrowed;
     _filename = other._filename;
     _totalAlpha = other._totalAlpha;
     _totalLuma = other._totalLuma;
     _avgAlpha = other._avgAlpha;
     _avgLuma = other._avgLuma;
     _renderLayerMap = other._renderLayerMap;
+    setAlphaBounds(other._alphaX0, other._alphaY0, other._alphaX1, other._alphaY1);
   }
 
   Image & Image::operator=(const Image & other)
@@ -59,12 +109,14 @@ namespace Comp {
     _w = other._w;
     _h = other._h;
     _data = other._data;
+    _borrowed = other._borrowed;
     _filename = other._filename;
     _totalAlpha = other._totalAlpha;
     _totalLuma = other._totalLuma;
     _avgAlpha = other._avgAlpha;
     _avgLuma = other._avgLuma;
     _renderLayerMap = other._renderLayerMap;
+    setAlphaBounds(other._alphaX0, other._alphaY0, other._alphaX1, other._alphaY1);
     return *this;
   }
 
@@ -74,15 +126,25 @@ namespace Comp {
 
   vector<unsigned char>& Image::getData()
   {
+    if (_borrowed != nullptr) {
+      _data.assign(_borrowed.get(), _borrowed.get() + (size_t)_w * _h * 4);
+      _borrowed = nullptr;
+    }
+
     return _data;
   }
 
+  const unsigned char* Image::getPixels()
+  {
+    return (_borrowed != nullptr) ? _borrowed.get() : _data.data();
+  }
+
   string Image::getBase64()
   {
     // convert raw pixels to png
     vector<unsigned char> png;
 
-    unsigned int error = lodepng::encode(png, _data, _w, _h);
+    unsigned int error = lodepng::encode(png, getPixels(), _w, _h);
 
     // convert to base64 string
     return base64_encode(png.data(), (unsigned int)png.size());
@@ -95,7 +157,7 @@ namespace Comp {
 
   void Image::save(string path)
   {
-    unsigned int error = lodepng::encode(path, _data, _w, _h);
+    unsigned int error = lodepng::encode(path, getPixels(), _w, _h);
 
     if (error) {
       getLogger()->log("Error writing image to file " + path + ". Error: " + lodepng_error_text(error), LogLevel::ERR);
@@ -115,7 +177,8 @@ namespace Comp {
   shared_ptr<Image> Image::resize(unsigned int w, unsigned int h)
   {
     shared_ptr<Image> scaled = shared_ptr<Image>(new Image(w, h));
-    stbir_resize_uint8(_data.data(), _w, _h, 0, scaled->_data.data(), w, h, 0, 4);
+    stbir_resize_uint8(getPixels(), _w, _h, 0, scaled->_data.data(), w, h, 0, 4);
+    scaled->updateAlphaBounds();
 
     return scaled;
   }
@@ -127,6 +190,8 @@ namespace Comp {
 
   void Image::reset(float r, float g, float b)
   {
+    getData();
+
     for (int i = 0; i < _data.size() / 4; i++) {
       _data[i * 4] = (unsigned char)(r * 255);
       _data[i * 4 + 1] = (unsigned char)(g * 255);
@@ -137,17 +202,18 @@ namespace Comp {
   RGBAColor Image::getPixel(int index)
   {
     // return black instead of dying for out of bounds
-    if (index < 0 || index >= _data.size() / 4) {
+    if (index < 0 || index >= dataSize() / 4) {
       // but also log
       getLogger()->log("Attempt to access out of bound pixel", Comp::WARN);
       return RGBAColor();
     }
 
+    const unsigned char* px = getPixels();
     RGBAColor c;
-    c._r = _data[index * 4] / 255.0f;
-    c._g = _data[index * 4 + 1] / 255.0f;
-    c._b = _data[index * 4 + 2] / 255.0f;
-    c._a = _data[index * 4 + 3] / 255.0f;
+    c._r = px[index * 4] / 255.0f;
+    c._g = px[index * 4 + 1] / 255.0f;
+    c._b = px[index * 4 + 2] / 255.0f;
+    c._a = px[index * 4 + 3] / 255.0f;
 
     return c;
   }
@@ -161,11 +227,12 @@ namespace Comp {
   {
     int index1 = (x1 + y1 * _w) * 4;
     int index2 = (x2 + y2 * _w) * 4;
+    const unsigned char* px = getPixels();
 
-    return (_data[index1] == _data[index2] &&
-      _data[index1 + 1] == _data[index2 + 1] &&
-      _data[index1 + 2] == _data[index2 + 2] &&
-      _data[index1 + 3] == _data[index2 + 3]);
+    return (px[index1] == px[index2] &&
+      px[index1 + 1] == px[index2 + 1] &&
+      px[index1 + 2] == px[index2 + 2] &&
+      px[index1 + 3] == px[index2 + 3]);
   }
 
   void Image::setPixel(int x, int y, float r, float g, float b, float a)
@@ -174,6 +241,7 @@ namespace Comp {
       return;
 
     int index = (x + y * _w )* 4;
+    getData();
     _data[index] = (unsigned char)(r * 255);
     _data[index + 1] = (unsigned char)(g * 255);
     _data[index + 2] = (unsigned char)(b * 255);
@@ -210,93 +278,34 @@ namespace Comp {
     // the idea here is that image y is similar to image A (this) if there exists
     // a linear transformation x s.t. Ax = y. this is basically a contrast/brightness
     // operation. Values in A are derived from the pixel values of this image.
+    // The fit only needs a few sums over the L channels, see ImageMetrics
+    PatchMoments m = patchMoments(getPixels(), y->getPixels(), getWidth(), getHeight(), 0)[0];
 
-    // set up the proper matrices
-    auto& yData = y->getData();
-
-    Eigen::VectorXd b;
-    b.resize(yData.size() / 4);
-
-    for (int i = 0; i < yData.size() / 4; i++) {
-      // premult color n stuff
-      double r = (yData[i * 4] / 255.0) * (yData[i * 4 + 3] / 255.0);
-      double g = (yData[i * 4 + 1] / 255.0) * (yData[i * 4 + 3] / 255.0);
-      double bl = (yData[i * 4 + 2] / 255.0) * (yData[i * 4 + 3] / 255.0);
-
-      // want L channel of Lab
-      Utils<double>::LabColorT Lab = Utils<double>::RGBToLab(r, g, bl);
-
-      // construct b
-      b[i] = Lab._L;
-    }
-
-    Eigen::MatrixX2d A;
-    A.resize(yData.size() / 4, Eigen::NoChange);
-    double avg = 0;
-
-    // A is a bit annoying since we need the average L before assigning values
-    for (int i = 0; i < _data.size() / 4; i++) {
-      double r = (_data[i * 4] / 255.0) * (_data[i * 4 + 3] / 255.0);
-      double g = (_data[i * 4 + 1] / 255.0) * (_data[i * 4 + 3] / 255.0);
-      double bl = (_data[i * 4 + 2] / 255.0) * (_data[i * 4 + 3] / 255.0);
-
-      // want L channel of Lab
-      Utils<double>::LabColorT Lab = Utils<double>::RGBToLab(r, g, bl);
-      A(i, 0) = Lab._L;
-      A(i, 1) = 1;
-      avg += Lab._L;
-    }
-
-    avg /= (_data.size() / 4);
-
-    // subtract the average from column 0
-    for (int i = 0; i < _data.size() / 4; i++) {
-      A(i, 0) = A(i, 0) - avg;
-    }
-
-    // solve
-    Eigen::Vector2d x = A.colPivHouseholderQr().solve(b);
-
-    double error = (A*x - b).norm() / b.norm();
-    return error;
+    return regressionResidual(m) / sqrt(m._syy);
   }
 
   vector<Eigen::VectorXd> Image::patches(int patchSize)
   {
     vector<Eigen::VectorXd> patch;
 
+    // L channel of the whole image, converted a row at a time
+    vector<double> luma(dataSize() / 4);
+    for (unsigned int y = 0; y < getHeight(); y++)
+      lumaRow(getPixels() + (size_t)y * getWidth() * 4, getWidth(), luma.data() + (size_t)y * getWidth());
+
     // starts in top left, proceeds until dimensions run out.
     for (unsigned int y = 0; y < getHeight(); y += (unsigned int)patchSize) {
       for (unsigned int x = 0; x < getWidth(); x += (unsigned int)patchSize) {
-        vector<double> luma;
-        int count = 0;
+        int pw = min((unsigned int)patchSize, getWidth() - x);
+        int ph = min((unsigned int)patchSize, getHeight() - y);
 
         // grab the patch.
-        for (int j = 0; j < patchSize; j++) {
-          int yloc = y + j;
-
-          for (int i = 0; i < patchSize; i++) {
-            int xloc = x + i;
-
-            if ((unsigned int)xloc >= getWidth() || (unsigned int)yloc >= getHeight())
-              continue;
-
-            // premult color n stuff
-            RGBAColor c = getPixel(xloc, yloc);
-
-            // want L channel of Lab
-            Utils<double>::LabColorT Lab = Utils<double>::RGBToLab(c._r * c._a, c._g * c._a, c._b * c._a);
-
-            // construct b
-            luma.push_back(Lab._L);
-            count++;
-          }
-        }
-
         Eigen::VectorXd p;
-        p.resize(count);
-        for (int i = 0; i < count; i++)
-          p[i] = luma[i];
+        p.resize(pw * ph);
+        for (int j = 0; j < ph; j++) {
+          for (int i = 0; i < pw; i++)
+            p[j * pw + i] = luma[(y + j) * getWidth() + x + i];
+        }
 
         //stringstream ss;
         //ss << "Patch at origin (" << x << "," << y << "): " << p;
@@ -345,42 +354,17 @@ namespace Comp {
 
   vector<double> Image::structIndBinDiff(Image * y, int patchSize)
   {
-    vector<Eigen::VectorXd> xBins = patches(patchSize);
-    vector<Eigen::VectorXd> yBins = y->patches(patchSize);
-
-    vector<double> means;
     vector<double> results;
 
-    // xBins needs the average
-    for (auto& b : xBins) {
-      double avg = 0;
-      for (int i = 0; i < b.size(); i++) {
-        avg += b[i];
-      }
-      means.push_back(avg / b.size());
-    }
-
-    vector<double> diffs;
-    for (int i = 0; i < xBins.size(); i++) {
-      Eigen::MatrixX2d A;
-      A.resize(xBins[i].size(), Eigen::NoChange);
-      for (int j = 0; j < xBins[i].size(); j++) {
-        A(j, 0) = xBins[i][j] - means[i];
-        A(j, 1) = 1;
-      }
-
-      Eigen::Vector2d x = A.colPivHouseholderQr().solve(yBins[i]);
+    if (y->getWidth() != getWidth() || y->getHeight() != getHeight())
+      return results;
 
-      double res = (A*x - yBins[i]).norm();
+    // per patch regression of y on this image, from the summed L channels of each patch
+    for (auto& m : patchMoments(getPixels(), y->getPixels(), getWidth(), getHeight(), patchSize)) {
+      double res = regressionResidual(m);
       if (isnan(res))
         res = 0;
       results.push_back(res);
-
-      //if (yBins[i].norm() == 0)
-        // should this be 0 instead?
-      //  results.push_back((A*x - yBins[i]).norm());
-      //else
-      //  results.push_back((A*x - yBins[i]).norm() / yBins[i].norm());
     }
 
     return results;
@@ -388,18 +372,18 @@ namespace Comp {
 
   double Image::MSSIM(Image * y, int patchSize, double a, double b, double g)
   {
-    double mssim = 0;
+    // unequal images are different
+    if (y->getWidth() != getWidth() || y->getHeight() != getHeight())
+      return 0;
 
-    auto xp = patches(patchSize);
-    auto yp = y->patches(patchSize);
+    double mssim = 0;
 
-    for (int i = 0; i < xp.size(); i++) {
-      double ssim = SSIMBinDiff(xp[i], yp[i], a, b, g);
-      //getLogger()->log("ssim bin " + to_string(i) + ": " + to_string(ssim));
-      mssim += ssim;
+    vector<PatchMoments> moments = patchMoments(getPixels(), y->getPixels(), getWidth(), getHeight(), patchSize);
+    for (auto& m : moments) {
+      mssim += ssim(m, a, b, g);
     }
 
-    return mssim / xp.size();
+    return mssim / moments.size();
   }
 
   double Image::SSIMBinDiff(Eigen::VectorXd x, Eigen::VectorXd y, double a, double b, double g)
@@ -567,10 +551,10 @@ namespace Comp {
     }
 
     // create histograms
-    unsigned char* xPx = _data.data();
-    unsigned char* yPx = y->_data.data();
+    const unsigned char* xPx = getPixels();
+    const unsigned char* yPx = y->getPixels();
 
-    for (int i = 0; i < _data.size() / 4; i++) {
+    for (int i = 0; i < dataSize() / 4; i++) {
       int idx = i * 4;
       float xa = xPx[idx + 3] / 255.0f;
       float ya = yPx[idx + 3] / 255.0f;
@@ -606,10 +590,10 @@ namespace Comp {
     }
 
     // create histograms
-    unsigned char* xPx = _data.data();
-    unsigned char* yPx = y->_data.data();
+    const unsigned char* xPx = getPixels();
+    const unsigned char* yPx = y->getPixels();
 
-    for (int i = 0; i < _data.size() / 4; i++) {
+    for (int i = 0; i < dataSize() / 4; i++) {
       int idx = i * 4;
       float xa = xPx[idx + 3] / 255.0f;
 
@@ -618,7 +602,7 @@ namespace Comp {
       hx[2]->add8BitPixel((unsigned char)(xPx[idx + 2] * xa));
     }
 
-    for (int i = 0; i < y->_data.size() / 4; i++) {
+    for (int i = 0; i < y->dataSize() / 4; i++) {
       int idx = i * 4;
       float ya = yPx[idx + 3] / 255.0f;
 
@@ -643,24 +627,79 @@ namespace Comp {
     _totalAlpha = 0;
     _totalLuma = 0;
 
-    for (int i = 0; i < _data.size() / 4; i++) {
+    const unsigned char* px = getPixels();
+
+    for (int i = 0; i < dataSize() / 4; i++) {
       int idx = i * 4;
-      float a = _data[i + 3] / 255.0f;
+      float a = px[i + 3] / 255.0f;
 
-      auto Lab = Utils<float>::RGBToLab(a * (_data[i] / 255.0f), a* (_data[i + 1] / 255.0f), a* (_data[i + 2] / 255.0f));
+      auto Lab = Utils<float>::RGBToLab(a * (px[i] / 255.0f), a* (px[i + 1] / 255.0f), a* (px[i + 2] / 255.0f));
 
       _totalAlpha += a;
       _totalLuma += Lab._L;
     }
 
-    _avgAlpha = _totalAlpha / (_data.size() / 4);
-    _avgLuma = _totalLuma / (_data.size() / 4);
+    _avgAlpha = _totalAlpha / (dataSize() / 4);
+    _avgLuma = _totalLuma / (dataSize() / 4);
+
+    updateAlphaBounds();
     
     stringstream ss;
     ss << "Analysis complete\nTotal Alpha: " << _totalAlpha << "\nAverage Alpha: " << _avgAlpha << "\nTotal Luma: " << _totalLuma << "\nAverage Luma: " << _avgLuma;
     getLogger()->log(ss.str());
   }
 
+  void Image::getAlphaBounds(int & x0, int & y0, int & x1, int & y1)
+  {
+    x0 = _alphaX0;
+    y0 = _alphaY0;
+    x1 = _alphaX1;
+    y1 = _alphaY1;
+  }
+
+  void Image::setAlphaBounds(int x0, int y0, int x1, int y1)
+  {
+    _alphaX0 = x0;
+    _alphaY0 = y0;
+    _alphaX1 = x1;
+    _alphaY1 = y1;
+  }
+
+  void Image::updateAlphaBounds()
+  {
+    // failed loads can leave the size set without any data
+    if (dataSize() < _w * _h * 4) {
+      setAlphaBounds(0, 0, _w, _h);
+      return;
+    }
+
+    int x0 = _w, y0 = _h, x1 = 0, y1 = 0;
+    const unsigned char* px = getPixels();
+
+    for (int y = 0; y < (int)_h; y++) {
+      const unsigned char* row = px + (size_t)y * _w * 4;
+      int first = -1;
+      int last = -1;
+
+      for (int x = 0; x < (int)_w; x++) {
+        if (row[x * 4 + 3] > 0) {
+          if (first < 0)
+            first = x;
+          last = x;
+        }
+      }
+
+      if (first >= 0) {
+        x0 = min(x0, first);
+        x1 = max(x1, last + 1);
+        y0 = min(y0, y);
+        y1 = y + 1;
+      }
+    }
+
+    setAlphaBounds(x0, y0, x1, y1);
+  }
+
   double Image::avgAlpha(int x, int y, int w, int h)
   {
     double avg = 0;
@@ -683,34 +722,63 @@ namespace Comp {
     // input image is assumed to be the prior state
     Image* ret = new Image(_w, _h);
     vector<unsigned char>& diffs = ret->getData();
-    vector<unsigned char> od = other->getData();
+    const unsigned char* px = getPixels();
+    const unsigned char* od = other->getPixels();
 
-    for (int i = 0; i < _data.size() / 4; i++) {
+    for (int i = 0; i < dataSize() / 4; i++) {
       int idx = i * 4;
 
       // alpha
       diffs[idx + 3] = 255;
 
-      diffs[idx] = (((int)_data[idx] - (int)od[idx]) / 2) + 127;
-      diffs[idx + 1] = (((int)_data[idx + 1] - (int)od[idx + 1]) / 2) + 127;
-      diffs[idx + 2] = (((int)_data[idx + 2] - (int)od[idx + 2]) / 2) + 127;
+      diffs[idx] = (((int)px[idx] - (int)od[idx]) / 2) + 127;
+      diffs[idx + 1] = (((int)px[idx + 1] - (int)od[idx + 1]) / 2) + 127;
+      diffs[idx + 2] = (((int)px[idx + 2] - (int)od[idx + 2]) / 2) + 127;
     }
     
     return ret;
   }
 
+  Image* Image::crop(int x, int y, int w, int h)
+  {
+    Image* ret = new Image(w, h);
+    vector<unsigned char>& retData = ret->getData();
+
+    // part of the rectangle that overlaps this image, in this image's coordinates
+    int sx0 = max(x, 0);
+    int sy0 = max(y, 0);
+    int sx1 = min(x + w, (int)_w);
+    int sy1 = min(y + h, (int)_h);
+
+    if (sx1 <= sx0 || sy1 <= sy0) {
+      ret->setAlphaBounds(0, 0, 0, 0);
+      return ret;
+    }
+
+    const unsigned char* px = getPixels();
+    for (int sy = sy0; sy < sy1; sy++) {
+      memcpy(&retData[((sy - y) * w + (sx0 - x)) * 4], px + ((size_t)sy * _w + sx0) * 4, (sx1 - sx0) * 4);
+    }
+
+    ret->setAlphaBounds(clamp(_alphaX0 - x, 0, w), clamp(_alphaY0 - y, 0, h),
+      clamp(_alphaX1 - x, 0, w), clamp(_alphaY1 - y, 0, h));
+
+    return ret;
+  }
+
   Image* Image::fill(float r, float g, float b)
   {
     Image* ret = new Image(_w, _h);
     vector<unsigned char>& retData = ret->getData();
+    const unsigned char* px = getPixels();
 
-    for (int i = 0; i < _data.size() / 4; i++) {
+    for (int i = 0; i < dataSize() / 4; i++) {
       int idx = i * 4;
 
       retData[idx] = (unsigned char)(r * 255);
       retData[idx + 1] = (unsigned char)(g * 255);
       retData[idx + 2] = (unsigned char)(b * 255);
-      retData[idx + 3] = _data[idx + 3];
+      retData[idx + 3] = px[idx + 3];
     }
 
     return ret;
@@ -788,10 +856,10 @@ namespace Comp {
 
     // this should probably subsample at some point but for now we'll do the slow thing
     // create vectors of lab colors for each of the pixels
-    flann::Matrix<float> xp(new float[(_data.size() / 4) * 3], _data.size() / 4, 3);
-    flann::Matrix<float> yp(new float[(_data.size() / 4) * 3], _data.size() / 4, 3);
+    flann::Matrix<float> xp(new float[(dataSize() / 4) * 3], dataSize() / 4, 3);
+    flann::Matrix<float> yp(new float[(dataSize() / 4) * 3], dataSize() / 4, 3);
 
-    for (int i = 0; i < _data.size() / 4; i++) {
+    for (int i = 0; i < dataSize() / 4; i++) {
       RGBAColor xpixel = getPixel(i);
       RGBAColor ypixel = y->getPixel(i);
 
@@ -824,7 +892,15 @@ namespace Comp {
     return sum;
   }
 
-  vector<string>& Image::getRenderMap()
+  void Image::setStats(float totalAlpha, float avgAlpha, float totalLuma, float avgLuma)
+  {
+    _totalAlpha = totalAlpha;
+    _avgAlpha = avgAlpha;
+    _totalLuma = totalLuma;
+    _avgLuma = avgLuma;
+  }
+
+  RenderLayerMap& Image::getRenderMap()
   {
     return _renderLayerMap;
   }
@@ -930,6 +1006,152 @@ namespace Comp {
     return min;
   }
 
+  FloatImage::FloatImage(unsigned int w, unsigned int h) : _w(w), _h(h),
+    _alphaX0(0), _alphaY0(0), _alphaX1(w), _alphaY1(h)
+  {
+    _data = vector<float>(w * h * 4, 0);
+    _renderLayerMap = RenderLayerMap(w * h);
+  }
+
+  FloatImage::FloatImage(Image * src)
+  {
+    _w = src->getWidth();
+    _h = src->getHeight();
+    _data = vector<float>(_w * _h * 4);
+    fromImage(src);
+    _renderLayerMap = src->getRenderMap();
+  }
+
+  FloatImage::FloatImage(const FloatImage & other)
+  {
+    _w = other._w;
+    _h = other._h;
+    _data = other._data;
+    _renderLayerMap = other._renderLayerMap;
+    _alphaX0 = other._alphaX0;
+    _alphaY0 = other._alphaY0;
+    _alphaX1 = other._alphaX1;
+    _alphaY1 = other._alphaY1;
+  }
+
+  FloatImage & FloatImage::operator=(const FloatImage & other)
+  {
+    // self assignment check
+    if (&other == this)
+      return *this;
+
+    _w = other._w;
+    _h = other._h;
+    _data = other._data;
+    _renderLayerMap = other._renderLayerMap;
+    _alphaX0 = other._alphaX0;
+    _alphaY0 = other._alphaY0;
+    _alphaX1 = other._alphaX1;
+    _alphaY1 = other._alphaY1;
+    return *this;
+  }
+
+  FloatImage::~FloatImage()
+  {
+  }
+
+  vector<float>& FloatImage::getData()
+  {
+    return _data;
+  }
+
+  Image * FloatImage::toImage()
+  {
+    Image* img = new Image(_w, _h);
+    toImage(img);
+    return img;
+  }
+
+  void FloatImage::toImage(Image * dest)
+  {
+    vector<unsigned char>& destPx = dest->getData();
+
+    for (unsigned int i = 0; i < _w * _h; i++) {
+      float a = _data[i * 4 + 3];
+
+      if (a > 0) {
+        destPx[i * 4] = (unsigned char)(clamp(_data[i * 4] / a, 0.0f, 1.0f) * 255);
+        destPx[i * 4 + 1] = (unsigned char)(clamp(_data[i * 4 + 1] / a, 0.0f, 1.0f) * 255);
+        destPx[i * 4 + 2] = (unsigned char)(clamp(_data[i * 4 + 2] / a, 0.0f, 1.0f) * 255);
+      }
+      else {
+        destPx[i * 4] = 255;
+        destPx[i * 4 + 1] = 255;
+        destPx[i * 4 + 2] = 255;
+      }
+
+      destPx[i * 4 + 3] = (unsigned char)(clamp(a, 0.0f, 1.0f) * 255);
+    }
+
+    dest->getRenderMap() = _renderLayerMap;
+    dest->setAlphaBounds(_alphaX0, _alphaY0, _alphaX1, _alphaY1);
+  }
+
+  void FloatImage::fromImage(Image * src)
+  {
+    const unsigned char* srcPx = src->getPixels();
+    src->getAlphaBounds(_alphaX0, _alphaY0, _alphaX1, _alphaY1);
+
+    // everything outside of the alpha bounds is transparent, which is all zeros premultiplied
+    fill(_data.begin(), _data.end(), 0.0f);
+
+    for (int y = _alphaY0; y < _alphaY1; y++) {
+      for (int x = _alphaX0; x < _alphaX1; x++) {
+        int i = x + y * _w;
+        float a = srcPx[i * 4 + 3] / 255.0f;
+        _data[i * 4] = (srcPx[i * 4] / 255.0f) * a;
+        _data[i * 4 + 1] = (srcPx[i * 4 + 1] / 255.0f) * a;
+        _data[i * 4 + 2] = (srcPx[i * 4 + 2] / 255.0f) * a;
+        _data[i * 4 + 3] = a;
+      }
+    }
+  }
+
+  FloatImage* FloatImage::crop(int x, int y, int w, int h)
+  {
+    FloatImage* ret = new FloatImage(w, h);
+    vector<float>& retData = ret->getData();
+
+    int sx0 = max(x, 0);
+    int sy0 = max(y, 0);
+    int sx1 = min(x + w, (int)_w);
+    int sy1 = min(y + h, (int)_h);
+
+    if (sx1 <= sx0 || sy1 <= sy0) {
+      ret->_alphaX0 = ret->_alphaY0 = ret->_alphaX1 = ret->_alphaY1 = 0;
+      return ret;
+    }
+
+    for (int sy = sy0; sy < sy1; sy++) {
+      memcpy(&retData[((sy - y) * w + (sx0 - x)) * 4], &_data[(sy * _w + sx0) * 4], (sx1 - sx0) * 4 * sizeof(float));
+    }
+
+    ret->_alphaX0 = clamp(_alphaX0 - x, 0, w);
+    ret->_alphaY0 = clamp(_alphaY0 - y, 0, h);
+    ret->_alphaX1 = clamp(_alphaX1 - x, 0, w);
+    ret->_alphaY1 = clamp(_alphaY1 - y, 0, h);
+
+    return ret;
+  }
+
+  RenderLayerMap& FloatImage::getRenderMap()
+  {
+    return _renderLayerMap;
+  }
+
+  void FloatImage::getAlphaBounds(int & x0, int & y0, int & x1, int & y1)
+  {
+    x0 = _alphaX0;
+    y0 = _alphaY0;
+    x1 = _alphaX1;
+    y1 = _alphaY1;
+  }
+
   ImportanceMap::ImportanceMap(int w, int h) : _w(w), _h(h)
   {
     _display = shared_ptr<Image>(new Image(_w, _h));
@@ -8,6 +8,8 @@ author: Evan Shimizu
 #define _COMP_IMAGE_H_
 
 #include <vector>
+#include <map>
+#include <cstdint>
 #include <iostream>
 
 // warnings from external libs suppressed 
@@ -29,6 +31,43 @@ author: Evan Shimizu
 using namespace std;
 
 namespace Comp {
+  // Maps out which layer was the most recent to affect each pixel of a render.
+  // Layers are stored as 16 bit ids into a table of names. The id buffer is only allocated
+  // once something is written to it, so images that never get rendered into don't pay for it.
+  class RenderLayerMap {
+  public:
+    RenderLayerMap(unsigned int size = 0);
+
+    // returns the id for the given layer name, adding it to the table if needed.
+    // id 0 is reserved for pixels no layer has touched (name "")
+    uint16_t getId(const string& name);
+
+    // name for the given id
+    const string& getName(uint16_t id) { return _names[id]; }
+
+    // number of entries in the name table
+    size_t numIds() { return _names.size(); }
+
+    // allocates the id buffer. Must be called before writing from multiple threads.
+    void allocate();
+    bool isAllocated() { return _ids.size() > 0; }
+
+    inline uint16_t get(int index) { return (_ids.size() == 0) ? 0 : _ids[index]; }
+    inline void set(int index, uint16_t id) { _ids[index] = id; }
+
+    // name of the layer that last touched the given pixel
+    const string& getLayer(int index) { return _names[get(index)]; }
+
+    // number of pixels covered by the map
+    unsigned int size() { return _size; }
+
+  private:
+    unsigned int _size;
+    vector<uint16_t> _ids;
+    vector<string> _names;
+    map<string, uint16_t> _lookup;
+  };
+
   class Image {
   public:
     // creates a blank image of arbitrary size
@@ -40,6 +79,14 @@ namespace Comp {
     // loads from base64 string
     Image(unsigned int w, unsigned int h, string& data);
 
+    // copies w * h RGBA pixels from data. Stats and alpha bounds are not computed, see analyze and setStats
+    Image(unsigned int w, unsigned int h, const unsigned char* data, string filename = "");
+
+    // uses w * h RGBA pixels owned by something else (a mapped file, for example) without copying them.
+    // data keeps its owner alive for as long as this image or a copy of it uses the pixels. The pixels
+    // are read only, getData copies them into the image first. Stats and alpha bounds are not computed.
+    Image(unsigned int w, unsigned int h, shared_ptr<const unsigned char> data, string filename = "");
+
     // copy constructor
     Image(const Image& other);
 
@@ -49,9 +96,19 @@ namespace Comp {
     // destructor
     ~Image();
 
-    // gets the raw image data (RGBA order)
+    // gets the raw image data (RGBA order). Borrowed pixels are copied into the image on the first call,
+    // so like any other write this can't run while other threads read the image
     vector<unsigned char>& getData();
 
+    // raw image data (RGBA order), read only. Never copies, use this when the pixels aren't modified
+    const unsigned char* getPixels();
+
+    // size of the raw image data in bytes, borrowed or not
+    size_t dataSize() { return (_borrowed != nullptr) ? (size_t)_w * _h * 4 : _data.size(); }
+
+    // true if the pixels are still borrowed, see the shared_ptr constructor
+    bool isBorrowed() { return _borrowed != nullptr; }
+
     // returns the image as a base64 encoded png
     string getBase64();
 
@@ -133,6 +190,10 @@ namespace Comp {
 
     Image* diff(Image* other);
 
+    // returns a w x h image holding the pixels starting at (x, y). Parts of the rectangle
+    // outside of this image are transparent. The caller owns the returned image.
+    Image* crop(int x, int y, int w, int h);
+
     // return a new image filled with the specified solid color
     // alpha is unaffected
     Image* fill(float r, float g, float b);
@@ -148,7 +209,17 @@ namespace Comp {
     float totalLuma() { return _totalLuma; }
     float avgLuma() { return _avgLuma; }
 
-    vector<string>& getRenderMap();
+    // restores stats saved from a previous analyze call
+    void setStats(float totalAlpha, float avgAlpha, float totalLuma, float avgLuma);
+
+    RenderLayerMap& getRenderMap();
+
+    // tight box around the pixels with non-zero alpha, as [x0, x1) x [y0, y1). Empty if x1 <= x0.
+    // The box is cached. analyze and resize compute it, other images start out covering everything.
+    // Call updateAlphaBounds after changing the alpha channel through getData.
+    void getAlphaBounds(int& x0, int& y0, int& x1, int& y1);
+    void setAlphaBounds(int x0, int y0, int x1, int y1);
+    void updateAlphaBounds();
 
   private:
     // loads an image from a file
@@ -178,14 +249,109 @@ namespace Comp {
 
     // raw pixel data
     vector<unsigned char> _data;
+
+    // pixels used instead of _data until getData needs a writable copy
+    shared_ptr<const unsigned char> _borrowed;
     
     // maps out which layer was the most recent to affect the pixel. mostly used internally
-    vector<string> _renderLayerMap;
+    RenderLayerMap _renderLayerMap;
+
+    // see getAlphaBounds
+    int _alphaX0;
+    int _alphaY0;
+    int _alphaX1;
+    int _alphaY1;
 
     // variables for the expression context
     Utils<ExpStep>::RGBAColorT _vars;
   };
 
+  // Floating point working buffer used by the compositor while blending a layer stack.
+  // Pixels are RGBA, premultiplied by alpha and stored in [0, 1] so the intermediate
+  // steps of a render don't round trip through 8 bits. Convert to an Image with toImage
+  // once the render is done.
+  class FloatImage {
+  public:
+    FloatImage(unsigned int w = 0, unsigned int h = 0);
+
+    // converts an 8-bit (unpremultiplied) image. The render map is copied as well.
+    FloatImage(Image* src);
+
+    FloatImage(const FloatImage& other);
+    FloatImage& operator=(const FloatImage& other);
+
+    ~FloatImage();
+
+    // raw premultiplied data (RGBA order)
+    vector<float>& getData();
+
+    unsigned int getWidth() { return _w; }
+    unsigned int getHeight() { return _h; }
+    unsigned int numPx() { return _w * _h; }
+
+    // returns the unpremultiplied color of the pixel. Fully transparent pixels come back as
+    // white with alpha 0, which matches the blank canvas the renderer starts with.
+    inline RGBAColor getPixel(int index) {
+      RGBAColor c;
+      float* px = &_data[index * 4];
+      c._a = px[3];
+
+      if (c._a > 0) {
+        c._r = px[0] / c._a;
+        c._g = px[1] / c._a;
+        c._b = px[2] / c._a;
+      }
+      else {
+        c._r = 1;
+        c._g = 1;
+        c._b = 1;
+      }
+
+      return c;
+    }
+
+    // stores an unpremultiplied color, clamped to [0, 1]. Alpha is left alone.
+    inline void setPixel(int index, RGBAColor& c) {
+      float* px = &_data[index * 4];
+      px[0] = clamp(c._r, 0.0f, 1.0f) * px[3];
+      px[1] = clamp(c._g, 0.0f, 1.0f) * px[3];
+      px[2] = clamp(c._b, 0.0f, 1.0f) * px[3];
+    }
+
+    // converts to an 8-bit unpremultiplied image. The caller owns the returned image.
+    Image* toImage();
+
+    // writes the contents of this image into an existing image of the same size
+    void toImage(Image* dest);
+
+    // reloads data from an 8-bit image of the same size. The alpha bounds are taken from the source
+    void fromImage(Image* src);
+
+    // see Image::crop. The render map is not copied. The caller owns the returned image.
+    FloatImage* crop(int x, int y, int w, int h);
+
+    RenderLayerMap& getRenderMap();
+
+    // see Image::getAlphaBounds. Pixels outside the bounds are all zero. Images converted from
+    // an Image keep its bounds, everything else covers the whole image.
+    void getAlphaBounds(int& x0, int& y0, int& x1, int& y1);
+
+  private:
+    unsigned int _w;
+    unsigned int _h;
+
+    // premultiplied pixel data
+    vector<float> _data;
+
+    // see Image::_renderLayerMap
+    RenderLayerMap _renderLayerMap;
+
+    int _alphaX0;
+    int _alphaY0;
+    int _alphaX1;
+    int _alphaY1;
+  };
+
   // I'm putting this in image because it's small enough to fit and 
   // it's sort of an image extension
   class ImportanceMap {
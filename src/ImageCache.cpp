@@ -0,0 +1,326 @@
+#include "ImageCache.h"
+
+#include <climits>
+
+namespace Comp {
+  ImageCache::ImageCache() : _budget(0), _usage(0), _clock(0)
+  {
+    _scales["micro"] = 0.05f;
+    _scales["thumb"] = 0.15f;
+    _scales["small"] = 0.25f;
+    _scales["medium"] = 0.5f;
+  }
+
+  void ImageCache::set(const string & name, shared_ptr<Image> full)
+  {
+    lock_guard<mutex> lock(_lock);
+
+    for (auto& level : _entries[name]._levels)
+      _usage -= bytes(level.second._img);
+
+    _entries[name]._levels.clear();
+    _entries[name]._full = full;
+  }
+
+  void ImageCache::erase(const string & name)
+  {
+    lock_guard<mutex> lock(_lock);
+
+    if (_entries.count(name) == 0)
+      return;
+
+    for (auto& level : _entries[name]._levels)
+      _usage -= bytes(level.second._img);
+
+    _entries.erase(name);
+  }
+
+  bool ImageCache::has(const string & name)
+  {
+    lock_guard<mutex> lock(_lock);
+    return _entries.count(name) > 0;
+  }
+
+  bool ImageCache::has(const string & name, const string & size)
+  {
+    lock_guard<mutex> lock(_lock);
+    return _entries.count(name) > 0 && (size == "full" || _scales.count(size) > 0);
+  }
+
+  shared_ptr<Image> ImageCache::get(const string & name, const string & size)
+  {
+    shared_ptr<Image> full;
+    float scale;
+
+    {
+      lock_guard<mutex> lock(_lock);
+
+      auto entry = _entries.find(name);
+      if (entry == _entries.end())
+        return nullptr;
+
+      if (size == "full")
+        return entry->second._full;
+
+      auto level = entry->second._levels.find(size);
+      if (level != entry->second._levels.end()) {
+        level->second._lastUse = ++_clock;
+        return level->second._img;
+      }
+
+      if (_scales.count(size) == 0)
+        return nullptr;
+
+      full = entry->second._full;
+      scale = _scales[size];
+    }
+
+    // resizing is the slow part, don't hold the lock for it
+    shared_ptr<Image> scaled = full->resize(scale);
+
+    lock_guard<mutex> lock(_lock);
+
+    // the image or size could have changed while resizing. The copy is still fine to return,
+    // it just doesn't get cached
+    auto entry = _entries.find(name);
+    if (entry == _entries.end() || entry->second._full != full || _scales.count(size) == 0 || _scales[size] != scale)
+      return scaled;
+
+    // another thread may have built the same copy in the meantime
+    auto level = entry->second._levels.find(size);
+    if (level != entry->second._levels.end()) {
+      level->second._lastUse = ++_clock;
+      return level->second._img;
+    }
+
+    CacheLevel& created = entry->second._levels[size];
+    created._img = scaled;
+    created._lastUse = ++_clock;
+    _usage += bytes(scaled);
+
+    evict(name, size);
+
+    return scaled;
+  }
+
+  void ImageCache::prepare(const vector<string>& names, const string & size, int threads, ThreadPool& pool)
+  {
+    if (size == "full")
+      return;
+
+    vector<string> missing;
+
+    {
+      lock_guard<mutex> lock(_lock);
+
+      if (_scales.count(size) == 0)
+        return;
+
+      for (auto& name : names) {
+        auto entry = _entries.find(name);
+        if (entry != _entries.end() && entry->second._levels.count(size) == 0)
+          missing.push_back(name);
+      }
+    }
+
+    // layers are independent, one per chunk so threads that finish early take the next one
+    pool.parallelFor((int)missing.size(), threads, 1, [&](int start, int end) {
+      for (int i = start; i < end; i++)
+        get(missing[i], size);
+    });
+  }
+
+  void ImageCache::invalidate(const string & name)
+  {
+    lock_guard<mutex> lock(_lock);
+
+    if (_entries.count(name) == 0)
+      return;
+
+    for (auto& level : _entries[name]._levels)
+      _usage -= bytes(level.second._img);
+
+    _entries[name]._levels.clear();
+  }
+
+  void ImageCache::setLevel(const string & name, const string & size, shared_ptr<Image> img)
+  {
+    lock_guard<mutex> lock(_lock);
+
+    auto entry = _entries.find(name);
+    if (entry == _entries.end() || size == "full" || _scales.count(size) == 0)
+      return;
+
+    auto level = entry->second._levels.find(size);
+    if (level != entry->second._levels.end())
+      _usage -= bytes(level->second._img);
+
+    CacheLevel& l = entry->second._levels[size];
+    l._img = img;
+    l._lastUse = ++_clock;
+    _usage += bytes(img);
+
+    evict(name, size);
+  }
+
+  void ImageCache::setScale(const string & size, float scale)
+  {
+    lock_guard<mutex> lock(_lock);
+
+    for (auto& entry : _entries) {
+      auto level = entry.second._levels.find(size);
+      if (level != entry.second._levels.end()) {
+        _usage -= bytes(level->second._img);
+        entry.second._levels.erase(level);
+      }
+    }
+
+    _scales[size] = scale;
+  }
+
+  void ImageCache::deleteScale(const string & size)
+  {
+    lock_guard<mutex> lock(_lock);
+
+    for (auto& entry : _entries) {
+      auto level = entry.second._levels.find(size);
+      if (level != entry.second._levels.end()) {
+        _usage -= bytes(level->second._img);
+        entry.second._levels.erase(level);
+      }
+    }
+
+    _scales.erase(size);
+  }
+
+  bool ImageCache::hasSize(const string & size)
+  {
+    lock_guard<mutex> lock(_lock);
+    return size == "full" || _scales.count(size) > 0;
+  }
+
+  float ImageCache::getScale(const string & size)
+  {
+    lock_guard<mutex> lock(_lock);
+
+    if (size == "full")
+      return 1;
+
+    auto s = _scales.find(size);
+    return (s == _scales.end()) ? 0 : s->second;
+  }
+
+  vector<string> ImageCache::getSizes()
+  {
+    lock_guard<mutex> lock(_lock);
+
+    vector<string> sizes;
+    sizes.push_back("full");
+    for (auto& s : _scales)
+      sizes.push_back(s.first);
+
+    return sizes;
+  }
+
+  unsigned int ImageCache::getWidth(const string & size)
+  {
+    lock_guard<mutex> lock(_lock);
+
+    if (_entries.size() == 0)
+      return 0;
+
+    unsigned int w = _entries.begin()->second._full->getWidth();
+    if (size == "full" || _scales.count(size) == 0)
+      return w;
+
+    // same rounding as Image::resize
+    return (unsigned int)(w * _scales[size]);
+  }
+
+  unsigned int ImageCache::getHeight(const string & size)
+  {
+    lock_guard<mutex> lock(_lock);
+
+    if (_entries.size() == 0)
+      return 0;
+
+    unsigned int h = _entries.begin()->second._full->getHeight();
+    if (size == "full" || _scales.count(size) == 0)
+      return h;
+
+    return (unsigned int)(h * _scales[size]);
+  }
+
+  bool ImageCache::empty()
+  {
+    lock_guard<mutex> lock(_lock);
+    return _entries.size() == 0;
+  }
+
+  vector<string> ImageCache::names()
+  {
+    lock_guard<mutex> lock(_lock);
+
+    vector<string> ret;
+    for (auto& entry : _entries)
+      ret.push_back(entry.first);
+
+    return ret;
+  }
+
+  void ImageCache::setMemoryBudget(size_t bytes)
+  {
+    lock_guard<mutex> lock(_lock);
+    _budget = bytes;
+    evict("", "");
+  }
+
+  size_t ImageCache::getMemoryBudget()
+  {
+    lock_guard<mutex> lock(_lock);
+    return _budget;
+  }
+
+  size_t ImageCache::getMemoryUsage()
+  {
+    lock_guard<mutex> lock(_lock);
+    return _usage;
+  }
+
+  size_t ImageCache::bytes(shared_ptr<Image>& img)
+  {
+    return (size_t)img->getWidth() * img->getHeight() * 4;
+  }
+
+  void ImageCache::evict(const string & keepName, const string & keepSize)
+  {
+    if (_budget == 0)
+      return;
+
+    while (_usage > _budget) {
+      // find the least recently used copy. There aren't many (layers x sizes) so a scan is fine
+      CacheEntry* oldestEntry = nullptr;
+      string oldestSize;
+      unsigned long long oldest = ULLONG_MAX;
+
+      for (auto& entry : _entries) {
+        for (auto& level : entry.second._levels) {
+          if (entry.first == keepName && level.first == keepSize)
+            continue;
+
+          if (level.second._lastUse < oldest) {
+            oldest = level.second._lastUse;
+            oldestEntry = &entry.second;
+            oldestSize = level.first;
+          }
+        }
+      }
+
+      if (oldestEntry == nullptr)
+        return;
+
+      _usage -= bytes(oldestEntry->_levels[oldestSize]._img);
+      oldestEntry->_levels.erase(oldestSize);
+    }
+  }
+}
@@ -0,0 +1,102 @@
+/*
+ImageCache.h - Full resolution layer images and their scaled copies for the compositor's render sizes
+author: Evan Shimizu
+*/
+
+#pragma once
+
+#include "Image.h"
+#include "Logger.h"
+#include "ThreadPool.h"
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace Comp {
+  // Holds the full resolution image of each layer (or mask) and the scaled copies used for the
+  // smaller render sizes. Scaled copies are only built the first time they're asked for, and the
+  // least recently used ones are dropped once they take more memory than the budget allows.
+  // Full resolution images are never dropped. All functions are safe to call from multiple threads.
+  class ImageCache {
+  public:
+    // starts out with the default micro, thumb, small and medium sizes
+    ImageCache();
+
+    // sets the full resolution image for name. Any scaled copies of the old image are dropped
+    void set(const string& name, shared_ptr<Image> full);
+    void erase(const string& name);
+
+    bool has(const string& name);
+
+    // true if there's an image named name and size is a known size
+    bool has(const string& name, const string& size);
+
+    // returns the image at the given size, scaling it from the full image if needed.
+    // Returns nullptr if there's no image with that name or no size with that name.
+    shared_ptr<Image> get(const string& name, const string& size = "full");
+
+    // builds the given size for every listed image that doesn't have it yet, split across threads
+    // from the given pool
+    void prepare(const vector<string>& names, const string& size, int threads, ThreadPool& pool);
+
+    // drops the scaled copies of an image. Call after changing the full image in place
+    void invalidate(const string& name);
+
+    // stores an already scaled copy of name, for example one read from a layer cache file.
+    // Ignored if there's no image named name or size is not a known size
+    void setLevel(const string& name, const string& size, shared_ptr<Image> img);
+
+    // adds or changes a size. Existing copies at that size are dropped. Scale is relative to full size
+    void setScale(const string& size, float scale);
+    void deleteScale(const string& size);
+    bool hasSize(const string& size);
+
+    // scale of the given size relative to full size, 0 if size is unknown
+    float getScale(const string& size);
+
+    // all sizes, including full
+    vector<string> getSizes();
+
+    // dimensions of images at the given size. All images in the cache are assumed to be the same
+    // size, so this is computed from the first one without building anything. 0 if there are no images.
+    unsigned int getWidth(const string& size);
+    unsigned int getHeight(const string& size);
+
+    bool empty();
+    vector<string> names();
+
+    // memory budget for scaled copies in bytes, 0 for no limit
+    void setMemoryBudget(size_t bytes);
+    size_t getMemoryBudget();
+
+    // bytes currently used by scaled copies
+    size_t getMemoryUsage();
+
+  private:
+    struct CacheLevel {
+      shared_ptr<Image> _img;
+      unsigned long long _lastUse;
+    };
+
+    struct CacheEntry {
+      shared_ptr<Image> _full;
+      map<string, CacheLevel> _levels;
+    };
+
+    static size_t bytes(shared_ptr<Image>& img);
+
+    // drops least recently used copies until the cache is within budget. The given copy is kept.
+    // _lock must be held
+    void evict(const string& keepName, const string& keepSize);
+
+    map<string, CacheEntry> _entries;
+    map<string, float> _scales;
+
+    size_t _budget;
+    size_t _usage;
+    unsigned long long _clock;
+
+    mutex _lock;
+  };
+}
@@ -0,0 +1,154 @@
+#include "ImageMetrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+namespace Comp {
+  // premultiplied 8 bit channels only take 256 * 256 values, so the inverse sRGB companding
+  // (the slow part of RGBToLab) is looked up. Indexed by (alpha << 8) | channel
+  static const vector<double>& linearTable()
+  {
+    static const vector<double> table = []() {
+      vector<double> t(256 * 256);
+      for (int a = 0; a < 256; a++) {
+        for (int c = 0; c < 256; c++) {
+          double x = (c / 255.0) * (a / 255.0);
+          t[(a << 8) | c] = (x <= 0.04045) ? x / 12.92 : pow((x + 0.055) / 1.055, 2.4);
+        }
+      }
+      return t;
+    }();
+
+    return table;
+  }
+
+  // cube root for the Lab conversion. std::cbrt is most of the cost of the conversion, this starts from an
+  // estimate made from the exponent bits and refines it with Halley's method to double precision
+  static inline double cubeRoot(double v)
+  {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    bits = bits / 3 + 0x2A9F7893782DA1CEull;
+
+    double r;
+    memcpy(&r, &bits, sizeof(r));
+
+    for (int i = 0; i < 3; i++) {
+      double r3 = r * r * r;
+      r = r * (r3 + 2 * v) / (2 * r3 + v);
+    }
+
+    return r;
+  }
+
+  void lumaRow(const unsigned char* px, int count, double* out)
+  {
+    const double* lin = linearTable().data();
+
+    // L only depends on Y, see Utils::RGBToLab for the constants
+    const double e = 216.0 / 24389.0;
+    const double k = 24389.0 / 27.0;
+
+    for (int i = 0; i < count; i++) {
+      const unsigned char* p = px + i * 4;
+      int a = p[3] << 8;
+
+      double Y = 0.2225045 * lin[a | p[0]] + 0.7168786 * lin[a | p[1]] + 0.0606169 * lin[a | p[2]];
+      double fy = (Y > e) ? cubeRoot(Y) : (k * Y + 16) / 116;
+      out[i] = 116 * fy - 16;
+    }
+  }
+
+  vector<PatchMoments> patchMoments(const unsigned char* x, const unsigned char* y, int w, int h, int patchSize)
+  {
+    int pw = (patchSize <= 0) ? max(w, 1) : patchSize;
+    int ph = (patchSize <= 0) ? max(h, 1) : patchSize;
+    int cols = (patchSize <= 0) ? 1 : (w + pw - 1) / pw;
+    int rows = (patchSize <= 0) ? 1 : (h + ph - 1) / ph;
+
+    vector<PatchMoments> moments(cols * rows, PatchMoments{ 0, 0, 0, 0, 0, 0 });
+    vector<double> lx(w);
+    vector<double> ly(w);
+
+    for (int row = 0; row < h; row++) {
+      lumaRow(x + (size_t)row * w * 4, w, lx.data());
+      lumaRow(y + (size_t)row * w * 4, w, ly.data());
+
+      PatchMoments* patchRow = moments.data() + (row / ph) * cols;
+
+      for (int c = 0; c < cols; c++) {
+        int start = c * pw;
+        int end = min(w, start + pw);
+
+        double sx = 0, sy = 0, sxx = 0, syy = 0, sxy = 0;
+        for (int i = start; i < end; i++) {
+          double vx = lx[i];
+          double vy = ly[i];
+          sx += vx;
+          sy += vy;
+          sxx += vx * vx;
+          syy += vy * vy;
+          sxy += vx * vy;
+        }
+
+        PatchMoments& m = patchRow[c];
+        m._n += end - start;
+        m._sx += sx;
+        m._sy += sy;
+        m._sxx += sxx;
+        m._syy += syy;
+        m._sxy += sxy;
+      }
+    }
+
+    return moments;
+  }
+
+  double regressionResidual(const PatchMoments& m)
+  {
+    if (m._n == 0)
+      return 0;
+
+    // centered sums
+    double cxx = m._sxx - m._sx * m._sx / m._n;
+    double cyy = m._syy - m._sy * m._sy / m._n;
+    double cxy = m._sxy - m._sx * m._sy / m._n;
+
+    // the two columns of the fit (x - mean and 1) are orthogonal, so q is the mean of y and
+    // p is cxy / cxx. A flat x patch leaves only q, same as the rank revealing QR would
+    double res = cyy;
+    if (cxx > 1e-10 * m._sxx)
+      res -= cxy * cxy / cxx;
+
+    return sqrt(max(0.0, res));
+  }
+
+  double ssim(const PatchMoments& m, double a, double b, double g)
+  {
+    double ux = m._sx / m._n;
+    double uy = m._sy / m._n;
+
+    // sample (n - 1) variance and covariance
+    double sx = sqrt(max(0.0, (m._sxx - m._sx * ux) / (m._n - 1)));
+    double sy = sqrt(max(0.0, (m._syy - m._sy * uy) / (m._n - 1)));
+    double sxy = (m._sxy - m._sx * uy) / (m._n - 1);
+
+    // stability constants
+    double c1 = 1e-3;
+    double c2 = 3e-3;
+    double c3 = c2 / 2;
+
+    // luma
+    double l = (2 * ux * uy + c1) / (ux * ux + uy * uy + c1);
+
+    // contrast
+    double c = (2 * sx * sy + c2) / (sx * sx + sy * sy + c2);
+
+    // structure
+    double s = (sxy + c3) / (sx * sy + c3);
+
+    return pow(l, a) * pow(c, b) * pow(s, g);
+  }
+}
@@ -0,0 +1,39 @@
+/*
+ImageMetrics.h - Structural comparison metrics computed from per patch sums of the L channel
+author: Evan Shimizu
+*/
+
+#pragma once
+
+#include <vector>
+
+using namespace std;
+
+namespace Comp {
+  // Sums over one patch of the L channel (Lab) of two images x and y. Everything the
+  // regression and SSIM comparisons need can be computed from these, so the pixels
+  // never need to be collected into per patch vectors.
+  struct PatchMoments {
+    double _n;
+    double _sx;
+    double _sy;
+    double _sxx;
+    double _syy;
+    double _sxy;
+  };
+
+  // L channel of count RGBA pixels, premultiplied by alpha first. Same result as Utils<double>::RGBAToLab
+  void lumaRow(const unsigned char* px, int count, double* out);
+
+  // Moments of each patch of two w x h RGBA images, in the same order as Image::patches (row major, starting
+  // top left, partial patches on the right and bottom edges). Computed in one pass over both images.
+  // patchSize <= 0 treats the entire image as one patch.
+  vector<PatchMoments> patchMoments(const unsigned char* x, const unsigned char* y, int w, int h, int patchSize);
+
+  // Residual norm of the least squares fit y = p * (x - mean(x)) + q over the patch.
+  // This is the fit Image::structDiff and Image::structIndBinDiff solve with a QR decomposition.
+  double regressionResidual(const PatchMoments& m);
+
+  // SSIM of the patch with the given exponents on the luma, contrast and structure terms. Same as Image::SSIMBinDiff
+  double ssim(const PatchMoments& m, double a = 0, double b = 0, double g = 1);
+}
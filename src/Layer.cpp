@@ -1,16 +1,16 @@
 #include "Layer.h"
 
 namespace Comp {
-  Layer::Layer() : _name(""), _adjustment(false)
+  Layer::Layer() : _name(""), _adjustment(false), _settings(make_shared<LayerSettings>())
   {
   }
 
-  Layer::Layer(string name, shared_ptr<Image> img) : _name(name), _adjustment(false)
+  Layer::Layer(string name, shared_ptr<Image> img) : _name(name), _adjustment(false), _settings(make_shared<LayerSettings>())
   {
     init(img);
   }
 
-  Layer::Layer(string name) : _name(name), _adjustment(true)
+  Layer::Layer(string name) : _name(name), _adjustment(true), _settings(make_shared<LayerSettings>())
   {
     init(nullptr);
   }
@@ -22,18 +22,10 @@ namespace Comp {
     _visible(other._visible),
     _image(other._image),
     _adjustment(other._adjustment),
-    _adjustments(other._adjustments),
-    _curves(other._curves),
-    _grad(other._grad),
-    _selectiveColor(other._selectiveColor),
-    _cbChannel(other._cbChannel),
-    _cbSettings(other._cbSettings),
+    _settings(other._settings),
     _mask(other._mask),
     _offsetX(other._offsetX),
-    _offsetY(other._offsetY),
-    _precompOrder(other._precompOrder),
-    _localAdjOrderOverride(other._localAdjOrderOverride),
-    _localSelectionGroupOverride(other._localSelectionGroupOverride)
+    _offsetY(other._offsetY)
   {
   }
 
@@ -45,18 +37,10 @@ namespace Comp {
     _visible = other._visible;
     _image = other._image;
     _adjustment = other._adjustment;
-    _adjustments = other._adjustments;
-    _curves = other._curves;
-    _grad = other._grad;
-    _selectiveColor = other._selectiveColor;
-    _cbChannel = other._cbChannel;
-    _cbSettings = other._cbSettings;
+    _settings = other._settings;
     _mask = other._mask;
     _offsetX = other._offsetX;
     _offsetY = other._offsetY;
-    _precompOrder = other._precompOrder;
-    _localAdjOrderOverride = other._localAdjOrderOverride;
-    _localSelectionGroupOverride = other._localSelectionGroupOverride;
 
     return *this;
   }
@@ -127,23 +111,23 @@ namespace Comp {
 
   void Layer::setConditionalBlend(string channel, map<string, float> settings)
   {
-    _cbChannel = channel;
-    _cbSettings = settings;
+    edit()._cbChannel = channel;
+    edit()._cbSettings = settings;
   }
 
   bool Layer::shouldConditionalBlend()
   {
-    return _cbSettings.size() > 0;
+    return _settings->_cbSettings.size() > 0;
   }
 
   const string& Layer::getConditionalBlendChannel()
   {
-    return _cbChannel;
+    return _settings->_cbChannel;
   }
 
   const map<string, float>& Layer::getConditionalBlendSettings()
   {
-    return _cbSettings;
+    return _settings->_cbSettings;
   }
 
   string Layer::getName()
@@ -170,8 +154,8 @@ namespace Comp {
 
   map<string, float> Layer::getAdjustment(AdjustmentType type)
   {
-    if (_adjustments.count(type) > 0) {
-      return _adjustments[type];
+    if (_settings->_adjustments.count(type) > 0) {
+      return _settings->_adjustments[type];
     }
     
     return map<string, float>();
@@ -179,33 +163,33 @@ namespace Comp {
 
   void Layer::deleteAdjustment(AdjustmentType type)
   {
-    _adjustments.erase(type);
+    edit()._adjustments.erase(type);
 
     if (type == AdjustmentType::CURVES) {
-      _curves.clear();
+      edit()._curves.clear();
     }
     if (type == AdjustmentType::GRADIENT) {
-      _grad._colors.clear();
-      _grad._x.clear();
+      edit()._grad._colors.clear();
+      edit()._grad._x.clear();
     }
     if (type == AdjustmentType::SELECTIVE_COLOR) {
-      _selectiveColor.clear();
+      edit()._selectiveColor.clear();
     }
   }
 
   void Layer::deleteAllAdjustments()
   {
-    _adjustments.clear();
-    _curves.clear();
-    _grad._colors.clear();
-    _grad._x.clear();
-    _selectiveColor.clear();
+    edit()._adjustments.clear();
+    edit()._curves.clear();
+    edit()._grad._colors.clear();
+    edit()._grad._x.clear();
+    edit()._selectiveColor.clear();
   }
 
   vector<AdjustmentType> Layer::getAdjustments()
   {
     vector<AdjustmentType> types;
-    for (auto a : _adjustments) {
+    for (auto a : _settings->_adjustments) {
       types.push_back(a.first);
     }
 
@@ -214,19 +198,19 @@ namespace Comp {
 
   void Layer::addAdjustment(AdjustmentType type, string param, float val)
   {
-    _adjustments[type][param] = val;
+    edit()._adjustments[type][param] = val;
   }
 
   void Layer::addAdjustment(AdjustmentType type, map<string, float> vals)
   {
-    _adjustments[type] = vals;
+    edit()._adjustments[type] = vals;
   }
 
   void Layer::addHSLAdjustment(float hue, float sat, float light)
   {
-    _adjustments[AdjustmentType::HSL]["hue"] = fmodf(hue, 1);
-    _adjustments[AdjustmentType::HSL]["sat"] = clamp<float>(sat, 0, 1);
-    _adjustments[AdjustmentType::HSL]["light"] = clamp<float>(light, 0, 1);
+    edit()._adjustments[AdjustmentType::HSL]["hue"] = fmodf(hue, 1);
+    edit()._adjustments[AdjustmentType::HSL]["sat"] = clamp<float>(sat, 0, 1);
+    edit()._adjustments[AdjustmentType::HSL]["light"] = clamp<float>(light, 0, 1);
   }
 
   void Layer::addLevelsAdjustment(float inMin, float inMax, float gamma, float outMin, float outMax)
@@ -245,29 +229,29 @@ namespace Comp {
       outMax = (outMax > 1) ? 1 : outMax;
     }
 
-    _adjustments[AdjustmentType::LEVELS]["inMin"] = clamp<float>(inMin, 0, 1);
-    _adjustments[AdjustmentType::LEVELS]["inMax"] = clamp<float>(inMax, 0, 1);
-    _adjustments[AdjustmentType::LEVELS]["gamma"] = clamp<float>(gamma, 0, 1);
-    _adjustments[AdjustmentType::LEVELS]["outMin"] = clamp<float>(outMin, 0, 1);
-    _adjustments[AdjustmentType::LEVELS]["outMax"] = clamp<float>(outMax, 0, 1);
+    edit()._adjustments[AdjustmentType::LEVELS]["inMin"] = clamp<float>(inMin, 0, 1);
+    edit()._adjustments[AdjustmentType::LEVELS]["inMax"] = clamp<float>(inMax, 0, 1);
+    edit()._adjustments[AdjustmentType::LEVELS]["gamma"] = clamp<float>(gamma, 0, 1);
+    edit()._adjustments[AdjustmentType::LEVELS]["outMin"] = clamp<float>(outMin, 0, 1);
+    edit()._adjustments[AdjustmentType::LEVELS]["outMax"] = clamp<float>(outMax, 0, 1);
   }
 
   void Layer::addCurvesChannel(string channel, Curve curve)
   {
-    _adjustments[AdjustmentType::CURVES][channel] = 1;
-    _curves[channel] = curve;
+    edit()._adjustments[AdjustmentType::CURVES][channel] = 1;
+    edit()._curves[channel] = curve;
   }
 
   void Layer::deleteCurvesChannel(string channel)
   {
-    _adjustments[AdjustmentType::CURVES].erase(channel);
-    _curves.erase(channel);
+    edit()._adjustments[AdjustmentType::CURVES].erase(channel);
+    edit()._curves.erase(channel);
   }
 
   Curve Layer::getCurveChannel(string channel)
   {
-    if (_curves.count(channel) > 0) {
-      return _curves[channel];
+    if (_settings->_curves.count(channel) > 0) {
+      return _settings->_curves[channel];
     }
 
     return Curve();
@@ -275,112 +259,111 @@ namespace Comp {
 
   void Layer::addExposureAdjustment(float exp, float offset, float gamma)
   {
-    _adjustments[AdjustmentType::EXPOSURE]["exposure"] = clamp<float>(exp, 0, 1);
-    _adjustments[AdjustmentType::EXPOSURE]["offset"] = clamp<float>(offset, 0, 1);
-    _adjustments[AdjustmentType::EXPOSURE]["gamma"] = clamp<float>(gamma, 0, 1);
+    edit()._adjustments[AdjustmentType::EXPOSURE]["exposure"] = clamp<float>(exp, 0, 1);
+    edit()._adjustments[AdjustmentType::EXPOSURE]["offset"] = clamp<float>(offset, 0, 1);
+    edit()._adjustments[AdjustmentType::EXPOSURE]["gamma"] = clamp<float>(gamma, 0, 1);
   }
 
   void Layer::addGradientAdjustment(Gradient grad)
   {
-    _adjustments[AdjustmentType::GRADIENT]["on"] = 1;
-    _grad = grad;
+    edit()._adjustments[AdjustmentType::GRADIENT]["on"] = 1;
+    edit()._grad = grad;
   }
 
   void Layer::addSelectiveColorAdjustment(bool relative, map<string, map<string, float>> data)
   {
-    _adjustments[AdjustmentType::SELECTIVE_COLOR]["relative"] = relative ? 1.0f : 0;
-    _selectiveColor = data;
+    edit()._adjustments[AdjustmentType::SELECTIVE_COLOR]["relative"] = relative ? 1.0f : 0;
+    edit()._selectiveColor = data;
   }
 
   float Layer::getSelectiveColorChannel(string channel, string param)
   {
-    // fairly sure it just creates defaults if the keys don't exist so should be fine
-    if (_selectiveColor.count(channel) == 0) {
-      _selectiveColor[channel][param] = 0.5;
+    auto c = _settings->_selectiveColor.find(channel);
+    if (c != _settings->_selectiveColor.end()) {
+      auto p = c->second.find(param);
+      if (p != c->second.end())
+        return p->second;
     }
 
-    if (_selectiveColor[channel].count(param) == 0) {
-      _selectiveColor[channel][param] = 0.5;
-      return 0.5;
-    }
-
-    return _selectiveColor[channel][param];
+    // missing keys default to 0.5 and are stored in the layer
+    edit()._selectiveColor[channel][param] = 0.5;
+    return 0.5;
   }
 
   void Layer::setSelectiveColorChannel(string channel, string param, float val)
   {
-    _selectiveColor[channel][param] = val;
+    edit()._selectiveColor[channel][param] = val;
   }
 
   void Layer::addColorBalanceAdjustment(bool preserveLuma, float shadowR, float shadowG, float shadowB,
     float midR, float midG, float midB,
     float highR, float highG, float highB)
   {
-    _adjustments[AdjustmentType::COLOR_BALANCE]["preserveLuma"] = preserveLuma ? 1.0f : 0;
-    _adjustments[AdjustmentType::COLOR_BALANCE]["shadowR"] = clamp<float>(shadowR, 0, 1);
-    _adjustments[AdjustmentType::COLOR_BALANCE]["shadowG"] = clamp<float>(shadowG, 0, 1);
-    _adjustments[AdjustmentType::COLOR_BALANCE]["shadowB"] = clamp<float>(shadowB, 0, 1);
-    _adjustments[AdjustmentType::COLOR_BALANCE]["midR"] = clamp<float>(midR, 0, 1);
-    _adjustments[AdjustmentType::COLOR_BALANCE]["midG"] = clamp<float>(midG, 0, 1);
-    _adjustments[AdjustmentType::COLOR_BALANCE]["midB"] = clamp<float>(midB, 0, 1);
-    _adjustments[AdjustmentType::COLOR_BALANCE]["highR"] = clamp<float>(highR, 0, 1);
-    _adjustments[AdjustmentType::COLOR_BALANCE]["highG"] = clamp<float>(highG, 0, 1);
-    _adjustments[AdjustmentType::COLOR_BALANCE]["highB"] = clamp<float>(highB, 0, 1);
+    edit()._adjustments[AdjustmentType::COLOR_BALANCE]["preserveLuma"] = preserveLuma ? 1.0f : 0;
+    edit()._adjustments[AdjustmentType::COLOR_BALANCE]["shadowR"] = clamp<float>(shadowR, 0, 1);
+    edit()._adjustments[AdjustmentType::COLOR_BALANCE]["shadowG"] = clamp<float>(shadowG, 0, 1);
+    edit()._adjustments[AdjustmentType::COLOR_BALANCE]["shadowB"] = clamp<float>(shadowB, 0, 1);
+    edit()._adjustments[AdjustmentType::COLOR_BALANCE]["midR"] = clamp<float>(midR, 0, 1);
+    edit()._adjustments[AdjustmentType::COLOR_BALANCE]["midG"] = clamp<float>(midG, 0, 1);
+    edit()._adjustments[AdjustmentType::COLOR_BALANCE]["midB"] = clamp<float>(midB, 0, 1);
+    edit()._adjustments[AdjustmentType::COLOR_BALANCE]["highR"] = clamp<float>(highR, 0, 1);
+    edit()._adjustments[AdjustmentType::COLOR_BALANCE]["highG"] = clamp<float>(highG, 0, 1);
+    edit()._adjustments[AdjustmentType::COLOR_BALANCE]["highB"] = clamp<float>(highB, 0, 1);
   }
 
   void Layer::addPhotoFilterAdjustment(bool preserveLuma, float r, float g, float b, float d)
   {
-    _adjustments[AdjustmentType::PHOTO_FILTER]["r"] = clamp<float>(r, 0, 1);
-    _adjustments[AdjustmentType::PHOTO_FILTER]["g"] = clamp<float>(g, 0, 1);
-    _adjustments[AdjustmentType::PHOTO_FILTER]["b"] = clamp<float>(b, 0, 1);
-    _adjustments[AdjustmentType::PHOTO_FILTER]["density"] = clamp<float>(d, 0, 1);
-    _adjustments[AdjustmentType::PHOTO_FILTER]["preserveLuma"] = preserveLuma ? 1.0f : 0;
+    edit()._adjustments[AdjustmentType::PHOTO_FILTER]["r"] = clamp<float>(r, 0, 1);
+    edit()._adjustments[AdjustmentType::PHOTO_FILTER]["g"] = clamp<float>(g, 0, 1);
+    edit()._adjustments[AdjustmentType::PHOTO_FILTER]["b"] = clamp<float>(b, 0, 1);
+    edit()._adjustments[AdjustmentType::PHOTO_FILTER]["density"] = clamp<float>(d, 0, 1);
+    edit()._adjustments[AdjustmentType::PHOTO_FILTER]["preserveLuma"] = preserveLuma ? 1.0f : 0;
   }
 
   void Layer::addColorAdjustment(float r, float g, float b, float a)
   {
-    _adjustments[AdjustmentType::COLORIZE]["r"] = clamp<float>(r, 0, 1);
-    _adjustments[AdjustmentType::COLORIZE]["g"] = clamp<float>(g, 0, 1);
-    _adjustments[AdjustmentType::COLORIZE]["b"] = clamp<float>(b, 0, 1);
-    _adjustments[AdjustmentType::COLORIZE]["a"] = clamp<float>(a, 0, 1);
+    edit()._adjustments[AdjustmentType::COLORIZE]["r"] = clamp<float>(r, 0, 1);
+    edit()._adjustments[AdjustmentType::COLORIZE]["g"] = clamp<float>(g, 0, 1);
+    edit()._adjustments[AdjustmentType::COLORIZE]["b"] = clamp<float>(b, 0, 1);
+    edit()._adjustments[AdjustmentType::COLORIZE]["a"] = clamp<float>(a, 0, 1);
   }
 
   void Layer::addLighterColorAdjustment(float r, float g, float b, float a)
   {
-    _adjustments[AdjustmentType::LIGHTER_COLORIZE]["r"] = clamp<float>(r, 0, 1);
-    _adjustments[AdjustmentType::LIGHTER_COLORIZE]["g"] = clamp<float>(g, 0, 1);
-    _adjustments[AdjustmentType::LIGHTER_COLORIZE]["b"] = clamp<float>(b, 0, 1);
-    _adjustments[AdjustmentType::LIGHTER_COLORIZE]["a"] = clamp<float>(a, 0, 1);
+    edit()._adjustments[AdjustmentType::LIGHTER_COLORIZE]["r"] = clamp<float>(r, 0, 1);
+    edit()._adjustments[AdjustmentType::LIGHTER_COLORIZE]["g"] = clamp<float>(g, 0, 1);
+    edit()._adjustments[AdjustmentType::LIGHTER_COLORIZE]["b"] = clamp<float>(b, 0, 1);
+    edit()._adjustments[AdjustmentType::LIGHTER_COLORIZE]["a"] = clamp<float>(a, 0, 1);
   }
 
   void Layer::addOverwriteColorAdjustment(float r, float g, float b, float a)
   {
-    _adjustments[AdjustmentType::OVERWRITE_COLOR]["r"] = clamp<float>(r, 0, 1);
-    _adjustments[AdjustmentType::OVERWRITE_COLOR]["g"] = clamp<float>(g, 0, 1);
-    _adjustments[AdjustmentType::OVERWRITE_COLOR]["b"] = clamp<float>(b, 0, 1);
-    _adjustments[AdjustmentType::OVERWRITE_COLOR]["a"] = clamp<float>(a, 0, 1);
+    edit()._adjustments[AdjustmentType::OVERWRITE_COLOR]["r"] = clamp<float>(r, 0, 1);
+    edit()._adjustments[AdjustmentType::OVERWRITE_COLOR]["g"] = clamp<float>(g, 0, 1);
+    edit()._adjustments[AdjustmentType::OVERWRITE_COLOR]["b"] = clamp<float>(b, 0, 1);
+    edit()._adjustments[AdjustmentType::OVERWRITE_COLOR]["a"] = clamp<float>(a, 0, 1);
   }
 
   void Layer::addInvertAdjustment()
   {
     // just add the key, there are no settings for this
-    _adjustments[AdjustmentType::INVERT]["on"] = 1;
+    edit()._adjustments[AdjustmentType::INVERT]["on"] = 1;
   }
 
   void Layer::addBrightnessAdjustment(float b, float c)
   {
-    _adjustments[AdjustmentType::BRIGHTNESS]["brightness"] = clamp<float>(b, 0, 1);
-    _adjustments[AdjustmentType::BRIGHTNESS]["contrast"] = clamp<float>(c, 0, 1);
+    edit()._adjustments[AdjustmentType::BRIGHTNESS]["brightness"] = clamp<float>(b, 0, 1);
+    edit()._adjustments[AdjustmentType::BRIGHTNESS]["contrast"] = clamp<float>(c, 0, 1);
   }
 
   map<string, map<string, float>> Layer::getSelectiveColor()
   {
-    return _selectiveColor;
+    return _settings->_selectiveColor;
   }
 
-  Gradient& Layer::getGradient()
+  const Gradient& Layer::getGradient()
   {
-    return _grad;
+    return _settings->_grad;
   }
 
   void Layer::resetImage()
@@ -396,21 +379,21 @@ namespace Comp {
     _expOpacity = context.registerParam(ParamType::FREE_PARAM, pfx + "opacity", _opacity);
     index++;
 
-    for (auto a : _adjustments) {
+    for (auto a : edit()._adjustments) {
       for (auto params : a.second) {
         _expAdjustments[a.first][params.first] = context.registerParam(ParamType::FREE_PARAM, pfx + params.first, params.second);
         index++;
       }
     }
 
-    if (_adjustments.count(SELECTIVE_COLOR) > 0) {
+    if (edit()._adjustments.count(SELECTIVE_COLOR) > 0) {
       // selective color
       vector<string> channels = { "reds", "yellows", "greens", "cyans", "blues", "magentas", "neutrals", "blacks", "whites" };
       vector<string> params = { "cyan", "magenta", "yellow", "black" };
 
       for (auto c : channels) {
         for (auto p : params) {
-          _expSelectiveColor[c][p] = context.registerParam(ParamType::FREE_PARAM, pfx + "sc_" + c + "_" + p, _selectiveColor[c][p]);
+          _expSelectiveColor[c][p] = context.registerParam(ParamType::FREE_PARAM, pfx + "sc_" + c + "_" + p, edit()._selectiveColor[c][p]);
           index++;
         }
       }
@@ -423,20 +406,20 @@ namespace Comp {
   {
     params.push_back(_opacity);
 
-    for (auto a : _adjustments) {
+    for (auto a : edit()._adjustments) {
       for (auto p : a.second) {
         params.push_back(p.second);
       }
     }
 
-    if (_adjustments.count(SELECTIVE_COLOR) > 0) {
+    if (edit()._adjustments.count(SELECTIVE_COLOR) > 0) {
       // selective color
       vector<string> channels = { "reds", "yellows", "greens", "cyans", "blues", "magentas", "neutrals", "blacks", "whites" };
       vector<string> names = { "cyan", "magenta", "yellow", "black" };
 
       for (auto c : channels) {
         for (auto p : names) {
-          params.push_back(_selectiveColor[c][p]);
+          params.push_back(edit()._selectiveColor[c][p]);
         }
       }
     }
@@ -457,7 +440,7 @@ namespace Comp {
     paramList.push_back(opacity);
 
     // regular adjustments
-    for (auto a : _adjustments) {
+    for (auto a : _settings->_adjustments) {
       for (auto p : a.second) {
         nlohmann::json param;
         param["layerName"] = _name;
@@ -473,7 +456,7 @@ namespace Comp {
     }
 
     // selective color
-    if (_adjustments.count(SELECTIVE_COLOR) > 0) {
+    if (_settings->_adjustments.count(SELECTIVE_COLOR) > 0) {
       vector<string> channels = { "reds", "yellows", "greens", "cyans", "blues", "magentas", "neutrals", "blacks", "whites" };
       vector<string> names = { "cyan", "magenta", "yellow", "black" };
       
@@ -485,8 +468,8 @@ namespace Comp {
           param["adjustmentType"] = SELECTIVE_COLOR;
           param["adjustmentName"] = "selectiveColor";
 
-          if (_selectiveColor.count(c) > 0 && _selectiveColor[c].count(p) > 0) {
-            param["value"] = _selectiveColor[c][p];
+          if (_settings->_selectiveColor.count(c) > 0 && _settings->_selectiveColor[c].count(p) > 0) {
+            param["value"] = _settings->_selectiveColor[c][p];
           }
           else {
             param["value"] = 0.5;
@@ -522,17 +505,17 @@ namespace Comp {
 
   void Layer::setPrecompOrder(vector<string> order)
   {
-    _precompOrder = order;
+    edit()._precompOrder = order;
   }
 
   vector<string> Layer::getPrecompOrder()
   {
-    return _precompOrder;
+    return _settings->_precompOrder;
   }
 
   bool Layer::isPrecomp()
   {
-    return _precompOrder.size() > 0;
+    return _settings->_precompOrder.size() > 0;
   }
 
   void Layer::setLocalAdjOverride(vector<AdjustmentType> order)
@@ -547,17 +530,17 @@ namespace Comp {
       tmp.insert(a);
     }
 
-    _localAdjOrderOverride = order;
+    edit()._localAdjOrderOverride = order;
   }
 
   vector<AdjustmentType> Layer::getLocalAdjOverride()
   {
-    return _localAdjOrderOverride;
+    return _settings->_localAdjOrderOverride;
   }
 
   bool Layer::hasLocalAdjOverride()
   {
-    return _localAdjOrderOverride.size() > 0;
+    return _settings->_localAdjOrderOverride.size() > 0;
   }
 
   void Layer::setLocalSelectionGroupOverride(vector<string> order)
@@ -572,17 +555,136 @@ namespace Comp {
       tmp.insert(g);
     }
 
-    _localSelectionGroupOverride = order;
+    edit()._localSelectionGroupOverride = order;
   }
 
   vector<string> Layer::getLocalSelectionGroupOverride()
   {
-    return _localSelectionGroupOverride;
+    return _settings->_localSelectionGroupOverride;
   }
 
   bool Layer::hasLocalSelectionGroupOverride()
   {
-    return _localSelectionGroupOverride.size() > 0;
+    return _settings->_localSelectionGroupOverride.size() > 0;
+  }
+
+  size_t Layer::stateHash()
+  {
+    size_t h = 0;
+    hashCombine(h, _name);
+    hashCombine(h, (int)_mode);
+    hashCombine(h, _opacity);
+    hashCombine(h, _visible);
+    hashCombine(h, _adjustment);
+    hashCombine(h, _offsetX);
+    hashCombine(h, _offsetY);
+    hashCombine(h, (void*)_image.get());
+    hashCombine(h, (void*)_mask.get());
+
+    hashCombine(h, adjustmentHash());
+
+    hashCombine(h, _settings->_cbChannel);
+    for (auto& cb : _settings->_cbSettings) {
+      hashCombine(h, cb.first);
+      hashCombine(h, cb.second);
+    }
+
+    for (auto& p : _settings->_precompOrder)
+      hashCombine(h, p);
+
+    for (auto& a : _settings->_localAdjOrderOverride)
+      hashCombine(h, (int)a);
+
+    for (auto& g : _settings->_localSelectionGroupOverride)
+      hashCombine(h, g);
+
+    return h;
+  }
+
+  size_t Layer::adjustmentHash()
+  {
+    size_t h = 0;
+
+    for (auto& a : _settings->_adjustments) {
+      hashCombine(h, (int)a.first);
+      for (auto& p : a.second) {
+        hashCombine(h, p.first);
+        hashCombine(h, p.second);
+      }
+    }
+
+    for (auto& c : _settings->_curves) {
+      hashCombine(h, c.first);
+      for (auto& pt : c.second._pts) {
+        hashCombine(h, pt._x);
+        hashCombine(h, pt._y);
+      }
+    }
+
+    for (int i = 0; i < _settings->_grad._x.size() && i < _settings->_grad._colors.size(); i++) {
+      hashCombine(h, _settings->_grad._x[i]);
+      hashCombine(h, _settings->_grad._colors[i]._r);
+      hashCombine(h, _settings->_grad._colors[i]._g);
+      hashCombine(h, _settings->_grad._colors[i]._b);
+    }
+
+    for (auto& sc : _settings->_selectiveColor) {
+      hashCombine(h, sc.first);
+      for (auto& p : sc.second) {
+        hashCombine(h, p.first);
+        hashCombine(h, p.second);
+      }
+    }
+
+    return h;
+  }
+
+  bool Layer::sameAdjustments(const LayerSettings& s)
+  {
+    const LayerSettings& o = *_settings;
+
+    if (o._adjustments != s._adjustments || o._selectiveColor != s._selectiveColor)
+      return false;
+
+    if (o._curves.size() != s._curves.size())
+      return false;
+
+    for (auto a = o._curves.begin(), b = s._curves.begin(); a != o._curves.end(); a++, b++) {
+      if (a->first != b->first || a->second._pts.size() != b->second._pts.size())
+        return false;
+
+      for (int i = 0; i < a->second._pts.size(); i++) {
+        if (a->second._pts[i]._x != b->second._pts[i]._x || a->second._pts[i]._y != b->second._pts[i]._y)
+          return false;
+      }
+    }
+
+    if (o._grad._x != s._grad._x || o._grad._colors.size() != s._grad._colors.size())
+      return false;
+
+    for (int i = 0; i < o._grad._colors.size(); i++) {
+      const RGBColor& a = o._grad._colors[i];
+      const RGBColor& b = s._grad._colors[i];
+      if (a._r != b._r || a._g != b._g || a._b != b._b)
+        return false;
+    }
+
+    return true;
+  }
+
+  const LayerSettings& Layer::getSettings()
+  {
+    return *_settings;
+  }
+
+  LayerSettings& Layer::edit()
+  {
+    // another layer still refers to these settings, so make a private copy before writing
+    if (_settings.use_count() > 1) {
+      _settings = make_shared<LayerSettings>(*_settings);
+    }
+
+    return *_settings;
   }
 
   void Layer::init(shared_ptr<Image> source)
@@ -36,6 +36,29 @@ namespace Comp {
     PASS_THROUGH = 16
   };
 
+  // Adjustment settings of a layer. These are shared between copies of a layer and only
+  // duplicated when one of the copies changes them (see Layer::edit), so copying a Context
+  // doesn't deep copy every adjustment map.
+  struct LayerSettings {
+    map<AdjustmentType, map<string, float> > _adjustments;
+    map<string, Curve> _curves;
+    Gradient _grad;
+    map<string, map<string, float> > _selectiveColor;
+
+    // conditional blending
+    string _cbChannel;
+    map<string, float> _cbSettings;
+
+    // if the layer is a precomposed group, we'll need to render that.
+    // this is just a recursive render call using the precomposition order
+    // stored in this layer (same context)
+    vector<string> _precompOrder;
+
+    // local ordering
+    vector<AdjustmentType> _localAdjOrderOverride;
+    vector<string> _localSelectionGroupOverride;
+  };
+
   class Layer {
   public:
     // blank layer, doesn't refer to much really
@@ -125,8 +148,9 @@ namespace Comp {
 
     template <typename T>
     inline T evalCurve(string channel, T x) {
-      if (_curves.count(channel) > 0) {
-        return _curves[channel].eval(x);
+      auto c = _settings->_curves.find(channel);
+      if (c != _settings->_curves.end()) {
+        return c->second.eval(x);
       }
 
       return x;
@@ -134,15 +158,15 @@ namespace Comp {
 
     template <typename T>
     inline typename Utils<T>::RGBColorT evalGradient(T x) {
-      if (_adjustments.count(AdjustmentType::GRADIENT) > 0) {
-        return _grad.eval(x);
+      if (_settings->_adjustments.count(AdjustmentType::GRADIENT) > 0) {
+        return _settings->_grad.eval(x);
       }
 
       return Utils<T>::RGBColorT();
     }
 
     map<string, map<string, float>> getSelectiveColor();
-    Gradient& getGradient();
+    const Gradient& getGradient();
 
     // resets image to white with alpha 1
     void resetImage();
@@ -185,6 +209,18 @@ namespace Comp {
     vector<string> getLocalSelectionGroupOverride();
     bool hasLocalSelectionGroupOverride();
 
+    // hash of every setting that changes how this layer renders. Image data is
+    // identified by pointer, so replacing pixels in place is not detected.
+    size_t stateHash();
+
+    // hash of just the adjustment settings (adjustments, curves, gradient, selective color)
+    size_t adjustmentHash();
+
+    // true if the adjustment settings in s (the ones adjustmentHash covers) are the same as this layer's.
+    // Caches keyed by adjustmentHash keep a copy of getSettings to rule out collisions
+    bool sameAdjustments(const LayerSettings& s);
+    const LayerSettings& getSettings();
+
   private:
     // initializes default layer settings
     void init(shared_ptr<Image> source);
@@ -203,20 +239,11 @@ namespace Comp {
     // Note that if adjustment is true, this layer is an adjustment layer and applies to
     // the current composition. If adjustment is false, this layer itself has adjustments
     // and the adjustments apply to only this layer.
-    map<AdjustmentType, map<string, float> > _adjustments;
-    
-    // curves yay
-    map<string, Curve> _curves;
-
-    // gradient yay
-    Gradient _grad;
-
-    // selective color yay?
-    map<string, map<string, float> > _selectiveColor;
+    // Never null. Read through _settings, write through edit().
+    shared_ptr<LayerSettings> _settings;
 
-    // conditional blending
-    string _cbChannel;
-    map<string, float> _cbSettings;
+    // returns settings that are safe to modify, copying them first if they're shared
+    LayerSettings& edit();
 
     // pointer to image data, stored in compositor
     shared_ptr<Image> _image;
@@ -226,15 +253,6 @@ namespace Comp {
 
     float _offsetX;
     float _offsetY;
-
-    // if the layer is a precomposed group, we'll need to render that.
-    // this is just a recursive render call using the precomposition order
-    // stored in this layer (same context)
-    vector<string> _precompOrder;
-
-    // local ordering
-    vector<AdjustmentType> _localAdjOrderOverride;
-    vector<string> _localSelectionGroupOverride;
   };
 
   typedef map<string, Layer> Context;
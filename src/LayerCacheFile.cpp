@@ -0,0 +1,414 @@
+#include "LayerCacheFile.h"
+
+#include <cstdio>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace Comp {
+  // file layout, all values little endian
+  // header: magic, version, flags, entry count, table length in bytes
+  // table: per entry source, size, scale, w, h, source bytes, source time, stats[4], bounds[4], offset, length
+  // strings are a uint32 length followed by the characters. Source times are in platform ticks (see fileStamp)
+  static const char layerCacheMagic[4] = { 'C', 'L', 'Y', 'R' };
+  static const uint32_t layerCacheVersion = 2;
+  static const size_t layerCacheHeaderSize = 4 + 4 + 4 + 4 + 8;
+  static const uint64_t layerCacheAlign = 4096;
+
+  template <typename T>
+  static void writeValue(vector<unsigned char>& buf, T val)
+  {
+    const unsigned char* p = (const unsigned char*)&val;
+    buf.insert(buf.end(), p, p + sizeof(T));
+  }
+
+  static void writeString(vector<unsigned char>& buf, const string& s)
+  {
+    writeValue<uint32_t>(buf, (uint32_t)s.size());
+    buf.insert(buf.end(), s.begin(), s.end());
+  }
+
+  template <typename T>
+  static bool readValue(const unsigned char* data, size_t length, size_t& pos, T& val)
+  {
+    if (pos + sizeof(T) > length)
+      return false;
+
+    memcpy(&val, data + pos, sizeof(T));
+    pos += sizeof(T);
+    return true;
+  }
+
+  static bool readString(const unsigned char* data, size_t length, size_t& pos, string& s)
+  {
+    uint32_t len;
+    if (!readValue(data, length, pos, len) || pos + len > length)
+      return false;
+
+    s = string((const char*)data + pos, len);
+    pos += len;
+    return true;
+  }
+
+  LayerCacheFile::Mapping::Mapping(const unsigned char* data, size_t length, void* fileHandle, void* mapHandle) :
+    _data(data), _length(length), _fileHandle(fileHandle), _mapHandle(mapHandle)
+  {
+  }
+
+  LayerCacheFile::Mapping::~Mapping()
+  {
+#ifdef _WIN32
+    UnmapViewOfFile(_data);
+    CloseHandle((HANDLE)_mapHandle);
+    CloseHandle((HANDLE)_fileHandle);
+#else
+    munmap((void*)_data, _length);
+#endif
+  }
+
+  LayerCacheFile::LayerCacheFile() : _data(nullptr), _length(0)
+  {
+  }
+
+  LayerCacheFile::~LayerCacheFile()
+  {
+    close();
+  }
+
+  bool LayerCacheFile::open(string file)
+  {
+    close();
+
+#ifdef _WIN32
+    HANDLE f = CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (f == INVALID_HANDLE_VALUE) {
+      getLogger()->log("Failed to open layer cache " + file, LogLevel::WARN);
+      return false;
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(f, &fileSize) || fileSize.QuadPart == 0) {
+      CloseHandle(f);
+      getLogger()->log("Layer cache " + file + " is empty", LogLevel::WARN);
+      return false;
+    }
+
+    HANDLE m = CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL);
+    void* view = (m == NULL) ? NULL : MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+    if (view == NULL) {
+      if (m != NULL)
+        CloseHandle(m);
+      CloseHandle(f);
+      getLogger()->log("Failed to map layer cache " + file, LogLevel::WARN);
+      return false;
+    }
+
+    _mapping = shared_ptr<Mapping>(new Mapping((const unsigned char*)view, (size_t)fileSize.QuadPart, f, m));
+#else
+    int f = ::open(file.c_str(), O_RDONLY);
+    if (f < 0) {
+      getLogger()->log("Failed to open layer cache " + file, LogLevel::WARN);
+      return false;
+    }
+
+    struct stat st;
+    if (fstat(f, &st) != 0 || st.st_size == 0) {
+      ::close(f);
+      getLogger()->log("Layer cache " + file + " is empty", LogLevel::WARN);
+      return false;
+    }
+
+    void* view = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, f, 0);
+
+    // the mapping stays valid after the descriptor is closed
+    ::close(f);
+
+    if (view == MAP_FAILED) {
+      getLogger()->log("Failed to map layer cache " + file, LogLevel::WARN);
+      return false;
+    }
+
+    _mapping = shared_ptr<Mapping>(new Mapping((const unsigned char*)view, (size_t)st.st_size, nullptr, nullptr));
+#endif
+
+    _data = _mapping->_data;
+    _length = _mapping->_length;
+
+    _filename = file;
+
+    // header
+    size_t pos = 0;
+    char magic[4];
+    uint32_t version, flags, count;
+    uint64_t tableLength;
+
+    bool valid = readValue(_data, _length, pos, magic) && memcmp(magic, layerCacheMagic, 4) == 0 &&
+      readValue(_data, _length, pos, version) && version == layerCacheVersion &&
+      readValue(_data, _length, pos, flags) && flags == 0 &&
+      readValue(_data, _length, pos, count) &&
+      readValue(_data, _length, pos, tableLength) && tableLength <= _length - layerCacheHeaderSize;
+
+    // entries are read from the table only
+    size_t tableEnd = valid ? layerCacheHeaderSize + (size_t)tableLength : 0;
+
+    // entry table
+    for (uint32_t i = 0; valid && i < count; i++) {
+      string source;
+      Entry e;
+
+      valid = readString(_data, tableEnd, pos, source) &&
+        readString(_data, tableEnd, pos, e._size) &&
+        readValue(_data, tableEnd, pos, e._scale) &&
+        readValue(_data, tableEnd, pos, e._w) &&
+        readValue(_data, tableEnd, pos, e._h) &&
+        readValue(_data, tableEnd, pos, e._sourceBytes) &&
+        readValue(_data, tableEnd, pos, e._sourceTime) &&
+        readValue(_data, tableEnd, pos, e._stats) &&
+        readValue(_data, tableEnd, pos, e._bounds) &&
+        readValue(_data, tableEnd, pos, e._offset) &&
+        readValue(_data, tableEnd, pos, e._length);
+
+      // pixel data has to be entirely inside the file, after the table
+      valid = valid && e._length == (uint64_t)e._w * e._h * 4 && e._offset >= tableEnd && e._offset <= _length &&
+        e._length <= _length - e._offset;
+
+      // alpha bounds are used to skip pixels when rendering, they have to be inside the image
+      valid = valid && 0 <= e._bounds[0] && e._bounds[0] <= e._bounds[2] && (int64_t)e._bounds[2] <= e._w &&
+        0 <= e._bounds[1] && e._bounds[1] <= e._bounds[3] && (int64_t)e._bounds[3] <= e._h;
+
+      if (valid)
+        _entries[source].push_back(e);
+    }
+
+    valid = valid && pos == tableEnd;
+
+    if (!valid) {
+      getLogger()->log(file + " is not a valid layer cache file", LogLevel::WARN);
+      close();
+      return false;
+    }
+
+    getLogger()->log("Opened layer cache " + file + " with " + to_string(count) + " images", LogLevel::INFO);
+    return true;
+  }
+
+  void LayerCacheFile::close()
+  {
+    // images from get may still be using the mapping, the last one to go unmaps it
+    _mapping = nullptr;
+    _data = nullptr;
+    _length = 0;
+    _entries.clear();
+    _filename = "";
+  }
+
+  bool LayerCacheFile::isOpen()
+  {
+    return _data != nullptr;
+  }
+
+  shared_ptr<Image> LayerCacheFile::get(const string & source, const string & size)
+  {
+    auto entries = _entries.find(source);
+    if (entries == _entries.end())
+      return nullptr;
+
+    for (auto& e : entries->second) {
+      if (e._size != size)
+        continue;
+
+      if (!isCurrent(source, e))
+        return nullptr;
+
+      // keep the name the png loader would have given the image
+      size_t slash = source.find_last_of("/\\");
+      string filename = (slash == string::npos) ? source : source.substr(slash + 1);
+
+      // shares ownership of the mapping, pointing at this entry's pixels
+      shared_ptr<const unsigned char> px = shared_ptr<const unsigned char>(_mapping, _data + e._offset);
+
+      shared_ptr<Image> img = shared_ptr<Image>(new Image(e._w, e._h, px, filename));
+      img->setStats(e._stats[0], e._stats[1], e._stats[2], e._stats[3]);
+      img->setAlphaBounds(e._bounds[0], e._bounds[1], e._bounds[2], e._bounds[3]);
+      return img;
+    }
+
+    return nullptr;
+  }
+
+  map<string, float> LayerCacheFile::getSizes(const string & source)
+  {
+    map<string, float> sizes;
+
+    auto entries = _entries.find(source);
+    if (entries == _entries.end())
+      return sizes;
+
+    for (auto& e : entries->second) {
+      if (isCurrent(source, e))
+        sizes[e._size] = e._scale;
+    }
+
+    return sizes;
+  }
+
+  bool LayerCacheFile::write(string file, const vector<LayerCacheItem>& items)
+  {
+    // table first, offsets are filled in once the table size is known
+    vector<Entry> entries;
+    vector<const LayerCacheItem*> written;
+
+    for (auto& item : items) {
+      Entry e;
+      if (item._img == nullptr || !fileStamp(item._source, e._sourceBytes, e._sourceTime)) {
+        getLogger()->log("Skipping layer cache entry for " + item._source + ". Source file not found.", LogLevel::WARN);
+        continue;
+      }
+
+      e._size = item._size;
+      e._scale = item._scale;
+      e._w = item._img->getWidth();
+      e._h = item._img->getHeight();
+      e._stats[0] = item._img->totalAlpha();
+      e._stats[1] = item._img->avgAlpha();
+      e._stats[2] = item._img->totalLuma();
+      e._stats[3] = item._img->avgLuma();
+
+      // images with no visible pixels have inverted bounds, those are stored empty
+      int x0, y0, x1, y1;
+      item._img->getAlphaBounds(x0, y0, x1, y1);
+      if (x1 <= x0 || y1 <= y0)
+        x0 = y0 = x1 = y1 = 0;
+
+      e._bounds[0] = x0;
+      e._bounds[1] = y0;
+      e._bounds[2] = x1;
+      e._bounds[3] = y1;
+      e._length = (uint64_t)e._w * e._h * 4;
+
+      entries.push_back(e);
+      written.push_back(&item);
+    }
+
+    auto buildTable = [&]() {
+      vector<unsigned char> table;
+      for (int i = 0; i < entries.size(); i++) {
+        Entry& e = entries[i];
+        writeString(table, written[i]->_source);
+        writeString(table, e._size);
+        writeValue(table, e._scale);
+        writeValue(table, e._w);
+        writeValue(table, e._h);
+        writeValue(table, e._sourceBytes);
+        writeValue(table, e._sourceTime);
+        for (int j = 0; j < 4; j++)
+          writeValue(table, e._stats[j]);
+        for (int j = 0; j < 4; j++)
+          writeValue(table, e._bounds[j]);
+        writeValue(table, e._offset);
+        writeValue(table, e._length);
+      }
+      return table;
+    };
+
+    // the table size doesn't depend on the offset values, so build it once to measure it
+    for (auto& e : entries)
+      e._offset = 0;
+
+    uint64_t offset = layerCacheHeaderSize + buildTable().size();
+    for (auto& e : entries) {
+      offset = (offset + layerCacheAlign - 1) / layerCacheAlign * layerCacheAlign;
+      e._offset = offset;
+      offset += e._length;
+    }
+
+    vector<unsigned char> table = buildTable();
+
+    vector<unsigned char> header;
+    header.insert(header.end(), layerCacheMagic, layerCacheMagic + 4);
+    writeValue(header, layerCacheVersion);
+    writeValue<uint32_t>(header, 0);
+    writeValue<uint32_t>(header, (uint32_t)entries.size());
+    writeValue<uint64_t>(header, (uint64_t)table.size());
+
+    string tmp = file + ".tmp";
+    FILE* out = fopen(tmp.c_str(), "wb");
+    if (out == nullptr) {
+      getLogger()->log("Failed to write layer cache " + file, LogLevel::ERR);
+      return false;
+    }
+
+    bool ok = fwrite(header.data(), 1, header.size(), out) == header.size() &&
+      fwrite(table.data(), 1, table.size(), out) == table.size();
+
+    uint64_t pos = header.size() + table.size();
+    vector<unsigned char> padding;
+    for (int i = 0; ok && i < entries.size(); i++) {
+      padding.assign((size_t)(entries[i]._offset - pos), 0);
+      const unsigned char* px = written[i]->_img->getPixels();
+
+      ok = fwrite(padding.data(), 1, padding.size(), out) == padding.size() &&
+        fwrite(px, 1, (size_t)entries[i]._length, out) == entries[i]._length;
+      pos = entries[i]._offset + entries[i]._length;
+    }
+
+    ok = (fclose(out) == 0) && ok;
+
+    // rename replaces an existing file in one step on posix. On windows it fails if the destination
+    // exists, and removing it first would leave no cache at all if the move then failed
+#ifdef _WIN32
+    ok = ok && MoveFileExA(tmp.c_str(), file.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    ok = ok && rename(tmp.c_str(), file.c_str()) == 0;
+#endif
+
+    if (!ok) {
+      remove(tmp.c_str());
+      getLogger()->log("Failed to write layer cache " + file, LogLevel::ERR);
+      return false;
+    }
+
+    getLogger()->log("Wrote layer cache " + file + " with " + to_string(entries.size()) + " images", LogLevel::INFO);
+    return true;
+  }
+
+  bool LayerCacheFile::isCurrent(const string & source, const Entry & e)
+  {
+    int64_t bytes, time;
+    return fileStamp(source, bytes, time) && bytes == e._sourceBytes && time == e._sourceTime;
+  }
+
+  bool LayerCacheFile::fileStamp(const string & file, int64_t & bytes, int64_t & time)
+  {
+    // whole seconds would miss a png saved twice within the same second, so this uses the
+    // full resolution of the file system: 100ns FILETIME ticks on windows, nanoseconds elsewhere
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    if (!GetFileAttributesExA(file.c_str(), GetFileExInfoStandard, &attr))
+      return false;
+
+    bytes = ((int64_t)attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+    time = ((int64_t)attr.ftLastWriteTime.dwHighDateTime << 32) | attr.ftLastWriteTime.dwLowDateTime;
+#else
+    struct stat st;
+    if (stat(file.c_str(), &st) != 0)
+      return false;
+
+    bytes = (int64_t)st.st_size;
+#ifdef __APPLE__
+    time = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    time = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+#endif
+    return true;
+  }
+}
@@ -0,0 +1,101 @@
+/*
+LayerCacheFile.h - Binary sidecar file holding decoded layer images so they don't need to be decoded from png again
+author: Evan Shimizu
+*/
+
+#pragma once
+
+#include "Image.h"
+#include "Logger.h"
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+namespace Comp {
+  // one image to write to a layer cache file
+  struct LayerCacheItem {
+    // png the image was decoded from. Entries are looked up by this path and
+    // are ignored once the png changes (size or modification time)
+    string _source;
+
+    // cache size name ("full" for the original image) and its scale relative to full size
+    string _size;
+    float _scale;
+
+    shared_ptr<Image> _img;
+  };
+
+  // Layer cache files are a small header, a table of entries, and then the raw RGBA pixels of each
+  // entry starting on a page boundary. Pixels are stored unpremultiplied, the same as Image.
+  // Files are opened by mapping them read only, so processes on the same machine loading the same file
+  // share the pages through the OS cache. Images returned by get borrow the mapped pixels instead of
+  // copying them (see Image::isBorrowed) and keep the mapping alive, even after the file is closed.
+  // An image only gets its own copy if something modifies it through Image::getData.
+  class LayerCacheFile {
+  public:
+    LayerCacheFile();
+    ~LayerCacheFile();
+
+    // maps an existing cache file. Returns false if the file can't be opened or isn't a layer cache file
+    bool open(string file);
+    void close();
+    bool isOpen();
+
+    // image decoded from source at the given size, or nullptr if the file has no up to date copy
+    shared_ptr<Image> get(const string& source, const string& size = "full");
+
+    // sizes stored for source, with their scales. Empty if the file has no up to date copy of source
+    map<string, float> getSizes(const string& source);
+
+    // writes a new cache file holding the given images. The file is written next to the destination
+    // and then moved into place, so processes that have the old file open are not affected. On windows
+    // the move fails while the old file is mapped (by any process, or by images still borrowing from it),
+    // and the old file is kept.
+    static bool write(string file, const vector<LayerCacheItem>& items);
+
+  private:
+    struct Entry {
+      string _size;
+      float _scale;
+      uint32_t _w;
+      uint32_t _h;
+      int64_t _sourceBytes;
+      int64_t _sourceTime;
+      float _stats[4];
+      int32_t _bounds[4];
+      uint64_t _offset;
+      uint64_t _length;
+    };
+
+    // true if the source file still has the size and modification time recorded for e
+    static bool isCurrent(const string& source, const Entry& e);
+
+    // size and modification time of a file, with the time at the file system's full resolution.
+    // False if the file doesn't exist
+    static bool fileStamp(const string& file, int64_t& bytes, int64_t& time);
+
+    // a mapped file. Unmapped once the cache file and every image borrowing from it let go of it
+    struct Mapping {
+      Mapping(const unsigned char* data, size_t length, void* fileHandle, void* mapHandle);
+      ~Mapping();
+
+      const unsigned char* _data;
+      size_t _length;
+
+      // platform specific handles for the mapping
+      void* _fileHandle;
+      void* _mapHandle;
+    };
+
+    // source -> entries, one per size
+    map<string, vector<Entry>> _entries;
+
+    string _filename;
+    shared_ptr<Mapping> _mapping;
+
+    // same as _mapping->_data and _mapping->_length, null and 0 while closed
+    const unsigned char* _data;
+    size_t _length;
+  };
+}
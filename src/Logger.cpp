@@ -20,6 +20,7 @@ namespace Comp {
   void Logger::log(string msg, LogLevel level)
   {
     if ((int)level >= _level) {
+      lock_guard<mutex> lock(_lock);
       if (_file.is_open()) {
         _file << "[" << logLevelToString(level) << "]\t" << printTime() << " " << msg << "\n";
         _file.flush();
@@ -14,6 +14,7 @@ author: Evan Shimizu
 #include <chrono>
 #include <time.h>
 #include <iomanip>
+#include <mutex>
 
 using namespace std;
 
@@ -44,6 +45,9 @@ namespace Comp
 
     ofstream _file;
     int _level;
+
+    // images and searches log from worker threads
+    mutex _lock;
   };
 
   // program-wide access to logger. Access should be through getLogger,
@@ -0,0 +1,103 @@
+/*
+SampleQueue.h - Bounded lock-free queue for passing search results from worker threads to a single reader
+author: Evan Shimizu
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+using namespace std;
+
+namespace Comp {
+  // Fixed capacity ring buffer that any number of threads can push to and one thread pops from.
+  // Neither side takes a lock. Each slot carries a sequence number saying whether it's free for the
+  // producer at a given position or holds data for the consumer, so producers only contend on the
+  // enqueue counter. Capacity is rounded up to a power of two.
+  template <typename T>
+  class SampleQueue {
+  public:
+    SampleQueue(size_t capacity) {
+      size_t size = 2;
+      while (size < capacity)
+        size *= 2;
+
+      _mask = size - 1;
+      _cells = unique_ptr<Cell[]>(new Cell[size]);
+      for (size_t i = 0; i < size; i++)
+        _cells[i]._seq.store(i, memory_order_relaxed);
+
+      _enqueue.store(0, memory_order_relaxed);
+      _dequeue.store(0, memory_order_relaxed);
+    }
+
+    // returns false if the queue is full. Safe to call from any thread
+    bool push(const T& val) {
+      size_t pos = _enqueue.load(memory_order_relaxed);
+      Cell* cell;
+
+      for (;;) {
+        cell = &_cells[pos & _mask];
+        size_t seq = cell->_seq.load(memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+
+        if (dif == 0) {
+          // slot is free at this position, claim it
+          if (_enqueue.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+            break;
+        }
+        else if (dif < 0) {
+          // the consumer hasn't freed this slot yet
+          return false;
+        }
+        else {
+          // another producer claimed it first
+          pos = _enqueue.load(memory_order_relaxed);
+        }
+      }
+
+      cell->_data = val;
+      cell->_seq.store(pos + 1, memory_order_release);
+      return true;
+    }
+
+    // returns false if the queue is empty. Only one thread may pop
+    bool pop(T& val) {
+      size_t pos = _dequeue.load(memory_order_relaxed);
+      Cell& cell = _cells[pos & _mask];
+      size_t seq = cell._seq.load(memory_order_acquire);
+
+      if ((intptr_t)seq - (intptr_t)(pos + 1) < 0)
+        return false;
+
+      val = cell._data;
+      cell._seq.store(pos + _mask + 1, memory_order_release);
+      _dequeue.store(pos + 1, memory_order_relaxed);
+      return true;
+    }
+
+    size_t capacity() { return _mask + 1; }
+
+    // number of items waiting. Only a snapshot while producers are running
+    size_t size() {
+      size_t e = _enqueue.load(memory_order_relaxed);
+      size_t d = _dequeue.load(memory_order_relaxed);
+      return (e > d) ? e - d : 0;
+    }
+
+  private:
+    struct Cell {
+      atomic<size_t> _seq;
+      T _data;
+    };
+
+    unique_ptr<Cell[]> _cells;
+    size_t _mask;
+
+    // kept on separate cache lines so producers and the consumer don't share one
+    alignas(64) atomic<size_t> _enqueue;
+    alignas(64) atomic<size_t> _dequeue;
+  };
+}
@@ -9,7 +9,7 @@ ExpSearchSample::ExpSearchSample(shared_ptr<Image> img, Context ctx, vector<doub
 }
 
 ExpSearchSample::ExpSearchSample(const ExpSearchSample & other) : _render(other._render), _ctx(other._ctx),
-  _brightness(other._brightness), _hue(other._hue), _sat(other._sat), _ctxVec(other._ctxVec)
+  _brightness(other._brightness), _hue(other._hue), _sat(other._sat), _descriptor(other._descriptor), _ctxVec(other._ctxVec)
 {
 }
 
@@ -54,9 +54,31 @@ Context ExpSearchSample::getContext()
   return _ctx;
 }
 
+// descriptor layout, see ExpSearchSample::_descriptor
+static const int descBrightBins = 16;
+static const int descHueBins = 18;
+static const int descSatBins = 10;
+static const int descGrid = 8;
+
+int ExpSearchSample::descriptorSize()
+{
+  return descBrightBins + descHueBins + descSatBins + descGrid * descGrid * 2;
+}
+
 void ExpSearchSample::preProcess()
 {
-  vector<unsigned char> imgData = _render->getData();
+  vector<unsigned char>& imgData = _render->getData();
+  int w = _render->getWidth();
+  int h = max(1, (int)_render->getHeight());
+
+  _descriptor = vector<float>(descriptorSize(), 0);
+  float* bright = _descriptor.data();
+  float* hue = bright + descBrightBins;
+  float* sat = hue + descHueBins;
+  float* gridMean = sat + descSatBins;
+  float* gridStd = gridMean + descGrid * descGrid;
+  vector<int> gridCount(descGrid * descGrid, 0);
+
   for (int i = 0; i < imgData.size() / 4; i++) {
     int index = i * 4;
     float alpha = imgData[index + 3] / 255.0f;
@@ -70,6 +92,31 @@ void ExpSearchSample::preProcess()
     _brightness.add(lab._L);
     _hue.add(hsl._h);
     _sat.add(hsl._s);
+
+    // descriptor
+    float L = clamp(lab._L / 100.0f, 0.0f, 1.0f);
+    float hueDeg = (hsl._h < 0) ? hsl._h + 360 : hsl._h;
+    bright[min((int)(L * descBrightBins), descBrightBins - 1)]++;
+    hue[clamp((int)(hueDeg / 360 * descHueBins), 0, descHueBins - 1)]++;
+    sat[clamp((int)(hsl._s * descSatBins), 0, descSatBins - 1)]++;
+
+    int cell = min((i % w) * descGrid / w, descGrid - 1) + min((i / w) * descGrid / h, descGrid - 1) * descGrid;
+    gridMean[cell] += L;
+    gridStd[cell] += L * L;
+    gridCount[cell]++;
+  }
+
+  float n = max(1.0f, (float)(imgData.size() / 4));
+  for (int i = 0; i < descBrightBins + descHueBins + descSatBins; i++)
+    _descriptor[i] /= n;
+
+  for (int i = 0; i < descGrid * descGrid; i++) {
+    if (gridCount[i] == 0)
+      continue;
+
+    float mean = gridMean[i] / gridCount[i];
+    gridMean[i] = mean;
+    gridStd[i] = sqrt(max(0.0f, gridStd[i] / gridCount[i] - mean * mean));
   }
 }
 
@@ -90,6 +137,7 @@ ExpSearchSet::ExpSearchSet()
   _ssimA = 0;
   _ssimB = 0;
   _ssimG = 1;
+  _neighbors = 8;
 
   _idCounter = 0;
 }
@@ -109,6 +157,9 @@ ExpSearchSet::ExpSearchSet(map<string, float>& settings)
   _ssimA = settings["ssimA"];
   _ssimB = settings["ssimB"];
   _ssimG = settings["ssimG"];
+  _neighbors = (settings.count("diversityNeighbors") > 0) ? (int)settings["diversityNeighbors"] : 8;
+
+  _idCounter = 0;
 }
 
 ExpSearchSet::~ExpSearchSet()
@@ -139,14 +190,18 @@ bool ExpSearchSet::add(shared_ptr<ExpSearchSample> x, bool structural)
   double minSat = x->satDist(_init);
   double minStruct;
 
+  // the exact metrics are expensive, so only the samples closest by descriptor are checked.
+  // The closest samples by the exact metrics are almost always among them
+  map<unsigned int, shared_ptr<ExpSearchSample> > compare = nearest(x);
+
   if (_structMode == StructDiffMode::BIN_STRUCT) {
-    minStruct = binStructPct(x);
+    minStruct = binStructPct(x, compare);
   }
   else {
     minStruct = structDiff(x, _init);
   }
 
-  for (auto& sample : _samples) {
+  for (auto& sample : compare) {
     double brightDist = x->brightnessDist(sample.second);
     double hueDist = x->hueDist(sample.second);
     double satDist = x->satDist(sample.second);
@@ -200,6 +255,17 @@ bool ExpSearchSet::add(shared_ptr<ExpSearchSample> x, bool structural)
     _samples[_idCounter] = x;
     _reasoning[_idCounter] = why.str();
 
+    // the index keeps pointers to the descriptor, which lives as long as the sample does
+    flann::Matrix<float> row(x->_descriptor.data(), 1, x->_descriptor.size());
+    if (_index == nullptr) {
+      _index = shared_ptr<flann::Index<flann::L2<float> > >(new flann::Index<flann::L2<float> >(row, flann::KDTreeIndexParams(4)));
+      _index->buildIndex();
+    }
+    else {
+      _index->addPoints(row);
+    }
+    _indexIds.push_back(_idCounter);
+
     getLogger()->log("Added sample " + to_string(_idCounter) + " to set (total: " + to_string(size()) + "): " + why.str());
     
     // also dump the histograms
@@ -303,7 +369,7 @@ double ExpSearchSet::structDiff(shared_ptr<ExpSearchSample> x, shared_ptr<ExpSea
   return 1e10;
 }
 
-double ExpSearchSet::binStructPct(shared_ptr<ExpSearchSample> x)
+double ExpSearchSet::binStructPct(shared_ptr<ExpSearchSample> x, map<unsigned int, shared_ptr<ExpSearchSample> >& samples)
 {
   vector<Eigen::VectorXd> bins = x->getImg()->patches(_structBinSize);
 
@@ -320,7 +386,7 @@ double ExpSearchSet::binStructPct(shared_ptr<ExpSearchSample> x)
   double pct = ct / (double)bins.size();
 
   // check vs other samples
-  for (auto& s : _samples) {
+  for (auto& s : samples) {
     s.second->getImg()->eliminateBinsSSIM(bins, _structBinSize, 0.99, _ssimA, _ssimB, _ssimG);
 
     // update count
@@ -339,4 +405,23 @@ double ExpSearchSet::binStructPct(shared_ptr<ExpSearchSample> x)
   return pct;
 }
 
-}
\ No newline at end of file
+map<unsigned int, shared_ptr<ExpSearchSample> > ExpSearchSet::nearest(shared_ptr<ExpSearchSample> x)
+{
+  if (_neighbors <= 0 || _index == nullptr || _samples.size() <= _neighbors)
+    return _samples;
+
+  flann::Matrix<float> query(x->_descriptor.data(), 1, x->_descriptor.size());
+  vector<vector<int> > indices;
+  vector<vector<float> > dists;
+  _index->knnSearch(query, indices, dists, _neighbors, flann::SearchParams(128));
+
+  map<unsigned int, shared_ptr<ExpSearchSample> > ret;
+  for (int i : indices[0]) {
+    if (i >= 0 && i < _indexIds.size())
+      ret[_indexIds[i]] = _samples[_indexIds[i]];
+  }
+
+  return ret;
+}
+
+}
@@ -0,0 +1,151 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+namespace Comp {
+  ThreadPool::ThreadPool() : _stop(false)
+  {
+  }
+
+  ThreadPool::~ThreadPool()
+  {
+    {
+      lock_guard<mutex> lock(_lock);
+      _stop = true;
+    }
+
+    _wake.notify_all();
+
+    for (auto& w : _workers)
+      w.join();
+  }
+
+  void ThreadPool::parallelFor(int count, int threads, int grain, const function<void(int, int)>& f)
+  {
+    if (count <= 0)
+      return;
+
+    if (grain < 1)
+      grain = 1;
+
+    int chunks = (count + grain - 1) / grain;
+    if (threads > chunks)
+      threads = chunks;
+
+    if (threads <= 1) {
+      f(0, count);
+      return;
+    }
+
+    shared_ptr<Job> job = shared_ptr<Job>(new Job());
+    job->_f = &f;
+    job->_count = count;
+    job->_grain = grain;
+    job->_chunks = chunks;
+    job->_maxHelpers = threads - 1;
+    job->_helpers = 0;
+    job->_next = 0;
+    job->_done = 0;
+    job->_failed = false;
+
+    int workers;
+
+    {
+      lock_guard<mutex> lock(_lock);
+
+      while ((int)_workers.size() < threads - 1)
+        _workers.push_back(thread(&ThreadPool::workerLoop, this));
+
+      workers = (int)_workers.size();
+      _jobs.push_back(job);
+    }
+
+    if (threads - 1 >= workers) {
+      _wake.notify_all();
+    }
+    else {
+      for (int i = 0; i < threads - 1; i++)
+        _wake.notify_one();
+    }
+
+    // calling thread participates as well
+    runChunks(*job);
+
+    // chunks claimed by workers may still be running, and they use f from this frame
+    unique_lock<mutex> lock(job->_lock);
+    job->_finished.wait(lock, [&]() { return job->_done == job->_chunks; });
+
+    if (job->_error)
+      rethrow_exception(job->_error);
+  }
+
+  int ThreadPool::size()
+  {
+    lock_guard<mutex> lock(_lock);
+    return (int)_workers.size();
+  }
+
+  void ThreadPool::workerLoop()
+  {
+    unique_lock<mutex> lock(_lock);
+
+    while (true) {
+      shared_ptr<Job> job;
+      _wake.wait(lock, [&]() { return _stop || (job = nextJob()) != nullptr; });
+
+      if (_stop)
+        return;
+
+      job->_helpers++;
+      lock.unlock();
+
+      runChunks(*job);
+
+      lock.lock();
+    }
+  }
+
+  void ThreadPool::runChunks(Job & job)
+  {
+    for (int chunk = job._next++; chunk < job._chunks; chunk = job._next++) {
+      // once a chunk has thrown the rest are only counted as done
+      if (!job._failed) {
+        int start = chunk * job._grain;
+
+        try {
+          (*job._f)(start, min(start + job._grain, job._count));
+        }
+        catch (...) {
+          lock_guard<mutex> lock(job._lock);
+          if (!job._failed) {
+            job._error = current_exception();
+            job._failed = true;
+          }
+        }
+      }
+
+      if (++job._done == job._chunks) {
+        // lock so the wake up can't land between the caller's check and its wait
+        lock_guard<mutex> lock(job._lock);
+        job._finished.notify_all();
+      }
+    }
+  }
+
+  shared_ptr<ThreadPool::Job> ThreadPool::nextJob()
+  {
+    for (auto it = _jobs.begin(); it != _jobs.end(); ) {
+      if ((*it)->_next >= (*it)->_chunks) {
+        it = _jobs.erase(it);
+        continue;
+      }
+
+      if ((*it)->_helpers < (*it)->_maxHelpers)
+        return *it;
+
+      it++;
+    }
+
+    return nullptr;
+  }
+}
@@ -0,0 +1,78 @@
+/*
+ThreadPool.h - Persistent worker threads for the compositor's parallel loops
+author: Evan Shimizu
+*/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace Comp {
+  // Worker threads that stay alive for the life of the pool, so parallel loops don't pay
+  // for creating and joining threads on every call. Each loop is split into chunks that
+  // are claimed from a shared counter by the calling thread and any idle workers, so threads
+  // that finish early take over the remaining chunks. Any number of threads may run loops
+  // at the same time, and loops may be nested inside other loops.
+  class ThreadPool {
+  public:
+    ThreadPool();
+    ~ThreadPool();
+
+    // splits [0, count) into chunks of at most grain items and runs f(start, end) on each, using
+    // at most the given number of threads including the caller. Returns once every chunk is done.
+    // The pool grows to threads - 1 workers the first time that many are asked for. If f throws, the
+    // remaining chunks are skipped and the first exception is rethrown here once no chunk is running.
+    void parallelFor(int count, int threads, int grain, const function<void(int, int)>& f);
+
+    // number of worker threads started so far
+    int size();
+
+  private:
+    struct Job {
+      const function<void(int, int)>* _f;
+      int _count;
+      int _grain;
+      int _chunks;
+
+      // workers (not counting the caller) allowed on this job, and how many have joined
+      int _maxHelpers;
+      int _helpers;
+
+      atomic<int> _next;
+      atomic<int> _done;
+
+      // first exception thrown by f. Set under _lock
+      exception_ptr _error;
+      atomic<bool> _failed;
+
+      mutex _lock;
+      condition_variable _finished;
+    };
+
+    void workerLoop();
+
+    // claims and runs chunks of job until none are left
+    void runChunks(Job& job);
+
+    // first queued job that still has chunks and room for another worker. Jobs with every chunk
+    // claimed are dropped from the queue. _lock must be held
+    shared_ptr<Job> nextJob();
+
+    vector<thread> _workers;
+    deque<shared_ptr<Job> > _jobs;
+    bool _stop;
+
+    mutex _lock;
+    condition_variable _wake;
+  };
+}
@@ -49,6 +49,12 @@ public:
   Histogram _hue;
   Histogram _sat;
 
+  // Compact summary of the render for finding similar samples quickly: fixed size brightness, hue
+  // and saturation histograms (as fractions of the image), then the mean and standard deviation of
+  // L in each cell of a coarse grid (the first two moments SSIM compares). Everything is in [0, 1].
+  vector<float> _descriptor;
+  static int descriptorSize();
+
 private:
   void preProcess();
 
@@ -92,12 +98,23 @@ private:
   double structDiff(shared_ptr<ExpSearchSample> x, shared_ptr<ExpSearchSample> y);
 
   // bit different from the other struct diff functions, this one will check against
-  // all samples and return a percentage of bins that are unique to the sample
-  double binStructPct(shared_ptr<ExpSearchSample> x);
+  // the given samples and return a percentage of bins that are unique to the sample
+  double binStructPct(shared_ptr<ExpSearchSample> x, map<unsigned int, shared_ptr<ExpSearchSample> >& samples);
+
+  // samples to run the full comparison against: the _neighbors closest to x by descriptor,
+  // or every sample if the index is turned off
+  map<unsigned int, shared_ptr<ExpSearchSample> > nearest(shared_ptr<ExpSearchSample> x);
 
   // the samples
   map<unsigned int, shared_ptr<ExpSearchSample> > _samples;
 
+  // nearest neighbor index over the descriptors of _samples. Row i of the index is sample _indexIds[i]
+  shared_ptr<flann::Index<flann::L2<float> > > _index;
+  vector<unsigned int> _indexIds;
+
+  // number of nearest samples compared exactly in add. 0 compares against every sample
+  int _neighbors;
+
   // explanations for why a sample was admitted
   map<unsigned int, string> _reasoning;
 
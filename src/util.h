@@ -90,6 +90,13 @@ inline T fmodt(T val, T mod)
   return rem;
 }
 
+// mixes the hash of val into seed (same scheme as boost::hash_combine)
+template <typename T>
+inline void hashCombine(size_t& seed, const T& val)
+{
+  seed ^= hash<T>()(val) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+}
+
 template <typename T>
 class PointT
 {